@@ -6,10 +6,13 @@
 #include "platform.h"
 
 #include "util.h"
+#include "pktbuf.h"
+#include "timer.h"
 #include "net.h"
 #include "ether.h"
 #include "arp.h"
 #include "ip.h"
+#include "icmp.h"
 
 /* see https://www.iana.org/assignments/arp-parameters/arp-parameters.txt */
 #define ARP_HRD_ETHER 0x0001
@@ -19,13 +22,45 @@
 #define ARP_OP_REQUEST 0x0001
 #define ARP_OP_REPLY   0x0002
 
-#define ARP_CACHE_SIZE 32
-#define ARP_CACHE_TIMEOUT 30 /* seconds */
+/*
+ * NOTE: The cache is an open addressing hash table (linear probing) keyed by the protocol address.
+ *       It doubles when it gets 3/4 full, up to ARP_CACHE_SLOTS_MAX slots. Beyond that an entry is
+ *       evicted in clock order: the hand sweeps the slots and takes the first entry not referenced
+ *       since its last pass.
+ *       Writers are serialized by the mutex, arp_resolve() reads without any lock: the writers bump
+ *       a sequence counter around their changes (seqlock) and a reader retries when it has changed.
+ *       A reader may still be probing an old table or a deleted entry, so neither is ever freed.
+ */
+#define ARP_CACHE_SLOTS_MIN 64
+#ifndef ARP_CACHE_SLOTS_MAX
+#define ARP_CACHE_SLOTS_MAX 8192 /* power of 2 (override with -D) */
+#endif
+#define ARP_RESOLVE_TIMEOUT 3 /* seconds, an incomplete entry is given up after this */
+#define ARP_HOLD_BYTES (128 * 1024) /* held by an incomplete entry, fits the fragments of the largest datagram (the oldest ones are dropped) */
+
+/*
+ * NOTE: Neighbor unreachability detection (similar to Linux, see RFC 4861 7.3.2)
+ *       A confirmed entry is REACHABLE for ARP_REACHABLE_TIME, then STALE. A STALE entry is still
+ *       used, the first use moves it to DELAY. If no ARP message from the neighbor confirms it within
+ *       ARP_DELAY_TIME, it is probed with unicast requests (PROBE) and deleted when they go unanswered.
+ *       The packets keep being sent with the old address meanwhile. Unused STALE entries are deleted
+ *       after ARP_STALE_TIME.
+ */
+#define ARP_REACHABLE_TIME 30 /* seconds */
+#define ARP_STALE_TIME 60 /* seconds */
+#define ARP_DELAY_TIME 5 /* seconds */
+#define ARP_PROBE_INTERVAL 1 /* seconds */
+#define ARP_PROBE_MAX 3
 
 #define ARP_CACHE_STATE_FREE       0
 #define ARP_CACHE_STATE_INCOMPLETE 1
-#define ARP_CACHE_STATE_RESOLVED   2
-#define ARP_CACHE_STATE_STATIC     3
+#define ARP_CACHE_STATE_REACHABLE  2
+#define ARP_CACHE_STATE_STALE      3
+#define ARP_CACHE_STATE_DELAY      4
+#define ARP_CACHE_STATE_PROBE      5
+#define ARP_CACHE_STATE_STATIC     6
+
+#define ARP_CACHE_STATE_VALID(x) ((x) >= ARP_CACHE_STATE_REACHABLE) /* has a hardware address */
 
 struct arp_hdr {
     uint16_t hrd;
@@ -45,13 +80,46 @@ struct arp_ether {
 
 struct arp_cache {
     unsigned char state;
+    unsigned char referenced; /* for the clock */
+    unsigned char probes; /* unicast requests sent in PROBE */
     ip_addr_t pa;
     uint8_t ha[ETHER_ADDR_LEN];
     struct timeval timestamp;
+    struct timer_entry timer; /* expiry */
+    struct net_iface *iface; /* the held packets are sent from */
+    struct queue_head hold; /* waiting for the resolution (IP datagrams) */
+    size_t hold_bytes;
+    struct arp_cache *next; /* free list */
+};
+
+struct arp_hold_entry {
+    struct queue_entry link;
+    struct pktbuf *pkt; /* NOTE: holds a reference to the packet */
+};
+
+struct arp_table {
+    size_t size; /* number of slots (power of 2) */
+    unsigned int shift; /* 32 - log2(size) */
+    struct arp_table *retired; /* the previous (smaller) table */
+    struct arp_cache *slots[];
+};
+
+struct arp_stack {
+    mutex_t mutex;
+    unsigned int seq; /* odd while being written */
+    struct arp_table *table;
+    size_t num; /* number of entries */
+    size_t hand; /* clock hand (slot index) */
+    struct arp_cache *free; /* deleted entries, recycled */
+    unsigned long misses;
+    unsigned long evictions;
 };
 
-static mutex_t mutex = MUTEX_INITIALIZER;
-static struct arp_cache caches[ARP_CACHE_SIZE];
+static struct arp_stack *
+arp_stack(void)
+{
+    return net_stack_priv(NET_STACK_PRIV_ARP);
+}
 
 static char *
 arp_opcode_ntoa(uint16_t opcode)
@@ -66,29 +134,29 @@ arp_opcode_ntoa(uint16_t opcode)
 }
 
 static void
-arp_dump(const uint8_t *data, size_t len)
+arp_dump(FILE *fp, const void *data, size_t len)
 {
     struct arp_ether *message;
     ip_addr_t spa, tpa;
     char addr[128];
 
     message = (struct arp_ether *)data;
-    flockfile(stderr);
-    fprintf(stderr, "        hrd: 0x%04x\n", ntoh16(message->hdr.hrd));
-    fprintf(stderr, "        pro: 0x%04x\n", ntoh16(message->hdr.pro));
-    fprintf(stderr, "        hln: %u\n", message->hdr.hln);
-    fprintf(stderr, "        pln: %u\n", message->hdr.pln);
-    fprintf(stderr, "         op: 0x%04x (%s)\n", ntoh16(message->hdr.op), arp_opcode_ntoa(message->hdr.op));
-    fprintf(stderr, "        sha: %s\n", ether_addr_ntop(message->sha, addr, sizeof(addr)));
+    flockfile(fp);
+    fprintf(fp, "        hrd: 0x%04x\n", ntoh16(message->hdr.hrd));
+    fprintf(fp, "        pro: 0x%04x\n", ntoh16(message->hdr.pro));
+    fprintf(fp, "        hln: %u\n", message->hdr.hln);
+    fprintf(fp, "        pln: %u\n", message->hdr.pln);
+    fprintf(fp, "         op: 0x%04x (%s)\n", ntoh16(message->hdr.op), arp_opcode_ntoa(message->hdr.op));
+    fprintf(fp, "        sha: %s\n", ether_addr_ntop(message->sha, addr, sizeof(addr)));
     memcpy(&spa, message->spa, sizeof(spa));
-    fprintf(stderr, "        spa: %s\n", ip_addr_ntop(spa, addr, sizeof(addr)));
-    fprintf(stderr, "        tha: %s\n", ether_addr_ntop(message->tha, addr, sizeof(addr)));
+    fprintf(fp, "        spa: %s\n", ip_addr_ntop(spa, addr, sizeof(addr)));
+    fprintf(fp, "        tha: %s\n", ether_addr_ntop(message->tha, addr, sizeof(addr)));
     memcpy(&tpa, message->tpa, sizeof(tpa));
-    fprintf(stderr, "        tpa: %s\n", ip_addr_ntop(tpa, addr, sizeof(addr)));
+    fprintf(fp, "        tpa: %s\n", ip_addr_ntop(tpa, addr, sizeof(addr)));
 #ifdef HEXDUMP
-    hexdump(stderr, data, len);
+    hexdump(fp, data, len);
 #endif
-    funlockfile(stderr);
+    funlockfile(fp);
 }
 
 /*
@@ -97,33 +165,313 @@ arp_dump(const uint8_t *data, size_t len)
  * NOTE: ARP Cache functions must be called after mutex locked
  */
 
+/* NOTE: must be called after arp->mutex locked */
+static void
+arp_write_begin(struct arp_stack *arp)
+{
+    __atomic_store_n(&arp->seq, arp->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+/* NOTE: must be called after arp->mutex locked */
+static void
+arp_write_end(struct arp_stack *arp)
+{
+    __atomic_store_n(&arp->seq, arp->seq + 1, __ATOMIC_RELEASE);
+}
+
+static unsigned int
+arp_read_begin(struct arp_stack *arp)
+{
+    unsigned int seq;
+
+    while ((seq = __atomic_load_n(&arp->seq, __ATOMIC_ACQUIRE)) & 1);
+    return seq;
+}
+
+static int
+arp_read_retry(struct arp_stack *arp, unsigned int seq)
+{
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&arp->seq, __ATOMIC_RELAXED) != seq;
+}
+
+static size_t
+arp_cache_hash(struct arp_table *table, ip_addr_t pa)
+{
+    /* NOTE: multiplicative (Fibonacci) hashing, the top bits of the product depend on all the bits of the address */
+    return ((uint32_t)pa * 0x9e3779b1) >> table->shift;
+}
+
+/*
+ * NOTE: returns the slot of the entry, or the empty slot where it would be inserted.
+ *       Also used by lockless readers: the probe is bounded, as a concurrent writer may leave no empty slot on its way.
+ */
+static size_t
+arp_cache_index(struct arp_table *table, ip_addr_t pa)
+{
+    struct arp_cache *cache;
+    size_t idx, n;
+
+    idx = arp_cache_hash(table, pa);
+    for (n = 0; n < table->size; n++) {
+        cache = __atomic_load_n(&table->slots[idx], __ATOMIC_RELAXED);
+        if (!cache || cache->pa == pa) {
+            break;
+        }
+        idx = (idx + 1) & (table->size - 1);
+    }
+    return idx;
+}
+
+static struct arp_table *
+arp_table_alloc(size_t size)
+{
+    struct arp_table *table;
+
+    table = memory_alloc(sizeof(*table) + sizeof(*table->slots) * size);
+    if (!table) {
+        return NULL;
+    }
+    table->size = size;
+    table->shift = 32 - __builtin_ctzl(size);
+    return table;
+}
+
+static int
+arp_cache_resize(struct arp_stack *arp, size_t size)
+{
+    struct arp_table *old, *table;
+    size_t idx;
+
+    old = arp->table;
+    table = arp_table_alloc(size);
+    if (!table) {
+        return -1;
+    }
+    for (idx = 0; idx < old->size; idx++) {
+        if (old->slots[idx]) {
+            table->slots[arp_cache_index(table, old->slots[idx]->pa)] = old->slots[idx];
+        }
+    }
+    table->retired = old;
+    arp->hand = 0;
+    __atomic_store_n(&arp->table, table, __ATOMIC_RELEASE);
+    debugf("resized, size=%zu, num=%zu", table->size, arp->num);
+    return 0;
+}
+
+static struct pktbuf *
+arp_hold_pop(struct queue_head *hold)
+{
+    struct arp_hold_entry *entry;
+    struct pktbuf *pkt;
+
+    entry = queue_data(queue_pop(hold), struct arp_hold_entry, link);
+    if (!entry) {
+        return NULL;
+    }
+    pkt = entry->pkt;
+    memory_free(entry);
+    return pkt;
+}
+
+/*
+ * NOTE: must be called after arp->mutex locked, bounded by bytes rather than packets: a fragmented
+ *       datagram is queued at once (41 fragments for 64KB over ethernet) and is useless without any of them
+ */
+static void
+arp_hold_push(struct arp_cache *cache, struct pktbuf *pkt)
+{
+    struct arp_hold_entry *entry;
+    struct pktbuf *old;
+
+    entry = memory_alloc(sizeof(*entry));
+    if (!entry) {
+        errorf("memory_alloc() failure");
+        return;
+    }
+    entry->pkt = pktbuf_get(pkt);
+    queue_push(&cache->hold, &entry->link);
+    cache->hold_bytes += pktbuf_total(pkt);
+    while (cache->hold_bytes > ARP_HOLD_BYTES) {
+        old = arp_hold_pop(&cache->hold);
+        cache->hold_bytes -= pktbuf_total(old);
+        pktbuf_free(old);
+    }
+}
+
+/* NOTE: must be called after arp->mutex locked, the caller sends (or reports) them after unlocking */
+static unsigned int
+arp_hold_take(struct arp_cache *cache, struct queue_head *pkts)
+{
+    *pkts = cache->hold;
+    queue_init(&cache->hold);
+    cache->hold_bytes = 0;
+    return pkts->num;
+}
+
+static void
+arp_hold_flush(struct net_iface *iface, struct queue_head *pkts, const uint8_t *ha)
+{
+    struct pktbuf *pkt;
+
+    while ((pkt = arp_hold_pop(pkts)) != NULL) {
+        net_device_output(iface->dev, NET_PROTOCOL_TYPE_IP, pkt, ha);
+        pktbuf_free(pkt);
+    }
+}
+
+static void
+arp_hold_unreach(struct net_iface *iface, struct queue_head *pkts)
+{
+    struct pktbuf *pkt;
+
+    while ((pkt = arp_hold_pop(pkts)) != NULL) {
+        ip_output_error(pkt, (struct ip_iface *)iface, ICMP_TYPE_DEST_UNREACH, ICMP_CODE_HOST_UNREACH, 0);
+        pktbuf_free(pkt);
+    }
+}
+
+static void
+arp_cache_delete(struct arp_cache *cache)
+{
+    struct arp_stack *arp = arp_stack();
+    struct arp_table *table = arp->table;
+    struct pktbuf *pkt;
+    char addr1[IP_ADDR_STR_LEN];
+    char addr2[ETHER_ADDR_STR_LEN];
+    size_t idx, next, home, mask;
+
+    debugf("DELETE: pa=%s, ha=%s", ip_addr_ntop(cache->pa, addr1, sizeof(addr1)), ether_addr_ntop(cache->ha, addr2, sizeof(addr2)));
+    /* backward shift deletion, no tombstones: pull back the following entries that probed past the slot */
+    mask = table->size - 1;
+    idx = arp_cache_index(table, cache->pa);
+    table->slots[idx] = NULL;
+    for (next = (idx + 1) & mask; table->slots[next]; next = (next + 1) & mask) {
+        home = arp_cache_hash(table, table->slots[next]->pa);
+        if (((next - home) & mask) >= ((next - idx) & mask)) {
+            table->slots[idx] = table->slots[next];
+            table->slots[next] = NULL;
+            idx = next;
+        }
+    }
+    arp->num--;
+    while ((pkt = arp_hold_pop(&cache->hold)) != NULL) {
+        pktbuf_free(pkt);
+    }
+    cache->hold_bytes = 0;
+    cache->state = ARP_CACHE_STATE_FREE;
+    cache->pa = 0;
+    cache->iface = NULL;
+    memset(cache->ha, 0, ETHER_ADDR_LEN);
+    timerclear(&cache->timestamp);
+    timer_cancel(&cache->timer);
+    cache->next = arp->free;
+    arp->free = cache;
+}
+
+static int
+arp_cache_evict(struct arp_stack *arp)
+{
+    struct arp_table *table = arp->table;
+    struct arp_cache *cache;
+    size_t n;
+
+    /* NOTE: two rounds at most, the first one may only clear the reference bits */
+    for (n = 0; n < table->size * 2; n++) {
+        cache = table->slots[arp->hand];
+        arp->hand = (arp->hand + 1) & (table->size - 1);
+        if (!cache || cache->state == ARP_CACHE_STATE_STATIC) {
+            continue;
+        }
+        if (__atomic_load_n(&cache->referenced, __ATOMIC_RELAXED)) {
+            __atomic_store_n(&cache->referenced, 0, __ATOMIC_RELAXED);
+            continue;
+        }
+        arp_cache_delete(cache);
+        arp->evictions++;
+        return 0;
+    }
+    return -1;
+}
+
+static void
+arp_cache_timer(void *arg);
+
+/* NOTE: the entry is inserted in the table, the caller sets its state */
 static struct arp_cache *
-arp_cache_alloc(void)
+arp_cache_alloc(ip_addr_t pa)
 {
-    struct arp_cache *entry, *oldest = NULL;
+    struct arp_stack *arp = arp_stack();
+    struct arp_cache *cache;
 
-    for (entry = caches; entry < tailof(caches); entry++) {
-        if (entry->state == ARP_CACHE_STATE_FREE) {
-            return entry;
+    if ((arp->num + 1) * 4 > arp->table->size * 3) {
+        if (arp->table->size >= ARP_CACHE_SLOTS_MAX || arp_cache_resize(arp, arp->table->size * 2) == -1) {
+            if (arp_cache_evict(arp) == -1) {
+                errorf("no entry to evict");
+                return NULL;
+            }
         }
-        if (!oldest || timercmp(&oldest->timestamp, &entry->timestamp, >)) {
-            oldest = entry;
+    }
+    cache = arp->free;
+    if (cache) {
+        arp->free = cache->next;
+    } else {
+        cache = memory_alloc(sizeof(*cache));
+        if (!cache) {
+            errorf("memory_alloc() failure");
+            return NULL;
         }
+        timer_entry_init(&cache->timer, net_worker_wheel(NET_WORKER_INTR), arp_cache_timer, cache);
     }
-    return oldest;
+    cache->next = NULL;
+    cache->pa = pa;
+    cache->referenced = 1;
+    arp->table->slots[arp_cache_index(arp->table, pa)] = cache;
+    arp->num++;
+    return cache;
 }
 
 static struct arp_cache *
 arp_cache_select(ip_addr_t pa)
 {
-    struct arp_cache *entry;
+    struct arp_stack *arp = arp_stack();
+    struct arp_cache *cache;
 
-    for (entry = caches; entry < tailof(caches); entry++) {
-        if (entry->state != ARP_CACHE_STATE_FREE && entry->pa == pa) {
-            return entry;
+    cache = arp->table->slots[arp_cache_index(arp->table, pa)];
+    if (cache) {
+        __atomic_store_n(&cache->referenced, 1, __ATOMIC_RELAXED);
+    }
+    return cache;
+}
+
+/* NOTE: lockless, returns the state of the entry (FREE if not found), copies the hardware address if valid */
+static unsigned char
+arp_cache_lookup(struct arp_stack *arp, ip_addr_t pa, uint8_t *ha)
+{
+    struct arp_table *table;
+    struct arp_cache *cache;
+    unsigned int seq;
+    unsigned char state;
+
+    do {
+        seq = arp_read_begin(arp);
+        table = __atomic_load_n(&arp->table, __ATOMIC_ACQUIRE);
+        cache = __atomic_load_n(&table->slots[arp_cache_index(table, pa)], __ATOMIC_RELAXED);
+        state = ARP_CACHE_STATE_FREE;
+        if (cache && cache->pa == pa) {
+            state = cache->state;
+            if (ARP_CACHE_STATE_VALID(state)) {
+                memcpy(ha, cache->ha, ETHER_ADDR_LEN);
+            }
         }
+    } while (arp_read_retry(arp, seq));
+    /* NOTE: the reference bit is only written when not set yet, readers keep the cache line shared */
+    if (cache && !__atomic_load_n(&cache->referenced, __ATOMIC_RELAXED)) {
+        __atomic_store_n(&cache->referenced, 1, __ATOMIC_RELAXED);
     }
-    return NULL;
+    return state;
 }
 
 static struct arp_cache *
@@ -138,9 +486,11 @@ arp_cache_update(ip_addr_t pa, const uint8_t *ha)
         /* not found */
         return NULL;
     }
-    cache->state = ARP_CACHE_STATE_RESOLVED;
+    cache->state = ARP_CACHE_STATE_REACHABLE;
+    cache->probes = 0;
     memcpy(cache->ha, ha, ETHER_ADDR_LEN);
     gettimeofday(&cache->timestamp, NULL);
+    timer_arm(&cache->timer, ARP_REACHABLE_TIME * 1000);
     debugf("UPDATE: pa=%s, ha=%s", ip_addr_ntop(pa, addr1, sizeof(addr1)), ether_addr_ntop(ha, addr2, sizeof(addr2)));
     return cache;
 }
@@ -152,77 +502,94 @@ arp_cache_insert(ip_addr_t pa, const uint8_t *ha)
     char addr1[IP_ADDR_STR_LEN];
     char addr2[ETHER_ADDR_STR_LEN];
 
-    cache = arp_cache_alloc();
+    cache = arp_cache_alloc(pa);
     if (!cache) {
         errorf("arp_cache_alloc() failure");
         return NULL;
     }
-    cache->state = ARP_CACHE_STATE_RESOLVED;
-    cache->pa = pa;
+    cache->state = ARP_CACHE_STATE_REACHABLE;
+    cache->probes = 0;
     memcpy(cache->ha, ha, ETHER_ADDR_LEN);
     gettimeofday(&cache->timestamp, NULL);
+    timer_arm(&cache->timer, ARP_REACHABLE_TIME * 1000);
     debugf("INSERT: pa=%s, ha=%s", ip_addr_ntop(pa, addr1, sizeof(addr1)), ether_addr_ntop(ha, addr2, sizeof(addr2)));
     return cache;
 }
 
-static void
-arp_cache_delete(struct arp_cache *cache)
-{
-    char addr1[IP_ADDR_STR_LEN];
-    char addr2[ETHER_ADDR_STR_LEN];
-
-    debugf("DELETE: pa=%s, ha=%s", ip_addr_ntop(cache->pa, addr1, sizeof(addr1)), ether_addr_ntop(cache->ha, addr2, sizeof(addr2)));
-    cache->state = ARP_CACHE_STATE_FREE;
-    cache->pa = 0;
-    memset(cache->ha, 0, ETHER_ADDR_LEN);
-    timerclear(&cache->timestamp);
-}
-
+/* NOTE: broadcast if tha is NULL, unicast (probe of a known neighbor) otherwise */
 static int
-arp_request(struct net_iface *iface, ip_addr_t tpa)
+arp_request(struct net_iface *iface, ip_addr_t tpa, const uint8_t *tha)
 {
-    struct arp_ether request;
-
-    request.hdr.hrd = hton16(ARP_HRD_ETHER);
-    request.hdr.pro = hton16(ARP_PRO_IP);
-    request.hdr.hln = ETHER_ADDR_LEN;
-    request.hdr.pln = IP_ADDR_LEN;
-    request.hdr.op = hton16(ARP_OP_REQUEST);
-    memcpy(request.sha, iface->dev->addr, ETHER_ADDR_LEN);
-    memcpy(request.spa, &((struct ip_iface *)iface)->unicast, IP_ADDR_LEN);
-    memset(request.tha, 0, ETHER_ADDR_LEN);
-    memcpy(request.tpa, &tpa, IP_ADDR_LEN);
-    debugf("dev=%s, opcode=%s(0x%04x), len=%zu", iface->dev->name, arp_opcode_ntoa(request.hdr.op), ntoh16(request.hdr.op), sizeof(request));
-    arp_dump((uint8_t *)&request, sizeof(request));
-    return net_device_output(iface->dev, ETHER_TYPE_ARP, (uint8_t *)&request, sizeof(request), iface->dev->broadcast);
+    struct pktbuf *pkt;
+    struct arp_ether *request;
+    int ret;
+
+    pkt = pktbuf_alloc(PKTBUF_HEADROOM, sizeof(*request));
+    if (!pkt) {
+        errorf("pktbuf_alloc() failure");
+        return -1;
+    }
+    request = (struct arp_ether *)pktbuf_put(pkt, sizeof(*request));
+    request->hdr.hrd = hton16(ARP_HRD_ETHER);
+    request->hdr.pro = hton16(ARP_PRO_IP);
+    request->hdr.hln = ETHER_ADDR_LEN;
+    request->hdr.pln = IP_ADDR_LEN;
+    request->hdr.op = hton16(ARP_OP_REQUEST);
+    memcpy(request->sha, iface->dev->addr, ETHER_ADDR_LEN);
+    memcpy(request->spa, &((struct ip_iface *)iface)->unicast, IP_ADDR_LEN);
+    memset(request->tha, 0, ETHER_ADDR_LEN);
+    memcpy(request->tpa, &tpa, IP_ADDR_LEN);
+    debugf("dev=%s, opcode=%s(0x%04x), len=%zu", iface->dev->name, arp_opcode_ntoa(request->hdr.op), ntoh16(request->hdr.op), sizeof(*request));
+    debugdump_with(arp_dump, request, sizeof(*request));
+    ret = net_device_output(iface->dev, ETHER_TYPE_ARP, pkt, tha ? tha : iface->dev->broadcast);
+    pktbuf_free(pkt);
+    return ret;
 }
 
 static int
 arp_reply(struct net_iface *iface, const uint8_t *tha, ip_addr_t tpa, const uint8_t *dst)
 {
-    struct arp_ether reply;
-
-    reply.hdr.hrd = hton16(ARP_HRD_ETHER);
-    reply.hdr.pro = hton16(ARP_PRO_IP);
-    reply.hdr.hln = ETHER_ADDR_LEN;
-    reply.hdr.pln = IP_ADDR_LEN;
-    reply.hdr.op = hton16(ARP_OP_REPLY);
-    memcpy(reply.sha, iface->dev->addr, ETHER_ADDR_LEN);
-    memcpy(reply.spa, &((struct ip_iface *)iface)->unicast, IP_ADDR_LEN);
-    memcpy(reply.tha, tha, ETHER_ADDR_LEN);
-    memcpy(reply.tpa, &tpa, IP_ADDR_LEN);
-    debugf("dev=%s, opcode=%s(0x%04x), len=%zu", iface->dev->name, arp_opcode_ntoa(reply.hdr.op), ntoh16(reply.hdr.op), sizeof(reply));
-    arp_dump((uint8_t *)&reply, sizeof(reply));
-    return net_device_output(iface->dev, ETHER_TYPE_ARP, (uint8_t *)&reply, sizeof(reply), dst);
+    struct pktbuf *pkt;
+    struct arp_ether *reply;
+    int ret;
+
+    pkt = pktbuf_alloc(PKTBUF_HEADROOM, sizeof(*reply));
+    if (!pkt) {
+        errorf("pktbuf_alloc() failure");
+        return -1;
+    }
+    reply = (struct arp_ether *)pktbuf_put(pkt, sizeof(*reply));
+    reply->hdr.hrd = hton16(ARP_HRD_ETHER);
+    reply->hdr.pro = hton16(ARP_PRO_IP);
+    reply->hdr.hln = ETHER_ADDR_LEN;
+    reply->hdr.pln = IP_ADDR_LEN;
+    reply->hdr.op = hton16(ARP_OP_REPLY);
+    memcpy(reply->sha, iface->dev->addr, ETHER_ADDR_LEN);
+    memcpy(reply->spa, &((struct ip_iface *)iface)->unicast, IP_ADDR_LEN);
+    memcpy(reply->tha, tha, ETHER_ADDR_LEN);
+    memcpy(reply->tpa, &tpa, IP_ADDR_LEN);
+    debugf("dev=%s, opcode=%s(0x%04x), len=%zu", iface->dev->name, arp_opcode_ntoa(reply->hdr.op), ntoh16(reply->hdr.op), sizeof(*reply));
+    debugdump_with(arp_dump, reply, sizeof(*reply));
+    ret = net_device_output(iface->dev, ETHER_TYPE_ARP, pkt, dst);
+    pktbuf_free(pkt);
+    return ret;
 }
 
 static void
-arp_input(const uint8_t *data, size_t len, struct net_device *dev)
+arp_input(struct pktbuf *pkt, struct net_device *dev)
 {
+    struct arp_stack *arp = arp_stack();
+    const uint8_t *data = pkt->data;
+    size_t len = pktbuf_len(pkt);
     struct arp_ether *msg;
     ip_addr_t spa, tpa;
     int merge = 0;
     struct net_iface *iface;
+    struct ip_iface *target;
+    struct arp_cache *cache;
+    struct queue_head hold;
+    unsigned int held = 0;
+    struct net_iface *hold_iface = NULL;
 
     if (len < sizeof(*msg)) {
         errorf("too short");
@@ -238,21 +605,41 @@ arp_input(const uint8_t *data, size_t len, struct net_device *dev)
         return;
     }
     debugf("dev=%s, opcode=%s(0x%04x), len=%zu", dev->name, arp_opcode_ntoa(msg->hdr.op), ntoh16(msg->hdr.op), len);
-    arp_dump(data, len);
+    debugdump_with(arp_dump, data, len);
     memcpy(&spa, msg->spa, sizeof(spa));
     memcpy(&tpa, msg->tpa, sizeof(tpa));
-    mutex_lock(&mutex);
-    if (arp_cache_update(spa, msg->sha)) {
+    iface = net_device_get_iface(dev, NET_IFACE_FAMILY_IP);
+    mutex_lock(&arp->mutex);
+    arp_write_begin(arp);
+    cache = arp_cache_update(spa, msg->sha);
+    if (cache) {
         /* updated */
         merge = 1;
+        if (!cache->iface) {
+            cache->iface = iface;
+        }
+        held = arp_hold_take(cache, &hold);
+        hold_iface = cache->iface;
     }
-    mutex_unlock(&mutex);
-    iface = net_device_get_iface(dev, NET_IFACE_FAMILY_IP);
-    if (iface && ((struct ip_iface *)iface)->unicast == tpa) {
+    arp_write_end(arp);
+    mutex_unlock(&arp->mutex);
+    if (held) {
+        debugf("flush the held packets, num=%u", held);
+        arp_hold_flush(hold_iface, &hold, msg->sha);
+    }
+    /* NOTE: any address of the device, the reply is sent from the iface owning it */
+    target = ip_iface_select(tpa);
+    if (target && NET_IFACE(target)->dev == dev) {
+        iface = NET_IFACE(target);
         if (!merge) {
-            mutex_lock(&mutex);
-            arp_cache_insert(spa, msg->sha);
-            mutex_unlock(&mutex);
+            mutex_lock(&arp->mutex);
+            arp_write_begin(arp);
+            cache = arp_cache_insert(spa, msg->sha);
+            if (cache) {
+                cache->iface = iface; /* probed from */
+            }
+            arp_write_end(arp);
+            mutex_unlock(&arp->mutex);
         }
         if (ntoh16(msg->hdr.op) == ARP_OP_REQUEST) {
             arp_reply(iface, msg->sha, spa, msg->sha);
@@ -260,10 +647,17 @@ arp_input(const uint8_t *data, size_t len, struct net_device *dev)
     }
 }
 
+/*
+ * NOTE: While the resolution is pending, the packet (an IP datagram) is held by the entry, if given,
+ *       and sent as soon as the reply arrives. If the resolution times out it is reported to its
+ *       source as unreachable.
+ */
 int
-arp_resolve(struct net_iface *iface, ip_addr_t pa, uint8_t *ha)
+arp_resolve(struct net_iface *iface, ip_addr_t pa, uint8_t *ha, struct pktbuf *pkt)
 {
+    struct arp_stack *arp = arp_stack();
     struct arp_cache *cache;
+    unsigned char state;
     char addr1[IP_ADDR_STR_LEN];
     char addr2[ETHER_ADDR_STR_LEN];
 
@@ -275,65 +669,176 @@ arp_resolve(struct net_iface *iface, ip_addr_t pa, uint8_t *ha)
         debugf("unsupported protocol address type");
         return ARP_RESOLVE_ERROR;
     }
-    mutex_lock(&mutex);
+    state = arp_cache_lookup(arp, pa, ha);
+    if (ARP_CACHE_STATE_VALID(state) && state != ARP_CACHE_STATE_STALE) {
+        debugf("resolved, pa=%s, ha=%s",
+            ip_addr_ntop(pa, addr1, sizeof(addr1)), ether_addr_ntop(ha, addr2, sizeof(addr2)));
+        return ARP_RESOLVE_FOUND;
+    }
+    /* slow path, the entry may have been changed since the lookup */
+    mutex_lock(&arp->mutex);
     cache = arp_cache_select(pa);
     if (!cache) {
-        cache = arp_cache_alloc();
+        arp->misses++;
+        arp_write_begin(arp);
+        cache = arp_cache_alloc(pa);
         if (!cache) {
-            mutex_unlock(&mutex);
+            arp_write_end(arp);
+            mutex_unlock(&arp->mutex);
             errorf("arp_cache_alloc() failure");
             return ARP_RESOLVE_ERROR;
         }
         cache->state = ARP_CACHE_STATE_INCOMPLETE;
-        cache->pa = pa;
+        arp_write_end(arp);
+        cache->iface = iface;
+        if (pkt) {
+            arp_hold_push(cache, pkt);
+        }
         gettimeofday(&cache->timestamp, NULL);
-        arp_request(iface, pa);
-        mutex_unlock(&mutex);
+        timer_arm(&cache->timer, ARP_RESOLVE_TIMEOUT * 1000);
+        arp_request(iface, pa, NULL);
+        mutex_unlock(&arp->mutex);
         debugf("cache not found, pa=%s", ip_addr_ntop(pa, addr1, sizeof(addr1)));
         return ARP_RESOLVE_INCOMPLETE;
     }
     if (cache->state == ARP_CACHE_STATE_INCOMPLETE) {
-        arp_request(iface, pa); /* just in case packet loss */
-        mutex_unlock(&mutex);
+        cache->iface = iface;
+        if (pkt) {
+            arp_hold_push(cache, pkt);
+        }
+        arp_request(iface, pa, NULL); /* just in case packet loss */
+        mutex_unlock(&arp->mutex);
         return ARP_RESOLVE_INCOMPLETE;
     }
+    if (cache->state == ARP_CACHE_STATE_STALE) {
+        /* in use again, give the neighbor a chance to be confirmed before probing it */
+        arp_write_begin(arp);
+        cache->state = ARP_CACHE_STATE_DELAY;
+        arp_write_end(arp);
+        cache->iface = iface;
+        gettimeofday(&cache->timestamp, NULL);
+        timer_arm(&cache->timer, ARP_DELAY_TIME * 1000);
+    }
     memcpy(ha, cache->ha, ETHER_ADDR_LEN);
-    mutex_unlock(&mutex);
+    mutex_unlock(&arp->mutex);
     debugf("resolved, pa=%s, ha=%s",
         ip_addr_ntop(pa, addr1, sizeof(addr1)), ether_addr_ntop(ha, addr2, sizeof(addr2)));
     return ARP_RESOLVE_FOUND;
 }
 
 static void
-arp_timer(void)
+arp_cache_timer(void *arg)
 {
-    struct arp_cache *entry;
+    struct arp_stack *arp = arp_stack();
+    struct arp_cache *cache;
     struct timeval now, diff;
-
-    mutex_lock(&mutex);
+    int timeout;
+    struct queue_head hold;
+    unsigned int held = 0;
+    struct net_iface *iface = NULL;
+
+    cache = (struct arp_cache *)arg;
+    mutex_lock(&arp->mutex);
+    switch (cache->state) {
+    case ARP_CACHE_STATE_INCOMPLETE:
+        timeout = ARP_RESOLVE_TIMEOUT;
+        break;
+    case ARP_CACHE_STATE_REACHABLE:
+        timeout = ARP_REACHABLE_TIME;
+        break;
+    case ARP_CACHE_STATE_STALE:
+        timeout = ARP_STALE_TIME;
+        break;
+    case ARP_CACHE_STATE_DELAY:
+        timeout = ARP_DELAY_TIME;
+        break;
+    case ARP_CACHE_STATE_PROBE:
+        timeout = ARP_PROBE_INTERVAL;
+        break;
+    default:
+        mutex_unlock(&arp->mutex);
+        return;
+    }
+    /* NOTE: the entry may have been refreshed after the timer fired, check its age again */
     gettimeofday(&now, NULL);
-    for (entry = caches; entry < tailof(caches); entry++) {
-        if (entry->state != ARP_CACHE_STATE_FREE && entry->state != ARP_CACHE_STATE_STATIC) {
-            timersub(&now, &entry->timestamp, &diff);
-            if (diff.tv_sec > ARP_CACHE_TIMEOUT) {
-                arp_cache_delete(entry);
-            }
+    timersub(&now, &cache->timestamp, &diff);
+    if (diff.tv_sec < timeout) {
+        if (!timer_pending(&cache->timer)) {
+            timer_arm(&cache->timer, (timeout - diff.tv_sec) * 1000);
+        }
+        mutex_unlock(&arp->mutex);
+        return;
+    }
+    switch (cache->state) {
+    case ARP_CACHE_STATE_REACHABLE:
+        arp_write_begin(arp);
+        cache->state = ARP_CACHE_STATE_STALE;
+        arp_write_end(arp);
+        cache->timestamp = now;
+        timer_arm(&cache->timer, ARP_STALE_TIME * 1000);
+        break;
+    case ARP_CACHE_STATE_DELAY:
+    case ARP_CACHE_STATE_PROBE:
+        if (cache->probes < ARP_PROBE_MAX && cache->iface) {
+            arp_write_begin(arp);
+            cache->state = ARP_CACHE_STATE_PROBE;
+            arp_write_end(arp);
+            cache->probes++;
+            cache->timestamp = now;
+            timer_arm(&cache->timer, ARP_PROBE_INTERVAL * 1000);
+            arp_request(cache->iface, cache->pa, cache->ha);
+            break;
         }
+        /* fall through */
+    default:
+        held = arp_hold_take(cache, &hold);
+        iface = cache->iface;
+        arp_write_begin(arp);
+        arp_cache_delete(cache);
+        arp_write_end(arp);
+        break;
+    }
+    mutex_unlock(&arp->mutex);
+    if (held) {
+        debugf("resolution timed out, drop the held packets, num=%u", held);
+        arp_hold_unreach(iface, &hold);
     }
-    mutex_unlock(&mutex);
+}
+
+int
+arp_cache_stat(struct arp_cache_stat *stat)
+{
+    struct arp_stack *arp = arp_stack();
+
+    mutex_lock(&arp->mutex);
+    stat->num = arp->num;
+    stat->size = arp->table->size;
+    stat->misses = arp->misses;
+    stat->evictions = arp->evictions;
+    mutex_unlock(&arp->mutex);
+    return 0;
 }
 
 int
 arp_init(void)
 {
-    struct timeval interval = {1, 0};
+    struct arp_stack *arp;
 
-    if (net_protocol_register("ARP", NET_PROTOCOL_TYPE_ARP, arp_input) == -1) {
-        errorf("net_protocol_register() failure");
+    arp = memory_alloc(sizeof(*arp));
+    if (!arp) {
+        errorf("memory_alloc() failure");
+        return -1;
+    }
+    mutex_init(&arp->mutex);
+    arp->table = arp_table_alloc(ARP_CACHE_SLOTS_MIN);
+    if (!arp->table) {
+        errorf("arp_table_alloc() failure");
+        memory_free(arp);
         return -1;
     }
-    if (net_timer_register("ARP Timer", interval, arp_timer) == -1) {
-        errorf("net_timer_register() failure");
+    net_stack_set_priv(NET_STACK_PRIV_ARP, arp);
+    if (net_protocol_register("ARP", NET_PROTOCOL_TYPE_ARP, arp_input) == -1) {
+        errorf("net_protocol_register() failure");
         return -1;
     }
     return 0;
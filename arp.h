@@ -1,6 +1,7 @@
 #ifndef ARP_H
 #define ARP_H
 
+#include <stddef.h>
 #include <stdint.h>
 
 #include "net.h"
@@ -10,8 +11,17 @@
 #define ARP_RESOLVE_INCOMPLETE  0
 #define ARP_RESOLVE_FOUND       1
 
+struct arp_cache_stat {
+    size_t num; /* entries */
+    size_t size; /* slots */
+    unsigned long misses; /* arp_resolve() calls that had no entry */
+    unsigned long evictions;
+};
+
+extern int
+arp_resolve(struct net_iface *iface, ip_addr_t pa, uint8_t *ha, struct pktbuf *pkt);
 extern int
-arp_resolve(struct net_iface *iface, ip_addr_t pa, uint8_t *ha);
+arp_cache_stat(struct arp_cache_stat *stat);
 extern int
 arp_init(void);
 
@@ -0,0 +1,227 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "platform.h"
+
+#include "util.h"
+#include "pktbuf.h"
+#include "net.h"
+#include "ether.h"
+#include "arp.h"
+#include "ip.h"
+
+#include "bench.h"
+
+/*
+ * Dummy ethernet device (drops everything it transmits)
+ */
+
+static int
+dummy_transmit(struct net_device *dev, uint16_t type, struct pktbuf *pkt, const void *dst)
+{
+    return 0;
+}
+
+static struct net_device_ops dummy_ops = {
+    .transmit = dummy_transmit,
+};
+
+static void
+dummy_setup(struct net_device *dev)
+{
+    ether_setup_helper(dev);
+    dev->ops = &dummy_ops;
+}
+
+/*
+ * Benchmark
+ */
+
+#define NEIGHBOR_ADDR_BASE 0xc6120000 /* 198.18.0.0/15 (benchmarking) */
+#define THREADS_MAX 64
+
+struct arp_message {
+    uint16_t hrd;
+    uint16_t pro;
+    uint8_t hln;
+    uint8_t pln;
+    uint16_t op;
+    uint8_t sha[ETHER_ADDR_LEN];
+    uint8_t spa[IP_ADDR_LEN];
+    uint8_t tha[ETHER_ADDR_LEN];
+    uint8_t tpa[IP_ADDR_LEN];
+} __attribute__((packed));
+
+struct worker {
+    pthread_t thread;
+    unsigned int seed;
+    unsigned long count;
+    unsigned long errors;
+};
+
+static struct net_device *dev;
+static struct ip_iface *iface;
+static unsigned int neighbors = 256;
+static unsigned long iterations = 1000000;
+static int serialized;
+static mutex_t serializer = MUTEX_INITIALIZER;
+
+static int
+populate(unsigned int num)
+{
+    struct pktbuf *pkt;
+    struct arp_message *msg;
+    struct arp_cache_stat stat;
+    ip_addr_t spa;
+    unsigned int i;
+    int retry;
+
+    for (i = 0; i < num; i++) {
+        pkt = pktbuf_alloc(PKTBUF_HEADROOM, sizeof(*msg));
+        if (!pkt) {
+            return -1;
+        }
+        msg = (struct arp_message *)pktbuf_put(pkt, sizeof(*msg));
+        msg->hrd = hton16(1);
+        msg->pro = hton16(ETHER_TYPE_IP);
+        msg->hln = ETHER_ADDR_LEN;
+        msg->pln = IP_ADDR_LEN;
+        msg->op = hton16(1); /* request */
+        memcpy(msg->sha, (uint8_t []){0x02, 0x00, 0x00, 0x00, i >> 8, i}, ETHER_ADDR_LEN);
+        spa = hton32(NEIGHBOR_ADDR_BASE + i);
+        memcpy(msg->spa, &spa, IP_ADDR_LEN);
+        memset(msg->tha, 0, ETHER_ADDR_LEN);
+        memcpy(msg->tpa, &iface->unicast, IP_ADDR_LEN);
+        net_input_handler(ETHER_TYPE_ARP, pkt, dev);
+        pktbuf_free(pkt);
+        if (i % 64 == 63) {
+            usleep(1000); /* NOTE: let the worker drain its queue, it drops on full */
+        }
+    }
+    for (retry = 0; retry < 1000; retry++) {
+        arp_cache_stat(&stat);
+        if (stat.num >= num) {
+            return 0;
+        }
+        usleep(1000);
+    }
+    return -1;
+}
+
+static void *
+worker_thread(void *arg)
+{
+    struct worker *w = arg;
+    uint8_t ha[ETHER_ADDR_LEN];
+    ip_addr_t pa;
+    unsigned long n;
+    int ret;
+
+    for (n = 0; n < iterations; n++) {
+        pa = hton32(NEIGHBOR_ADDR_BASE + rand_r(&w->seed) % neighbors);
+        if (serialized) {
+            mutex_lock(&serializer);
+        }
+        ret = arp_resolve((struct net_iface *)iface, pa, ha, NULL);
+        if (serialized) {
+            mutex_unlock(&serializer);
+        }
+        if (ret != ARP_RESOLVE_FOUND) {
+            w->errors++;
+        }
+        bench_use(ha[0]);
+    }
+    w->count = n;
+    return NULL;
+}
+
+static double
+bench_resolve(int threads, unsigned long *errors)
+{
+    struct worker workers[THREADS_MAX] = {};
+    unsigned long total = 0;
+    uint64_t start, end;
+    int i;
+
+    *errors = 0;
+    start = bench_now();
+    for (i = 0; i < threads; i++) {
+        workers[i].seed = i + 1;
+        pthread_create(&workers[i].thread, NULL, worker_thread, &workers[i]);
+    }
+    for (i = 0; i < threads; i++) {
+        pthread_join(workers[i].thread, NULL);
+        total += workers[i].count;
+        *errors += workers[i].errors;
+    }
+    end = bench_now();
+    return (double)total * 1000 / (end - start); /* Mops/s */
+}
+
+int
+main(int argc, char *argv[])
+{
+    int opt;
+    int threads[] = {1, 2, 4, 8}, *t;
+    double lockless, locked;
+    unsigned long errors1, errors2;
+
+    while ((opt = getopt(argc, argv, "n:a:")) != -1) {
+        switch (opt) {
+        case 'n':
+            iterations = strtoul(optarg, NULL, 10);
+            break;
+        case 'a':
+            neighbors = strtoul(optarg, NULL, 10);
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-n iterations] [-a neighbors]\n", argv[0]);
+            return -1;
+        }
+    }
+    if (!iterations || !neighbors || neighbors > 0xffff) {
+        fprintf(stderr, "iterations and neighbors (up to 65535) must be greater than 0\n");
+        return -1;
+    }
+    if (net_init() == -1) {
+        fprintf(stderr, "net_init() failure\n");
+        return -1;
+    }
+    dev = net_device_alloc(dummy_setup);
+    if (!dev || net_device_register(dev) == -1) {
+        fprintf(stderr, "net_device_register() failure\n");
+        return -1;
+    }
+    iface = ip_iface_alloc("198.19.255.254", "255.254.0.0");
+    if (!iface || ip_iface_register(dev, iface) == -1) {
+        fprintf(stderr, "ip_iface_register() failure\n");
+        return -1;
+    }
+    if (net_run() == -1) {
+        fprintf(stderr, "net_run() failure\n");
+        return -1;
+    }
+    if (populate(neighbors) == -1) {
+        fprintf(stderr, "failed to populate the cache\n");
+        net_shutdown();
+        return -1;
+    }
+    printf("arp: arp_resolve() per iteration, iterations=%lu (per thread), neighbors=%u\n", iterations, neighbors);
+    printf("%8s %18s %18s\n", "threads", "serialized(Mops/s)", "lockless(Mops/s)");
+    for (t = threads; t < tailof(threads); t++) {
+        serialized = 1;
+        locked = bench_resolve(*t, &errors1);
+        serialized = 0;
+        lockless = bench_resolve(*t, &errors2);
+        printf("%8d %18.2f %18.2f\n", *t, locked, lockless);
+        if (errors1 || errors2) {
+            fprintf(stderr, "unresolved: %lu, %lu\n", errors1, errors2);
+        }
+    }
+    net_shutdown();
+    return 0;
+}
@@ -0,0 +1,229 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sched.h>
+
+#include "platform.h"
+
+#include "util.h"
+#include "pktbuf.h"
+#include "net.h"
+#include "ether.h"
+#include "ip.h"
+
+#include "bench.h"
+
+/*
+ * Dummy ethernet devices (count the frames transmitted by the output one)
+ */
+
+static struct net_device *in, *out;
+static unsigned long transmitted; /* by the output device */
+
+static ssize_t
+dummy_write(struct net_device *dev, const struct iovec *iov, int iovcnt)
+{
+    ssize_t len = 0;
+    int i;
+
+    for (i = 0; i < iovcnt; i++) {
+        len += iov[i].iov_len;
+    }
+    if (dev == out) {
+        __atomic_add_fetch(&transmitted, 1, __ATOMIC_RELEASE);
+    }
+    return len;
+}
+
+static int
+dummy_transmit(struct net_device *dev, uint16_t type, struct pktbuf *pkt, const void *dst)
+{
+    return ether_transmit_helper(dev, type, pkt, dst, dummy_write);
+}
+
+static struct net_device_ops dummy_ops = {
+    .transmit = dummy_transmit,
+};
+
+static void
+dummy_setup(struct net_device *dev)
+{
+    ether_setup_helper(dev);
+    dev->ops = &dummy_ops;
+}
+
+/*
+ * Benchmark
+ */
+
+#define SOURCE_ADDR 0xc0000202 /* 192.0.2.2, on the input device */
+#define GATEWAY_ADDR 0xc6120002 /* 198.18.0.2, on the output device */
+#define DESTINATION_BASE 0x0a000000 /* 10.0.0.0/8, routed via the gateway */
+#define INFLIGHT_MAX 256 /* injected but not forwarded yet, below NET_PROTOCOL_QUEUE_DEPTH */
+#define PAYLOAD_SIZE 64
+
+struct arp_message {
+    uint16_t hrd;
+    uint16_t pro;
+    uint8_t hln;
+    uint8_t pln;
+    uint16_t op;
+    uint8_t sha[ETHER_ADDR_LEN];
+    uint8_t spa[IP_ADDR_LEN];
+    uint8_t tha[ETHER_ADDR_LEN];
+    uint8_t tpa[IP_ADDR_LEN];
+} __attribute__((packed));
+
+static struct ip_iface *gw_iface;
+static unsigned long packets = 1000000;
+
+/* NOTE: the gateway announces itself with a request, which makes an entry in the ARP cache */
+static int
+resolve_gateway(void)
+{
+    struct pktbuf *pkt;
+    struct arp_message *msg;
+    ip_addr_t spa = hton32(GATEWAY_ADDR);
+    uint8_t ha[ETHER_ADDR_LEN] = {0x02, 0x00, 0x00, 0x00, 0x00, 0x02};
+
+    pkt = pktbuf_alloc(PKTBUF_HEADROOM, sizeof(*msg));
+    if (!pkt) {
+        return -1;
+    }
+    msg = (struct arp_message *)pktbuf_put(pkt, sizeof(*msg));
+    msg->hrd = hton16(1);
+    msg->pro = hton16(ETHER_TYPE_IP);
+    msg->hln = ETHER_ADDR_LEN;
+    msg->pln = IP_ADDR_LEN;
+    msg->op = hton16(1); /* request */
+    memcpy(msg->sha, ha, ETHER_ADDR_LEN);
+    memcpy(msg->spa, &spa, IP_ADDR_LEN);
+    memset(msg->tha, 0, ETHER_ADDR_LEN);
+    memcpy(msg->tpa, &gw_iface->unicast, IP_ADDR_LEN);
+    net_input_handler(ETHER_TYPE_ARP, pkt, out);
+    pktbuf_free(pkt);
+    usleep(100000);
+    return 0;
+}
+
+static struct pktbuf *
+datagram(ip_addr_t dst)
+{
+    struct pktbuf *pkt;
+    uint8_t *hdr;
+    ip_addr_t src = hton32(SOURCE_ADDR);
+
+    /* NOTE: as received, the link header has been stripped */
+    pkt = pktbuf_alloc(PKTBUF_HEADROOM + ETHER_HDR_SIZE, IP_HDR_SIZE_MIN + PAYLOAD_SIZE);
+    if (!pkt) {
+        return NULL;
+    }
+    hdr = pktbuf_put(pkt, IP_HDR_SIZE_MIN + PAYLOAD_SIZE);
+    memset(hdr, 0, IP_HDR_SIZE_MIN + PAYLOAD_SIZE);
+    hdr[0] = (IP_VERSION_IPV4 << 4) | (IP_HDR_SIZE_MIN >> 2);
+    *(uint16_t *)(hdr + 2) = hton16(IP_HDR_SIZE_MIN + PAYLOAD_SIZE);
+    hdr[8] = 64; /* TTL */
+    hdr[9] = IP_PROTOCOL_UDP;
+    memcpy(hdr + 12, &src, IP_ADDR_LEN);
+    memcpy(hdr + 16, &dst, IP_ADDR_LEN);
+    *(uint16_t *)(hdr + 10) = cksum16((uint16_t *)hdr, IP_HDR_SIZE_MIN, 0);
+    return pkt;
+}
+
+static double
+bench_forward(unsigned int destinations, unsigned long *drops)
+{
+    struct pktbuf *pkt;
+    unsigned long n, base;
+    uint64_t start, end;
+
+    *drops = 0;
+    base = __atomic_load_n(&transmitted, __ATOMIC_ACQUIRE);
+    start = bench_now();
+    for (n = 0; n < packets; n++) {
+        while (n - (__atomic_load_n(&transmitted, __ATOMIC_ACQUIRE) - base) - *drops >= INFLIGHT_MAX) {
+            sched_yield();
+        }
+        pkt = datagram(hton32(DESTINATION_BASE + n % destinations));
+        if (!pkt) {
+            return -1;
+        }
+        if (net_input_handler(ETHER_TYPE_IP, pkt, in) == -1) {
+            (*drops)++;
+        }
+        pktbuf_free(pkt);
+    }
+    while (__atomic_load_n(&transmitted, __ATOMIC_ACQUIRE) - base + *drops < packets) {
+        sched_yield();
+    }
+    end = bench_now();
+    return (double)packets * 1000 / (end - start); /* Mpps */
+}
+
+int
+main(int argc, char *argv[])
+{
+    int opt;
+    unsigned int destinations[] = {1, 256, 65536}, *d;
+    struct ip_iface *iface;
+    unsigned long drops;
+    double mpps;
+
+    while ((opt = getopt(argc, argv, "n:")) != -1) {
+        switch (opt) {
+        case 'n':
+            packets = strtoul(optarg, NULL, 10);
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-n packets]\n", argv[0]);
+            return -1;
+        }
+    }
+    if (!packets) {
+        fprintf(stderr, "packets must be greater than 0\n");
+        return -1;
+    }
+    if (net_init() == -1) {
+        fprintf(stderr, "net_init() failure\n");
+        return -1;
+    }
+    in = net_device_alloc(dummy_setup);
+    out = net_device_alloc(dummy_setup);
+    if (!in || !out || net_device_register(in) == -1 || net_device_register(out) == -1) {
+        fprintf(stderr, "net_device_register() failure\n");
+        return -1;
+    }
+    iface = ip_iface_alloc("192.0.2.1", "255.255.255.0");
+    gw_iface = ip_iface_alloc("198.18.0.1", "255.254.0.0");
+    if (!iface || !gw_iface || ip_iface_register(in, iface) == -1 || ip_iface_register(out, gw_iface) == -1) {
+        fprintf(stderr, "ip_iface_register() failure\n");
+        return -1;
+    }
+    if (ip_route_add(hton32(DESTINATION_BASE), hton32(0xff000000), hton32(GATEWAY_ADDR), gw_iface) == -1) {
+        fprintf(stderr, "ip_route_add() failure\n");
+        return -1;
+    }
+    ip_set_forwarding(1);
+    if (net_run() == -1) {
+        fprintf(stderr, "net_run() failure\n");
+        return -1;
+    }
+    if (resolve_gateway() == -1) {
+        fprintf(stderr, "failed to resolve the gateway\n");
+        net_shutdown();
+        return -1;
+    }
+    printf("forward: %s => %s, packets=%lu, payload=%d bytes\n", in->name, out->name, packets, PAYLOAD_SIZE);
+    printf("%12s %12s %12s\n", "destinations", "Mpps", "ns/packet");
+    for (d = destinations; d < tailof(destinations); d++) {
+        mpps = bench_forward(*d, &drops);
+        printf("%12u %12.2f %12.1f\n", *d, mpps, 1000 / mpps);
+        if (drops) {
+            fprintf(stderr, "dropped: %lu\n", drops);
+        }
+    }
+    net_shutdown();
+    return 0;
+}
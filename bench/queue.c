@@ -0,0 +1,158 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "platform.h"
+
+#include "util.h"
+
+#include "bench.h"
+
+/*
+ * Legacy queue (allocates a node for every push, frees it on pop)
+ */
+
+struct legacy_queue_entry {
+    struct legacy_queue_entry *next;
+    void *data;
+};
+
+struct legacy_queue_head {
+    struct legacy_queue_entry *head;
+    struct legacy_queue_entry *tail;
+    unsigned int num;
+};
+
+static void *
+legacy_queue_push(struct legacy_queue_head *queue, void *data)
+{
+    struct legacy_queue_entry *entry;
+
+    entry = memory_alloc(sizeof(*entry));
+    if (!entry) {
+        return NULL;
+    }
+    entry->next = NULL;
+    entry->data = data;
+    if (queue->tail) {
+        queue->tail->next = entry;
+    }
+    queue->tail = entry;
+    if (!queue->head) {
+        queue->head = entry;
+    }
+    queue->num++;
+    return data;
+}
+
+static void *
+legacy_queue_pop(struct legacy_queue_head *queue)
+{
+    struct legacy_queue_entry *entry;
+    void *data;
+
+    if (!queue->head) {
+        return NULL;
+    }
+    entry = queue->head;
+    queue->head = entry->next;
+    if (!queue->head) {
+        queue->tail = NULL;
+    }
+    queue->num--;
+    data = entry->data;
+    memory_free(entry);
+    return data;
+}
+
+/*
+ * Benchmark
+ */
+
+struct item {
+    struct queue_entry link;
+    uint32_t value;
+};
+
+static struct item *items;
+
+static double
+bench_legacy(unsigned long iterations, unsigned int depth)
+{
+    struct legacy_queue_head queue = {};
+    struct item *item;
+    unsigned long n;
+    unsigned int i;
+    uint64_t start, end;
+
+    for (i = 0; i < depth; i++) {
+        legacy_queue_push(&queue, &items[i]);
+    }
+    start = bench_now();
+    for (n = 0; n < iterations; n++) {
+        item = legacy_queue_pop(&queue);
+        bench_use(item);
+        legacy_queue_push(&queue, item);
+    }
+    end = bench_now();
+    while (legacy_queue_pop(&queue));
+    return (double)(end - start) / iterations;
+}
+
+static double
+bench_intrusive(unsigned long iterations, unsigned int depth)
+{
+    struct queue_head queue = QUEUE_HEAD_INITIALIZER;
+    struct item *item;
+    unsigned long n;
+    unsigned int i;
+    uint64_t start, end;
+
+    for (i = 0; i < depth; i++) {
+        queue_push(&queue, &items[i].link);
+    }
+    start = bench_now();
+    for (n = 0; n < iterations; n++) {
+        item = queue_data(queue_pop(&queue), struct item, link);
+        bench_use(item);
+        queue_push(&queue, &item->link);
+    }
+    end = bench_now();
+    return (double)(end - start) / iterations;
+}
+
+int
+main(int argc, char *argv[])
+{
+    int opt;
+    unsigned long iterations = 10000000;
+    unsigned int depths[] = {1, 16, 256, 4096}, *depth;
+
+    while ((opt = getopt(argc, argv, "n:")) != -1) {
+        switch (opt) {
+        case 'n':
+            iterations = strtoul(optarg, NULL, 10);
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-n iterations]\n", argv[0]);
+            return -1;
+        }
+    }
+    if (!iterations) {
+        fprintf(stderr, "iterations must be greater than 0\n");
+        return -1;
+    }
+    items = calloc(depths[countof(depths)-1], sizeof(*items));
+    if (!items) {
+        fprintf(stderr, "calloc() failure\n");
+        return -1;
+    }
+    printf("queue: pop + push per iteration, iterations=%lu\n", iterations);
+    printf("%8s %16s %16s\n", "depth", "legacy(ns/op)", "intrusive(ns/op)");
+    for (depth = depths; depth < tailof(depths); depth++) {
+        printf("%8u %16.2f %16.2f\n", *depth, bench_legacy(iterations, *depth), bench_intrusive(iterations, *depth));
+    }
+    free(items);
+    return 0;
+}
@@ -0,0 +1,199 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "platform.h"
+
+#include "util.h"
+#include "net.h"
+#include "ip.h"
+
+#include "driver/null.h"
+
+#include "bench.h"
+
+/*
+ * Benchmark
+ */
+
+#define THREADS_MAX 64
+#define ADDRS_NUM 65536 /* looked up round robin, power of 2 */
+
+struct worker {
+    pthread_t thread;
+    unsigned long count;
+};
+
+static struct net_stack *stack;
+static ip_addr_t addrs[ADDRS_NUM];
+static unsigned long iterations = 10000000;
+
+/* NOTE: roughly the prefix length distribution of a full internet table, mostly /24 */
+static int
+prefixlen_random(void)
+{
+    int r = rand() % 100;
+
+    if (r < 58) return 24;
+    if (r < 68) return 23;
+    if (r < 76) return 22;
+    if (r < 82) return 21;
+    if (r < 87) return 20;
+    if (r < 93) return 16 + rand() % 4;
+    if (r < 97) return 8 + rand() % 8;
+    return 25 + rand() % 8;
+}
+
+static uint32_t
+random32(void)
+{
+    return ((uint32_t)rand() << 16) ^ (uint32_t)rand();
+}
+
+static int
+setup(size_t num, uint64_t *elapsed)
+{
+    struct net_device *dev;
+    struct ip_iface *iface;
+    struct ip_route_entry *entries;
+    uint32_t mask;
+    size_t i;
+    int len;
+    uint64_t start;
+
+    stack = net_stack_create();
+    if (!stack) {
+        return -1;
+    }
+    dev = null_init();
+    iface = ip_iface_alloc("192.0.2.1", "255.255.255.0");
+    if (!dev || !iface || ip_iface_register(dev, iface) == -1) {
+        return -1;
+    }
+    entries = calloc(num, sizeof(*entries));
+    if (!entries) {
+        return -1;
+    }
+    for (i = 0; i < num; i++) {
+        len = prefixlen_random();
+        mask = len ? 0xffffffff << (32 - len) : 0;
+        entries[i].network = hton32(random32() & mask);
+        entries[i].netmask = hton32(mask);
+        entries[i].nexthop = hton32(0xc0000202); /* 192.0.2.2 */
+        entries[i].iface = iface;
+    }
+    start = bench_now();
+    if (ip_route_add_batch(entries, num) == -1) {
+        free(entries);
+        return -1;
+    }
+    *elapsed = bench_now() - start;
+    /* half of the addresses fall in a loaded prefix, the others anywhere */
+    for (i = 0; i < ADDRS_NUM; i++) {
+        addrs[i] = (i & 1) ? hton32(random32()) : entries[rand() % num].network | hton32(rand() & 0xff);
+    }
+    free(entries);
+    return 0;
+}
+
+static void *
+worker_thread(void *arg)
+{
+    struct worker *w = arg;
+    unsigned long n;
+
+    net_stack_enter(stack);
+    for (n = 0; n < iterations; n++) {
+        bench_use(ip_route_get_iface(addrs[n & (ADDRS_NUM - 1)]));
+    }
+    w->count = n;
+    return NULL;
+}
+
+static double
+bench_lookup(int threads)
+{
+    struct worker workers[THREADS_MAX] = {};
+    unsigned long total = 0;
+    uint64_t start, end;
+    int i;
+
+    start = bench_now();
+    for (i = 0; i < threads; i++) {
+        pthread_create(&workers[i].thread, NULL, worker_thread, &workers[i]);
+    }
+    for (i = 0; i < threads; i++) {
+        pthread_join(workers[i].thread, NULL);
+        total += workers[i].count;
+    }
+    end = bench_now();
+    return (double)total * 1000 / (end - start); /* Mlookups/s */
+}
+
+static double
+bench_update(int rounds)
+{
+    ip_addr_t network;
+    uint64_t start, end;
+    int i;
+
+    start = bench_now();
+    for (i = 0; i < rounds; i++) {
+        network = hton32(0xc6120000 | i); /* 198.18.0.x/32 (may already exist, only removed if added) */
+        if (ip_route_add(network, IP_ADDR_BROADCAST, hton32(0xc0000202), ip_route_get_iface(hton32(0xc0000202))) == 0) {
+            ip_route_del(network, IP_ADDR_BROADCAST);
+        }
+    }
+    end = bench_now();
+    return (double)(end - start) / 1000 / rounds; /* us */
+}
+
+int
+main(int argc, char *argv[])
+{
+    int opt;
+    size_t sizes[] = {1000, 100000, 1000000}, *size;
+    int threads[] = {1, 2, 4}, *t;
+    uint64_t elapsed;
+
+    while ((opt = getopt(argc, argv, "n:")) != -1) {
+        switch (opt) {
+        case 'n':
+            iterations = strtoul(optarg, NULL, 10);
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-n iterations]\n", argv[0]);
+            return -1;
+        }
+    }
+    if (!iterations) {
+        fprintf(stderr, "iterations must be greater than 0\n");
+        return -1;
+    }
+    if (net_init() == -1) {
+        fprintf(stderr, "net_init() failure\n");
+        return -1;
+    }
+    srand(1);
+    printf("route: ip_route_get_iface() per iteration, iterations=%lu (per thread)\n", iterations);
+    printf("%8s %12s %14s", "prefixes", "load(ms)", "add+del(us)");
+    for (t = threads; t < tailof(threads); t++) {
+        printf("   %dthr(Mlookups/s)", *t);
+    }
+    printf("\n");
+    for (size = sizes; size < tailof(sizes); size++) {
+        /* NOTE: a new stack (and routing table) for each size */
+        if (setup(*size, &elapsed) == -1) {
+            fprintf(stderr, "setup failure, prefixes=%zu\n", *size);
+            return -1;
+        }
+        printf("%8zu %12.1f %14.1f", *size, (double)elapsed / 1000000, bench_update(100));
+        for (t = threads; t < tailof(threads); t++) {
+            printf(" %19.2f", bench_lookup(*t));
+        }
+        printf("\n");
+    }
+    return 0;
+}
@@ -0,0 +1,208 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <sched.h>
+
+#include "platform.h"
+
+#include "util.h"
+#include "pktbuf.h"
+#include "net.h"
+#include "ip.h"
+#include "tcp.h"
+
+#include "tcp_peer.h"
+
+/*
+ * Dummy device (plays the peer, looks into the segments transmitted to it)
+ */
+
+static unsigned long segments; /* segments transmitted by the stack */
+static unsigned long bytes; /* bytes of their text */
+static uint32_t synack_seq; /* ISS of the stack, 0 until the SYN-ACK is seen */
+
+static int
+dummy_transmit(struct net_device *dev, uint16_t type, struct pktbuf *pkt, const void *dst)
+{
+    uint8_t *hdr;
+    size_t hlen, total;
+
+    hdr = pkt->data;
+    hlen = (hdr[0] & 0x0f) << 2;
+    total = ntoh16(*(uint16_t *)(hdr + 2));
+    if (hdr[9] != IP_PROTOCOL_TCP) {
+        return 0;
+    }
+    if ((hdr[hlen + 13] & 0x12) == 0x12) {
+        __atomic_store_n(&synack_seq, ntoh32(*(uint32_t *)(hdr + hlen + 4)), __ATOMIC_RELEASE);
+    }
+    __atomic_add_fetch(&bytes, total - hlen - ((hdr[hlen + 12] >> 4) << 2), __ATOMIC_RELEASE);
+    __atomic_add_fetch(&segments, 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+static struct net_device_ops dummy_ops = {
+    .transmit = dummy_transmit,
+};
+
+static void
+dummy_setup(struct net_device *dev)
+{
+    dev->type = NET_DEVICE_TYPE_NULL;
+    dev->mtu = TCP_PEER_MTU;
+    dev->ops = &dummy_ops;
+}
+
+/*
+ * Peer
+ */
+
+#define LOCAL_ADDR 0xc0000201 /* 192.0.2.1, the stack */
+#define PEER_ADDR 0xc0000202 /* 192.0.2.2, injected */
+#define LOCAL_PORT 7
+#define PEER_PORT 40000
+#define PEER_ISS 1000
+#define PEER_WSCALE 8 /* the window scale option of the peer */
+
+static size_t peer_bufsize; /* the buffers of the pcb, and the window of the peer */
+static struct net_device *dev;
+static uint32_t peer_seq = PEER_ISS;
+static uint32_t peer_ack;
+
+int
+tcp_peer_init(size_t bufsize)
+{
+    struct ip_iface *iface;
+
+    peer_bufsize = bufsize;
+    dev = net_device_alloc(dummy_setup);
+    if (!dev || net_device_register(dev) == -1) {
+        fprintf(stderr, "net_device_register() failure\n");
+        return -1;
+    }
+    iface = ip_iface_alloc("192.0.2.1", "255.255.255.0");
+    if (!iface || ip_iface_register(dev, iface) == -1) {
+        fprintf(stderr, "ip_iface_register() failure\n");
+        return -1;
+    }
+    return 0;
+}
+
+int
+tcp_peer_inject(uint8_t flg, const uint8_t *data, size_t len)
+{
+    struct pktbuf *pkt;
+    uint8_t *hdr, *tcp;
+    ip_addr_t src = hton32(PEER_ADDR), dst = hton32(LOCAL_ADDR);
+    uint32_t pseudo[3];
+    uint16_t psum;
+    size_t hlen;
+    int ret;
+
+    /* NOTE: the SYN carries the window scale option, the window is scaled from then on */
+    hlen = (flg & 0x02) ? 24 : 20;
+    /* NOTE: as received, the link header has been stripped */
+    pkt = pktbuf_alloc(PKTBUF_HEADROOM, IP_HDR_SIZE_MIN + hlen + len);
+    if (!pkt) {
+        return -1;
+    }
+    hdr = pktbuf_put(pkt, IP_HDR_SIZE_MIN + hlen + len);
+    memset(hdr, 0, IP_HDR_SIZE_MIN + hlen);
+    hdr[0] = (IP_VERSION_IPV4 << 4) | (IP_HDR_SIZE_MIN >> 2);
+    *(uint16_t *)(hdr + 2) = hton16(IP_HDR_SIZE_MIN + hlen + len);
+    hdr[8] = 64; /* TTL */
+    hdr[9] = IP_PROTOCOL_TCP;
+    memcpy(hdr + 12, &src, IP_ADDR_LEN);
+    memcpy(hdr + 16, &dst, IP_ADDR_LEN);
+    *(uint16_t *)(hdr + 10) = cksum16((uint16_t *)hdr, IP_HDR_SIZE_MIN, 0);
+    tcp = hdr + IP_HDR_SIZE_MIN;
+    *(uint16_t *)(tcp + 0) = hton16(PEER_PORT);
+    *(uint16_t *)(tcp + 2) = hton16(LOCAL_PORT);
+    *(uint32_t *)(tcp + 4) = hton32(peer_seq);
+    *(uint32_t *)(tcp + 8) = hton32(peer_ack);
+    tcp[12] = (hlen >> 2) << 4;
+    tcp[13] = flg;
+    if (flg & 0x02) {
+        *(uint16_t *)(tcp + 14) = hton16(65535);
+        tcp[20] = 1; /* NOP */
+        tcp[21] = 3; /* window scale */
+        tcp[22] = 3;
+        tcp[23] = PEER_WSCALE;
+    } else {
+        *(uint16_t *)(tcp + 14) = hton16(MIN((peer_bufsize + (1 << PEER_WSCALE) - 1) >> PEER_WSCALE, 65535));
+    }
+    memcpy(tcp + hlen, data, len);
+    pseudo[0] = src;
+    pseudo[1] = dst;
+    pseudo[2] = hton32((IP_PROTOCOL_TCP << 16) | (hlen + len));
+    psum = ~cksum16((uint16_t *)pseudo, sizeof(pseudo), 0);
+    *(uint16_t *)(tcp + 16) = cksum16((uint16_t *)tcp, hlen + len, psum);
+    ret = net_input_handler(NET_PROTOCOL_TYPE_IP, pkt, dev);
+    pktbuf_free(pkt);
+    if (ret == -1) {
+        return -1;
+    }
+    peer_seq += len;
+    if (flg & 0x02) {
+        peer_seq++;
+    }
+    return 0;
+}
+
+int
+tcp_peer_acknowledge(size_t len)
+{
+    peer_ack += len;
+    return tcp_peer_inject(0x10, NULL, 0); /* ACK */
+}
+
+int
+tcp_peer_establish(void)
+{
+    int id;
+    struct ip_endpoint local = { .addr = hton32(LOCAL_ADDR), .port = hton16(LOCAL_PORT) };
+
+    id = tcp_open();
+    if (id == -1 || tcp_bind(id, &local) == -1 || tcp_set_bufsize(id, peer_bufsize, peer_bufsize) == -1 || tcp_listen(id, 1) == -1) {
+        return -1;
+    }
+    if (tcp_peer_inject(0x02, NULL, 0) == -1) { /* SYN */
+        return -1;
+    }
+    while (!__atomic_load_n(&synack_seq, __ATOMIC_ACQUIRE)) {
+        sched_yield();
+    }
+    peer_ack = synack_seq + 1;
+    if (tcp_peer_inject(0x10, NULL, 0) == -1) { /* ACK */
+        return -1;
+    }
+    return tcp_accept(id, NULL);
+}
+
+unsigned long
+tcp_peer_segments(void)
+{
+    return __atomic_load_n(&segments, __ATOMIC_ACQUIRE);
+}
+
+unsigned long
+tcp_peer_bytes(void)
+{
+    return __atomic_load_n(&bytes, __ATOMIC_ACQUIRE);
+}
+
+void
+tcp_peer_wait_segments(unsigned long n)
+{
+    while (tcp_peer_segments() < n) {
+        sched_yield();
+    }
+}
+
+void
+tcp_peer_wait_bytes(unsigned long n)
+{
+    while (tcp_peer_bytes() < n) {
+        sched_yield();
+    }
+}
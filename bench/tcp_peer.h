@@ -0,0 +1,40 @@
+#ifndef TCP_PEER_H
+#define TCP_PEER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "ip.h"
+
+/*
+ * NOTE: The fake peer of the TCP benchmarks: a dummy device looking into the segments the stack
+ *       transmits, and segments built by hand injected as if received from it. The connection is
+ *       accepted by the stack (192.0.2.1:7) from the peer (192.0.2.2:40000).
+ */
+
+#define TCP_PEER_MTU 1500
+#define TCP_PEER_MSS (TCP_PEER_MTU - IP_HDR_SIZE_MIN - 20)
+
+/* NOTE: must be called after net_init() and before net_run(), bufsize is for the both ends */
+extern int
+tcp_peer_init(size_t bufsize);
+/* NOTE: returns the socket of the connection accepted by the stack */
+extern int
+tcp_peer_establish(void);
+/* NOTE: the sequence number of the peer advances by len */
+extern int
+tcp_peer_inject(uint8_t flg, const uint8_t *data, size_t len);
+/* NOTE: acknowledges len more bytes of the stack */
+extern int
+tcp_peer_acknowledge(size_t len);
+
+extern unsigned long
+tcp_peer_segments(void);
+extern unsigned long
+tcp_peer_bytes(void);
+extern void
+tcp_peer_wait_segments(unsigned long n);
+extern void
+tcp_peer_wait_bytes(unsigned long n);
+
+#endif
@@ -0,0 +1,152 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "platform.h"
+
+#include "util.h"
+#include "net.h"
+#include "ip.h"
+#include "tcp.h"
+
+#include "bench.h"
+#include "tcp_peer.h"
+
+/*
+ * Benchmark
+ */
+
+#define FILL_BATCH 64 /* segments injected before waiting for their ACKs */
+
+static size_t bufsize = 65535; /* the receive buffer of the pcb */
+
+/* NOTE: fills the receive buffer with len bytes, one ACK is transmitted for each segment */
+static int
+fill(size_t len)
+{
+    static uint8_t data[TCP_PEER_MSS];
+    unsigned long base;
+    size_t n, done = 0;
+
+    base = tcp_peer_segments();
+    while (done < len) {
+        n = MIN(len - done, sizeof(data));
+        if (base % FILL_BATCH == 0) {
+            /* NOTE: keeps the input queue of the worker from overflowing with a large buffer */
+            tcp_peer_wait_segments(base);
+        }
+        if (tcp_peer_inject(0x18, data, n) == -1) { /* PSH|ACK */
+            return -1;
+        }
+        done += n;
+        base++;
+    }
+    tcp_peer_wait_segments(base);
+    return 0;
+}
+
+static int
+establish(void)
+{
+    int soc;
+
+    soc = tcp_peer_establish();
+    if (soc == -1) {
+        return -1;
+    }
+    /* NOTE: moves the head off the start of the buffer, the data wraps around the end from now on */
+    if (fill(1000) == -1) {
+        return -1;
+    }
+    return soc;
+}
+
+static double
+bench_receive(int soc, size_t size, unsigned int rounds)
+{
+    static uint8_t buf[TCP_BUFSIZE_MAX];
+    unsigned int r;
+    size_t done;
+    ssize_t ret;
+    uint64_t start, elapsed = 0;
+
+    for (r = 0; r < rounds; r++) {
+        if (fill(bufsize) == -1) {
+            return -1;
+        }
+        done = 0;
+        start = bench_now();
+        while (done < bufsize) {
+            ret = tcp_receive(soc, buf, MIN(size, bufsize - done));
+            if (ret <= 0) {
+                return -1;
+            }
+            done += ret;
+        }
+        elapsed += bench_now() - start;
+        bench_use(buf);
+    }
+    return (double)elapsed / ((double)bufsize * rounds); /* ns/byte */
+}
+
+int
+main(int argc, char *argv[])
+{
+    int opt, soc;
+    unsigned int rounds = 200;
+    size_t sizes[] = {64, 1024, 16384}, *size;
+    uint8_t buf[1000];
+    double ns;
+
+    while ((opt = getopt(argc, argv, "n:b:")) != -1) {
+        switch (opt) {
+        case 'n':
+            rounds = strtoul(optarg, NULL, 10);
+            break;
+        case 'b':
+            bufsize = strtoul(optarg, NULL, 10);
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-n rounds] [-b bufsize]\n", argv[0]);
+            return -1;
+        }
+    }
+    if (!rounds) {
+        fprintf(stderr, "rounds must be greater than 0\n");
+        return -1;
+    }
+    if (bufsize < TCP_BUFSIZE_MIN || bufsize > TCP_BUFSIZE_MAX) {
+        fprintf(stderr, "bufsize must be in %d-%d\n", TCP_BUFSIZE_MIN, TCP_BUFSIZE_MAX);
+        return -1;
+    }
+    if (net_init() == -1) {
+        fprintf(stderr, "net_init() failure\n");
+        return -1;
+    }
+    if (tcp_peer_init(bufsize) == -1) {
+        return -1;
+    }
+    if (net_run() == -1) {
+        fprintf(stderr, "net_run() failure\n");
+        return -1;
+    }
+    soc = establish();
+    if (soc == -1 || tcp_receive(soc, buf, sizeof(buf)) != sizeof(buf)) {
+        fprintf(stderr, "failed to establish the connection\n");
+        net_shutdown();
+        return -1;
+    }
+    printf("tcp_receive: drains a full receive buffer (%zu bytes), rounds=%u\n", bufsize, rounds);
+    printf("%12s %12s %12s\n", "read size", "ns/byte", "MB/s");
+    for (size = sizes; size < tailof(sizes); size++) {
+        ns = bench_receive(soc, *size, rounds);
+        if (ns < 0) {
+            fprintf(stderr, "bench_receive() failure\n");
+            break;
+        }
+        printf("%12zu %12.3f %12.1f\n", *size, ns, 1000 / ns);
+    }
+    net_shutdown();
+    return 0;
+}
@@ -0,0 +1,117 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "platform.h"
+
+#include "util.h"
+#include "net.h"
+#include "ip.h"
+#include "tcp.h"
+
+#include "bench.h"
+#include "tcp_peer.h"
+
+/*
+ * Benchmark
+ */
+
+static size_t bufsize = 65535; /* the send buffer of the pcb, and the window of the peer */
+
+/* NOTE: the time to hand over a buffer full of data, sent out as much as the congestion window allows */
+static double
+bench_send(int soc, size_t size, unsigned int rounds)
+{
+    static uint8_t buf[TCP_BUFSIZE_MAX];
+    unsigned int r;
+    unsigned long base;
+    size_t done, acked, n;
+    ssize_t ret;
+    uint64_t start, elapsed = 0;
+
+    for (r = 0; r < rounds; r++) {
+        base = tcp_peer_bytes();
+        done = 0;
+        start = bench_now();
+        while (done < bufsize) {
+            ret = tcp_send(soc, buf, MIN(size, bufsize - done));
+            if (ret <= 0) {
+                return -1;
+            }
+            done += ret;
+        }
+        elapsed += bench_now() - start;
+        /* NOTE: acknowledges the data as it goes out, the rest is sent as the congestion window opens */
+        for (acked = 0; acked < bufsize; acked += n) {
+            tcp_peer_wait_bytes(base + acked + 1);
+            n = tcp_peer_bytes() - base - acked;
+            if (tcp_peer_acknowledge(n) == -1) {
+                return -1;
+            }
+        }
+        /* NOTE: lets the worker process the ACK (its loop sleeps up to 1ms), not to be timed as a blocked write */
+        usleep(2000);
+    }
+    return (double)elapsed / ((double)bufsize * rounds); /* ns/byte */
+}
+
+int
+main(int argc, char *argv[])
+{
+    int opt, soc;
+    unsigned int rounds = 200;
+    size_t sizes[] = {64, 1024, 16384}, *size;
+    double ns;
+
+    while ((opt = getopt(argc, argv, "n:b:")) != -1) {
+        switch (opt) {
+        case 'n':
+            rounds = strtoul(optarg, NULL, 10);
+            break;
+        case 'b':
+            bufsize = strtoul(optarg, NULL, 10);
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-n rounds] [-b bufsize]\n", argv[0]);
+            return -1;
+        }
+    }
+    if (!rounds) {
+        fprintf(stderr, "rounds must be greater than 0\n");
+        return -1;
+    }
+    if (bufsize < TCP_BUFSIZE_MIN || bufsize > TCP_BUFSIZE_MAX) {
+        fprintf(stderr, "bufsize must be in %d-%d\n", TCP_BUFSIZE_MIN, TCP_BUFSIZE_MAX);
+        return -1;
+    }
+    if (net_init() == -1) {
+        fprintf(stderr, "net_init() failure\n");
+        return -1;
+    }
+    if (tcp_peer_init(bufsize) == -1) {
+        return -1;
+    }
+    if (net_run() == -1) {
+        fprintf(stderr, "net_run() failure\n");
+        return -1;
+    }
+    soc = tcp_peer_establish();
+    if (soc == -1) {
+        fprintf(stderr, "failed to establish the connection\n");
+        net_shutdown();
+        return -1;
+    }
+    printf("tcp_send: hands over a full window (%zu bytes), rounds=%u\n", bufsize, rounds);
+    printf("%12s %12s %12s\n", "write size", "ns/byte", "MB/s");
+    for (size = sizes; size < tailof(sizes); size++) {
+        ns = bench_send(soc, *size, rounds);
+        if (ns < 0) {
+            fprintf(stderr, "bench_send() failure\n");
+            break;
+        }
+        printf("%12zu %12.3f %12.1f\n", *size, ns, 1000 / ns);
+    }
+    net_shutdown();
+    return 0;
+}
@@ -2,6 +2,7 @@
 #include <stdint.h>
 
 #include "util.h"
+#include "pktbuf.h"
 #include "net.h"
 
 #include "loopback.h"
@@ -9,11 +10,18 @@
 #define LOOPBACK_MTU UINT16_MAX /* maximum size of IP datagram */
 
 static int
-loopback_transmit(struct net_device *dev, uint16_t type, const uint8_t *data, size_t len, const void *dst)
+loopback_transmit(struct net_device *dev, uint16_t type, struct pktbuf *pkt, const void *dst)
 {
-    debugf("dev=%s, type=%s(0x%04x), len=%zu", dev->name, net_protocol_name(type), type, len);
-    debugdump(data, len);
-    net_input_handler(type, data, len, dev);
+    debugf("dev=%s, type=%s(0x%04x), len=%zu", dev->name, net_protocol_name(type), type, pktbuf_total(pkt));
+    debugdump(pkt->data, pktbuf_len(pkt));
+    /* NOTE: the receiver shares the buffer, no copy (unless it has segments, input buffers are linear) */
+    pkt = pktbuf_linearize(pkt);
+    if (!pkt) {
+        errorf("pktbuf_linearize() failure");
+        return -1;
+    }
+    net_input_handler(type, pkt, dev);
+    pktbuf_free(pkt);
     return 0;
 }
 
@@ -2,15 +2,16 @@
 #include <stdint.h>
 
 #include "util.h"
+#include "pktbuf.h"
 #include "net.h"
 
 #define NULL_MTU UINT16_MAX /* maximum size of IP datagram */
 
 static int
-null_transmit(struct net_device *dev, uint16_t type, const uint8_t *data, size_t len, const void *dst)
+null_transmit(struct net_device *dev, uint16_t type, struct pktbuf *pkt, const void *dst)
 {
-    debugf("dev=%s, type=%s(0x%04x), len=%zu", dev->name, net_protocol_name(type), type, len);
-    debugdump(data, len);
+    debugf("dev=%s, type=%s(0x%04x), len=%zu", dev->name, net_protocol_name(type), type, pktbuf_total(pkt));
+    debugdump(pkt->data, pktbuf_len(pkt));
     /* drop data */
     return 0;
 }
@@ -5,6 +5,7 @@
 #include <sys/types.h>
 
 #include "util.h"
+#include "pktbuf.h"
 #include "net.h"
 #include "ether.h"
 
@@ -66,67 +67,114 @@ ether_addr_ntop(const uint8_t *n, char *p, size_t size)
 }
 
 static void
-ether_dump(const uint8_t *frame, size_t flen)
+ether_dump(FILE *fp, const void *frame, size_t flen)
 {
     struct ether_hdr *hdr;
     char addr[ETHER_ADDR_STR_LEN];
 
     hdr = (struct ether_hdr *)frame;
-    flockfile(stderr);
-    fprintf(stderr, "        src: %s\n", ether_addr_ntop(hdr->src, addr, sizeof(addr)));
-    fprintf(stderr, "        dst: %s\n", ether_addr_ntop(hdr->dst, addr, sizeof(addr)));
-    fprintf(stderr, "       type: 0x%04x (%s)\n", ntoh16(hdr->type), ether_type_ntoa(hdr->type));
+    flockfile(fp);
+    fprintf(fp, "        src: %s\n", ether_addr_ntop(hdr->src, addr, sizeof(addr)));
+    fprintf(fp, "        dst: %s\n", ether_addr_ntop(hdr->dst, addr, sizeof(addr)));
+    fprintf(fp, "       type: 0x%04x (%s)\n", ntoh16(hdr->type), ether_type_ntoa(hdr->type));
 #ifdef HEXDUMP
-    hexdump(stderr, frame, flen);
+    hexdump(fp, frame, flen);
 #endif
-    funlockfile(stderr);
+    funlockfile(fp);
 }
 
 int
-ether_transmit_helper(struct net_device *dev, uint16_t type, const uint8_t *data, size_t len, const void *dst, ssize_t (*callback)(struct net_device *dev, const uint8_t *data, size_t len))
+ether_transmit_helper(struct net_device *dev, uint16_t type, struct pktbuf *pkt, const void *dst, ssize_t (*callback)(struct net_device *dev, const struct iovec *iov, int iovcnt))
 {
-    uint8_t frame[ETHER_FRAME_SIZE_MAX] = {};
+    static const uint8_t pad[ETHER_FRAME_SIZE_MIN] = {};
+    struct iovec iov[PKTBUF_FRAGS_MAX + 2]; /* the data, the segments and the padding */
     struct ether_hdr *hdr;
-    size_t flen, pad = 0;
+    size_t flen;
+    int n;
 
-    hdr = (struct ether_hdr *)frame;
+    hdr = (struct ether_hdr *)pktbuf_push(pkt, sizeof(*hdr));
+    if (!hdr) {
+        errorf("pktbuf_push() failure");
+        return -1;
+    }
     memcpy(hdr->dst, dst, ETHER_ADDR_LEN);
     memcpy(hdr->src, dev->addr, ETHER_ADDR_LEN);
     hdr->type = hton16(type);
-    memcpy(hdr + 1, data, len);
-    if (len < ETHER_PAYLOAD_SIZE_MIN) {
-        pad = ETHER_PAYLOAD_SIZE_MIN - len;
+    n = pktbuf_iovec(pkt, iov, countof(iov) - 1);
+    if (n == -1) {
+        errorf("pktbuf_iovec() failure");
+        return -1;
+    }
+    flen = pktbuf_total(pkt);
+    if (flen < ETHER_FRAME_SIZE_MIN) {
+        /* NOTE: padded with a vector of zeros, the buffer is left as is */
+        iov[n].iov_base = (void *)pad;
+        iov[n].iov_len = ETHER_FRAME_SIZE_MIN - flen;
+        n++;
+        flen = ETHER_FRAME_SIZE_MIN;
     }
-    flen = sizeof(*hdr) + len + pad;
     debugf("dev=%s, type=%s(0x%04x), len=%zu", dev->name, ether_type_ntoa(hdr->type), type, flen);
-    ether_dump(frame, flen);
-    return callback(dev, frame, flen) == (ssize_t)flen ? 0 : -1;
+    debugdump_with(ether_dump, pkt->data, pktbuf_len(pkt));
+    return callback(dev, iov, n) == (ssize_t)flen ? 0 : -1;
 }
 
-int
-ether_poll_helper(struct net_device *dev, ssize_t (*callback)(struct net_device *dev, uint8_t *buf, size_t size))
+static int
+ether_input_helper(struct net_device *dev, ssize_t (*callback)(struct net_device *dev, uint8_t *buf, size_t size))
 {
-    uint8_t frame[ETHER_FRAME_SIZE_MAX];
+    struct pktbuf *pkt;
     ssize_t flen;
     struct ether_hdr *hdr;
     uint16_t type;
 
-    flen = callback(dev, frame, sizeof(frame));
+    pkt = pktbuf_alloc(PKTBUF_HEADROOM, ETHER_FRAME_SIZE_MAX);
+    if (!pkt) {
+        errorf("pktbuf_alloc() failure");
+        return -1;
+    }
+    flen = callback(dev, pkt->data, ETHER_FRAME_SIZE_MAX); /* NOTE: receive directly into the packet buffer */
+    if (flen <= 0) {
+        /* no more frames (0) or error (-1) */
+        pktbuf_free(pkt);
+        return flen;
+    }
     if (flen < (ssize_t)sizeof(*hdr)) {
         errorf("input data is too short");
-        return -1;
+        pktbuf_free(pkt);
+        return 1;
     }
-    hdr = (struct ether_hdr *)frame;
+    pktbuf_put(pkt, flen);
+    hdr = (struct ether_hdr *)pkt->data;
     if (memcmp(dev->addr, hdr->dst, ETHER_ADDR_LEN) != 0) {
         if (memcmp(ETHER_ADDR_BROADCAST, hdr->dst, ETHER_ADDR_LEN) != 0) {
             /* for other host */
-            return -1;
+            pktbuf_free(pkt);
+            return 1;
         }
     }
     type = ntoh16(hdr->type);
     debugf("dev=%s, type=%s(0x%04x), len=%zu", dev->name, ether_type_ntoa(hdr->type), type, flen);
-    ether_dump(frame, flen);
-    return net_input_handler(type, (uint8_t *)(hdr + 1), flen - sizeof(*hdr), dev);
+    debugdump_with(ether_dump, pkt->data, flen);
+    pktbuf_pull(pkt, sizeof(*hdr));
+    net_input_handler(type, pkt, dev);
+    pktbuf_free(pkt);
+    return 1;
+}
+
+/*
+ * NOTE: receives up to budget frames, the callback must not block and returns 0 when no frame is available.
+ *       returns the number of frames received (including the ones dropped here), 0 if none.
+ */
+int
+ether_poll_helper(struct net_device *dev, int budget, ssize_t (*callback)(struct net_device *dev, uint8_t *buf, size_t size))
+{
+    int num;
+
+    for (num = 0; num < budget; num++) {
+        if (ether_input_helper(dev, callback) <= 0) {
+            break;
+        }
+    }
+    return num;
 }
 
 void
@@ -5,6 +5,7 @@
 #include <stdint.h>
 #include <unistd.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 
 #include "net.h"
 
@@ -31,9 +32,9 @@ extern char *
 ether_addr_ntop(const uint8_t *n, char *p, size_t size);
 
 extern int
-ether_transmit_helper(struct net_device *dev, uint16_t type, const uint8_t *payload, size_t plen, const void *dst, ssize_t (*callback)(struct net_device *dev, const uint8_t *buf, size_t len));
+ether_transmit_helper(struct net_device *dev, uint16_t type, struct pktbuf *pkt, const void *dst, ssize_t (*callback)(struct net_device *dev, const struct iovec *iov, int iovcnt));
 extern int
-ether_poll_helper(struct net_device *dev, ssize_t (*callback)(struct net_device *dev, uint8_t *buf, size_t size));
+ether_poll_helper(struct net_device *dev, int budget, ssize_t (*callback)(struct net_device *dev, uint8_t *buf, size_t size));
 extern void
 ether_setup_helper(struct net_device *net_device);
 
@@ -3,6 +3,7 @@
 #include <string.h>
 
 #include "util.h"
+#include "pktbuf.h"
 #include "ip.h"
 #include "icmp.h"
 
@@ -53,36 +54,38 @@ icmp_type_ntoa(uint8_t type) {
 }
 
 static void
-icmp_dump(const uint8_t *data, size_t len)
+icmp_dump(FILE *fp, const void *data, size_t len)
 {
     struct icmp_hdr *hdr;
     struct icmp_echo *echo;
 
-    flockfile(stderr);
+    flockfile(fp);
     hdr = (struct icmp_hdr *)data;
-    fprintf(stderr, "       type: %u (%s)\n", hdr->type, icmp_type_ntoa(hdr->type));
-    fprintf(stderr, "       code: %u\n", hdr->code);
-    fprintf(stderr, "        sum: 0x%04x (0x%04x)\n", ntoh16(hdr->sum), ntoh16(cksum16((uint16_t *)data, len, -hdr->sum)));
+    fprintf(fp, "       type: %u (%s)\n", hdr->type, icmp_type_ntoa(hdr->type));
+    fprintf(fp, "       code: %u\n", hdr->code);
+    fprintf(fp, "        sum: 0x%04x (0x%04x)\n", ntoh16(hdr->sum), ntoh16(cksum16((uint16_t *)data, len, -hdr->sum)));
     switch (hdr->type) {
     case ICMP_TYPE_ECHOREPLY:
     case ICMP_TYPE_ECHO:
         echo = (struct icmp_echo *)hdr;
-        fprintf(stderr, "         id: %u\n", ntoh16(echo->id));
-        fprintf(stderr, "        seq: %u\n", ntoh16(echo->seq));
+        fprintf(fp, "         id: %u\n", ntoh16(echo->id));
+        fprintf(fp, "        seq: %u\n", ntoh16(echo->seq));
         break;
     default:
-        fprintf(stderr, "     values: 0x%08x\n", ntoh32(hdr->values));
+        fprintf(fp, "     values: 0x%08x\n", ntoh32(hdr->values));
         break;
     }
 #ifdef HEXDUMP
-    hexdump(stderr, data, len);
+    hexdump(fp, data, len);
 #endif
-    funlockfile(stderr);
+    funlockfile(fp);
 }
 
 static void
-icmp_input(const uint8_t *data, size_t len, ip_addr_t src, ip_addr_t dst, struct ip_iface *iface)
+icmp_input(struct pktbuf *pkt, ip_addr_t src, ip_addr_t dst, struct ip_iface *iface)
 {
+    const uint8_t *data = pkt->data;
+    size_t len = pktbuf_len(pkt);
     struct icmp_hdr *hdr;
     char addr1[IP_ADDR_STR_LEN];
     char addr2[IP_ADDR_STR_LEN];
@@ -102,7 +105,7 @@ icmp_input(const uint8_t *data, size_t len, ip_addr_t src, ip_addr_t dst, struct
         ip_addr_ntop(dst, addr2, sizeof(addr2)),
         icmp_type_ntoa(hdr->type), hdr->type, len,
         ip_addr_ntop(iface->unicast, addr3, sizeof(addr3)));
-    icmp_dump(data, len);
+    debugdump_with(icmp_dump, data, len);
     switch (hdr->type) {
     case ICMP_TYPE_ECHO:
         if (dst != iface->unicast) {
@@ -112,6 +115,13 @@ icmp_input(const uint8_t *data, size_t len, ip_addr_t src, ip_addr_t dst, struct
         }
         icmp_output(ICMP_TYPE_ECHOREPLY, hdr->code, hdr->values, (uint8_t *)(hdr + 1), len - sizeof(*hdr), dst, src);
         break;
+    case ICMP_TYPE_DEST_UNREACH:
+    case ICMP_TYPE_SOURCE_QUENCH:
+    case ICMP_TYPE_TIME_EXCEEDED:
+    case ICMP_TYPE_PARAM_PROBLEM:
+        /* NOTE: an error about a datagram we sent, quoted in the message */
+        ip_input_error(hdr->type, hdr->code, hdr->values, (uint8_t *)(hdr + 1), len - sizeof(*hdr));
+        break;
     default:
         /* ignore */
         break;
@@ -121,13 +131,23 @@ icmp_input(const uint8_t *data, size_t len, ip_addr_t src, ip_addr_t dst, struct
 int
 icmp_output(uint8_t type, uint8_t code, uint32_t values, const uint8_t *data, size_t len, ip_addr_t src, ip_addr_t dst)
 {
-    uint8_t buf[ICMP_BUFSIZ];
+    struct pktbuf *pkt;
     struct icmp_hdr *hdr;
     size_t msg_len;
     char addr1[IP_ADDR_STR_LEN];
     char addr2[IP_ADDR_STR_LEN];
+    int ret;
 
-    hdr = (struct icmp_hdr *)buf;
+    if (len > ICMP_BUFSIZ - sizeof(*hdr)) {
+        errorf("too long, len=%zu", len);
+        return -1;
+    }
+    pkt = pktbuf_alloc(PKTBUF_HEADROOM, sizeof(*hdr) + len);
+    if (!pkt) {
+        errorf("pktbuf_alloc() failure");
+        return -1;
+    }
+    hdr = (struct icmp_hdr *)pktbuf_put(pkt, sizeof(*hdr) + len);
     hdr->type = type;
     hdr->code = code;
     hdr->sum = 0;
@@ -139,8 +159,10 @@ icmp_output(uint8_t type, uint8_t code, uint32_t values, const uint8_t *data, si
         ip_addr_ntop(src, addr1, sizeof(addr1)),
         ip_addr_ntop(dst, addr2, sizeof(addr2)),
         icmp_type_ntoa(hdr->type), hdr->type, msg_len);
-    icmp_dump((uint8_t *)hdr, msg_len);
-    return ip_output(IP_PROTOCOL_ICMP, (uint8_t *)hdr, msg_len, src, dst);
+    debugdump_with(icmp_dump, (uint8_t *)hdr, msg_len);
+    ret = ip_output(IP_PROTOCOL_ICMP, pkt, src, dst);
+    pktbuf_free(pkt);
+    return ret;
 }
 
 int
@@ -6,25 +6,36 @@
 #include "platform.h"
 
 #include "util.h"
+#include "pktbuf.h"
+#include "timer.h"
 #include "net.h"
 #include "arp.h"
 #include "ip.h"
+#include "icmp.h"
 
 struct ip_protocol {
     struct ip_protocol *next;
     char name[16];
     uint8_t type;
-    void (*handler)(const uint8_t *data, size_t len, ip_addr_t src, ip_addr_t dst, struct ip_iface *iface);
+    void (*handler)(struct pktbuf *pkt, ip_addr_t src, ip_addr_t dst, struct ip_iface *iface);
+    void (*error_handler)(uint8_t type, uint8_t code, uint32_t values, const uint8_t *data, size_t len, ip_addr_t src, ip_addr_t dst);
 };
 
 struct ip_route {
-    struct ip_route *next;
+    struct ip_route *next; /* RIB hash chain */
     ip_addr_t network;
     ip_addr_t netmask;
+    int prefixlen;
     ip_addr_t nexthop;
     struct ip_iface *iface;
 };
 
+struct ip_fib; /* see below */
+struct ip_reass; /* see below */
+struct ip_dst_cache; /* see below */
+struct ip_pmtu; /* see below */
+struct ip_local; /* see below */
+
 struct ip_hdr {
     uint8_t vhl;
     uint8_t tos;
@@ -39,13 +50,59 @@ struct ip_hdr {
     uint8_t options[0];
 };
 
+#define IP_HDR_FLAG_DF 0x4000 /* don't fragment */
+#define IP_HDR_FLAG_MF 0x2000 /* more fragments */
+#define IP_HDR_OFFSET_MASK 0x1fff /* in units of 8 bytes */
+
+#ifndef IP_REASS_MEM_MAX
+#define IP_REASS_MEM_MAX (4 * 1024 * 1024) /* bytes held by the reassembly per stack (override with -D) */
+#endif
+#define IP_REASS_TIMEOUT 30 /* seconds */
+#define IP_REASS_HASH_SIZE 64 /* buckets per net worker (power of 2) */
+
+/* NOTE: the datagrams being reassembled on a net worker, see ip_reass_input() */
+struct ip_reass_queue {
+    struct ip_reass *buckets[IP_REASS_HASH_SIZE];
+    struct ip_reass *oldest; /* for the eviction */
+    struct ip_reass *newest;
+    size_t mem; /* bytes held */
+};
+
 const ip_addr_t IP_ADDR_ANY       = 0x00000000; /* 0.0.0.0 */
 const ip_addr_t IP_ADDR_BROADCAST = 0xffffffff; /* 255.255.255.255 */
 
-/* NOTE: if you want to add/delete the entries after net_run(), you need to protect these lists with a mutex. */
-static struct ip_iface *ifaces;
-static struct ip_protocol *protocols;
-static struct ip_route *routes;
+struct ip_stack {
+    /* NOTE: the interfaces and protocols are registered before net_run(), protect these lists with a mutex to change them after */
+    struct ip_iface *ifaces;
+    struct ip_protocol *protocols;
+    /* local addresses, read without any lock (see ip_local_lookup()) */
+    struct ip_local **locals;
+    size_t locals_size;
+    size_t locals_num;
+    /* routing table, the FIB is read without any lock (see ip_route_lookup()) */
+    mutex_t route_mutex;
+    struct ip_route **rib;
+    size_t rib_size;
+    size_t rib_num;
+    struct ip_fib *fib;
+    unsigned int route_gen; /* incremented on every change of the FIB */
+    /* reassembly, only touched by the net worker of the queue (see ip_reass_input()) */
+    struct ip_reass_queue reass[NET_WORKER_NUM];
+    /* forwarding */
+    int forwarding;
+    struct ip_dst_cache *dst_cache; /* IP_DST_CACHE_SIZE entries per net worker (see ip_forward()) */
+    /* path MTU (see ip_pmtu_get()) */
+    mutex_t pmtu_mutex; /* serializes the writers, ip_pmtu_get() takes no lock */
+    unsigned int pmtu_seq; /* odd while being written */
+    struct ip_pmtu *pmtu; /* IP_PMTU_CACHE_SIZE sets of IP_PMTU_CACHE_WAYS entries */
+    unsigned int pmtu_num; /* entries ever used, the cache is not looked up while 0 */
+};
+
+static struct ip_stack *
+ip_stack(void)
+{
+    return net_stack_priv(NET_STACK_PRIV_IP);
+}
 
 int
 ip_addr_pton(const char *p, ip_addr_t *n)
@@ -116,58 +173,475 @@ ip_endpoint_ntop(const struct ip_endpoint *n, char *p, size_t size)
     return p;
 }
 
-void
-ip_dump(const uint8_t *data, size_t len)
+static void
+ip_dump(FILE *fp, const void *data, size_t len)
 {
     struct ip_hdr *hdr;
     uint8_t v, hl, hlen;
     uint16_t total, offset;
     char addr[IP_ADDR_STR_LEN];
 
-    flockfile(stderr);
+    flockfile(fp);
     hdr = (struct ip_hdr *)data;
     v = (hdr->vhl & 0xf0) >> 4;
     hl = hdr->vhl & 0x0f;
     hlen = hl << 2;
-    fprintf(stderr, "        vhl: 0x%02x [v: %u, hl: %u (%u)]\n", hdr->vhl, v, hl, hlen);
-    fprintf(stderr, "        tos: 0x%02x\n", hdr->tos);
+    fprintf(fp, "        vhl: 0x%02x [v: %u, hl: %u (%u)]\n", hdr->vhl, v, hl, hlen);
+    fprintf(fp, "        tos: 0x%02x\n", hdr->tos);
     total = ntoh16(hdr->total);
-    fprintf(stderr, "      total: %u (payload: %u)\n", total, total - hlen);
-    fprintf(stderr, "         id: %u\n", ntoh16(hdr->id));
+    fprintf(fp, "      total: %u (payload: %u)\n", total, total - hlen);
+    fprintf(fp, "         id: %u\n", ntoh16(hdr->id));
     offset = ntoh16(hdr->offset);
-    fprintf(stderr, "     offset: 0x%04x [flags=%x, offset=%u]\n", offset, (offset & 0xe000) >> 13, offset & 0x1fff);
-    fprintf(stderr, "        ttl: %u\n", hdr->ttl);
-    fprintf(stderr, "   protocol: %u (%s)\n", hdr->protocol, ip_protocol_name(hdr->protocol));
-    fprintf(stderr, "        sum: 0x%04x (0x%04x)\n", ntoh16(hdr->sum), ntoh16(cksum16((uint16_t *)data, hlen, -hdr->sum)));
-    fprintf(stderr, "        src: %s\n", ip_addr_ntop(hdr->src, addr, sizeof(addr)));
-    fprintf(stderr, "        dst: %s\n", ip_addr_ntop(hdr->dst, addr, sizeof(addr)));
+    fprintf(fp, "     offset: 0x%04x [flags=%x, offset=%u]\n", offset, (offset & 0xe000) >> 13, offset & 0x1fff);
+    fprintf(fp, "        ttl: %u\n", hdr->ttl);
+    fprintf(fp, "   protocol: %u (%s)\n", hdr->protocol, ip_protocol_name(hdr->protocol));
+    fprintf(fp, "        sum: 0x%04x (0x%04x)\n", ntoh16(hdr->sum), ntoh16(cksum16((uint16_t *)data, hlen, -hdr->sum)));
+    fprintf(fp, "        src: %s\n", ip_addr_ntop(hdr->src, addr, sizeof(addr)));
+    fprintf(fp, "        dst: %s\n", ip_addr_ntop(hdr->dst, addr, sizeof(addr)));
 #ifdef HEXDUMP
-    hexdump(stderr, data, len);
+    hexdump(fp, data, len);
 #endif
-    funlockfile(stderr);
+    funlockfile(fp);
+}
+
+/*
+ * Routing table
+ *
+ * NOTE: The routes are kept in a hash table keyed by (network, prefix length) for the updates (RIB),
+ *       and expanded into a multibit trie for the longest prefix match (FIB, DIR-16-8-8): a root table
+ *       indexed by the top 16 bits of the address and nodes of 256 entries for the next 8 bits each.
+ *       An entry holds the most specific route covering its range, or points to the next node (tagged
+ *       with the low bit). A lookup reads at most three entries and takes no lock (see rcu_read_lock()).
+ *       Updates are serialized by the mutex: a single add/delete rewrites the affected root entries
+ *       in place and replaces the nodes below them with modified copies, a batch builds a whole new
+ *       FIB and swaps it. The replaced nodes (and deleted routes) are freed after rcu_synchronize().
+ */
+
+#define IP_FIB_ROOT_BITS 16
+#define IP_FIB_NODE_BITS 8
+#define IP_FIB_NODE_SIZE (1 << IP_FIB_NODE_BITS)
+#define IP_FIB_LEVELS 3 /* 16 + 8 + 8 bits */
+
+#define IP_FIB_IS_NODE(x) ((x) & 1)
+#define IP_FIB_NODE(x) ((struct ip_fib_node *)((x) & ~(uintptr_t)1))
+#define IP_FIB_ROUTE(x) ((struct ip_route *)(x))
+
+#define IP_RIB_SIZE_MIN 64
+#define IP_LOCAL_SIZE_MIN 16 /* buckets of the local address table (power of 2) */
+
+struct ip_fib_node {
+    uintptr_t entries[IP_FIB_NODE_SIZE];
+};
+
+struct ip_fib {
+    uintptr_t root[1 << IP_FIB_ROOT_BITS];
+};
+
+/* NOTE: the nodes replaced by an update, freed after a grace period */
+struct ip_fib_retired {
+    struct ip_fib_retired *next;
+    size_t num;
+    void *ptrs[254];
+};
+
+static int
+ip_route_prefixlen(ip_addr_t netmask)
+{
+    uint32_t mask = ntoh32(netmask);
+    int len;
+
+    len = __builtin_popcount(mask);
+    if (mask != (len ? 0xffffffff << (32 - len) : 0)) {
+        return -1; /* not contiguous */
+    }
+    return len;
+}
+
+static ip_addr_t
+ip_route_netmask(int len)
+{
+    return hton32(len ? 0xffffffff << (32 - len) : 0);
+}
+
+static size_t
+ip_rib_hash(struct ip_stack *ip, ip_addr_t network, int len)
+{
+    return ((uint32_t)(network ^ len) * 0x9e3779b1) >> (32 - __builtin_ctzl(ip->rib_size));
 }
 
-/* NOTE: must not be call after net_run() */
 static struct ip_route *
-ip_route_add(ip_addr_t network, ip_addr_t netmask, ip_addr_t nexthop, struct ip_iface *iface)
+ip_rib_select(struct ip_stack *ip, ip_addr_t network, int len)
 {
     struct ip_route *route;
-    char addr1[IP_ADDR_STR_LEN];
-    char addr2[IP_ADDR_STR_LEN];
-    char addr3[IP_ADDR_STR_LEN];
-    char addr4[IP_ADDR_STR_LEN];
 
+    for (route = ip->rib[ip_rib_hash(ip, network, len)]; route; route = route->next) {
+        if (route->network == network && route->prefixlen == len) {
+            break;
+        }
+    }
+    return route;
+}
+
+static int
+ip_rib_insert(struct ip_stack *ip, struct ip_route *route)
+{
+    struct ip_route **rib, **old, *entry;
+    size_t size, idx, i;
+
+    if (ip->rib_num + 1 > ip->rib_size) {
+        size = ip->rib_size * 2;
+        rib = memory_alloc(sizeof(*rib) * size);
+        if (!rib) {
+            return -1;
+        }
+        old = ip->rib;
+        ip->rib = rib;
+        ip->rib_size = size;
+        for (i = 0; i < size / 2; i++) {
+            while ((entry = old[i]) != NULL) {
+                old[i] = entry->next;
+                idx = ip_rib_hash(ip, entry->network, entry->prefixlen);
+                entry->next = rib[idx];
+                rib[idx] = entry;
+            }
+        }
+        memory_free(old);
+    }
+    idx = ip_rib_hash(ip, route->network, route->prefixlen);
+    route->next = ip->rib[idx];
+    ip->rib[idx] = route;
+    ip->rib_num++;
+    return 0;
+}
+
+static void
+ip_rib_remove(struct ip_stack *ip, struct ip_route *route)
+{
+    struct ip_route **p;
+
+    for (p = &ip->rib[ip_rib_hash(ip, route->network, route->prefixlen)]; *p; p = &(*p)->next) {
+        if (*p == route) {
+            *p = route->next;
+            ip->rib_num--;
+            break;
+        }
+    }
+}
+
+/* NOTE: the most specific route shorter than the prefix that covers it (NULL if none) */
+static struct ip_route *
+ip_rib_covering(struct ip_stack *ip, ip_addr_t network, int len)
+{
+    struct ip_route *route;
+
+    while (len-- > 0) {
+        route = ip_rib_select(ip, network & ip_route_netmask(len), len);
+        if (route) {
+            return route;
+        }
+    }
+    return NULL;
+}
+
+static int
+ip_fib_retire(struct ip_fib_retired **list, void *ptr)
+{
+    struct ip_fib_retired *chunk = *list;
+
+    if (!chunk || chunk->num == countof(chunk->ptrs)) {
+        chunk = memory_alloc(sizeof(*chunk));
+        if (!chunk) {
+            return -1;
+        }
+        chunk->next = *list;
+        *list = chunk;
+    }
+    chunk->ptrs[chunk->num++] = ptr;
+    return 0;
+}
+
+/* NOTE: must be called after rcu_synchronize() */
+static void
+ip_fib_reclaim(struct ip_fib_retired *list)
+{
+    struct ip_fib_retired *chunk;
+    size_t i;
+
+    while ((chunk = list) != NULL) {
+        list = chunk->next;
+        for (i = 0; i < chunk->num; i++) {
+            memory_free(chunk->ptrs[i]);
+        }
+        memory_free(chunk);
+    }
+}
+
+static struct ip_fib_node *
+ip_fib_node_alloc(uintptr_t entry)
+{
+    struct ip_fib_node *node;
+    int i;
+
+    node = memory_alloc_nozero(sizeof(*node));
+    if (!node) {
+        return NULL;
+    }
+    if (IP_FIB_IS_NODE(entry)) {
+        memcpy(node->entries, IP_FIB_NODE(entry)->entries, sizeof(node->entries));
+    } else {
+        for (i = 0; i < IP_FIB_NODE_SIZE; i++) {
+            node->entries[i] = entry; /* expanded */
+        }
+    }
+    return node;
+}
+
+static void
+ip_fib_node_free(struct ip_fib_node *node, int level)
+{
+    int i;
+
+    if (level < IP_FIB_LEVELS - 1) {
+        for (i = 0; i < IP_FIB_NODE_SIZE; i++) {
+            if (IP_FIB_IS_NODE(node->entries[i])) {
+                ip_fib_node_free(IP_FIB_NODE(node->entries[i]), level + 1);
+            }
+        }
+    }
+    memory_free(node);
+}
+
+static void
+ip_fib_free(struct ip_fib *fib)
+{
+    size_t i;
+
+    for (i = 0; i < countof(fib->root); i++) {
+        if (IP_FIB_IS_NODE(fib->root[i])) {
+            ip_fib_node_free(IP_FIB_NODE(fib->root[i]), 1);
+        }
+    }
+    memory_free(fib);
+}
+
+struct ip_fib_update {
+    struct ip_route *from; /* NULL: add, replaces the less specific routes */
+    struct ip_route *to;
+    struct ip_fib_retired *retired; /* NULL: building a private FIB, no copy needed */
+    int shared;
+};
+
+static int
+ip_fib_update_entry(uintptr_t *entry, int level, struct ip_fib_update *u);
+
+/*
+ * NOTE: applies the update to the entries [first, first + num) of a table of the level,
+ *       for a prefix that covers them entirely.
+ */
+static int
+ip_fib_update_range(uintptr_t *entries, size_t first, size_t num, int level, struct ip_fib_update *u)
+{
+    size_t i;
+    struct ip_route *route;
+
+    for (i = first; i < first + num; i++) {
+        if (IP_FIB_IS_NODE(entries[i])) {
+            if (ip_fib_update_entry(&entries[i], level, u) == -1) {
+                return -1;
+            }
+            continue;
+        }
+        route = IP_FIB_ROUTE(entries[i]);
+        if (u->from ? route == u->from : (!route || route->prefixlen <= u->to->prefixlen)) {
+            __atomic_store_n(&entries[i], (uintptr_t)u->to, __ATOMIC_RELEASE);
+        }
+    }
+    return 0;
+}
+
+/* NOTE: the entry points to a node of the next level, covered entirely by the prefix */
+static int
+ip_fib_update_entry(uintptr_t *entry, int level, struct ip_fib_update *u)
+{
+    struct ip_fib_node *node;
+    int ret;
+
+    node = IP_FIB_NODE(*entry);
+    if (u->shared) {
+        /* copy on write, the readers keep using the old node until the copy is published */
+        node = ip_fib_node_alloc(*entry);
+        if (!node) {
+            return -1;
+        }
+        if (ip_fib_retire(&u->retired, IP_FIB_NODE(*entry)) == -1) {
+            memory_free(node);
+            return -1;
+        }
+    }
+    /* NOTE: published even on failure, a partially updated copy is still a valid table */
+    ret = ip_fib_update_range(node->entries, 0, IP_FIB_NODE_SIZE, level + 1, u);
+    __atomic_store_n(entry, (uintptr_t)node | 1, __ATOMIC_RELEASE);
+    return ret;
+}
+
+/* NOTE: applies the update of the prefix to a table of the level (the root or a node) */
+static int
+ip_fib_update_table(uintptr_t *entries, int level, uint32_t addr, int len, struct ip_fib_update *u)
+{
+    int top, bits, ret;
+    size_t idx;
+    uintptr_t *entry;
+    struct ip_fib_node *node;
+
+    top = level ? IP_FIB_ROOT_BITS + IP_FIB_NODE_BITS * (level - 1) : 0; /* bits indexed above */
+    bits = level ? IP_FIB_NODE_BITS : IP_FIB_ROOT_BITS;
+    idx = (addr >> (32 - top - bits)) & ((1 << bits) - 1);
+    if (len <= top + bits) {
+        return ip_fib_update_range(entries, idx, (size_t)1 << (top + bits - len), level, u);
+    }
+    /* more specific than this level, go down (a route entry is expanded into a new node) */
+    entry = &entries[idx];
+    if (IP_FIB_IS_NODE(*entry) && !u->shared) {
+        node = IP_FIB_NODE(*entry);
+    } else {
+        node = ip_fib_node_alloc(*entry);
+        if (!node) {
+            return -1;
+        }
+        if (IP_FIB_IS_NODE(*entry) && ip_fib_retire(&u->retired, IP_FIB_NODE(*entry)) == -1) {
+            memory_free(node);
+            return -1;
+        }
+    }
+    ret = ip_fib_update_table(node->entries, level + 1, addr, len, u);
+    __atomic_store_n(entry, (uintptr_t)node | 1, __ATOMIC_RELEASE);
+    return ret;
+}
+
+/* NOTE: must be called after ip->route_mutex locked, builds a private FIB from the RIB */
+static struct ip_fib *
+ip_fib_build(struct ip_stack *ip)
+{
+    struct ip_fib *fib;
+    struct ip_fib_update u = {};
+    struct ip_route *route;
+    size_t i;
+
+    fib = memory_alloc(sizeof(*fib));
+    if (!fib) {
+        return NULL;
+    }
+    for (i = 0; i < ip->rib_size; i++) {
+        for (route = ip->rib[i]; route; route = route->next) {
+            u.to = route;
+            if (ip_fib_update_table(fib->root, 0, ntoh32(route->network), route->prefixlen, &u) == -1) {
+                ip_fib_free(fib);
+                return NULL;
+            }
+        }
+    }
+    return fib;
+}
+
+/* NOTE: must be called after ip->route_mutex locked */
+static int
+ip_fib_rebuild(struct ip_stack *ip)
+{
+    struct ip_fib *fib, *old;
+
+    fib = ip_fib_build(ip);
+    if (!fib) {
+        return -1;
+    }
+    old = ip->fib;
+    __atomic_store_n(&ip->fib, fib, __ATOMIC_RELEASE);
+    __atomic_add_fetch(&ip->route_gen, 1, __ATOMIC_RELEASE);
+    rcu_synchronize();
+    ip_fib_free(old);
+    return 0;
+}
+
+/*
+ * NOTE: must be called after ip->route_mutex locked, applies a single change in place.
+ *       from == NULL adds the route to, otherwise the entries of from are replaced with to.
+ */
+static int
+ip_fib_change(struct ip_stack *ip, struct ip_route *route, struct ip_route *from, struct ip_route *to)
+{
+    struct ip_fib_update u = {from, to, NULL, 1};
+    int ret;
+
+    ret = ip_fib_update_table(ip->fib->root, 0, ntoh32(route->network), route->prefixlen, &u);
+    __atomic_add_fetch(&ip->route_gen, 1, __ATOMIC_RELEASE);
+    rcu_synchronize();
+    ip_fib_reclaim(u.retired);
+    if (ret == -1) {
+        errorf("ip_fib_update_table() failure, rebuild the FIB");
+        return ip_fib_rebuild(ip);
+    }
+    return 0;
+}
+
+static struct ip_route *
+ip_route_alloc(ip_addr_t network, ip_addr_t netmask, ip_addr_t nexthop, struct ip_iface *iface)
+{
+    struct ip_route *route;
+    int len;
+    char addr[IP_ADDR_STR_LEN];
+
+    len = ip_route_prefixlen(netmask);
+    if (len == -1) {
+        errorf("invalid netmask, netmask=%s", ip_addr_ntop(netmask, addr, sizeof(addr)));
+        return NULL;
+    }
     route = memory_alloc(sizeof(*route));
     if (!route) {
         errorf("memory_alloc() failure");
         return NULL;
     }
-    route->network = network;
+    route->network = network & netmask;
     route->netmask = netmask;
+    route->prefixlen = len;
     route->nexthop = nexthop;
     route->iface = iface;
-    route->next = routes;
-    routes = route;
+    return route;
+}
+
+int
+ip_route_add(ip_addr_t network, ip_addr_t netmask, ip_addr_t nexthop, struct ip_iface *iface)
+{
+    struct ip_stack *ip = ip_stack();
+    struct ip_route *route;
+    char addr1[IP_ADDR_STR_LEN];
+    char addr2[IP_ADDR_STR_LEN];
+    char addr3[IP_ADDR_STR_LEN];
+    char addr4[IP_ADDR_STR_LEN];
+
+    route = ip_route_alloc(network, netmask, nexthop, iface);
+    if (!route) {
+        return -1;
+    }
+    mutex_lock(&ip->route_mutex);
+    if (ip_rib_select(ip, route->network, route->prefixlen)) {
+        mutex_unlock(&ip->route_mutex);
+        errorf("already exists, network=%s, netmask=%s",
+            ip_addr_ntop(route->network, addr1, sizeof(addr1)), ip_addr_ntop(netmask, addr2, sizeof(addr2)));
+        memory_free(route);
+        return -1;
+    }
+    if (ip_rib_insert(ip, route) == -1) {
+        mutex_unlock(&ip->route_mutex);
+        errorf("ip_rib_insert() failure");
+        memory_free(route);
+        return -1;
+    }
+    if (ip_fib_change(ip, route, NULL, route) == -1) {
+        /* NOTE: the route may be partially visible, keep it */
+        mutex_unlock(&ip->route_mutex);
+        errorf("ip_fib_change() failure");
+        return -1;
+    }
+    mutex_unlock(&ip->route_mutex);
     infof("network=%s, netmask=%s, nexthop=%s, iface=%s dev=%s",
         ip_addr_ntop(route->network, addr1, sizeof(addr1)),
         ip_addr_ntop(route->netmask, addr2, sizeof(addr2)),
@@ -175,132 +649,984 @@ ip_route_add(ip_addr_t network, ip_addr_t netmask, ip_addr_t nexthop, struct ip_
         ip_addr_ntop(route->iface->unicast, addr4, sizeof(addr4)),
         NET_IFACE(iface)->dev->name
     );
-    return route;
+    return 0;
+}
+
+/* NOTE: the routes are published at once, with a single swap of the FIB (the duplicates are skipped) */
+int
+ip_route_add_batch(const struct ip_route_entry *entries, size_t num)
+{
+    struct ip_stack *ip = ip_stack();
+    struct ip_route *route;
+    size_t i, added = 0;
+
+    mutex_lock(&ip->route_mutex);
+    for (i = 0; i < num; i++) {
+        route = ip_route_alloc(entries[i].network, entries[i].netmask, entries[i].nexthop, entries[i].iface);
+        if (!route) {
+            break;
+        }
+        if (ip_rib_select(ip, route->network, route->prefixlen)) {
+            memory_free(route);
+            continue;
+        }
+        if (ip_rib_insert(ip, route) == -1) {
+            errorf("ip_rib_insert() failure");
+            memory_free(route);
+            break;
+        }
+        added++;
+    }
+    if (ip_fib_rebuild(ip) == -1) {
+        mutex_unlock(&ip->route_mutex);
+        errorf("ip_fib_rebuild() failure");
+        return -1;
+    }
+    mutex_unlock(&ip->route_mutex);
+    infof("added=%zu, skipped=%zu, routes=%zu", added, i - added, ip->rib_num);
+    return i == num ? 0 : -1;
+}
+
+int
+ip_route_del(ip_addr_t network, ip_addr_t netmask)
+{
+    struct ip_stack *ip = ip_stack();
+    struct ip_route *route;
+    int len;
+    char addr1[IP_ADDR_STR_LEN];
+    char addr2[IP_ADDR_STR_LEN];
+
+    len = ip_route_prefixlen(netmask);
+    if (len == -1) {
+        errorf("invalid netmask, netmask=%s", ip_addr_ntop(netmask, addr2, sizeof(addr2)));
+        return -1;
+    }
+    mutex_lock(&ip->route_mutex);
+    route = ip_rib_select(ip, network & netmask, len);
+    if (!route) {
+        mutex_unlock(&ip->route_mutex);
+        errorf("not found, network=%s, netmask=%s",
+            ip_addr_ntop(network, addr1, sizeof(addr1)), ip_addr_ntop(netmask, addr2, sizeof(addr2)));
+        return -1;
+    }
+    ip_rib_remove(ip, route);
+    if (ip_fib_change(ip, route, route, ip_rib_covering(ip, route->network, len)) == -1) {
+        /* NOTE: still referenced by the FIB, never freed */
+        mutex_unlock(&ip->route_mutex);
+        errorf("ip_fib_change() failure");
+        return -1;
+    }
+    mutex_unlock(&ip->route_mutex);
+    infof("network=%s, netmask=%s",
+        ip_addr_ntop(route->network, addr1, sizeof(addr1)), ip_addr_ntop(route->netmask, addr2, sizeof(addr2)));
+    memory_free(route); /* NOTE: no reader left, ip_fib_change() waited for them */
+    return 0;
+}
+
+/* NOTE: lockless, returns the interface and the next hop of the most specific route */
+static struct ip_iface *
+ip_route_lookup(ip_addr_t dst, ip_addr_t *nexthop)
+{
+    struct ip_stack *ip = ip_stack();
+    struct ip_fib *fib;
+    struct ip_route *route;
+    struct ip_iface *iface = NULL;
+    uint32_t addr = ntoh32(dst);
+    uintptr_t entry;
+
+    rcu_read_lock();
+    fib = __atomic_load_n(&ip->fib, __ATOMIC_ACQUIRE);
+    entry = __atomic_load_n(&fib->root[addr >> (32 - IP_FIB_ROOT_BITS)], __ATOMIC_ACQUIRE);
+    if (IP_FIB_IS_NODE(entry)) {
+        entry = __atomic_load_n(&IP_FIB_NODE(entry)->entries[(addr >> 8) & 0xff], __ATOMIC_ACQUIRE);
+        if (IP_FIB_IS_NODE(entry)) {
+            entry = __atomic_load_n(&IP_FIB_NODE(entry)->entries[addr & 0xff], __ATOMIC_ACQUIRE);
+        }
+    }
+    route = IP_FIB_ROUTE(entry);
+    if (route) {
+        iface = route->iface;
+        if (nexthop) {
+            *nexthop = (route->nexthop != IP_ADDR_ANY) ? route->nexthop : dst;
+        }
+    }
+    rcu_read_unlock();
+    return iface;
+}
+
+int
+ip_route_set_default_gateway(struct ip_iface *iface, const char *gateway)
+{
+    ip_addr_t gw;
+
+    if (ip_addr_pton(gateway, &gw) == -1) {
+        errorf("ip_addr_pton() failure, addr=%s", gateway);
+        return -1;
+    }
+    if (ip_route_add(IP_ADDR_ANY, IP_ADDR_ANY, gw, iface) == -1) {
+        errorf("ip_route_add() failure");
+        return -1;
+    }
+    return 0;
+}
+
+struct ip_iface *
+ip_route_get_iface(ip_addr_t dst)
+{
+    return ip_route_lookup(dst, NULL);
+}
+
+/*
+ * Local addresses
+ *
+ * NOTE: The unicast and the directed broadcast addresses of all the ifaces are kept in a hash table
+ *       (chained, grown to keep the load factor at most 1), so that ip_input() tells a datagram for us
+ *       in O(1) however many addresses a device has. The entries are added before net_run() only.
+ */
+
+struct ip_local {
+    struct ip_local *next;
+    ip_addr_t addr;
+    struct ip_iface *iface;
+    int broadcast;
+};
+
+static size_t
+ip_local_hash(struct ip_stack *ip, ip_addr_t addr)
+{
+    return ((uint32_t)addr * 0x9e3779b1) >> (32 - __builtin_ctzl(ip->locals_size));
+}
+
+/* NOTE: dev NULL matches any device, a broadcast address is matched only if broadcast is set */
+static struct ip_local *
+ip_local_lookup(struct ip_stack *ip, ip_addr_t addr, struct net_device *dev, int broadcast)
+{
+    struct ip_local *entry;
+
+    for (entry = ip->locals[ip_local_hash(ip, addr)]; entry; entry = entry->next) {
+        if (entry->addr == addr && (!entry->broadcast || broadcast) && (!dev || NET_IFACE(entry->iface)->dev == dev)) {
+            break;
+        }
+    }
+    return entry;
+}
+
+static int
+ip_local_add(struct ip_stack *ip, ip_addr_t addr, struct ip_iface *iface, int broadcast)
+{
+    struct ip_local **locals, *entry;
+    size_t size, idx, i;
+
+    if (ip->locals_num + 1 > ip->locals_size) {
+        size = ip->locals_size * 2;
+        locals = memory_alloc(sizeof(*locals) * size);
+        if (!locals) {
+            return -1;
+        }
+        for (i = 0; i < ip->locals_size; i++) {
+            while ((entry = ip->locals[i]) != NULL) {
+                ip->locals[i] = entry->next;
+                idx = ((uint32_t)entry->addr * 0x9e3779b1) >> (32 - __builtin_ctzl(size));
+                entry->next = locals[idx];
+                locals[idx] = entry;
+            }
+        }
+        memory_free(ip->locals);
+        ip->locals = locals;
+        ip->locals_size = size;
+    }
+    entry = memory_alloc(sizeof(*entry));
+    if (!entry) {
+        return -1;
+    }
+    entry->addr = addr;
+    entry->iface = iface;
+    entry->broadcast = broadcast;
+    idx = ip_local_hash(ip, addr);
+    entry->next = ip->locals[idx];
+    ip->locals[idx] = entry;
+    ip->locals_num++;
+    return 0;
+}
+
+struct ip_iface *
+ip_iface_alloc(const char *unicast, const char *netmask)
+{
+    struct ip_iface *iface;
+
+    iface = memory_alloc(sizeof(*iface));
+    if (!iface) {
+        errorf("memory_alloc() failure");
+        return NULL;
+    }
+    NET_IFACE(iface)->family = NET_IFACE_FAMILY_IP;
+    if (ip_addr_pton(unicast, &iface->unicast) == -1) {
+        errorf("ip_addr_pton() failure, addr=%s", unicast);
+        memory_free(iface);
+        return NULL;
+    }
+    if (ip_addr_pton(netmask, &iface->netmask) == -1) {
+        errorf("ip_addr_pton() failure, addr=%s", netmask);
+        memory_free(iface);
+        return NULL;
+    }
+    iface->broadcast = (iface->unicast & iface->netmask) | ~iface->netmask;
+    return iface;
+}
+
+/* NOTE: must not be call after net_run() */
+int
+ip_iface_register(struct net_device *dev, struct ip_iface *iface)
+{
+    struct ip_stack *ip = ip_stack();
+    char addr1[IP_ADDR_STR_LEN];
+    char addr2[IP_ADDR_STR_LEN];
+    char addr3[IP_ADDR_STR_LEN];
+
+    struct ip_route *route;
+    int prefixlen;
+
+    if (ip_local_lookup(ip, iface->unicast, NULL, 0)) {
+        errorf("already exists, unicast=%s", ip_addr_ntop(iface->unicast, addr1, sizeof(addr1)));
+        return -1;
+    }
+    prefixlen = ip_route_prefixlen(iface->netmask);
+    if (prefixlen == -1) {
+        errorf("invalid netmask, netmask=%s", ip_addr_ntop(iface->netmask, addr2, sizeof(addr2)));
+        return -1;
+    }
+    if (net_device_add_iface(dev, NET_IFACE(iface)) == -1) {
+        errorf("net_device_add_iface() failure");
+        return -1;
+    }
+    mutex_lock(&ip->route_mutex);
+    route = ip_rib_select(ip, iface->unicast & iface->netmask, prefixlen);
+    mutex_unlock(&ip->route_mutex);
+    if (route && NET_IFACE(route->iface)->dev == dev) {
+        /* NOTE: a secondary address on the same network shares the route of the first one */
+        debugf("connected route already exists, dev=%s", dev->name);
+    } else if (ip_route_add(iface->unicast & iface->netmask, iface->netmask, IP_ADDR_ANY, iface) == -1) {
+        errorf("ip_route_add() failure");
+        return -1;
+    }
+    if (ip_local_add(ip, iface->unicast, iface, 0) == -1 || ip_local_add(ip, iface->broadcast, iface, 1) == -1) {
+        errorf("ip_local_add() failure");
+        return -1;
+    }
+    iface->next = ip->ifaces;
+    ip->ifaces = iface;
+    infof("registered: dev=%s, unicast=%s, netmask=%s, broadcast=%s",
+        dev->name,
+        ip_addr_ntop(iface->unicast, addr1, sizeof(addr1)),
+        ip_addr_ntop(iface->netmask, addr2, sizeof(addr2)),
+        ip_addr_ntop(iface->broadcast, addr3, sizeof(addr3)));
+    return 0;
+}
+
+struct ip_iface *
+ip_iface_select(ip_addr_t addr)
+{
+    struct ip_local *entry;
+
+    entry = ip_local_lookup(ip_stack(), addr, NULL, 0);
+    return entry ? entry->iface : NULL;
+}
+
+/*
+ * Reassembly
+ *
+ * NOTE: The fragments of a datagram are steered to the same net worker (see ip_hash()), so each worker
+ *       reassembles in a queue of its own, and its timers expire on that worker too: no lock is needed.
+ *       A datagram is looked up in a hash table keyed by (src, dst, id, protocol). Its fragments are
+ *       held by reference (no copy) in an array sorted by offset, a fragment is placed with a binary
+ *       search, in order arrivals are appended. Overlapping fragments discard the whole datagram.
+ *       Once complete, the payloads are copied once into a buffer of the exact size, which is handed
+ *       up as is. A datagram not completed in IP_REASS_TIMEOUT is discarded, the oldest ones are
+ *       evicted when the queue holds more than its share of IP_REASS_MEM_MAX.
+ */
+
+#define IP_REASS_FRAGS_MIN 8 /* initial size of the fragment array */
+
+struct ip_frag {
+    uint16_t offset; /* of the payload in the datagram */
+    uint16_t len;
+    uint8_t *data; /* the payload */
+    struct pktbuf *pkt; /* NOTE: pkt->data points to the IP header */
+};
+
+struct ip_reass {
+    struct ip_reass *next; /* hash chain */
+    struct ip_reass *older;
+    struct ip_reass *newer;
+    struct ip_reass_queue *queue;
+    ip_addr_t src;
+    ip_addr_t dst;
+    uint16_t id;
+    uint8_t protocol;
+    struct ip_iface *iface; /* received on, for the ICMP error */
+    uint32_t size; /* size of the payload, 0 until the last fragment arrives */
+    uint32_t received; /* bytes of the payload received */
+    size_t mem; /* bytes held, including this structure */
+    struct ip_frag *frags;
+    size_t num;
+    size_t capacity;
+    struct timer_entry timer;
+};
+
+static size_t
+ip_reass_truesize(struct pktbuf *pkt)
+{
+    return sizeof(*pkt) + (pkt->end - pkt->head);
+}
+
+static unsigned int
+ip_reass_hash(ip_addr_t src, ip_addr_t dst, uint16_t id, uint8_t protocol)
+{
+    uint32_t key;
+
+    key = src ^ dst ^ ((uint32_t)id << 8 | protocol);
+    return (key * 0x9e3779b1) >> 26; /* NOTE: the top bits of the product, log2(IP_REASS_HASH_SIZE) */
+}
+
+static struct ip_reass *
+ip_reass_select(struct ip_reass_queue *queue, struct ip_hdr *hdr)
+{
+    struct ip_reass *reass;
+
+    reass = queue->buckets[ip_reass_hash(hdr->src, hdr->dst, hdr->id, hdr->protocol)];
+    for (; reass; reass = reass->next) {
+        if (reass->src == hdr->src && reass->dst == hdr->dst && reass->id == hdr->id && reass->protocol == hdr->protocol) {
+            break;
+        }
+    }
+    return reass;
+}
+
+static void
+ip_reass_free(struct ip_reass *reass)
+{
+    struct ip_reass_queue *queue = reass->queue;
+    struct ip_reass **p;
+    struct ip_frag *frag;
+
+    timer_cancel(&reass->timer);
+    for (p = &queue->buckets[ip_reass_hash(reass->src, reass->dst, reass->id, reass->protocol)]; *p; p = &(*p)->next) {
+        if (*p == reass) {
+            *p = reass->next;
+            break;
+        }
+    }
+    if (reass->older) {
+        reass->older->newer = reass->newer;
+    } else {
+        queue->oldest = reass->newer;
+    }
+    if (reass->newer) {
+        reass->newer->older = reass->older;
+    } else {
+        queue->newest = reass->older;
+    }
+    for (frag = reass->frags; frag < reass->frags + reass->num; frag++) {
+        pktbuf_free(frag->pkt);
+    }
+    queue->mem -= reass->mem;
+    memory_free(reass->frags);
+    memory_free(reass);
+}
+
+static void
+ip_reass_timer(void *arg)
+{
+    struct ip_reass *reass = arg;
+    char addr[IP_ADDR_STR_LEN];
+
+    debugf("timeout, src=%s, id=%u, received=%u", ip_addr_ntop(reass->src, addr, sizeof(addr)), ntoh16(reass->id), reass->received);
+    if (reass->num && reass->frags[0].offset == 0) {
+        /* NOTE: reported only when the first fragment has been received (see RFC 792) */
+        ip_output_error(reass->frags[0].pkt, reass->iface, ICMP_TYPE_TIME_EXCEEDED, ICMP_CODE_EXCEEDED_FRAGMENT, 0);
+    }
+    ip_reass_free(reass);
+}
+
+static struct ip_reass *
+ip_reass_alloc(struct ip_reass_queue *queue, int worker, struct ip_hdr *hdr, struct ip_iface *iface)
+{
+    struct ip_reass *reass, **bucket;
+
+    reass = memory_alloc(sizeof(*reass));
+    if (!reass) {
+        errorf("memory_alloc() failure");
+        return NULL;
+    }
+    reass->frags = memory_alloc_nozero(sizeof(*reass->frags) * IP_REASS_FRAGS_MIN);
+    if (!reass->frags) {
+        errorf("memory_alloc() failure");
+        memory_free(reass);
+        return NULL;
+    }
+    reass->capacity = IP_REASS_FRAGS_MIN;
+    reass->queue = queue;
+    reass->src = hdr->src;
+    reass->dst = hdr->dst;
+    reass->id = hdr->id;
+    reass->protocol = hdr->protocol;
+    reass->iface = iface;
+    reass->mem = sizeof(*reass) + sizeof(*reass->frags) * reass->capacity;
+    queue->mem += reass->mem;
+    bucket = &queue->buckets[ip_reass_hash(hdr->src, hdr->dst, hdr->id, hdr->protocol)];
+    reass->next = *bucket;
+    *bucket = reass;
+    reass->older = queue->newest;
+    if (queue->newest) {
+        queue->newest->newer = reass;
+    } else {
+        queue->oldest = reass;
+    }
+    queue->newest = reass;
+    timer_entry_init(&reass->timer, net_worker_wheel(worker), ip_reass_timer, reass);
+    timer_arm(&reass->timer, IP_REASS_TIMEOUT * 1000);
+    return reass;
+}
+
+/* NOTE: returns -1 when the datagram must be discarded (overlapping or inconsistent fragments) */
+static int
+ip_reass_insert(struct ip_reass *reass, struct pktbuf *pkt)
+{
+    struct ip_hdr *hdr;
+    uint16_t hlen, offset, len;
+    uint32_t end;
+    size_t lo, hi, mid;
+    struct ip_frag *frags, *frag;
+
+    hdr = (struct ip_hdr *)pkt->data;
+    hlen = (hdr->vhl & 0x0f) << 2;
+    offset = (ntoh16(hdr->offset) & IP_HDR_OFFSET_MASK) << 3;
+    len = pktbuf_len(pkt) - hlen;
+    end = offset + len;
+    if (!len || end > IP_PAYLOAD_SIZE_MAX) {
+        errorf("bad fragment, offset=%u, len=%u", offset, len);
+        return -1;
+    }
+    if (ntoh16(hdr->offset) & IP_HDR_FLAG_MF) {
+        if (len & 7 || (reass->size && end > reass->size)) {
+            errorf("bad fragment, offset=%u, len=%u, size=%u", offset, len, reass->size);
+            return -1;
+        }
+    } else {
+        /* the last fragment */
+        if ((reass->size && reass->size != end) || (reass->num && reass->frags[reass->num-1].offset + reass->frags[reass->num-1].len > end)) {
+            errorf("bad last fragment, offset=%u, len=%u, size=%u", offset, len, reass->size);
+            return -1;
+        }
+        reass->size = end;
+    }
+    /* the first fragment placed after this one */
+    lo = 0;
+    hi = reass->num;
+    if (hi && reass->frags[hi-1].offset < offset) {
+        lo = hi; /* NOTE: in order, appended */
+    }
+    while (lo < hi) {
+        mid = (lo + hi) / 2;
+        if (reass->frags[mid].offset <= offset) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    if (lo) {
+        frag = &reass->frags[lo-1];
+        if (frag->offset == offset && frag->len == len) {
+            /* duplicate */
+            return 0;
+        }
+        if (frag->offset + frag->len > offset) {
+            errorf("overlapped, offset=%u, len=%u", offset, len);
+            return -1;
+        }
+    }
+    if (lo < reass->num && end > reass->frags[lo].offset) {
+        errorf("overlapped, offset=%u, len=%u", offset, len);
+        return -1;
+    }
+    if (reass->num == reass->capacity) {
+        frags = memory_alloc_nozero(sizeof(*frags) * reass->capacity * 2);
+        if (!frags) {
+            errorf("memory_alloc() failure");
+            return -1;
+        }
+        memcpy(frags, reass->frags, sizeof(*frags) * reass->num);
+        memory_free(reass->frags);
+        reass->frags = frags;
+        reass->mem += sizeof(*frags) * reass->capacity;
+        reass->queue->mem += sizeof(*frags) * reass->capacity;
+        reass->capacity *= 2;
+    }
+    frag = &reass->frags[lo];
+    memmove(frag + 1, frag, sizeof(*frag) * (reass->num - lo));
+    frag->offset = offset;
+    frag->len = len;
+    frag->data = (uint8_t *)hdr + hlen;
+    frag->pkt = pktbuf_get(pkt);
+    reass->num++;
+    reass->received += len;
+    reass->mem += ip_reass_truesize(pkt);
+    reass->queue->mem += ip_reass_truesize(pkt);
+    return 0;
+}
+
+static struct pktbuf *
+ip_reass_build(struct ip_reass *reass)
+{
+    struct pktbuf *pkt;
+    struct ip_hdr *first, *hdr;
+    uint16_t hlen;
+    struct ip_frag *frag;
+
+    first = (struct ip_hdr *)reass->frags[0].pkt->data;
+    hlen = (first->vhl & 0x0f) << 2;
+    if (hlen + reass->size > IP_TOTAL_SIZE_MAX) {
+        errorf("too long, hlen=%u, size=%u", hlen, reass->size);
+        return NULL;
+    }
+    pkt = pktbuf_alloc(PKTBUF_HEADROOM, hlen + reass->size);
+    if (!pkt) {
+        errorf("pktbuf_alloc() failure");
+        return NULL;
+    }
+    pkt->dev = reass->frags[0].pkt->dev;
+    hdr = (struct ip_hdr *)pktbuf_put(pkt, hlen + reass->size);
+    memcpy(hdr, first, hlen);
+    for (frag = reass->frags; frag < reass->frags + reass->num; frag++) {
+        memcpy((uint8_t *)hdr + hlen + frag->offset, frag->data, frag->len);
+    }
+    hdr->total = hton16(hlen + reass->size);
+    hdr->offset &= hton16(IP_HDR_FLAG_DF);
+    hdr->sum = 0;
+    hdr->sum = cksum16((uint16_t *)hdr, hlen, 0);
+    return pkt;
+}
+
+/* NOTE: returns the reassembled datagram (the caller releases it) when the fragment completes one, otherwise NULL */
+static struct pktbuf *
+ip_reass_input(struct pktbuf *pkt, struct ip_iface *iface)
+{
+    struct ip_stack *ip = ip_stack();
+    struct ip_hdr *hdr;
+    struct ip_reass_queue *queue;
+    struct ip_reass *reass;
+    size_t need;
+    int worker;
+
+    hdr = (struct ip_hdr *)pkt->data;
+    worker = net_worker_select(ip_flow_hash(hdr->src, hdr->dst, 0, 0)); /* NOTE: the same as ip_hash() */
+    queue = &ip->reass[worker];
+    reass = ip_reass_select(queue, hdr);
+    need = ip_reass_truesize(pkt) + (reass ? 0 : sizeof(*reass) + sizeof(struct ip_frag) * IP_REASS_FRAGS_MIN);
+    while (queue->mem + need > IP_REASS_MEM_MAX / NET_WORKER_NUM && queue->oldest && queue->oldest != reass) {
+        debugf("evicted, id=%u", ntoh16(queue->oldest->id));
+        ip_reass_free(queue->oldest);
+    }
+    if (queue->mem + need > IP_REASS_MEM_MAX / NET_WORKER_NUM) {
+        errorf("no memory for the reassembly, mem=%zu", queue->mem);
+        return NULL;
+    }
+    if (!reass) {
+        reass = ip_reass_alloc(queue, worker, hdr, iface);
+        if (!reass) {
+            errorf("ip_reass_alloc() failure");
+            return NULL;
+        }
+    }
+    if (ip_reass_insert(reass, pkt) == -1) {
+        ip_reass_free(reass);
+        return NULL;
+    }
+    if (!reass->size || reass->received != reass->size) {
+        return NULL;
+    }
+    pkt = ip_reass_build(reass);
+    ip_reass_free(reass);
+    return pkt;
+}
+
+/*
+ * Forwarding
+ *
+ * NOTE: Enabled with ip_set_forwarding(). A datagram for another host is sent on with its TTL decremented
+ *       and the checksum updated incrementally. Each net worker keeps a destination cache (direct mapped)
+ *       from the destination to the outgoing interface and the hardware address of the next hop, a hit
+ *       skips both ip_route_lookup() and arp_resolve(). An entry is invalidated by any change of the FIB
+ *       (generation), and goes through the slow path again after IP_DST_CACHE_LIFETIME, so ARP still
+ *       sees the neighbor in use (NUD) and a changed hardware address is picked up.
+ */
+
+#define IP_DST_CACHE_SIZE 256 /* entries per net worker (power of 2) */
+#define IP_DST_CACHE_LIFETIME 1000 /* milliseconds */
+
+struct ip_dst_cache {
+    ip_addr_t dst;
+    unsigned int gen; /* of the FIB, 0: unused */
+    uint64_t expire;
+    struct ip_iface *iface;
+    uint8_t ha[NET_DEVICE_ADDR_LEN];
+};
+
+void
+ip_set_forwarding(int enable)
+{
+    __atomic_store_n(&ip_stack()->forwarding, enable, __ATOMIC_RELAXED);
+}
+
+/* NOTE: HC' = ~(~HC + ~m + m') (RFC 1624), the one's complement sum does not depend on the byte order */
+static uint16_t
+ip_cksum_adjust(uint16_t sum, uint16_t old, uint16_t new)
+{
+    uint32_t s;
+
+    s = (uint16_t)~sum + (uint16_t)~old + new;
+    s = (s & 0xffff) + (s >> 16);
+    s = (s & 0xffff) + (s >> 16);
+    return ~s;
+}
+
+/* NOTE: only the options with the copied flag go to the fragments other than the first (see RFC 791) */
+static uint16_t
+ip_forward_copy_options(const struct ip_hdr *hdr, struct ip_hdr *frag)
+{
+    const uint8_t *opt = hdr->options, *end = (uint8_t *)hdr + ((hdr->vhl & 0x0f) << 2);
+    uint8_t *p = frag->options;
+    size_t len;
+
+    while (opt < end && *opt != 0) {
+        len = (*opt == 1) ? 1 : (opt + 1 < end ? opt[1] : 0);
+        if (len < 1 || opt + len > end) {
+            break;
+        }
+        if (*opt & 0x80) {
+            memcpy(p, opt, len);
+            p += len;
+        }
+        opt += len;
+    }
+    while ((p - (uint8_t *)frag) & 3) {
+        *p++ = 0; /* end of option list */
+    }
+    return p - (uint8_t *)frag;
+}
+
+/* NOTE: fragments a datagram being forwarded, the payload is shared by the fragments (see pktbuf_attach()) */
+static int
+ip_forward_fragments(struct pktbuf *pkt, struct ip_iface *iface, const uint8_t *ha)
+{
+    struct ip_hdr *hdr, *fhdr;
+    uint16_t hlen, fhlen, flags, base;
+    size_t len, max, offset, n;
+    struct pktbuf *frag;
+    int ret = 0;
+
+    hdr = (struct ip_hdr *)pkt->data;
+    hlen = (hdr->vhl & 0x0f) << 2;
+    len = pktbuf_len(pkt) - hlen;
+    flags = ntoh16(hdr->offset) & IP_HDR_FLAG_MF;
+    base = ntoh16(hdr->offset) & IP_HDR_OFFSET_MASK;
+    for (offset = 0; offset < len && ret != -1; offset += n) {
+        frag = pktbuf_alloc(PKTBUF_HEADROOM, IP_HDR_SIZE_MAX);
+        if (!frag) {
+            errorf("pktbuf_alloc() failure");
+            return -1;
+        }
+        fhdr = (struct ip_hdr *)frag->data;
+        if (offset) {
+            memcpy(fhdr, hdr, IP_HDR_SIZE_MIN);
+            fhlen = ip_forward_copy_options(hdr, fhdr);
+        } else {
+            memcpy(fhdr, hdr, hlen);
+            fhlen = hlen;
+        }
+        pktbuf_put(frag, fhlen);
+        max = (NET_IFACE(iface)->dev->mtu - fhlen) & ~7;
+        n = MIN(max, len - offset);
+        fhdr->vhl = (IP_VERSION_IPV4 << 4) | (fhlen >> 2);
+        fhdr->total = hton16(fhlen + n);
+        fhdr->offset = hton16((base + (offset >> 3)) | ((offset + n < len) ? IP_HDR_FLAG_MF : flags));
+        fhdr->sum = 0;
+        fhdr->sum = cksum16((uint16_t *)fhdr, fhlen, 0);
+        if (pktbuf_attach(frag, pkt, (uint8_t *)hdr + hlen + offset, n) == -1) {
+            errorf("pktbuf_attach() failure");
+            ret = -1;
+        } else {
+            ret = net_device_output(NET_IFACE(iface)->dev, NET_PROTOCOL_TYPE_IP, frag, ha);
+        }
+        pktbuf_free(frag);
+    }
+    return ret;
 }
 
-static struct ip_route *
-ip_route_lookup(ip_addr_t dst)
+static int
+ip_forward_output(struct pktbuf *pkt, struct ip_iface *in, struct ip_iface *out, const uint8_t *ha)
 {
-    struct ip_route *route, *candidate = NULL;
+    struct ip_hdr *hdr;
+    uint16_t mtu;
 
-    for (route = routes; route; route = route->next) {
-        if ((dst & route->netmask) == route->network) {
-            if (!candidate || ntoh32(candidate->netmask) < ntoh32(route->netmask)) {
-                candidate = route;
-            }
+    hdr = (struct ip_hdr *)pkt->data;
+    mtu = NET_IFACE(out)->dev->mtu;
+    if (pktbuf_len(pkt) > mtu) {
+        if (ntoh16(hdr->offset) & IP_HDR_FLAG_DF) {
+            /* NOTE: the MTU of the next hop is in the low-order 16 bits (see RFC 1191) */
+            ip_output_error(pkt, in, ICMP_TYPE_DEST_UNREACH, ICMP_CODE_FRAGMENT_NEEDED, hton32(mtu));
+            return -1;
         }
+        return ip_forward_fragments(pkt, out, ha);
     }
-    return candidate;
+    return net_device_output(NET_IFACE(out)->dev, NET_PROTOCOL_TYPE_IP, pkt, ha);
 }
 
-/* NOTE: must not be call after net_run() */
-int
-ip_route_set_default_gateway(struct ip_iface *iface, const char *gateway)
+static void
+ip_forward(struct pktbuf *pkt, struct ip_iface *in)
 {
-    ip_addr_t gw;
+    struct ip_stack *ip = ip_stack();
+    struct ip_hdr *hdr;
+    struct ip_dst_cache *cache = NULL;
+    struct ip_iface *iface;
+    ip_addr_t nexthop;
+    uint8_t ha[NET_DEVICE_ADDR_LEN] = {};
+    uint16_t old, new;
+    uint32_t src, dst;
+    unsigned int gen;
+    uint64_t now = 0;
+    int worker, ret;
+    char addr[IP_ADDR_STR_LEN];
 
-    if (ip_addr_pton(gateway, &gw) == -1) {
-        errorf("ip_addr_pton() failure, addr=%s", gateway);
-        return -1;
+    hdr = (struct ip_hdr *)pkt->data;
+    src = ntoh32(hdr->src) >> 24;
+    dst = ntoh32(hdr->dst) >> 24;
+    if (src == 0 || src == 127 || src >= 224 || dst == 0 || dst == 127 || dst >= 224) {
+        /* NOTE: zero, loopback, multicast and reserved addresses are not forwarded (see RFC 1812 5.3.7) */
+        return;
     }
-    if (!ip_route_add(IP_ADDR_ANY, IP_ADDR_ANY, gw, iface)) {
-        errorf("ip_route_add() failure");
-        return -1;
+    if (ip_iface_select(hdr->dst)) {
+        /* for another interface of ours */
+        return;
     }
-    return 0;
+    if (hdr->ttl <= 1) {
+        ip_output_error(pkt, in, ICMP_TYPE_TIME_EXCEEDED, ICMP_CODE_EXCEEDED_TTL, 0);
+        return;
+    }
+    memcpy(&old, &hdr->ttl, sizeof(old)); /* NOTE: the 16-bit word of the TTL and the protocol */
+    hdr->ttl--;
+    memcpy(&new, &hdr->ttl, sizeof(new));
+    hdr->sum = ip_cksum_adjust(hdr->sum, old, new);
+    gen = __atomic_load_n(&ip->route_gen, __ATOMIC_ACQUIRE);
+    worker = net_worker_current();
+    if (worker != NET_WORKER_INTR) {
+        /* NOTE: the top bits of the product, log2(IP_DST_CACHE_SIZE) */
+        cache = &ip->dst_cache[worker * IP_DST_CACHE_SIZE + ((ntoh32(hdr->dst) * 0x9e3779b1) >> 24)];
+        now = timer_now();
+        if (cache->dst == hdr->dst && cache->gen == gen && now < cache->expire) {
+            ip_forward_output(pkt, in, cache->iface, cache->ha);
+            return;
+        }
+    }
+    /* slow path */
+    iface = ip_route_lookup(hdr->dst, &nexthop);
+    if (!iface) {
+        debugf("no route, dst=%s", ip_addr_ntop(hdr->dst, addr, sizeof(addr)));
+        ip_output_error(pkt, in, ICMP_TYPE_DEST_UNREACH, ICMP_CODE_NET_UNREACH, 0);
+        return;
+    }
+    if (NET_IFACE(iface)->dev->flags & NET_DEVICE_FLAG_NEED_ARP) {
+        /* NOTE: a datagram to be fragmented is not held, its fragments are made on output */
+        ret = arp_resolve(NET_IFACE(iface), nexthop, ha, pktbuf_len(pkt) <= NET_IFACE(iface)->dev->mtu ? pkt : NULL);
+        if (ret != ARP_RESOLVE_FOUND) {
+            return;
+        }
+    }
+    if (cache) {
+        cache->dst = hdr->dst;
+        cache->gen = gen;
+        cache->expire = now + IP_DST_CACHE_LIFETIME;
+        cache->iface = iface;
+        memcpy(cache->ha, ha, sizeof(ha));
+    }
+    ip_forward_output(pkt, in, iface, ha);
 }
 
-struct ip_iface *
-ip_route_get_iface(ip_addr_t dst)
+/*
+ * Path MTU
+ *
+ * NOTE: RFC 1191. The path MTU learned from an ICMP "fragmentation needed" is kept per destination in a
+ *       set associative cache (no allocation, the entry expiring first is replaced). An entry only lowers
+ *       the MTU of the outgoing device and ages out after IP_PMTU_TIMEOUT, then the larger MTU is tried
+ *       again (a reduction is reported again if the path has not changed).
+ *       The writers are serialized by the mutex and bump a sequence counter around their changes
+ *       (seqlock, as the ARP cache), ip_pmtu_get() reads without any lock and retries if it has changed.
+ */
+
+#define IP_PMTU_CACHE_SIZE 256 /* sets (power of 2) */
+#define IP_PMTU_CACHE_WAYS 4
+#define IP_PMTU_TIMEOUT (10 * 60 * 1000) /* milliseconds, see RFC 1191 6.3 */
+#define IP_PMTU_MIN 576 /* every host accepts (RFC 791), smaller reports are not trusted */
+
+struct ip_pmtu {
+    ip_addr_t dst;
+    uint16_t mtu; /* 0: unused */
+    uint64_t expire;
+};
+
+/* NOTE: RFC 1191 7, an estimate for the routers not reporting the next-hop MTU */
+static const uint16_t ip_pmtu_plateaus[] = {
+    32000, 17914, 8166, 4352, 2002, 1492, 1006, 508, 296, 68
+};
+
+static struct ip_pmtu *
+ip_pmtu_set(struct ip_stack *ip, ip_addr_t dst)
 {
-    struct ip_route *route;
+    return &ip->pmtu[(((ntoh32(dst) * 0x9e3779b1) >> 24) & (IP_PMTU_CACHE_SIZE - 1)) * IP_PMTU_CACHE_WAYS];
+}
 
-    route = ip_route_lookup(dst);
-    if (!route) {
-        return NULL;
-    }
-    return route->iface;
+/* NOTE: must be called after ip->pmtu_mutex locked */
+static void
+ip_pmtu_write_begin(struct ip_stack *ip)
+{
+    __atomic_store_n(&ip->pmtu_seq, ip->pmtu_seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
 }
 
-struct ip_iface *
-ip_iface_alloc(const char *unicast, const char *netmask)
+/* NOTE: must be called after ip->pmtu_mutex locked */
+static void
+ip_pmtu_write_end(struct ip_stack *ip)
+{
+    __atomic_store_n(&ip->pmtu_seq, ip->pmtu_seq + 1, __ATOMIC_RELEASE);
+}
+
+/* NOTE: lockless, returns the MTU of the path to the destination, 0 if there is no route */
+uint16_t
+ip_pmtu_get(ip_addr_t dst)
 {
+    struct ip_stack *ip = ip_stack();
     struct ip_iface *iface;
+    struct ip_pmtu *set, *entry;
+    uint16_t mtu, found;
+    unsigned int seq;
+    uint64_t now;
 
-    iface = memory_alloc(sizeof(*iface));
+    iface = ip_route_lookup(dst, NULL);
     if (!iface) {
-        errorf("memory_alloc() failure");
-        return NULL;
-    }
-    NET_IFACE(iface)->family = NET_IFACE_FAMILY_IP;
-    if (ip_addr_pton(unicast, &iface->unicast) == -1) {
-        errorf("ip_addr_pton() failure, addr=%s", unicast);
-        memory_free(iface);
-        return NULL;
+        return 0;
     }
-    if (ip_addr_pton(netmask, &iface->netmask) == -1) {
-        errorf("ip_addr_pton() failure, addr=%s", netmask);
-        memory_free(iface);
-        return NULL;
+    mtu = NET_IFACE(iface)->dev->mtu;
+    if (!__atomic_load_n(&ip->pmtu_num, __ATOMIC_RELAXED)) {
+        return mtu;
     }
-    iface->broadcast = (iface->unicast & iface->netmask) | ~iface->netmask;
-    return iface;
+    set = ip_pmtu_set(ip, dst);
+    now = timer_now();
+    do {
+        while ((seq = __atomic_load_n(&ip->pmtu_seq, __ATOMIC_ACQUIRE)) & 1);
+        found = 0;
+        for (entry = set; entry < set + IP_PMTU_CACHE_WAYS; entry++) {
+            if (entry->mtu && entry->dst == dst && entry->expire > now) {
+                found = entry->mtu;
+                break;
+            }
+        }
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while (__atomic_load_n(&ip->pmtu_seq, __ATOMIC_RELAXED) != seq);
+    return found ? MIN(mtu, found) : mtu;
 }
 
-/* NOTE: must not be call after net_run() */
-int
-ip_iface_register(struct net_device *dev, struct ip_iface *iface)
+/* NOTE: the reported MTU only lowers the path MTU (RFC 1191 6.3), returns the path MTU after the update */
+static uint16_t
+ip_pmtu_update(ip_addr_t dst, uint16_t mtu)
 {
-    char addr1[IP_ADDR_STR_LEN];
-    char addr2[IP_ADDR_STR_LEN];
-    char addr3[IP_ADDR_STR_LEN];
+    struct ip_stack *ip = ip_stack();
+    struct ip_pmtu *set, *entry, *victim = NULL;
+    uint16_t current;
+    uint64_t now;
+    char addr[IP_ADDR_STR_LEN];
 
-    if (net_device_add_iface(dev, NET_IFACE(iface)) == -1) {
-        errorf("net_device_add_iface() failure");
-        return -1;
+    current = ip_pmtu_get(dst);
+    if (!current || mtu >= current) {
+        return current;
     }
-    if (!ip_route_add(iface->unicast & iface->netmask, iface->netmask, IP_ADDR_ANY, iface)) {
-        errorf("ip_route_add() failure");
-        return -1;
+    mtu = MAX(mtu, IP_PMTU_MIN);
+    if (mtu >= current) {
+        return current;
     }
-    iface->next = ifaces;
-    ifaces = iface;
-    infof("registered: dev=%s, unicast=%s, netmask=%s, broadcast=%s",
-        dev->name,
-        ip_addr_ntop(iface->unicast, addr1, sizeof(addr1)),
-        ip_addr_ntop(iface->netmask, addr2, sizeof(addr2)),
-        ip_addr_ntop(iface->broadcast, addr3, sizeof(addr3)));
-    return 0;
+    set = ip_pmtu_set(ip, dst);
+    now = timer_now();
+    mutex_lock(&ip->pmtu_mutex);
+    ip_pmtu_write_begin(ip);
+    for (entry = set; entry < set + IP_PMTU_CACHE_WAYS; entry++) {
+        if (entry->mtu && entry->dst == dst) {
+            victim = entry;
+            break;
+        }
+        /* NOTE: an unused entry first, then the one expiring first (an expired one if any) */
+        if (!victim || (victim->mtu && (!entry->mtu || entry->expire < victim->expire))) {
+            victim = entry;
+        }
+    }
+    if (!victim->mtu) {
+        __atomic_add_fetch(&ip->pmtu_num, 1, __ATOMIC_RELAXED);
+    }
+    victim->dst = dst;
+    victim->mtu = mtu;
+    victim->expire = now + IP_PMTU_TIMEOUT;
+    ip_pmtu_write_end(ip);
+    mutex_unlock(&ip->pmtu_mutex);
+    infof("path mtu lowered, dst=%s, mtu=%u => %u", ip_addr_ntop(dst, addr, sizeof(addr)), current, mtu);
+    return mtu;
 }
 
-struct ip_iface *
-ip_iface_select(ip_addr_t addr)
+static uint16_t
+ip_pmtu_plateau(uint16_t total)
 {
-    struct ip_iface *entry;
+    const uint16_t *plateau;
 
-    for (entry = ifaces; entry; entry = entry->next) {
-        if (entry->unicast == addr) {
-            break;
+    for (plateau = ip_pmtu_plateaus; plateau < tailof(ip_pmtu_plateaus); plateau++) {
+        if (*plateau < total) {
+            return *plateau;
         }
     }
-    return entry;
+    return IP_PMTU_MIN;
 }
 
 static void
-ip_input(const uint8_t *data, size_t len, struct net_device *dev)
+ip_input_local(struct pktbuf *pkt, struct ip_iface *iface)
 {
+    struct ip_stack *ip = ip_stack();
+    struct ip_hdr *hdr;
+    struct ip_protocol *proto;
+
+    hdr = (struct ip_hdr *)pkt->data;
+    pktbuf_pull(pkt, (hdr->vhl & 0x0f) << 2);
+    for (proto = ip->protocols; proto; proto = proto->next) {
+        if (proto->type == hdr->protocol) {
+            proto->handler(pkt, hdr->src, hdr->dst, iface);
+            return;
+        }
+    }
+    /* unsupported protocol */
+}
+
+static void
+ip_input(struct pktbuf *pkt, struct net_device *dev)
+{
+    struct ip_stack *ip = ip_stack();
+    size_t len = pktbuf_len(pkt);
     struct ip_hdr *hdr;
     uint8_t v;
     uint16_t hlen, total, offset;
+    struct ip_local *local;
     struct ip_iface *iface;
     char addr[IP_ADDR_STR_LEN];
-    struct ip_protocol *proto;
 
     if (len < IP_HDR_SIZE_MIN) {
         errorf("too short");
         return;
     }
-    hdr = (struct ip_hdr *)data;
+    hdr = (struct ip_hdr *)pkt->data;
     v = hdr->vhl >> 4;
     if (v != IP_VERSION_IPV4) {
         errorf("ip version error: v=%u", v);
@@ -320,36 +1646,45 @@ ip_input(const uint8_t *data, size_t len, struct net_device *dev)
         errorf("checksum error: sum=0x%04x, verify=0x%04x", ntoh16(hdr->sum), ntoh16(cksum16((uint16_t *)hdr, hlen, -hdr->sum)));
         return;
     }
-    offset = ntoh16(hdr->offset);
-    if (offset & 0x2000 || offset & 0x1fff) {
-        errorf("fragments does not support");
-        return;
-    }
-    iface = (struct ip_iface *)net_device_get_iface(dev, NET_IFACE_FAMILY_IP);
-    if (!iface) {
-        /* iface is not registered to the device */
-        return;
-    }
-    if (hdr->dst != iface->unicast) {
-        if (hdr->dst != iface->broadcast && hdr->dst != IP_ADDR_BROADCAST) {
+    local = ip_local_lookup(ip, hdr->dst, dev, 1);
+    if (local) {
+        iface = local->iface;
+    } else {
+        /* NOTE: the first iface of the device (see net_device_add_iface()) receives the rest */
+        iface = (struct ip_iface *)net_device_get_iface(dev, NET_IFACE_FAMILY_IP);
+        if (!iface) {
+            /* iface is not registered to the device */
+            return;
+        }
+        if (hdr->dst != IP_ADDR_BROADCAST) {
             /* for other host */
+            if (__atomic_load_n(&ip->forwarding, __ATOMIC_RELAXED)) {
+                pktbuf_trim(pkt, total); /* strip link layer padding */
+                ip_forward(pkt, iface);
+            }
             return;
         }
     }
     debugf("dev=%s, iface=%s, protocol=%s(0x%02x), len=%u",
         dev->name, ip_addr_ntop(iface->unicast, addr, sizeof(addr)), ip_protocol_name(hdr->protocol), hdr->protocol, total);
-    ip_dump(data, total);
-    for (proto = protocols; proto; proto = proto->next) {
-        if (proto->type == hdr->protocol) {
-            proto->handler((uint8_t *)hdr + hlen, total - hlen, hdr->src, hdr->dst, iface);
+    debugdump_with(ip_dump, hdr, total);
+    pktbuf_trim(pkt, total); /* strip link layer padding */
+    offset = ntoh16(hdr->offset);
+    if (offset & (IP_HDR_FLAG_MF | IP_HDR_OFFSET_MASK)) {
+        pkt = ip_reass_input(pkt, iface);
+        if (!pkt) {
+            /* incomplete (or discarded) */
             return;
         }
+        ip_input_local(pkt, iface);
+        pktbuf_free(pkt);
+        return;
     }
-    /* unsupported protocol */
+    ip_input_local(pkt, iface);
 }
 
 static int
-ip_output_device(struct ip_iface *iface, const uint8_t *data, size_t len, ip_addr_t dst)
+ip_output_device(struct ip_iface *iface, struct pktbuf *pkt, ip_addr_t dst)
 {
     uint8_t hwaddr[NET_DEVICE_ADDR_LEN] = {};
     int ret;
@@ -358,28 +1693,31 @@ ip_output_device(struct ip_iface *iface, const uint8_t *data, size_t len, ip_add
         if (dst == iface->broadcast || dst == IP_ADDR_BROADCAST) {
             memcpy(hwaddr, NET_IFACE(iface)->dev->broadcast, NET_IFACE(iface)->dev->alen);
         } else {
-            ret = arp_resolve(NET_IFACE(iface), dst, hwaddr);
+            ret = arp_resolve(NET_IFACE(iface), dst, hwaddr, pkt);
             if (ret != ARP_RESOLVE_FOUND) {
                 return ret;
             }
         }
     }
-    return net_device_output(NET_IFACE(iface)->dev, NET_PROTOCOL_TYPE_IP, data, len, hwaddr);
+    return net_device_output(NET_IFACE(iface)->dev, NET_PROTOCOL_TYPE_IP, pkt, hwaddr);
 }
 
 static ssize_t
-ip_output_core(struct ip_iface *iface, uint8_t protocol, const uint8_t *data, size_t len, ip_addr_t src, ip_addr_t dst, ip_addr_t nexthop, uint16_t id, uint16_t offset)
+ip_output_core(struct ip_iface *iface, uint8_t protocol, struct pktbuf *pkt, ip_addr_t src, ip_addr_t dst, ip_addr_t nexthop, uint16_t id, uint16_t offset)
 {
-    uint8_t buf[IP_TOTAL_SIZE_MAX];
     struct ip_hdr *hdr;
     uint16_t hlen, total;
     char addr[IP_ADDR_STR_LEN];
 
-    hdr = (struct ip_hdr *)buf;
     hlen = sizeof(*hdr);
+    total = hlen + pktbuf_total(pkt);
+    hdr = (struct ip_hdr *)pktbuf_push(pkt, hlen); /* NOTE: header is written in front of the payload, no copy */
+    if (!hdr) {
+        errorf("pktbuf_push() failure");
+        return -1;
+    }
     hdr->vhl = (IP_VERSION_IPV4 << 4) | (hlen >> 2);
     hdr->tos = 0;
-    total = hlen + len;
     hdr->total = hton16(total);
     hdr->id = hton16(id);
     hdr->offset = hton16(offset);
@@ -389,30 +1727,66 @@ ip_output_core(struct ip_iface *iface, uint8_t protocol, const uint8_t *data, si
     hdr->src = src;
     hdr->dst = dst;
     hdr->sum = cksum16((uint16_t *)hdr, hlen, 0); /* don't convert bytoder */
-    memcpy(hdr+1, data, len);
     debugf("dev=%s, iface=%s, protocol=%s(0x%02x), len=%u",
         NET_IFACE(iface)->dev->name, ip_addr_ntop(iface->unicast, addr, sizeof(addr)), ip_protocol_name(protocol), protocol, total);
-    ip_dump(buf, total);
-    return ip_output_device(iface, buf, total, nexthop);
+    debugdump_with(ip_dump, hdr, pktbuf_len(pkt));
+    return ip_output_device(iface, pkt, nexthop);
+}
+
+/*
+ * NOTE: the payload is split at multiples of 8 bytes. A fragment is a buffer holding only the headers,
+ *       followed by its part of the payload as a segment of the original buffer (no copy, see pktbuf_attach()).
+ */
+static ssize_t
+ip_output_fragments(struct ip_iface *iface, uint8_t protocol, struct pktbuf *pkt, ip_addr_t src, ip_addr_t dst, ip_addr_t nexthop, uint16_t id)
+{
+    size_t len, max, offset, n;
+    struct pktbuf *frag;
+    ssize_t ret = 0;
+
+    max = (NET_IFACE(iface)->dev->mtu - IP_HDR_SIZE_MIN) & ~7;
+    if (!max) {
+        errorf("mtu too small, dev=%s, mtu=%u", NET_IFACE(iface)->dev->name, NET_IFACE(iface)->dev->mtu);
+        return -1;
+    }
+    pkt = pktbuf_linearize(pkt);
+    if (!pkt) {
+        errorf("pktbuf_linearize() failure");
+        return -1;
+    }
+    len = pktbuf_len(pkt);
+    for (offset = 0; offset < len && ret != -1; offset += n) {
+        n = MIN(max, len - offset);
+        frag = pktbuf_alloc(PKTBUF_HEADROOM, 0);
+        if (!frag) {
+            errorf("pktbuf_alloc() failure");
+            ret = -1;
+            break;
+        }
+        if (pktbuf_attach(frag, pkt, pkt->data + offset, n) == -1) {
+            errorf("pktbuf_attach() failure");
+            ret = -1;
+        } else {
+            ret = ip_output_core(iface, protocol, frag, src, dst, nexthop, id, (offset >> 3) | (offset + n < len ? IP_HDR_FLAG_MF : 0));
+        }
+        pktbuf_free(frag);
+    }
+    pktbuf_free(pkt);
+    return ret == -1 ? -1 : 0;
 }
 
 static uint16_t
 ip_generate_id(void)
 {
-    static mutex_t mutex = MUTEX_INITIALIZER;
     static uint16_t id = 128;
-    uint16_t ret;
 
-    mutex_lock(&mutex);
-    ret = id++;
-    mutex_unlock(&mutex);
-    return ret;
+    return __atomic_fetch_add(&id, 1, __ATOMIC_RELAXED);
 }
 
-ssize_t
-ip_output(uint8_t protocol, const uint8_t *data, size_t len, ip_addr_t src, ip_addr_t dst)
+static ssize_t
+ip_output_route(uint8_t protocol, struct pktbuf *pkt, ip_addr_t src, ip_addr_t dst, uint16_t flags)
 {
-    struct ip_route *route;
+    size_t len = pktbuf_total(pkt);
     struct ip_iface *iface;
     char addr[IP_ADDR_STR_LEN];
     ip_addr_t nexthop;
@@ -422,37 +1796,204 @@ ip_output(uint8_t protocol, const uint8_t *data, size_t len, ip_addr_t src, ip_a
         errorf("source address is required for broadcast addresses");
         return -1;
     }
-    route = ip_route_lookup(dst);
-    if (!route) {
+    iface = ip_route_lookup(dst, &nexthop);
+    if (!iface) {
         errorf("no route to host, addr=%s", ip_addr_ntop(dst, addr, sizeof(addr)));
         return -1;
     }
-    iface = route->iface;
-    if (src != IP_ADDR_ANY && src != iface->unicast) {
-        errorf("unable to output with specified source address, addr=%s", ip_addr_ntop(src, addr, sizeof(addr)));
-        return -1;
+    if (src == IP_ADDR_ANY) {
+        src = iface->unicast;
+    } else if (src != iface->unicast) {
+        /* NOTE: any address of the outgoing device */
+        if (!ip_local_lookup(ip_stack(), src, NET_IFACE(iface)->dev, 0)) {
+            errorf("unable to output with specified source address, addr=%s", ip_addr_ntop(src, addr, sizeof(addr)));
+            return -1;
+        }
     }
-    nexthop = (route->nexthop != IP_ADDR_ANY) ? route->nexthop : dst;
-    if (NET_IFACE(iface)->dev->mtu < IP_HDR_SIZE_MIN + len) {
-        errorf("too long, dev=%s, mtu=%s, tatal=%zu",
-            NET_IFACE(iface)->dev->name, NET_IFACE(iface)->dev->mtu, IP_HDR_SIZE_MIN + len);
+    if (len > IP_PAYLOAD_SIZE_MAX) {
+        errorf("too long, len=%zu", len);
         return -1;
     }
     id = ip_generate_id();
-    if (ip_output_core(iface, protocol, data, len, iface->unicast, dst, nexthop, id, 0) == -1) {
+    if (NET_IFACE(iface)->dev->mtu < IP_HDR_SIZE_MIN + len) {
+        if (flags & IP_HDR_FLAG_DF) {
+            errorf("too long to send without fragmentation, len=%zu, mtu=%u", len, NET_IFACE(iface)->dev->mtu);
+            return -1;
+        }
+        if (ip_output_fragments(iface, protocol, pkt, src, dst, nexthop, id) == -1) {
+            errorf("ip_output_fragments() failure");
+            return -1;
+        }
+        return len;
+    }
+    if (ip_output_core(iface, protocol, pkt, src, dst, nexthop, id, flags) == -1) {
         errorf("ip_output_core() failure");
         return -1;
     }
     return len;
 }
 
+ssize_t
+ip_output(uint8_t protocol, struct pktbuf *pkt, ip_addr_t src, ip_addr_t dst)
+{
+    return ip_output_route(protocol, pkt, src, dst, 0);
+}
+
+/* NOTE: sent with DF set for the path MTU discovery, fails if the datagram does not fit the device */
+ssize_t
+ip_output_df(uint8_t protocol, struct pktbuf *pkt, ip_addr_t src, ip_addr_t dst)
+{
+    return ip_output_route(protocol, pkt, src, dst, IP_HDR_FLAG_DF);
+}
+
+/*
+ * NOTE: reports an undeliverable datagram (the IP header at pkt->data) to its source with an ICMP error.
+ *       Nothing is sent about errors, fragments other than the first and broadcasts (see RFC 1122 3.2.2),
+ *       nor about datagrams sent by ourselves: the local sender has no way to receive the report.
+ */
+int
+ip_output_error(struct pktbuf *pkt, struct ip_iface *iface, uint8_t type, uint8_t code, uint32_t values)
+{
+    struct ip_hdr *hdr;
+    uint16_t hlen;
+    uint8_t *payload;
+    size_t len;
+    char addr[IP_ADDR_STR_LEN];
+
+    len = pktbuf_len(pkt);
+    if (len < IP_HDR_SIZE_MIN) {
+        return -1;
+    }
+    hdr = (struct ip_hdr *)pkt->data;
+    hlen = (hdr->vhl & 0x0f) << 2;
+    if (len < hlen) {
+        return -1;
+    }
+    if (hdr->src == IP_ADDR_ANY || hdr->src == IP_ADDR_BROADCAST || hdr->dst == IP_ADDR_BROADCAST) {
+        return 0;
+    }
+    if (ntoh16(hdr->offset) & IP_HDR_OFFSET_MASK) {
+        return 0;
+    }
+    if (hdr->protocol == IP_PROTOCOL_ICMP && len > hlen) {
+        payload = (uint8_t *)hdr + hlen;
+        switch (*payload) {
+        case ICMP_TYPE_DEST_UNREACH:
+        case ICMP_TYPE_SOURCE_QUENCH:
+        case ICMP_TYPE_REDIRECT:
+        case ICMP_TYPE_TIME_EXCEEDED:
+        case ICMP_TYPE_PARAM_PROBLEM:
+            return 0;
+        }
+    }
+    if (ip_iface_select(hdr->src)) {
+        debugf("originated locally, not reported, src=%s", ip_addr_ntop(hdr->src, addr, sizeof(addr)));
+        return 0;
+    }
+    /* the header and the first 64 bits of the data */
+    len = MIN(len, (size_t)hlen + 8);
+    return icmp_output(type, code, values, (uint8_t *)hdr, len, iface->unicast, hdr->src);
+}
+
+/*
+ * NOTE: called by ICMP with the datagram quoted in an error message (its IP header and at least 64 bits
+ *       of the payload). A "fragmentation needed" lowers the path MTU, then the protocol of the datagram
+ *       is notified with the quoted payload and the addresses of the datagram (values carries the path MTU).
+ */
+void
+ip_input_error(uint8_t type, uint8_t code, uint32_t values, const uint8_t *data, size_t len)
+{
+    struct ip_stack *ip = ip_stack();
+    struct ip_hdr *hdr;
+    uint16_t hlen, mtu;
+    struct ip_protocol *proto;
+    char addr[IP_ADDR_STR_LEN];
+
+    if (len < IP_HDR_SIZE_MIN) {
+        errorf("too short");
+        return;
+    }
+    hdr = (struct ip_hdr *)data;
+    hlen = (hdr->vhl & 0x0f) << 2;
+    if ((hdr->vhl >> 4) != IP_VERSION_IPV4 || hlen < IP_HDR_SIZE_MIN || len < (size_t)hlen + 8) {
+        errorf("invalid quoted datagram, len=%zu", len);
+        return;
+    }
+    if (!ip_iface_select(hdr->src)) {
+        debugf("not originated locally, src=%s", ip_addr_ntop(hdr->src, addr, sizeof(addr)));
+        return;
+    }
+    if (type == ICMP_TYPE_DEST_UNREACH && code == ICMP_CODE_FRAGMENT_NEEDED) {
+        /* NOTE: the next-hop MTU is the low-order 16 bits (RFC 1191 4), 0 from the older routers */
+        mtu = ntoh32(values) & 0xffff;
+        if (!mtu) {
+            mtu = ip_pmtu_plateau(ntoh16(hdr->total));
+        }
+        mtu = ip_pmtu_update(hdr->dst, mtu);
+        if (!mtu) {
+            return;
+        }
+        values = hton32(mtu);
+    }
+    for (proto = ip->protocols; proto; proto = proto->next) {
+        if (proto->type == hdr->protocol) {
+            if (proto->error_handler) {
+                proto->error_handler(type, code, values, data + hlen, len - hlen, hdr->src, hdr->dst);
+            }
+            return;
+        }
+    }
+}
+
+/* NOTE: the tuple is hashed in network byte order, the same as it appears in the datagram */
+uint32_t
+ip_flow_hash(ip_addr_t src, ip_addr_t dst, uint16_t sport, uint16_t dport)
+{
+    uint8_t tuple[IP_ADDR_LEN * 2 + sizeof(uint16_t) * 2];
+
+    memcpy(tuple, &src, IP_ADDR_LEN);
+    memcpy(tuple + IP_ADDR_LEN, &dst, IP_ADDR_LEN);
+    memcpy(tuple + IP_ADDR_LEN * 2, &sport, sizeof(sport));
+    memcpy(tuple + IP_ADDR_LEN * 2 + sizeof(sport), &dport, sizeof(dport));
+    return net_flow_hash(tuple, sizeof(tuple));
+}
+
+/* NOTE: selects the net worker of the datagram, called before ip_input() (the header is not validated yet) */
+static uint32_t
+ip_hash(struct pktbuf *pkt)
+{
+    struct ip_hdr *hdr;
+    uint16_t hlen, *ports;
+
+    if (pktbuf_len(pkt) < IP_HDR_SIZE_MIN) {
+        return 0;
+    }
+    hdr = (struct ip_hdr *)pkt->data;
+    hlen = (hdr->vhl & 0x0f) << 2;
+    if (ntoh16(hdr->offset) & (IP_HDR_FLAG_MF | IP_HDR_OFFSET_MASK) || pktbuf_len(pkt) < (size_t)hlen + sizeof(uint16_t) * 2) {
+        /* fragments do not carry the ports (except the first one) */
+        return ip_flow_hash(hdr->src, hdr->dst, 0, 0);
+    }
+    ports = (uint16_t *)((uint8_t *)hdr + hlen);
+    switch (hdr->protocol) {
+    case IP_PROTOCOL_TCP:
+        return ip_flow_hash(hdr->src, hdr->dst, ports[0], ports[1]);
+    case IP_PROTOCOL_UDP:
+        /* NOTE: an unconnected UDP socket has no flow, steered by the local port (see udp.c) */
+        return ip_flow_hash(IP_ADDR_ANY, IP_ADDR_ANY, 0, ports[1]);
+    default:
+        return ip_flow_hash(hdr->src, hdr->dst, 0, 0);
+    }
+}
+
 /* NOTE: must not be call after net_run() */
 int
-ip_protocol_register(const char *name, uint8_t type, void (*handler)(const uint8_t *data, size_t len, ip_addr_t src, ip_addr_t dst, struct ip_iface *iface))
+ip_protocol_register(const char *name, uint8_t type, void (*handler)(struct pktbuf *pkt, ip_addr_t src, ip_addr_t dst, struct ip_iface *iface))
 {
+    struct ip_stack *ip = ip_stack();
     struct ip_protocol *entry;
 
-    for (entry = protocols; entry; entry = entry->next) {
+    for (entry = ip->protocols; entry; entry = entry->next) {
         if (entry->type == type) {
             errorf("already exists, type=%s(0x%02x), exist=%s(0x%02x)", name, type, entry->name, entry->type);
             return -1;
@@ -466,18 +2007,36 @@ ip_protocol_register(const char *name, uint8_t type, void (*handler)(const uint8
     strncpy(entry->name, name, sizeof(entry->name)-1);
     entry->type = type;
     entry->handler = handler;
-    entry->next = protocols;
-    protocols = entry;
+    entry->next = ip->protocols;
+    ip->protocols = entry;
     infof("registered, type=%s(0x%02x)", entry->name, entry->type);
     return 0;
 }
 
+/* NOTE: must not be call after net_run(), see ip_input_error() */
+int
+ip_protocol_set_error_handler(uint8_t type, void (*handler)(uint8_t type, uint8_t code, uint32_t values, const uint8_t *data, size_t len, ip_addr_t src, ip_addr_t dst))
+{
+    struct ip_stack *ip = ip_stack();
+    struct ip_protocol *entry;
+
+    for (entry = ip->protocols; entry; entry = entry->next) {
+        if (entry->type == type) {
+            entry->error_handler = handler;
+            return 0;
+        }
+    }
+    errorf("not registered, type=0x%02x", type);
+    return -1;
+}
+
 char *
 ip_protocol_name(uint8_t type)
 {
+    struct ip_stack *ip = ip_stack();
     struct ip_protocol *entry;
 
-    for (entry = protocols; entry; entry = entry->next) {
+    for (entry = ip->protocols; entry; entry = entry->next) {
         if (entry->type == type) {
             return entry->name;
         }
@@ -488,9 +2047,35 @@ ip_protocol_name(uint8_t type)
 int
 ip_init(void)
 {
+    struct ip_stack *ip;
+
+    ip = memory_alloc(sizeof(*ip));
+    if (!ip) {
+        errorf("memory_alloc() failure");
+        return -1;
+    }
+    mutex_init(&ip->route_mutex);
+    mutex_init(&ip->pmtu_mutex);
+    ip->rib = memory_alloc(sizeof(*ip->rib) * IP_RIB_SIZE_MIN);
+    ip->locals = memory_alloc(sizeof(*ip->locals) * IP_LOCAL_SIZE_MIN);
+    ip->fib = memory_alloc(sizeof(*ip->fib));
+    ip->dst_cache = memory_alloc(sizeof(*ip->dst_cache) * IP_DST_CACHE_SIZE * NET_WORKER_NUM);
+    ip->pmtu = memory_alloc(sizeof(*ip->pmtu) * IP_PMTU_CACHE_SIZE * IP_PMTU_CACHE_WAYS);
+    if (!ip->rib || !ip->locals || !ip->fib || !ip->dst_cache || !ip->pmtu) {
+        errorf("memory_alloc() failure");
+        return -1;
+    }
+    ip->rib_size = IP_RIB_SIZE_MIN;
+    ip->locals_size = IP_LOCAL_SIZE_MIN;
+    ip->route_gen = 1;
+    net_stack_set_priv(NET_STACK_PRIV_IP, ip);
     if (net_protocol_register("IP", NET_PROTOCOL_TYPE_IP, ip_input) == -1) {
         errorf("net_protocol_register() failure");
         return -1;
     }
+    if (net_protocol_set_hash(NET_PROTOCOL_TYPE_IP, ip_hash) == -1) {
+        errorf("net_protocol_set_hash() failure");
+        return -1;
+    }
     return 0;
 }
@@ -52,6 +52,20 @@ ip_endpoint_pton(const char *p, struct ip_endpoint *n);
 extern char *
 ip_endpoint_ntop(const struct ip_endpoint *n, char *p, size_t size);
 
+/* NOTE: a route to add, see ip_route_add_batch() */
+struct ip_route_entry {
+    ip_addr_t network;
+    ip_addr_t netmask;
+    ip_addr_t nexthop; /* IP_ADDR_ANY: directly connected */
+    struct ip_iface *iface;
+};
+
+extern int
+ip_route_add(ip_addr_t network, ip_addr_t netmask, ip_addr_t nexthop, struct ip_iface *iface);
+extern int
+ip_route_add_batch(const struct ip_route_entry *entries, size_t num);
+extern int
+ip_route_del(ip_addr_t network, ip_addr_t netmask);
 extern int
 ip_route_set_default_gateway(struct ip_iface *iface, const char *gateway);
 extern struct ip_iface *
@@ -64,11 +78,29 @@ ip_iface_register(struct net_device *dev, struct ip_iface *iface);
 extern struct ip_iface *
 ip_iface_select(ip_addr_t addr);
 
+extern void
+ip_set_forwarding(int enable);
+
+extern uint16_t
+ip_pmtu_get(ip_addr_t dst);
+
+extern ssize_t
+ip_output(uint8_t protocol, struct pktbuf *pkt, ip_addr_t src, ip_addr_t dst);
 extern ssize_t
-ip_output(uint8_t protocol, const uint8_t *data, size_t len, ip_addr_t src, ip_addr_t dst);
+ip_output_df(uint8_t protocol, struct pktbuf *pkt, ip_addr_t src, ip_addr_t dst);
+
+extern int
+ip_output_error(struct pktbuf *pkt, struct ip_iface *iface, uint8_t type, uint8_t code, uint32_t values);
+extern void
+ip_input_error(uint8_t type, uint8_t code, uint32_t values, const uint8_t *data, size_t len);
+
+extern uint32_t
+ip_flow_hash(ip_addr_t src, ip_addr_t dst, uint16_t sport, uint16_t dport);
 
 extern int
-ip_protocol_register(const char *name, uint8_t type, void (*handler)(const uint8_t *data, size_t len, ip_addr_t src, ip_addr_t dst, struct ip_iface *iface));
+ip_protocol_register(const char *name, uint8_t type, void (*handler)(struct pktbuf *pkt, ip_addr_t src, ip_addr_t dst, struct ip_iface *iface));
+extern int
+ip_protocol_set_error_handler(uint8_t type, void (*handler)(uint8_t type, uint8_t code, uint32_t values, const uint8_t *data, size_t len, ip_addr_t src, ip_addr_t dst));
 extern char *
 ip_protocol_name(uint8_t type);
 
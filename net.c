@@ -4,32 +4,30 @@
 #include <string.h>
 #include <unistd.h>
 #include <signal.h>
+#include <time.h>
 #include <sys/time.h>
 
 #include "platform.h"
 
 #include "util.h"
+#include "pktbuf.h"
+#include "timer.h"
 #include "net.h"
 
 struct net_protocol {
     struct net_protocol *next;
     char name[16];
     uint16_t type;
-    struct queue_head queue; /* input queue */
-    void (*handler)(const uint8_t *data, size_t len, struct net_device *dev);
-};
-
-/* NOTE: the data follows immediately after the structure */
-struct net_protocol_queue_entry {
-    struct net_device *dev;
-    size_t len;
+    struct mpsc_ring queue[NET_WORKER_NUM]; /* input queues (struct pktbuf), one per worker, pushed by any driver thread */
+    void (*handler)(struct pktbuf *pkt, struct net_device *dev);
+    uint32_t (*hash)(struct pktbuf *pkt); /* flow hash for steering, NULL: everything goes to worker 0 */
 };
 
 struct net_timer {
     struct net_timer *next;
     char name[16];
     struct timeval interval;
-    struct timeval last;
+    struct timer_entry entry;
     void (*handler)(void);
 };
 
@@ -39,11 +37,99 @@ struct net_event {
     void *arg;
 };
 
-/* NOTE: if you want to add/delete the entries after net_run(), you need to protect these lists with a mutex. */
-static struct net_device *devices;
-static struct net_protocol *protocols;
-static struct net_timer *timers;
-static struct net_event *events;
+/*
+ * NOTE: Protocol processing runs on NET_WORKER_NUM worker threads. Each of them owns one input queue
+ *       of every protocol and its own timer wheel. net_input_handler() steers a packet to a worker by
+ *       the flow hash of the protocol (software RSS), so all packets of a flow land on the same worker.
+ */
+struct net_worker {
+    struct net_stack *stack;
+    int index;
+    thread_t thread;
+    mutex_t mutex;
+    struct sched_ctx ctx;
+    int pending; /* wakeup requested */
+    int running;
+    struct timer_wheel *wheel;
+};
+
+#if NET_WORKER_NUM < 1 || NET_WORKER_NUM > 64
+#error "NET_WORKER_NUM must be between 1 and 64"
+#endif
+
+struct net_busy_poll {
+    int cpu; /* -1 if not pinned */
+    int running;
+    thread_t thread;
+};
+
+/*
+ * NOTE: All the state of a stack (devices, protocols, timers, workers and the private data of the other
+ *       modules) belongs to a struct net_stack, so a process can run several independent stacks, e.g. one
+ *       per core with its own devices. The API works on the current stack of the calling thread:
+ *       net_stack_create() enters the new stack, other threads select one with net_stack_enter()
+ *       (or use the first stack created). The threads of a stack (intr, workers, busy-poll) run in it.
+ */
+struct net_stack {
+    /* NOTE: if you want to add/delete the entries after net_run(), you need to protect these lists with a mutex. */
+    struct net_device *devices;
+    struct net_protocol *protocols;
+    struct net_timer *timers;
+    struct net_event *events;
+    unsigned int index; /* for the device names */
+    struct net_worker workers[NET_WORKER_NUM];
+    struct timer_wheel *wheel; /* expired on the intr thread */
+    struct net_device *poll_list; /* scheduled devices, only touched on the intr thread */
+    void *priv[NET_STACK_PRIV_NUM]; /* see net_stack_priv() */
+};
+
+static struct net_stack *first; /* for the threads that have not entered any stack */
+static __thread struct net_stack *current;
+
+/* NOTE: the well-known default key of Microsoft RSS, any 40 bytes would do */
+static const uint8_t rss_key[40] = {
+    0x6d, 0x5a, 0x56, 0xda, 0x25, 0x5b, 0x0e, 0xc2, 0x41, 0x67,
+    0x25, 0x3d, 0x43, 0xa3, 0x8f, 0xb0, 0xd0, 0xca, 0x2b, 0xcb,
+    0xae, 0x7b, 0x30, 0xb4, 0x77, 0xcb, 0x2d, 0xa3, 0x80, 0x30,
+    0xf2, 0x0c, 0x6a, 0x42, 0xb7, 0x3b, 0xbe, 0xac, 0x01, 0xfa,
+};
+
+static __thread struct net_worker *self; /* the net worker running on the thread */
+static __thread int polling; /* in a poll round, worker wakeups are deferred to the end of the round */
+static __thread uint64_t polling_wakeup; /* workers to wake up at the end of the round */
+
+static void
+net_worker_wakeup(struct net_worker *worker);
+static void
+net_worker_wakeup_deferred(void);
+
+static void *
+net_device_busy_poll_thread(void *arg);
+
+struct net_stack *
+net_stack_current(void)
+{
+    return current ? current : first;
+}
+
+void
+net_stack_enter(struct net_stack *stack)
+{
+    current = stack;
+}
+
+void *
+net_stack_priv(int id)
+{
+    return net_stack_current()->priv[id];
+}
+
+/* NOTE: called by the modules on init, the data lives as long as the stack */
+void
+net_stack_set_priv(int id, void *priv)
+{
+    net_stack_current()->priv[id] = priv;
+}
 
 struct net_device *
 net_device_alloc(void (*setup)(struct net_device *dev))
@@ -65,12 +151,13 @@ net_device_alloc(void (*setup)(struct net_device *dev))
 int
 net_device_register(struct net_device *dev)
 {
-    static unsigned int index = 0;
+    struct net_stack *stack = net_stack_current();
 
-    dev->index = index++;
+    dev->stack = stack;
+    dev->index = stack->index++;
     snprintf(dev->name, sizeof(dev->name), "net%d", dev->index);
-    dev->next = devices;
-    devices = dev;
+    dev->next = stack->devices;
+    stack->devices = dev;
     infof("registered, dev=%s, type=0x%04x", dev->name, dev->type);
     return 0;
 }
@@ -88,6 +175,17 @@ net_device_open(struct net_device *dev)
             return -1;
         }
     }
+    if (dev->busy_poll) {
+        if (!(dev->poll_flags & NET_DEVICE_POLL_ATTACHED)) {
+            errorf("busy-poll requested, but not attached, dev=%s", dev->name);
+            return -1;
+        }
+        dev->busy_poll->running = 1;
+        if (thread_create(&dev->busy_poll->thread, net_device_busy_poll_thread, dev, dev->busy_poll->cpu) == -1) {
+            errorf("thread_create() failure, dev=%s", dev->name);
+            return -1;
+        }
+    }
     dev->flags |= NET_DEVICE_FLAG_UP;
     infof("dev=%s, state=%s", dev->name, NET_DEVICE_STATE(dev));
     return 0;
@@ -100,6 +198,10 @@ net_device_close(struct net_device *dev)
         errorf("not opened, dev=%s", dev->name);
         return -1;
     }
+    if (dev->busy_poll) {
+        __atomic_store_n(&dev->busy_poll->running, 0, __ATOMIC_RELEASE);
+        thread_join(dev->busy_poll->thread);
+    }
     if (dev->ops->close) {
         if (dev->ops->close(dev) == -1) {
             errorf("failure, dev=%s", dev->name);
@@ -111,21 +213,132 @@ net_device_close(struct net_device *dev)
     return 0;
 }
 
+static int
+net_device_isr(int fd, void *id)
+{
+    struct net_stack *stack = net_stack_current();
+    struct net_device *dev;
+
+    dev = (struct net_device *)id;
+    if (dev->poll_flags & NET_DEVICE_POLL_SCHEDULED) {
+        return 0;
+    }
+    /* NOTE: no more notifications until a poll round of the device comes back empty */
+    intr_fd_disable(fd);
+    dev->poll_flags |= NET_DEVICE_POLL_SCHEDULED;
+    dev->poll_next = stack->poll_list;
+    stack->poll_list = dev;
+    return raise_softirq();
+}
+
+/* NOTE: called by a driver that implements the poll op on open, the core takes over the RX notification of the fd */
+int
+net_device_poll_attach(struct net_device *dev, int fd)
+{
+    if (!dev->ops->poll) {
+        errorf("poll not supported, dev=%s", dev->name);
+        return -1;
+    }
+    dev->poll_fd = fd;
+    dev->poll_flags |= NET_DEVICE_POLL_ATTACHED;
+    if (dev->busy_poll) {
+        /* never notified, the busy-poll thread spins on the device */
+        return 0;
+    }
+    if (intr_request_fd(fd, net_device_isr, dev->name, dev) == -1) {
+        errorf("intr_request_fd() failure, dev=%s", dev->name);
+        return -1;
+    }
+    return 0;
+}
+
+/* NOTE: called from the softirq handler of the intr thread */
+int
+net_device_poll_handler(void)
+{
+    struct net_stack *stack = net_stack_current();
+    struct net_device *dev, **p;
+    int num, more = 0;
+
+    polling = 1;
+    p = &stack->poll_list;
+    while ((dev = *p) != NULL) {
+        num = NET_DEVICE_IS_UP(dev) ? dev->ops->poll(dev, NET_DEVICE_POLL_BUDGET) : -1;
+        if (num > 0) {
+            more = 1;
+            p = &dev->poll_next;
+            continue;
+        }
+        /* empty round (or error), back to the interrupt mode */
+        *p = dev->poll_next;
+        dev->poll_next = NULL;
+        dev->poll_flags &= ~NET_DEVICE_POLL_SCHEDULED;
+        if (NET_DEVICE_IS_UP(dev)) {
+            intr_fd_enable(dev->poll_fd);
+        }
+    }
+    polling = 0;
+    net_worker_wakeup_deferred();
+    if (more) {
+        /* NOTE: the next round runs after the other pending events (timers, devices) */
+        raise_softirq();
+    }
+    return 0;
+}
+
+static void *
+net_device_busy_poll_thread(void *arg)
+{
+    struct net_device *dev;
+
+    dev = (struct net_device *)arg;
+    net_stack_enter(dev->stack);
+    polling = 1;
+    while (__atomic_load_n(&dev->busy_poll->running, __ATOMIC_ACQUIRE)) {
+        if (dev->ops->poll(dev, NET_DEVICE_POLL_BUDGET) > 0) {
+            net_worker_wakeup_deferred();
+        }
+    }
+    return NULL;
+}
+
+/* NOTE: must not be call after net_run() */
+int
+net_device_busy_poll(struct net_device *dev, int cpu)
+{
+    struct net_busy_poll *busy;
+
+    if (!dev->ops->poll) {
+        errorf("poll not supported, dev=%s", dev->name);
+        return -1;
+    }
+    busy = memory_alloc(sizeof(*busy));
+    if (!busy) {
+        errorf("memory_alloc() failure");
+        return -1;
+    }
+    busy->cpu = cpu;
+    dev->busy_poll = busy;
+    infof("dev=%s, cpu=%d", dev->name, cpu);
+    return 0;
+}
+
 /* NOTE: must not be call after net_run() */
 int
 net_device_add_iface(struct net_device *dev, struct net_iface *iface)
 {
-    struct net_iface *entry;
+    struct net_iface **p;
 
-    for (entry = dev->ifaces; entry; entry = entry->next) {
-        if (entry->family == iface->family) {
-            errorf("already exists, dev=%s, family=%d", dev->name, entry->family);
+    /* NOTE: appended, the first iface of a family is the primary one (see net_device_get_iface()) */
+    for (p = &dev->ifaces; *p; p = &(*p)->next) {
+        if (*p == iface) {
+            errorf("already exists, dev=%s, family=%d", dev->name, iface->family);
             return -1;
         }
     }
-    iface->next = dev->ifaces;
+    iface->next = NULL;
     iface->dev = dev;
-    dev->ifaces = iface;
+    *p = iface;
     return 0;
 }
 
@@ -143,19 +356,22 @@ net_device_get_iface(struct net_device *dev, int family)
 }
 
 int
-net_device_output(struct net_device *dev, uint16_t type, const uint8_t *data, size_t len, const void *dst)
+net_device_output(struct net_device *dev, uint16_t type, struct pktbuf *pkt, const void *dst)
 {
+    size_t len;
+
     if (!NET_DEVICE_IS_UP(dev)) {
         errorf("not opened, dev=%s", dev->name);
         return -1;
     }
+    len = pktbuf_total(pkt);
     if (len > dev->mtu) {
         errorf("too long, dev=%s, mtu=%u, len=%zu", dev->name, dev->mtu, len);
         return -1;
     }
     debugf("dev=%s, type=%s(0x%04x), len=%zu", dev->name, net_protocol_name(type), type, len);
-    debugdump(data, len);
-    if (dev->ops->transmit(dev, type, data, len, dst) == -1) {
+    debugdump(pkt->data, pktbuf_len(pkt));
+    if (dev->ops->transmit(dev, type, pkt, dst) == -1) {
         errorf("device transmit failure, dev=%s, len=%zu", dev->name, len);
         return -1;
     }
@@ -163,29 +379,31 @@ net_device_output(struct net_device *dev, uint16_t type, const uint8_t *data, si
 }
 
 int
-net_input_handler(uint16_t type, const uint8_t *data, size_t len, struct net_device *dev)
+net_input_handler(uint16_t type, struct pktbuf *pkt, struct net_device *dev)
 {
+    struct net_stack *stack = net_stack_current();
     struct net_protocol *proto;
-    struct net_protocol_queue_entry *entry;
+    int worker;
 
-    for (proto = protocols; proto; proto = proto->next) {
+    for (proto = stack->protocols; proto; proto = proto->next) {
         if (proto->type == type) {
-            entry = memory_alloc(sizeof(*entry) + len);
-            if (!entry) {
-                errorf("memory_alloc() failure");
+            worker = proto->hash ? net_worker_select(proto->hash(pkt)) : 0;
+            pkt->dev = dev;
+            if (mpsc_ring_push(&proto->queue[worker], pktbuf_get(pkt)) == -1) {
+                /* NOTE: drop on full rather than grow without bound, the ring counts the drops */
+                debugf("queue full, dev=%s, type=%s(0x%04x), worker=%d, drops=%lu",
+                    dev->name, proto->name, type, worker, mpsc_ring_drops(&proto->queue[worker]));
+                pktbuf_free(pkt);
                 return -1;
             }
-            entry->dev = dev;
-            entry->len = len;
-            memcpy(entry+1, data, len);
-            if (!queue_push(&proto->queue, entry)) {
-                errorf("queue_push() failure");
-                memory_free(entry);
-                return -1;
+            debugf("queue pushed (num:%zu), dev=%s, type=%s(0x%04x), worker=%d, len=%zd",
+                mpsc_ring_count(&proto->queue[worker]), dev->name, proto->name, type, worker, pktbuf_len(pkt));
+            debugdump(pkt->data, pktbuf_len(pkt));
+            if (polling) {
+                polling_wakeup |= (uint64_t)1 << worker;
+            } else {
+                net_worker_wakeup(&stack->workers[worker]);
             }
-            debugf("queue pushed (num:%u), dev=%s, type=%s(0x%04x), len=%zd", proto->queue.num, dev->name, proto->name, type, len);
-            debugdump(data, len);
-            raise_softirq();
             return 0;
         }
     }
@@ -195,11 +413,13 @@ net_input_handler(uint16_t type, const uint8_t *data, size_t len, struct net_dev
 
 /* NOTE: must not be call after net_run() */
 int
-net_protocol_register(const char *name, uint16_t type, void (*handler)(const uint8_t *data, size_t len, struct net_device *dev))
+net_protocol_register(const char *name, uint16_t type, void (*handler)(struct pktbuf *pkt, struct net_device *dev))
 {
+    struct net_stack *stack = net_stack_current();
     struct net_protocol *proto;
+    int i;
 
-    for (proto = protocols; proto; proto = proto->next) {
+    for (proto = stack->protocols; proto; proto = proto->next) {
         if (type == proto->type) {
             errorf("already registered, type=%s(0x%04x), exist=%s(0x%04x)", name, type, proto->name, proto->type);
             return -1;
@@ -210,11 +430,21 @@ net_protocol_register(const char *name, uint16_t type, void (*handler)(const uin
         errorf("memory_alloc() failure");
         return -1;
     }
+    for (i = 0; i < NET_WORKER_NUM; i++) {
+        if (mpsc_ring_init(&proto->queue[i], NET_PROTOCOL_QUEUE_DEPTH) == -1) {
+            errorf("mpsc_ring_init() failure");
+            while (--i >= 0) {
+                mpsc_ring_destroy(&proto->queue[i]);
+            }
+            memory_free(proto);
+            return -1;
+        }
+    }
     strncpy(proto->name, name, sizeof(proto->name)-1);
     proto->type = type;
     proto->handler = handler;
-    proto->next = protocols;
-    protocols = proto;
+    proto->next = stack->protocols;
+    stack->protocols = proto;
     infof("registered, type=%s(0x%04x)", proto->name, type);
     return 0;
 }
@@ -222,9 +452,10 @@ net_protocol_register(const char *name, uint16_t type, void (*handler)(const uin
 char *
 net_protocol_name(uint16_t type)
 {
+    struct net_stack *stack = net_stack_current();
     struct net_protocol *entry;
 
-    for (entry = protocols; entry; entry = entry->next) {
+    for (entry = stack->protocols; entry; entry = entry->next) {
         if (entry->type == type) {
             return entry->name;
         }
@@ -232,33 +463,201 @@ net_protocol_name(uint16_t type)
     return "UNKNOWN";
 }
 
+/* NOTE: must not be call after net_run() */
 int
-net_protocol_handler(void)
+net_protocol_set_hash(uint16_t type, uint32_t (*hash)(struct pktbuf *pkt))
+{
+    struct net_stack *stack = net_stack_current();
+    struct net_protocol *proto;
+
+    for (proto = stack->protocols; proto; proto = proto->next) {
+        if (proto->type == type) {
+            proto->hash = hash;
+            return 0;
+        }
+    }
+    errorf("not registered, type=0x%04x", type);
+    return -1;
+}
+
+static int
+net_protocol_handler(struct net_worker *worker)
 {
+    struct net_stack *stack = net_stack_current();
     struct net_protocol *proto;
-    struct net_protocol_queue_entry *entry;
-    unsigned int num;
+    struct pktbuf *pkt;
+    size_t num;
 
-    for (proto = protocols; proto; proto = proto->next) {
+    for (proto = stack->protocols; proto; proto = proto->next) {
         while (1) {
-            entry = queue_pop(&proto->queue);
-            if (!entry) {
+            pkt = mpsc_ring_pop(&proto->queue[worker->index]);
+            if (!pkt) {
                 break;
             }
-            num = proto->queue.num;
-            debugf("queue popped (num:%u), dev=%s, type=0x%04x, len=%zd", num, entry->dev->name, proto->type, entry->len);
-            debugdump((uint8_t *)(entry+1), entry->len);
-            proto->handler((uint8_t *)(entry+1), entry->len, entry->dev);
-            free(entry);
+            num = mpsc_ring_count(&proto->queue[worker->index]);
+            debugf("queue popped (num:%zu), worker=%d, dev=%s, type=0x%04x, len=%zd", num, worker->index, pkt->dev->name, proto->type, pktbuf_len(pkt));
+            debugdump(pkt->data, pktbuf_len(pkt));
+            proto->handler(pkt, pkt->dev);
+            pktbuf_free(pkt);
         }
     }
     return 0;
 }
 
+uint32_t
+net_flow_hash(const void *tuple, size_t len)
+{
+    return toeplitz_hash(rss_key, sizeof(rss_key), tuple, len);
+}
+
+int
+net_worker_select(uint32_t hash)
+{
+    return hash % NET_WORKER_NUM;
+}
+
+/* NOTE: returns the index of the calling net worker, NET_WORKER_INTR on any other thread */
+int
+net_worker_current(void)
+{
+    return self ? self->index : NET_WORKER_INTR;
+}
+
+struct timer_wheel *
+net_worker_wheel(int worker)
+{
+    if (worker < 0 || worker >= NET_WORKER_NUM) {
+        return net_stack_current()->wheel; /* the intr thread */
+    }
+    return net_stack_current()->workers[worker].wheel;
+}
+
+static void
+net_worker_wakeup(struct net_worker *worker)
+{
+    /* NOTE: coalesced, only the first producer after the worker consumed the request takes the mutex */
+    if (__atomic_exchange_n(&worker->pending, 1, __ATOMIC_ACQ_REL)) {
+        return;
+    }
+    mutex_lock(&worker->mutex);
+    sched_wakeup(&worker->ctx);
+    mutex_unlock(&worker->mutex);
+}
+
+static void
+net_worker_wakeup_deferred(void)
+{
+    struct net_stack *stack = net_stack_current();
+    int i;
+
+    for (i = 0; polling_wakeup; i++) {
+        if (polling_wakeup & ((uint64_t)1 << i)) {
+            net_worker_wakeup(&stack->workers[i]);
+            polling_wakeup &= ~((uint64_t)1 << i);
+        }
+    }
+}
+
+static void *
+net_worker_thread(void *arg)
+{
+    struct net_worker *worker;
+    struct timespec abstime;
+
+    worker = (struct net_worker *)arg;
+    net_stack_enter(worker->stack);
+    self = worker;
+    while (__atomic_load_n(&worker->running, __ATOMIC_ACQUIRE)) {
+        net_protocol_handler(worker);
+        timer_expire(worker->wheel);
+        mutex_lock(&worker->mutex);
+        if (!__atomic_load_n(&worker->pending, __ATOMIC_ACQUIRE)) {
+            /* NOTE: wake up for the next tick of the timer wheel at the latest */
+            clock_gettime(CLOCK_REALTIME, &abstime);
+            timespec_add_nsec(&abstime, 1000000);
+            sched_sleep(&worker->ctx, &worker->mutex, &abstime);
+        }
+        __atomic_store_n(&worker->pending, 0, __ATOMIC_RELEASE);
+        mutex_unlock(&worker->mutex);
+    }
+    return NULL;
+}
+
+static int
+net_worker_init(void)
+{
+    struct net_stack *stack = net_stack_current();
+    struct net_worker *worker;
+
+    for (worker = stack->workers; worker < tailof(stack->workers); worker++) {
+        worker->stack = stack;
+        worker->index = indexof(stack->workers, worker);
+        mutex_init(&worker->mutex);
+        sched_ctx_init(&worker->ctx);
+        worker->wheel = timer_wheel_alloc();
+        if (!worker->wheel) {
+            errorf("timer_wheel_alloc() failure");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int
+net_worker_run(void)
+{
+    struct net_stack *stack = net_stack_current();
+    struct net_worker *worker;
+
+    for (worker = stack->workers; worker < tailof(stack->workers); worker++) {
+        worker->running = 1;
+        if (thread_create(&worker->thread, net_worker_thread, worker, -1) == -1) {
+            errorf("thread_create() failure, worker=%d", worker->index);
+            worker->running = 0;
+            return -1;
+        }
+    }
+    infof("%d workers running", NET_WORKER_NUM);
+    return 0;
+}
+
+static void
+net_worker_shutdown(void)
+{
+    struct net_stack *stack = net_stack_current();
+    struct net_worker *worker;
+
+    for (worker = stack->workers; worker < tailof(stack->workers); worker++) {
+        if (!worker->running) {
+            continue;
+        }
+        __atomic_store_n(&worker->running, 0, __ATOMIC_RELEASE);
+        net_worker_wakeup(worker);
+        thread_join(worker->thread);
+    }
+}
+
+static uint64_t
+net_timer_interval(struct net_timer *timer)
+{
+    return timer->interval.tv_sec * 1000 + timer->interval.tv_usec / 1000;
+}
+
+static void
+net_timer_fire(void *arg)
+{
+    struct net_timer *timer;
+
+    timer = (struct net_timer *)arg;
+    timer->handler();
+    timer_arm(&timer->entry, net_timer_interval(timer));
+}
+
 /* NOTE: must not be call after net_run() */
 int
 net_timer_register(const char *name, struct timeval interval, void (*handler)(void))
 {
+    struct net_stack *stack = net_stack_current();
     struct net_timer *timer;
 
     timer = memory_alloc(sizeof(*timer));
@@ -268,10 +667,11 @@ net_timer_register(const char *name, struct timeval interval, void (*handler)(vo
     }
     strncpy(timer->name, name, sizeof(timer->name)-1);
     timer->interval = interval;
-    gettimeofday(&timer->last, NULL);
     timer->handler = handler;
-    timer->next = timers;
-    timers = timer;
+    timer_entry_init(&timer->entry, stack->wheel, net_timer_fire, timer);
+    timer_arm(&timer->entry, net_timer_interval(timer));
+    timer->next = stack->timers;
+    stack->timers = timer;
     infof("registered: %s interval={%d, %d}", timer->name, interval.tv_sec, interval.tv_usec);
     return 0;
 }
@@ -279,31 +679,22 @@ net_timer_register(const char *name, struct timeval interval, void (*handler)(vo
 int
 net_timer_handler(void)
 {
-    struct net_timer *timer;
-    struct timeval now, diff;
-
-    for (timer = timers; timer; timer = timer->next) {
-        gettimeofday(&now, NULL);
-        timersub(&now, &timer->last, &diff);
-        if (timercmp(&timer->interval, &diff, <) != 0) { /* true (!0) or false (0) */
-            timer->handler();
-            timer->last = now;
-        }
-    }
-    return 0;
+    /* NOTE: periodic timers are entries of the timing wheel as well, see timer.c */
+    return timer_expire(net_stack_current()->wheel);
 }
 
 int
 net_interrupt(void)
 {
-    /* getpid(2) and kill(2) are signal safety functions. see signal-safety(7). */
-    return kill(getpid(), SIGUSR2);
+    /* NOTE: raise_event() is async-signal-safe on both backends. see signal-safety(7). */
+    return raise_event();
 }
 
 /* NOTE: must not be call after net_run() */
 int
 net_event_subscribe(void (*handler)(void *arg), void *arg)
 {
+    struct net_stack *stack = net_stack_current();
     struct net_event *event;
 
     event = memory_alloc(sizeof(*event));
@@ -313,17 +704,18 @@ net_event_subscribe(void (*handler)(void *arg), void *arg)
     }
     event->handler = handler;
     event->arg = arg;
-    event->next = events;
-    events = event;
+    event->next = stack->events;
+    stack->events = event;
     return 0;
 }
 
 int
 net_event_handler(void)
 {
+    struct net_stack *stack = net_stack_current();
     struct net_event *event;
 
-    for (event = events; event; event = event->next) {
+    for (event = stack->events; event; event = event->next) {
         event->handler(event->arg);
     }
     return 0;
@@ -332,14 +724,19 @@ net_event_handler(void)
 int
 net_run(void)
 {
+    struct net_stack *stack = net_stack_current();
     struct net_device *dev;
 
     if (intr_run() == -1) {
         errorf("intr_run() failure");
         return -1;
     }
+    if (net_worker_run() == -1) {
+        errorf("net_worker_run() failure");
+        return -1;
+    }
     debugf("open all devices...");
-    for (dev = devices; dev; dev = dev->next) {
+    for (dev = stack->devices; dev; dev = dev->next) {
         net_device_open(dev);
     }
     debugf("running...");
@@ -349,12 +746,26 @@ net_run(void)
 void
 net_shutdown(void)
 {
+    struct net_stack *stack = net_stack_current();
     struct net_device *dev;
+    struct net_protocol *proto;
+    struct memory_stat stat;
+    int cls, i;
 
     debugf("close all devices...");
-    for (dev = devices; dev; dev = dev->next) {
+    for (dev = stack->devices; dev; dev = dev->next) {
         net_device_close(dev);
     }
+    net_worker_shutdown();
+    for (proto = stack->protocols; proto; proto = proto->next) {
+        for (i = 0; i < NET_WORKER_NUM; i++) {
+            debugf("protocol=%s(0x%04x), worker=%d, queue drops=%lu", proto->name, proto->type, i, mpsc_ring_drops(&proto->queue[i]));
+        }
+    }
+    for (cls = 0; memory_stat(cls, &stat) == 0; cls++) {
+        debugf("memory class=%d, size=%zu, hit=%lu, miss=%lu, inuse=%lu, hiwat=%lu",
+            cls, stat.size, stat.hit, stat.miss, stat.inuse, stat.hiwat);
+    }
     debugf("shutdown");
 }
 
@@ -363,34 +774,66 @@ net_shutdown(void)
 #include "icmp.h"
 #include "udp.h"
 #include "tcp.h"
+#include "sock.h"
 
-int
-net_init(void)
+/* NOTE: the new stack becomes the current one of the calling thread */
+struct net_stack *
+net_stack_create(void)
 {
+    struct net_stack *stack;
+
+    stack = memory_alloc(sizeof(*stack));
+    if (!stack) {
+        errorf("memory_alloc() failure");
+        return NULL;
+    }
+    if (!first) {
+        first = stack;
+    }
+    net_stack_enter(stack);
     if (intr_init() == -1) {
         errorf("intr_init() failure");
-        return -1;
+        return NULL;
+    }
+    stack->wheel = timer_wheel_alloc();
+    if (!stack->wheel) {
+        errorf("timer_wheel_alloc() failure");
+        return NULL;
+    }
+    if (net_worker_init() == -1) {
+        errorf("net_worker_init() failure");
+        return NULL;
     }
     if (arp_init() == -1) {
         errorf("arp_init() failure");
-        return -1;
+        return NULL;
     }
     if (ip_init() == -1) {
         errorf("ip_init() failure");
-        return -1;
+        return NULL;
     }
     if (icmp_init() == -1) {
         errorf("icmp_init() failure");
-        return -1;
+        return NULL;
     }
     if (udp_init() == -1) {
         errorf("udp_init() failure");
-        return -1;
+        return NULL;
     }
     if (tcp_init() == -1) {
         errorf("tcp_init() failure");
-        return -1;
+        return NULL;
     }
-    infof("initialized");
-    return 0;
+    if (sock_init() == -1) {
+        errorf("sock_init() failure");
+        return NULL;
+    }
+    infof("initialized, stack=%p", stack);
+    return stack;
+}
+
+int
+net_init(void)
+{
+    return net_stack_create() ? 0 : -1;
 }
@@ -35,9 +35,39 @@
 #define NET_PROTOCOL_TYPE_ARP  0x0806
 #define NTT_PROTOCOL_TYPE_IPV6 0x86dd
 
+#ifndef NET_PROTOCOL_QUEUE_DEPTH
+#define NET_PROTOCOL_QUEUE_DEPTH 1024 /* per protocol, packets beyond this are dropped (override with -D) */
+#endif
+
+#ifndef NET_WORKER_NUM
+#define NET_WORKER_NUM 1 /* protocol processing threads (override with -D, see Makefile) */
+#endif
+
+#ifndef NET_DEVICE_POLL_BUDGET
+#define NET_DEVICE_POLL_BUDGET 64 /* max frames received by a device in one poll round (override with -D) */
+#endif
+
+#define NET_DEVICE_POLL_ATTACHED  0x0001
+#define NET_DEVICE_POLL_SCHEDULED 0x0002 /* on the poll list, notifications disabled */
+
 #define NET_IRQ_SHARED 0x0001
 
+#define NET_WORKER_INTR (-1) /* for net_worker_wheel(), the intr thread */
+
+/* NOTE: slots of the per-stack private data of the modules, see net_stack_priv() */
+#define NET_STACK_PRIV_INTR 0
+#define NET_STACK_PRIV_ARP  1
+#define NET_STACK_PRIV_IP   2
+#define NET_STACK_PRIV_UDP  3
+#define NET_STACK_PRIV_TCP  4
+#define NET_STACK_PRIV_SOCK 5
+#define NET_STACK_PRIV_NUM  6
+
 struct net_device; /* forward declaration */
+struct pktbuf; /* forward declaration */
+struct net_busy_poll; /* forward declaration */
+struct timer_wheel; /* forward declaration */
+struct net_stack; /* forward declaration */
 
 struct net_iface {
     struct net_iface *next;
@@ -49,12 +79,13 @@ struct net_iface {
 struct net_device_ops {
     int (*open)(struct net_device *dev);
     int (*close)(struct net_device *dev);
-    int (*transmit)(struct net_device *dev, uint16_t type, const uint8_t *data, size_t len, const void *dst);
-    int (*poll)(struct net_device *dev);
+    int (*transmit)(struct net_device *dev, uint16_t type, struct pktbuf *pkt, const void *dst);
+    int (*poll)(struct net_device *dev, int budget); /* returns the number of frames received (up to budget) */
 };
 
 struct net_device {
     struct net_device *next;
+    struct net_stack *stack; /* the stack registered to */
     struct net_iface *ifaces; /* NOTE: if you want to add/delete the entries after net_run(), you need to protect ifaces with a mutex. */
     unsigned int index;
     char name[IFNAMSIZ];
@@ -70,8 +101,24 @@ struct net_device {
     };
     struct net_device_ops *ops;
     void *priv;
+    /* polling (NAPI-style), see net_device_poll_attach() */
+    unsigned int poll_flags;
+    int poll_fd; /* RX notification source */
+    struct net_busy_poll *busy_poll; /* see net.c */
+    struct net_device *poll_next; /* poll list, only touched on the intr thread */
 };
 
+extern struct net_stack *
+net_stack_create(void);
+extern void
+net_stack_enter(struct net_stack *stack);
+extern struct net_stack *
+net_stack_current(void);
+extern void *
+net_stack_priv(int id);
+extern void
+net_stack_set_priv(int id, void *priv);
+
 extern struct net_device *
 net_device_alloc(void (*setup)(struct net_device *dev));
 extern int
@@ -81,17 +128,33 @@ net_device_add_iface(struct net_device *dev, struct net_iface *iface);
 extern struct net_iface *
 net_device_get_iface(struct net_device *dev, int family);
 extern int
-net_device_output(struct net_device *dev, uint16_t type, const uint8_t *data, size_t len, const void *dst);
+net_device_output(struct net_device *dev, uint16_t type, struct pktbuf *pkt, const void *dst);
 
 extern int
-net_input_handler(uint16_t type, const uint8_t *data, size_t len, struct net_device *dev);
+net_device_poll_attach(struct net_device *dev, int fd);
+extern int
+net_device_busy_poll(struct net_device *dev, int cpu);
+extern int
+net_device_poll_handler(void);
 
 extern int
-net_protocol_register(const char *name, uint16_t type, void (*handler)(const uint8_t *data, size_t len, struct net_device *dev));
+net_input_handler(uint16_t type, struct pktbuf *pkt, struct net_device *dev);
+
+extern int
+net_protocol_register(const char *name, uint16_t type, void (*handler)(struct pktbuf *pkt, struct net_device *dev));
+extern int
+net_protocol_set_hash(uint16_t type, uint32_t (*hash)(struct pktbuf *pkt));
 extern char *
 net_protocol_name(uint16_t type);
+
+extern uint32_t
+net_flow_hash(const void *tuple, size_t len);
+extern int
+net_worker_select(uint32_t hash);
+extern struct timer_wheel *
+net_worker_wheel(int worker);
 extern int
-net_protocol_handler(void);
+net_worker_current(void);
 
 extern int
 net_timer_register(const char *name, struct timeval interval, void (*handler)(void));
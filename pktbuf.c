@@ -0,0 +1,187 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "platform.h"
+
+#include "util.h"
+#include "pktbuf.h"
+
+struct pktbuf *
+pktbuf_alloc(size_t headroom, size_t size)
+{
+    struct pktbuf *pkt;
+
+    pkt = memory_alloc_nozero(sizeof(*pkt) + headroom + size); /* NOTE: every layer writes all of its header fields */
+    if (!pkt) {
+        errorf("memory_alloc() failure");
+        return NULL;
+    }
+    pkt->ref = 1;
+    pkt->dev = NULL;
+    pkt->head = (uint8_t *)(pkt + 1);
+    pkt->data = pkt->head + headroom;
+    pkt->tail = pkt->data;
+    pkt->end = pkt->data + size;
+    pkt->nfrags = 0;
+    return pkt;
+}
+
+struct pktbuf *
+pktbuf_get(struct pktbuf *pkt)
+{
+    __atomic_add_fetch(&pkt->ref, 1, __ATOMIC_RELAXED);
+    return pkt;
+}
+
+void
+pktbuf_free(struct pktbuf *pkt)
+{
+    int i;
+
+    if (__atomic_sub_fetch(&pkt->ref, 1, __ATOMIC_ACQ_REL) == 0) {
+        for (i = 0; i < pkt->nfrags; i++) {
+            pktbuf_free(pkt->frags[i].pkt);
+        }
+        memory_free(pkt);
+    }
+}
+
+uint8_t *
+pktbuf_push(struct pktbuf *pkt, size_t len)
+{
+    if (pktbuf_headroom(pkt) < len) {
+        errorf("no headroom, headroom=%zu, len=%zu", pktbuf_headroom(pkt), len);
+        return NULL;
+    }
+    pkt->data -= len;
+    return pkt->data;
+}
+
+uint8_t *
+pktbuf_pull(struct pktbuf *pkt, size_t len)
+{
+    if (pktbuf_len(pkt) < len) {
+        errorf("too short, len=%zu, want=%zu", pktbuf_len(pkt), len);
+        return NULL;
+    }
+    pkt->data += len;
+    return pkt->data;
+}
+
+uint8_t *
+pktbuf_put(struct pktbuf *pkt, size_t len)
+{
+    uint8_t *tail;
+
+    if (pktbuf_tailroom(pkt) < len) {
+        errorf("no tailroom, tailroom=%zu, len=%zu", pktbuf_tailroom(pkt), len);
+        return NULL;
+    }
+    tail = pkt->tail;
+    pkt->tail += len;
+    return tail;
+}
+
+int
+pktbuf_trim(struct pktbuf *pkt, size_t len)
+{
+    if (pktbuf_len(pkt) < len) {
+        return -1;
+    }
+    pkt->tail = pkt->data + len;
+    return 0;
+}
+
+/* NOTE: appends a segment of another buffer after the data (no copy), the segment must not be modified afterwards */
+int
+pktbuf_attach(struct pktbuf *pkt, struct pktbuf *from, uint8_t *data, size_t len)
+{
+    if (pkt->nfrags == PKTBUF_FRAGS_MAX) {
+        errorf("too many segments, nfrags=%d", pkt->nfrags);
+        return -1;
+    }
+    pkt->frags[pkt->nfrags].pkt = pktbuf_get(from);
+    pkt->frags[pkt->nfrags].data = data;
+    pkt->frags[pkt->nfrags].len = len;
+    pkt->nfrags++;
+    return 0;
+}
+
+/* NOTE: returns the number of the vectors filled (the data and the segments) */
+int
+pktbuf_iovec(const struct pktbuf *pkt, struct iovec *iov, int max)
+{
+    int i;
+
+    if (max < pkt->nfrags + 1) {
+        errorf("too few vectors, max=%d, nfrags=%d", max, pkt->nfrags);
+        return -1;
+    }
+    iov[0].iov_base = pkt->data;
+    iov[0].iov_len = pktbuf_len(pkt);
+    for (i = 0; i < pkt->nfrags; i++) {
+        iov[i+1].iov_base = pkt->frags[i].data;
+        iov[i+1].iov_len = pkt->frags[i].len;
+    }
+    return pkt->nfrags + 1;
+}
+
+/* NOTE: returns a new reference to the buffer itself if it has no segments, otherwise to a linear copy */
+struct pktbuf *
+pktbuf_linearize(struct pktbuf *pkt)
+{
+    struct pktbuf *new;
+    uint8_t *p;
+    int i;
+
+    if (!pkt->nfrags) {
+        return pktbuf_get(pkt);
+    }
+    new = pktbuf_alloc(pktbuf_headroom(pkt), pktbuf_total(pkt));
+    if (!new) {
+        errorf("pktbuf_alloc() failure");
+        return NULL;
+    }
+    p = pktbuf_put(new, pktbuf_total(pkt));
+    memcpy(p, pkt->data, pktbuf_len(pkt));
+    p += pktbuf_len(pkt);
+    for (i = 0; i < pkt->nfrags; i++) {
+        memcpy(p, pkt->frags[i].data, pkt->frags[i].len);
+        p += pkt->frags[i].len;
+    }
+    new->dev = pkt->dev;
+    return new;
+}
+
+size_t
+pktbuf_len(const struct pktbuf *pkt)
+{
+    return pkt->tail - pkt->data;
+}
+
+/* NOTE: the data and the segments */
+size_t
+pktbuf_total(const struct pktbuf *pkt)
+{
+    size_t len;
+    int i;
+
+    len = pktbuf_len(pkt);
+    for (i = 0; i < pkt->nfrags; i++) {
+        len += pkt->frags[i].len;
+    }
+    return len;
+}
+
+size_t
+pktbuf_headroom(const struct pktbuf *pkt)
+{
+    return pkt->data - pkt->head;
+}
+
+size_t
+pktbuf_tailroom(const struct pktbuf *pkt)
+{
+    return pkt->end - pkt->tail;
+}
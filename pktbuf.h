@@ -0,0 +1,73 @@
+#ifndef PKTBUF_H
+#define PKTBUF_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+#define PKTBUF_HEADROOM 128 /* enough for the link, IP (with options) and TCP (with options) headers */
+#define PKTBUF_FRAGS_MAX 4 /* segments shared from other buffers, see pktbuf_attach() */
+
+struct net_device; /* forward declaration */
+
+/*
+ * Packet Buffer
+ *
+ * NOTE: Each layer prepends (pktbuf_push) or strips (pktbuf_pull) its header in place.
+ *       Anyone who keeps a pktbuf beyond the call takes its own reference with pktbuf_get().
+ *       Once passed to an output function, the contents belong to the lower layers
+ *       (they may be modified or shared with the receiver), the caller only releases its reference.
+ *       On output, the data may be followed by segments of other buffers (scatter-gather), which
+ *       are referenced instead of copied and never modified. The drivers write the frame with
+ *       pktbuf_iovec(), input buffers are always linear (see pktbuf_linearize()).
+ */
+struct pktbuf_frag {
+    struct pktbuf *pkt; /* the buffer holding the segment (referenced) */
+    uint8_t *data;
+    size_t len;
+};
+
+struct pktbuf {
+    int ref; /* reference count */
+    struct net_device *dev; /* input device */
+    uint8_t *head; /* start of the buffer */
+    uint8_t *data; /* start of the data */
+    uint8_t *tail; /* end of the data */
+    uint8_t *end; /* end of the buffer */
+    int nfrags;
+    struct pktbuf_frag frags[PKTBUF_FRAGS_MAX]; /* follow the data */
+    /* NOTE: the buffer follows immediately after the structure */
+};
+
+extern struct pktbuf *
+pktbuf_alloc(size_t headroom, size_t size);
+extern struct pktbuf *
+pktbuf_get(struct pktbuf *pkt);
+extern void
+pktbuf_free(struct pktbuf *pkt);
+
+extern uint8_t *
+pktbuf_push(struct pktbuf *pkt, size_t len);
+extern uint8_t *
+pktbuf_pull(struct pktbuf *pkt, size_t len);
+extern uint8_t *
+pktbuf_put(struct pktbuf *pkt, size_t len);
+extern int
+pktbuf_trim(struct pktbuf *pkt, size_t len);
+extern int
+pktbuf_attach(struct pktbuf *pkt, struct pktbuf *from, uint8_t *data, size_t len);
+extern int
+pktbuf_iovec(const struct pktbuf *pkt, struct iovec *iov, int max);
+extern struct pktbuf *
+pktbuf_linearize(struct pktbuf *pkt);
+
+extern size_t
+pktbuf_len(const struct pktbuf *pkt);
+extern size_t
+pktbuf_total(const struct pktbuf *pkt);
+extern size_t
+pktbuf_headroom(const struct pktbuf *pkt);
+extern size_t
+pktbuf_tailroom(const struct pktbuf *pkt);
+
+#endif
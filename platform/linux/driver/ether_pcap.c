@@ -9,7 +9,7 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/ioctl.h>
-#include <sys/poll.h>
+#include <sys/uio.h>
 #include <linux/if.h>
 #include <linux/if_ether.h>
 #include <linux/if_packet.h>
@@ -22,12 +22,9 @@
 
 #include "driver/ether_pcap.h"
 
-#define ETHER_PCAP_IRQ (SIGRTMIN+3)
-
 struct ether_pcap {
     char name[IFNAMSIZ];
     int fd;
-    unsigned int irq;
 };
 
 #define PRIV(x) ((struct ether_pcap *)x->priv)
@@ -93,24 +90,6 @@ ether_pcap_open(struct net_device *dev)
         close(pcap->fd);
         return -1;
     }
-    /* Set Asynchronous I/O signal delivery destination */
-    if (fcntl(pcap->fd, F_SETOWN, getpid()) == -1) {
-        errorf("fcntl(F_SETOWN): %s, dev=%s", strerror(errno), dev->name);
-        close(pcap->fd);
-        return -1;
-    }
-    /* Enable Asynchronous I/O */
-    if (fcntl(pcap->fd, F_SETFL, O_ASYNC) == -1) {
-        errorf("fcntl(F_SETFL): %s, dev=%s", strerror(errno), dev->name);
-        close(pcap->fd);
-        return -1;
-    }
-    /* Use other signal instead of SIGIO */
-    if (fcntl(pcap->fd, F_SETSIG, pcap->irq) == -1) {
-        errorf("fcntl(F_SETSIG): %s, dev=%s", strerror(errno), dev->name);
-        close(pcap->fd);
-        return -1;
-    }
     if (memcmp(dev->addr, ETHER_ADDR_ANY, ETHER_ADDR_LEN) == 0) {
         if (ether_pcap_addr(dev) == -1) {
             errorf("ether_pcap_addr() failure, dev=%s", dev->name);
@@ -118,6 +97,12 @@ ether_pcap_open(struct net_device *dev)
             return -1;
         }
     }
+    /* NOTE: the core disables the notification while it polls the device, see net_device_poll_handler() */
+    if (net_device_poll_attach(dev, pcap->fd) == -1) {
+        errorf("net_device_poll_attach() failure, dev=%s", dev->name);
+        close(pcap->fd);
+        return -1;
+    }
     return 0;
 };
 
@@ -129,15 +114,15 @@ ether_pcap_close(struct net_device *dev)
 }
 
 static ssize_t
-ether_pcap_write(struct net_device *dev, const uint8_t *frame, size_t flen)
+ether_pcap_write(struct net_device *dev, const struct iovec *iov, int iovcnt)
 {
-    return write(PRIV(dev)->fd, frame, flen);
+    return writev(PRIV(dev)->fd, iov, iovcnt);
 }
 
 int
-ether_pcap_transmit(struct net_device *dev, uint16_t type, const uint8_t *buf, size_t len, const void *dst)
+ether_pcap_transmit(struct net_device *dev, uint16_t type, struct pktbuf *pkt, const void *dst)
 {
-    return ether_transmit_helper(dev, type, buf, len, dst, ether_pcap_write);
+    return ether_transmit_helper(dev, type, pkt, dst, ether_pcap_write);
 }
 
 static ssize_t
@@ -145,46 +130,28 @@ ether_pcap_read(struct net_device *dev, uint8_t *buf, size_t size)
 {
     ssize_t len;
 
-    len = read(PRIV(dev)->fd, buf, size);
-    if (len <= 0) {
-        if (len == -1 && errno != EINTR) {
-            errorf("read: %s, dev=%s", strerror(errno), dev->name);
+    len = recv(PRIV(dev)->fd, buf, size, MSG_DONTWAIT);
+    if (len == -1) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+            return 0; /* no more frames */
         }
+        errorf("recv: %s, dev=%s", strerror(errno), dev->name);
         return -1;
     }
     return len;
 }
 
 static int
-ether_pcap_isr(unsigned int irq, void *id)
+ether_pcap_poll(struct net_device *dev, int budget)
 {
-    struct net_device *dev = (struct net_device *)id;
-    struct pollfd pfd;
-    int ret;
-
-    pfd.fd = PRIV(dev)->fd;
-    pfd.events = POLLIN;
-    while (1) {
-        ret = poll(&pfd, 1, 0);
-        if (ret == -1) {
-            if (errno == EINTR) {
-                continue;
-            }
-            errorf("poll: %s, dev=%s", strerror(errno), dev->name);
-            return -1;
-        }
-        if (ret == 0) {
-            break;
-        }
-        ether_poll_helper(dev, ether_pcap_read);
-    }
-    return 0;
+    return ether_poll_helper(dev, budget, ether_pcap_read);
 }
 
 static struct net_device_ops ether_pcap_ops = {
     .open = ether_pcap_open,
     .close = ether_pcap_close,
     .transmit = ether_pcap_transmit,
+    .poll = ether_pcap_poll,
 };
 
 struct net_device *
@@ -212,14 +179,12 @@ ether_pcap_init(const char *name, const char *addr)
     }
     strncpy(pcap->name, name, sizeof(pcap->name)-1);
     pcap->fd = -1;
-    pcap->irq = ETHER_PCAP_IRQ;
     dev->priv = pcap;
     if (net_device_register(dev) == -1) {
         errorf("net_device_register() failure");
         memory_free(pcap);
         return NULL;
     }
-    intr_request_irq(pcap->irq, ether_pcap_isr, NET_IRQ_SHARED, dev->name, dev);
     debugf("ethernet device initialized, dev=%s", dev->name);
     return dev;
 }
@@ -9,7 +9,7 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/ioctl.h>
-#include <sys/poll.h>
+#include <sys/uio.h>
 #include <linux/if.h>
 #include <linux/if_tun.h>
 
@@ -23,12 +23,9 @@
 
 #define CLONE_DEVICE "/dev/net/tun"
 
-#define ETHER_TAP_IRQ (SIGRTMIN+2)
-
 struct ether_tap {
     char name[IFNAMSIZ];
     int fd;
-    unsigned int irq;
 };
 
 #define PRIV(x) ((struct ether_tap *)x->priv)
@@ -62,7 +59,7 @@ ether_tap_open(struct net_device *dev)
     struct ifreq ifr = {};
 
     tap = PRIV(dev);
-    tap->fd = open(CLONE_DEVICE, O_RDWR);
+    tap->fd = open(CLONE_DEVICE, O_RDWR | O_NONBLOCK); /* NOTE: the poll op must not block */
     if (tap->fd == -1) {
         errorf("open: %s, dev=%s", strerror(errno), dev->name);
         return -1;
@@ -74,24 +71,6 @@ ether_tap_open(struct net_device *dev)
         close(tap->fd);
         return -1;
     }
-    /* Set Asynchronous I/O signal delivery destination */
-    if (fcntl(tap->fd, F_SETOWN, getpid()) == -1) {
-        errorf("fcntl(F_SETOWN): %s, dev=%s", strerror(errno), dev->name);
-        close(tap->fd);
-        return -1;
-    }
-    /* Enable Asynchronous I/O */
-    if (fcntl(tap->fd, F_SETFL, O_ASYNC) == -1) {
-        errorf("fcntl(F_SETFL): %s, dev=%s", strerror(errno), dev->name);
-        close(tap->fd);
-        return -1;
-    }
-    /* Use other signal instead of SIGIO */
-    if (fcntl(tap->fd, F_SETSIG, tap->irq) == -1) {
-        errorf("fcntl(F_SETSIG): %s, dev=%s", strerror(errno), dev->name);
-        close(tap->fd);
-        return -1;
-    }
     if (memcmp(dev->addr, ETHER_ADDR_ANY, ETHER_ADDR_LEN) == 0) {
         if (ether_tap_addr(dev) == -1) {
             errorf("ether_tap_addr() failure, dev=%s", dev->name);
@@ -99,6 +78,12 @@ ether_tap_open(struct net_device *dev)
             return -1;
         }
     }
+    /* NOTE: the core disables the notification while it polls the device, see net_device_poll_handler() */
+    if (net_device_poll_attach(dev, tap->fd) == -1) {
+        errorf("net_device_poll_attach() failure, dev=%s", dev->name);
+        close(tap->fd);
+        return -1;
+    }
     return 0;
 };
 
@@ -110,15 +95,15 @@ ether_tap_close(struct net_device *dev)
 }
 
 static ssize_t
-ether_tap_write(struct net_device *dev, const uint8_t *frame, size_t flen)
+ether_tap_write(struct net_device *dev, const struct iovec *iov, int iovcnt)
 {
-    return write(PRIV(dev)->fd, frame, flen);
+    return writev(PRIV(dev)->fd, iov, iovcnt);
 }
 
 int
-ether_tap_transmit(struct net_device *dev, uint16_t type, const uint8_t *buf, size_t len, const void *dst)
+ether_tap_transmit(struct net_device *dev, uint16_t type, struct pktbuf *pkt, const void *dst)
 {
-    return ether_transmit_helper(dev, type, buf, len, dst, ether_tap_write);
+    return ether_transmit_helper(dev, type, pkt, dst, ether_tap_write);
 }
 
 static ssize_t
@@ -127,45 +112,27 @@ ether_tap_read(struct net_device *dev, uint8_t *buf, size_t size)
     ssize_t len;
 
     len = read(PRIV(dev)->fd, buf, size);
-    if (len <= 0) {
-        if (len == -1 && errno != EINTR) {
-            errorf("read: %s, dev=%s", strerror(errno), dev->name);
+    if (len == -1) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+            return 0; /* no more frames */
         }
+        errorf("read: %s, dev=%s", strerror(errno), dev->name);
         return -1;
     }
     return len;
 }
 
 static int
-ether_tap_isr(unsigned int irq, void *id)
+ether_tap_poll(struct net_device *dev, int budget)
 {
-    struct net_device *dev = (struct net_device *)id;
-    struct pollfd pfd;
-    int ret;
-
-    pfd.fd = PRIV(dev)->fd;
-    pfd.events = POLLIN;
-    while (1) {
-        ret = poll(&pfd, 1, 0);
-        if (ret == -1) {
-            if (errno == EINTR) {
-                continue;
-            }
-            errorf("poll: %s, dev=%s", strerror(errno), dev->name);
-            return -1;
-        }
-        if (ret == 0) {
-            break;
-        }
-        ether_poll_helper(dev, ether_tap_read);
-    }
-    return 0;
+    return ether_poll_helper(dev, budget, ether_tap_read);
 }
 
 static struct net_device_ops ether_tap_ops = {
     .open = ether_tap_open,
     .close = ether_tap_close,
     .transmit = ether_tap_transmit,
+    .poll = ether_tap_poll,
 };
 
 struct net_device *
@@ -193,14 +160,12 @@ ether_tap_init(const char *name, const char *addr)
     }
     strncpy(tap->name, name, sizeof(tap->name)-1);
     tap->fd = -1;
-    tap->irq = ETHER_TAP_IRQ;
     dev->priv = tap;
     if (net_device_register(dev) == -1) {
         errorf("net_device_register() failure");
         memory_free(tap);
         return NULL;
     }
-    intr_request_irq(tap->irq, ether_tap_isr, NET_IRQ_SHARED, dev->name, dev);
     debugf("ethernet device initialized, dev=%s", dev->name);
     return dev;
 }
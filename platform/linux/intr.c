@@ -1,8 +1,11 @@
+#define _GNU_SOURCE /* for F_SETSIG */
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
 #include <errno.h>
 #include <signal.h>
+#include <fcntl.h>
+#include <poll.h>
 #include <pthread.h>
 
 #include "platform.h"
@@ -19,8 +22,25 @@ struct irq_entry {
     void *dev;
 };
 
+struct fd_entry {
+    struct fd_entry *next;
+    int fd;
+    int (*handler)(int fd, void *dev);
+    char name[16];
+    void *dev;
+    int disabled;
+};
+
+/* NOTE: all fds share one real-time signal, the handlers must tolerate a call with nothing to read */
+#define INTR_FD_SIGNAL (SIGRTMIN+4)
+
+/* NOTE: signals are process-wide, this backend supports only one stack per process */
+static struct net_stack *stack;
+
 sigset_t sigmask;
 struct irq_entry *irq_vec;
+static struct fd_entry *fd_vec;
+static mutex_t fd_vec_mutex = MUTEX_INITIALIZER;
 
 int
 intr_request_irq(unsigned int irq, int (*handler)(unsigned int irq, void *dev), int flags, const char *name, void *dev)
@@ -52,6 +72,109 @@ intr_request_irq(unsigned int irq, int (*handler)(unsigned int irq, void *dev),
     return 0;
 }
 
+/* NOTE: may be called after intr_run() (drivers register their fd on open) */
+int
+intr_request_fd(int fd, int (*handler)(int fd, void *dev), const char *name, void *dev)
+{
+    struct fd_entry *entry;
+
+    debugf("fd=%d, handler=%p, name=%s, dev=%p", fd, handler, name, dev);
+    entry = memory_alloc(sizeof(*entry));
+    if (!entry) {
+        errorf("memory_alloc() failure");
+        return -1;
+    }
+    entry->fd = fd;
+    entry->handler = handler;
+    strncpy(entry->name, name, sizeof(entry->name)-1);
+    entry->dev = dev;
+    mutex_lock(&fd_vec_mutex);
+    entry->next = fd_vec;
+    fd_vec = entry;
+    mutex_unlock(&fd_vec_mutex);
+    /* Set Asynchronous I/O signal delivery destination */
+    if (fcntl(fd, F_SETOWN, getpid()) == -1) {
+        errorf("fcntl(F_SETOWN): %s, name=%s", strerror(errno), name);
+        return -1;
+    }
+    /* Enable Asynchronous I/O (keep the other status flags, e.g. O_NONBLOCK) */
+    if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_ASYNC) == -1) {
+        errorf("fcntl(F_SETFL): %s, name=%s", strerror(errno), name);
+        return -1;
+    }
+    /* Use other signal instead of SIGIO */
+    if (fcntl(fd, F_SETSIG, INTR_FD_SIGNAL) == -1) {
+        errorf("fcntl(F_SETSIG): %s, name=%s", strerror(errno), name);
+        return -1;
+    }
+    debugf("registered: fd=%d, name=%s", fd, name);
+    return 0;
+}
+
+static int
+intr_fd_modify(int fd, int disabled)
+{
+    struct fd_entry *entry;
+    int flags;
+
+    mutex_lock(&fd_vec_mutex);
+    for (entry = fd_vec; entry; entry = entry->next) {
+        if (entry->fd == fd) {
+            break;
+        }
+    }
+    mutex_unlock(&fd_vec_mutex);
+    if (!entry) {
+        errorf("not registered, fd=%d", fd);
+        return -1;
+    }
+    flags = fcntl(fd, F_GETFL);
+    if (flags == -1) {
+        errorf("fcntl(F_GETFL): %s, name=%s", strerror(errno), entry->name);
+        return -1;
+    }
+    flags = disabled ? (flags & ~O_ASYNC) : (flags | O_ASYNC);
+    if (fcntl(fd, F_SETFL, flags) == -1) {
+        errorf("fcntl(F_SETFL): %s, name=%s", strerror(errno), entry->name);
+        return -1;
+    }
+    entry->disabled = disabled;
+    return 0;
+}
+
+int
+intr_fd_disable(int fd)
+{
+    return intr_fd_modify(fd, 1);
+}
+
+int
+intr_fd_enable(int fd)
+{
+    struct pollfd pfd = {fd, POLLIN, 0};
+
+    if (intr_fd_modify(fd, 0) == -1) {
+        return -1;
+    }
+    /* NOTE: O_ASYNC signals only on new arrivals, notify the data that arrived while disabled */
+    if (poll(&pfd, 1, 0) == 1) {
+        kill(getpid(), INTR_FD_SIGNAL);
+    }
+    return 0;
+}
+
+int
+raise_softirq(void)
+{
+    return kill(getpid(), SIGUSR1);
+}
+
+int
+raise_event(void)
+{
+    return kill(getpid(), SIGUSR2);
+}
+
 static int
 intr_timer_setup(struct itimerspec *interval)
 {
@@ -75,7 +198,9 @@ intr_thread(void *arg)
     struct itimerspec interval = {ts, ts};
     int sig, err;
     struct irq_entry *entry;
+    struct fd_entry *fde;
 
+    net_stack_enter(stack);
     if (intr_timer_setup(&interval) == -1) {
         return NULL;
     }
@@ -87,7 +212,7 @@ intr_thread(void *arg)
         }
         switch (sig) {
         case SIGUSR1:
-            net_protocol_handler();
+            net_device_poll_handler();
             break;
         case SIGUSR2:
             net_event_handler();
@@ -96,6 +221,17 @@ intr_thread(void *arg)
             net_timer_handler();
             break;
         default:
+            if (sig == INTR_FD_SIGNAL) {
+                mutex_lock(&fd_vec_mutex);
+                fde = fd_vec;
+                mutex_unlock(&fd_vec_mutex);
+                for (; fde; fde = fde->next) {
+                    if (!fde->disabled) {
+                        fde->handler(fde->fd, fde->dev);
+                    }
+                }
+                break;
+            }
             for (entry = irq_vec; entry; entry = entry->next) {
                 if (entry->irq == (unsigned int)sig) {
                     debugf("irq=%d, name=%s", entry->irq, entry->name);
@@ -131,9 +267,15 @@ intr_run(void)
 int
 intr_init(void)
 {
+    if (stack) {
+        errorf("the signal backend supports only one stack");
+        return -1;
+    }
+    stack = net_stack_current();
     sigemptyset(&sigmask);
     sigaddset(&sigmask, SIGUSR1);
     sigaddset(&sigmask, SIGUSR2);
     sigaddset(&sigmask, SIGALRM);
+    sigaddset(&sigmask, INTR_FD_SIGNAL);
     return 0;
 }
@@ -0,0 +1,348 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <sys/signalfd.h>
+
+#include "platform.h"
+
+#include "util.h"
+#include "net.h"
+
+/*
+ * Interrupt (epoll backend)
+ *
+ * NOTE: The intr thread waits on a single epoll instance:
+ *       - softirq/event: eventfd, raised by a write (coalesced until the thread reads it)
+ *         (the softirq runs the device poll rounds, protocols are processed by the net workers)
+ *       - timer: timerfd with a 1ms period
+ *       - devices: their fds, registered directly with intr_request_fd()
+ *       - legacy IRQs (intr_request_irq): the signals are received through a signalfd
+ *       Each stack has its own intr thread and epoll instance (see net_stack_create()).
+ *       NOTE: the signals of legacy IRQs are process-wide, a signal must not be requested by two stacks.
+ */
+
+#define INTR_EPOLL_EVENTS 16
+
+struct irq_entry {
+    struct irq_entry *next;
+    unsigned int irq;
+    int (*handler)(unsigned int irq, void *dev);
+    int flags;
+    char name[16];
+    void *dev;
+};
+
+struct fd_entry {
+    struct fd_entry *next;
+    int fd;
+    int (*handler)(int fd, void *dev);
+    char name[16];
+    void *dev;
+};
+
+struct intr_stack {
+    int epfd;
+    int softirq_fd;
+    int event_fd;
+    int timer_fd;
+    int signal_fd;
+    sigset_t sigmask;
+    struct irq_entry *irq_vec;
+    struct fd_entry *fd_vec;
+    mutex_t fd_vec_mutex;
+    pthread_t tid;
+    struct net_stack *stack;
+};
+
+static struct intr_stack *
+intr_stack(void)
+{
+    return net_stack_priv(NET_STACK_PRIV_INTR);
+}
+
+int
+intr_request_irq(unsigned int irq, int (*handler)(unsigned int irq, void *dev), int flags, const char *name, void *dev)
+{
+    struct intr_stack *intr = intr_stack();
+    struct irq_entry *entry;
+
+    debugf("irq=%u, handler=%p, flags=%d, name=%s, dev=%p", irq, handler, flags, name, dev);
+    for (entry = intr->irq_vec; entry; entry = entry->next) {
+        if (entry->irq == irq) {
+            if (entry->flags ^ NET_IRQ_SHARED || flags ^ NET_IRQ_SHARED) {
+                errorf("conflicts with already registered IRQs");
+                return -1;
+            }
+        }
+    }
+    entry = memory_alloc(sizeof(*entry));
+    if (!entry) {
+        errorf("memory_alloc() failure");
+        return -1;
+    }
+    entry->irq = irq;
+    entry->handler = handler;
+    entry->flags = flags;
+    strncpy(entry->name, name, sizeof(entry->name)-1);
+    entry->dev = dev;
+    entry->next = intr->irq_vec;
+    intr->irq_vec = entry;
+    sigaddset(&intr->sigmask, irq);
+    debugf("registered: irq=%u, name=%s", irq, name);
+    return 0;
+}
+
+/* NOTE: may be called after intr_run() (drivers register their fd on open) */
+int
+intr_request_fd(int fd, int (*handler)(int fd, void *dev), const char *name, void *dev)
+{
+    struct intr_stack *intr = intr_stack();
+    struct fd_entry *entry;
+    struct epoll_event ev = {};
+
+    debugf("fd=%d, handler=%p, name=%s, dev=%p", fd, handler, name, dev);
+    entry = memory_alloc(sizeof(*entry));
+    if (!entry) {
+        errorf("memory_alloc() failure");
+        return -1;
+    }
+    entry->fd = fd;
+    entry->handler = handler;
+    strncpy(entry->name, name, sizeof(entry->name)-1);
+    entry->dev = dev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = entry;
+    if (epoll_ctl(intr->epfd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+        errorf("epoll_ctl: %s, name=%s", strerror(errno), name);
+        memory_free(entry);
+        return -1;
+    }
+    mutex_lock(&intr->fd_vec_mutex);
+    entry->next = intr->fd_vec;
+    intr->fd_vec = entry;
+    mutex_unlock(&intr->fd_vec_mutex);
+    debugf("registered: fd=%d, name=%s", fd, name);
+    return 0;
+}
+
+static int
+intr_fd_modify(int fd, uint32_t events)
+{
+    struct intr_stack *intr = intr_stack();
+    struct fd_entry *entry;
+    struct epoll_event ev = {};
+
+    mutex_lock(&intr->fd_vec_mutex);
+    for (entry = intr->fd_vec; entry; entry = entry->next) {
+        if (entry->fd == fd) {
+            break;
+        }
+    }
+    mutex_unlock(&intr->fd_vec_mutex);
+    if (!entry) {
+        errorf("not registered, fd=%d", fd);
+        return -1;
+    }
+    ev.events = events;
+    ev.data.ptr = entry;
+    if (epoll_ctl(intr->epfd, EPOLL_CTL_MOD, fd, &ev) == -1) {
+        errorf("epoll_ctl: %s, name=%s", strerror(errno), entry->name);
+        return -1;
+    }
+    return 0;
+}
+
+int
+intr_fd_disable(int fd)
+{
+    return intr_fd_modify(fd, 0);
+}
+
+int
+intr_fd_enable(int fd)
+{
+    /* NOTE: level-triggered, pending data is notified right away */
+    return intr_fd_modify(fd, EPOLLIN);
+}
+
+static int
+intr_eventfd_raise(int fd)
+{
+    uint64_t val = 1;
+
+    /* NOTE: write(2) is async-signal-safe, EAGAIN means the counter is already pending */
+    if (write(fd, &val, sizeof(val)) == -1 && errno != EAGAIN) {
+        return -1;
+    }
+    return 0;
+}
+
+int
+raise_softirq(void)
+{
+    return intr_eventfd_raise(intr_stack()->softirq_fd);
+}
+
+int
+raise_event(void)
+{
+    return intr_eventfd_raise(intr_stack()->event_fd);
+}
+
+static int
+intr_fd_drain(int fd)
+{
+    uint64_t val;
+
+    /* NOTE: eventfd and timerfd are read as a single counter, draining it re-arms the edge */
+    return read(fd, &val, sizeof(val)) == sizeof(val) ? 0 : -1;
+}
+
+static int
+intr_softirq_handler(int fd, void *dev)
+{
+    intr_fd_drain(fd);
+    return net_device_poll_handler();
+}
+
+static int
+intr_event_handler(int fd, void *dev)
+{
+    intr_fd_drain(fd);
+    return net_event_handler();
+}
+
+static int
+intr_timer_handler(int fd, void *dev)
+{
+    intr_fd_drain(fd);
+    return net_timer_handler();
+}
+
+static int
+intr_signal_handler(int fd, void *dev)
+{
+    struct intr_stack *intr = intr_stack();
+    struct signalfd_siginfo info;
+    struct irq_entry *entry;
+
+    while (read(fd, &info, sizeof(info)) == sizeof(info)) {
+        for (entry = intr->irq_vec; entry; entry = entry->next) {
+            if (entry->irq == info.ssi_signo) {
+                debugf("irq=%d, name=%s", entry->irq, entry->name);
+                entry->handler(entry->irq, entry->dev);
+            }
+        }
+    }
+    return 0;
+}
+
+static void *
+intr_thread(void *arg)
+{
+    struct intr_stack *intr;
+    struct epoll_event events[INTR_EPOLL_EVENTS];
+    struct fd_entry *entry;
+    int n, i;
+
+    intr = (struct intr_stack *)arg;
+    net_stack_enter(intr->stack);
+    while (1) {
+        n = epoll_wait(intr->epfd, events, countof(events), -1);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            errorf("epoll_wait: %s", strerror(errno));
+            break;
+        }
+        for (i = 0; i < n; i++) {
+            entry = events[i].data.ptr;
+            entry->handler(entry->fd, entry->dev);
+        }
+    }
+    return NULL;
+}
+
+int
+intr_run(void)
+{
+    struct intr_stack *intr = intr_stack();
+    struct itimerspec interval = {{0, 1000000}, {0, 1000000}}; // 1ms
+    int err;
+
+    err = pthread_sigmask(SIG_BLOCK, &intr->sigmask, NULL);
+    if (err) {
+        errorf("pthread_sigmask() %s", strerror(err));
+        return -1;
+    }
+    if (intr->irq_vec) {
+        intr->signal_fd = signalfd(-1, &intr->sigmask, SFD_NONBLOCK | SFD_CLOEXEC);
+        if (intr->signal_fd == -1) {
+            errorf("signalfd: %s", strerror(errno));
+            return -1;
+        }
+        if (intr_request_fd(intr->signal_fd, intr_signal_handler, "signal", NULL) == -1) {
+            errorf("intr_request_fd() failure");
+            return -1;
+        }
+    }
+    if (timerfd_settime(intr->timer_fd, 0, &interval, NULL) == -1) {
+        errorf("timerfd_settime: %s", strerror(errno));
+        return -1;
+    }
+    err = pthread_create(&intr->tid, NULL, intr_thread, intr);
+    if (err) {
+        errorf("pthread_create() %s", strerror(err));
+        return -1;
+    }
+    return 0;
+}
+
+int
+intr_init(void)
+{
+    struct intr_stack *intr;
+
+    intr = memory_alloc(sizeof(*intr));
+    if (!intr) {
+        errorf("memory_alloc() failure");
+        return -1;
+    }
+    intr->stack = net_stack_current();
+    mutex_init(&intr->fd_vec_mutex);
+    intr->signal_fd = -1;
+    net_stack_set_priv(NET_STACK_PRIV_INTR, intr);
+    sigemptyset(&intr->sigmask);
+    intr->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (intr->epfd == -1) {
+        errorf("epoll_create1: %s", strerror(errno));
+        return -1;
+    }
+    intr->softirq_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    intr->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (intr->softirq_fd == -1 || intr->event_fd == -1) {
+        errorf("eventfd: %s", strerror(errno));
+        return -1;
+    }
+    intr->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (intr->timer_fd == -1) {
+        errorf("timerfd_create: %s", strerror(errno));
+        return -1;
+    }
+    if (intr_request_fd(intr->softirq_fd, intr_softirq_handler, "softirq", NULL) == -1 ||
+        intr_request_fd(intr->event_fd, intr_event_handler, "event", NULL) == -1 ||
+        intr_request_fd(intr->timer_fd, intr_timer_handler, "timer", NULL) == -1) {
+        errorf("intr_request_fd() failure");
+        return -1;
+    }
+    return 0;
+}
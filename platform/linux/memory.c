@@ -0,0 +1,307 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "platform.h"
+
+/*
+ * Pool allocator with fixed size classes
+ *
+ * NOTE: Each thread keeps a small cache of free blocks per class, so the common
+ *       alloc/free path takes no lock. When a cache runs dry (or overflows) half of
+ *       its capacity is moved from (or to) the global pool of the class at once.
+ *       Requests larger than the biggest class go straight to malloc()/free().
+ */
+
+#define MEMORY_BLOCK_MAGIC 0x6d656d21 /* "mem!" */
+#define MEMORY_CLASS_LARGE MEMORY_CLASS_NUM /* not pooled */
+
+struct memory_block {
+    uint32_t cls;
+    uint32_t magic;
+    struct memory_block *next; /* valid only while the block is free */
+    /* NOTE: the user data follows immediately after the structure */
+};
+
+struct memory_class {
+    size_t size; /* usable size */
+    size_t cache_max; /* per-thread cache capacity */
+    size_t pool_max; /* global pool capacity */
+};
+
+/* NOTE: the sizes match the objects of the stack, see pktbuf.h for the packet classes */
+static const struct memory_class classes[MEMORY_CLASS_NUM] = {
+    {           64, 256, 1024}, /* queue nodes, small entries */
+    {          256, 256, 1024}, /* pcb related entries, short segments */
+    {         2048,  64,  512}, /* MTU-sized packets (pktbuf + headroom + ethernet frame) */
+    {64 * 1024 + 512, 4,   16}, /* max IP-sized packets (pktbuf + headroom + 64KB) */
+};
+
+struct memory_pool {
+    mutex_t mutex;
+    struct memory_block *head;
+    size_t num;
+};
+
+#define MEMORY_CACHE_RELEASED -1 /* the thread is exiting, blocks go straight to the pools */
+
+struct memory_cache {
+    int registered;
+    struct memory_block *head[MEMORY_CLASS_NUM];
+    size_t num[MEMORY_CLASS_NUM];
+};
+
+static struct memory_pool pools[MEMORY_CLASS_NUM] = {
+    {MUTEX_INITIALIZER, NULL, 0},
+    {MUTEX_INITIALIZER, NULL, 0},
+    {MUTEX_INITIALIZER, NULL, 0},
+    {MUTEX_INITIALIZER, NULL, 0},
+};
+static struct memory_stat stats[MEMORY_CLASS_NUM];
+
+static __thread struct memory_cache cache;
+static pthread_key_t cache_key;
+static pthread_once_t cache_once = PTHREAD_ONCE_INIT;
+
+static void
+memory_cache_release(void *arg)
+{
+    struct memory_cache *c = arg;
+    struct memory_block *block;
+    int cls;
+
+    for (cls = 0; cls < MEMORY_CLASS_NUM; cls++) {
+        while ((block = c->head[cls]) != NULL) {
+            c->head[cls] = block->next;
+            mutex_lock(&pools[cls].mutex);
+            block->next = pools[cls].head;
+            pools[cls].head = block;
+            pools[cls].num++;
+            mutex_unlock(&pools[cls].mutex);
+        }
+        c->num[cls] = 0;
+    }
+    /* NOTE: the destructors of other keys may still allocate/free after this one ran */
+    c->registered = MEMORY_CACHE_RELEASED;
+}
+
+static void
+memory_cache_key_create(void)
+{
+    pthread_key_create(&cache_key, memory_cache_release);
+}
+
+/* NOTE: returns NULL once the cache has been released (thread exit) */
+static struct memory_cache *
+memory_cache_get(void)
+{
+    if (cache.registered == MEMORY_CACHE_RELEASED) {
+        return NULL;
+    }
+    if (!cache.registered) {
+        /* NOTE: the destructor hands the cached blocks back to the pools on thread exit */
+        pthread_once(&cache_once, memory_cache_key_create);
+        pthread_setspecific(cache_key, &cache);
+        cache.registered = 1;
+    }
+    return &cache;
+}
+
+static int
+memory_class_select(size_t size)
+{
+    int cls;
+
+    for (cls = 0; cls < MEMORY_CLASS_NUM; cls++) {
+        if (size <= classes[cls].size) {
+            return cls;
+        }
+    }
+    return MEMORY_CLASS_LARGE;
+}
+
+static void
+memory_stat_inuse_inc(struct memory_stat *stat)
+{
+    unsigned long inuse, hiwat;
+
+    inuse = __atomic_add_fetch(&stat->inuse, 1, __ATOMIC_RELAXED);
+    hiwat = __atomic_load_n(&stat->hiwat, __ATOMIC_RELAXED);
+    while (inuse > hiwat) {
+        if (__atomic_compare_exchange_n(&stat->hiwat, &hiwat, inuse, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+            break;
+        }
+    }
+}
+
+static struct memory_block *
+memory_block_get(int cls)
+{
+    struct memory_cache *c;
+    struct memory_block *block;
+    size_t batch;
+
+    c = memory_cache_get();
+    if (!c) {
+        mutex_lock(&pools[cls].mutex);
+        block = pools[cls].head;
+        if (block) {
+            pools[cls].head = block->next;
+            pools[cls].num--;
+        }
+        mutex_unlock(&pools[cls].mutex);
+    } else if (!c->head[cls]) {
+        /* refill the cache from the global pool */
+        batch = classes[cls].cache_max / 2;
+        mutex_lock(&pools[cls].mutex);
+        while (pools[cls].head && c->num[cls] < batch) {
+            block = pools[cls].head;
+            pools[cls].head = block->next;
+            pools[cls].num--;
+            block->next = c->head[cls];
+            c->head[cls] = block;
+            c->num[cls]++;
+        }
+        mutex_unlock(&pools[cls].mutex);
+    }
+    if (c) {
+        block = c->head[cls];
+        if (block) {
+            c->head[cls] = block->next;
+            c->num[cls]--;
+        }
+    }
+    if (block) {
+        __atomic_add_fetch(&stats[cls].hit, 1, __ATOMIC_RELAXED);
+    } else {
+        block = malloc(sizeof(*block) + classes[cls].size);
+        if (!block) {
+            return NULL;
+        }
+        block->cls = cls;
+        block->magic = MEMORY_BLOCK_MAGIC;
+        __atomic_add_fetch(&stats[cls].miss, 1, __ATOMIC_RELAXED);
+    }
+    memory_stat_inuse_inc(&stats[cls]);
+    return block;
+}
+
+static void
+memory_block_put(struct memory_block *block)
+{
+    struct memory_cache *c;
+    struct memory_block *tmp;
+    int cls = block->cls;
+    size_t batch;
+
+    __atomic_sub_fetch(&stats[cls].inuse, 1, __ATOMIC_RELAXED);
+    c = memory_cache_get();
+    if (!c) {
+        mutex_lock(&pools[cls].mutex);
+        if (pools[cls].num < classes[cls].pool_max) {
+            block->next = pools[cls].head;
+            pools[cls].head = block;
+            pools[cls].num++;
+            block = NULL;
+        }
+        mutex_unlock(&pools[cls].mutex);
+        free(block);
+        return;
+    }
+    block->next = c->head[cls];
+    c->head[cls] = block;
+    c->num[cls]++;
+    if (c->num[cls] <= classes[cls].cache_max) {
+        return;
+    }
+    /* flush half of the cache to the global pool, release what does not fit */
+    batch = classes[cls].cache_max / 2;
+    mutex_lock(&pools[cls].mutex);
+    while (c->num[cls] > batch) {
+        tmp = c->head[cls];
+        c->head[cls] = tmp->next;
+        c->num[cls]--;
+        if (pools[cls].num < classes[cls].pool_max) {
+            tmp->next = pools[cls].head;
+            pools[cls].head = tmp;
+            pools[cls].num++;
+        } else {
+            free(tmp);
+        }
+    }
+    mutex_unlock(&pools[cls].mutex);
+}
+
+static void *
+memory_alloc_core(size_t size, int zero)
+{
+    struct memory_block *block;
+    int cls;
+
+    cls = memory_class_select(size);
+    if (cls == MEMORY_CLASS_LARGE) {
+        block = malloc(sizeof(*block) + size);
+        if (!block) {
+            return NULL;
+        }
+        block->cls = MEMORY_CLASS_LARGE;
+        block->magic = MEMORY_BLOCK_MAGIC;
+    } else {
+        block = memory_block_get(cls);
+        if (!block) {
+            return NULL;
+        }
+    }
+    if (zero) {
+        memset(block + 1, 0, size); /* NOTE: only the requested size, not the whole class */
+    }
+    return block + 1;
+}
+
+void *
+memory_alloc(size_t size)
+{
+    return memory_alloc_core(size, 1);
+}
+
+void *
+memory_alloc_nozero(size_t size)
+{
+    return memory_alloc_core(size, 0);
+}
+
+void
+memory_free(void *ptr)
+{
+    struct memory_block *block;
+
+    if (!ptr) {
+        return;
+    }
+    block = (struct memory_block *)ptr - 1;
+    if (block->magic != MEMORY_BLOCK_MAGIC) {
+        fprintf(stderr, "memory_free: bad block, ptr=%p\n", ptr);
+        abort();
+    }
+    if (block->cls == MEMORY_CLASS_LARGE) {
+        free(block);
+        return;
+    }
+    memory_block_put(block);
+}
+
+int
+memory_stat(int cls, struct memory_stat *stat)
+{
+    if (cls < 0 || cls >= MEMORY_CLASS_NUM) {
+        return -1;
+    }
+    stat->size = classes[cls].size;
+    stat->hit = __atomic_load_n(&stats[cls].hit, __ATOMIC_RELAXED);
+    stat->miss = __atomic_load_n(&stats[cls].miss, __ATOMIC_RELAXED);
+    stat->inuse = __atomic_load_n(&stats[cls].inuse, __ATOMIC_RELAXED);
+    stat->hiwat = __atomic_load_n(&stats[cls].hiwat, __ATOMIC_RELAXED);
+    return 0;
+}
@@ -12,17 +12,24 @@
  * Memory
  */
 
-static inline void *
-memory_alloc(size_t size)
-{
-    return calloc(1, size);
-}
+#define MEMORY_CLASS_NUM 4
+
+struct memory_stat {
+    size_t size; /* block size of the class */
+    unsigned long hit; /* served from the pool */
+    unsigned long miss; /* newly allocated from the system */
+    unsigned long inuse;
+    unsigned long hiwat; /* high-water mark of inuse */
+};
 
-static inline void
-memory_free(void *ptr)
-{
-    free(ptr);
-}
+extern void *
+memory_alloc(size_t size); /* zero-filled */
+extern void *
+memory_alloc_nozero(size_t size);
+extern void
+memory_free(void *ptr);
+extern int
+memory_stat(int cls, struct memory_stat *stat);
 
 /*
  * Mutex
@@ -73,21 +80,60 @@ sched_wakeup(struct sched_ctx *ctx);
 extern int
 sched_interrupt(struct sched_ctx *ctx);
 
+/*
+ * Thread
+ */
+
+typedef pthread_t thread_t;
+
+/* NOTE: the thread starts with all signals blocked, cpu < 0 means not pinned */
+extern int
+thread_create(thread_t *thread, void *(*start)(void *arg), void *arg, int cpu);
+extern int
+thread_join(thread_t thread);
+
+/*
+ * RCU (read-copy-update)
+ *
+ * NOTE: A writer publishes a new version of a structure with a pointer swap, readers use whichever
+ *       version they loaded inside a read section. After rcu_synchronize() returns no reader is left
+ *       in a section that began before the call, so the old version can be freed.
+ *       Read sections nest, must be short and must not sleep.
+ */
+
+extern void
+rcu_read_lock(void);
+extern void
+rcu_read_unlock(void);
+extern void
+rcu_synchronize(void);
+
 /*
  * Interrupt
+ *
+ * NOTE: Two backends implement this interface, selected at build time (see Makefile):
+ *       - epoll  (intr_epoll.c): eventfd for softirq/events, timerfd for the timer, fds watched directly
+ *       - signal (intr.c): SIGUSR1/SIGUSR2/SIGALRM and O_ASYNC with real-time signals
  */
 
 extern int
 intr_request_irq(unsigned int irq, int (*handler)(unsigned int irq, void *id), int flags, const char *name, void *dev);
 extern int
+intr_request_fd(int fd, int (*handler)(int fd, void *id), const char *name, void *dev);
+/* NOTE: mask/unmask the notification of a registered fd, data that arrived while masked is notified on unmask */
+extern int
+intr_fd_disable(int fd);
+extern int
+intr_fd_enable(int fd);
+extern int
 intr_run(void);
 extern int
 intr_init(void);
 
-static inline void
-raise_softirq(void)
-{
-    kill(getpid(), SIGUSR1);
-}
+/* NOTE: async-signal-safe, may be called from signal handlers */
+extern int
+raise_softirq(void);
+extern int
+raise_event(void);
 
 #endif
@@ -0,0 +1,104 @@
+#include <pthread.h>
+#include <sched.h>
+
+#include "platform.h"
+
+/*
+ * RCU (read-copy-update)
+ *
+ * NOTE: Each reader thread registers a record on its first read section. On entry it publishes
+ *       the current epoch in its record, on exit it clears it. rcu_synchronize() advances the epoch
+ *       and waits until no record shows an older one: every reader that may have seen the old
+ *       version has left its section by then. The read side costs one full fence and never blocks.
+ */
+
+struct rcu_reader {
+    struct rcu_reader *next;
+    struct rcu_reader **pprev;
+    unsigned long epoch; /* 0 when not reading */
+    unsigned int nesting;
+    int registered;
+};
+
+static mutex_t readers_mutex = MUTEX_INITIALIZER;
+static struct rcu_reader *readers;
+static unsigned long epoch = 1;
+
+static __thread struct rcu_reader reader;
+static pthread_key_t reader_key;
+static pthread_once_t reader_once = PTHREAD_ONCE_INIT;
+
+static void
+rcu_reader_release(void *arg)
+{
+    struct rcu_reader *r = arg;
+
+    mutex_lock(&readers_mutex);
+    *r->pprev = r->next;
+    if (r->next) {
+        r->next->pprev = r->pprev;
+    }
+    mutex_unlock(&readers_mutex);
+}
+
+static void
+rcu_reader_key_create(void)
+{
+    pthread_key_create(&reader_key, rcu_reader_release);
+}
+
+static void
+rcu_reader_register(void)
+{
+    /* NOTE: the destructor unlinks the record on thread exit */
+    pthread_once(&reader_once, rcu_reader_key_create);
+    pthread_setspecific(reader_key, &reader);
+    mutex_lock(&readers_mutex);
+    reader.next = readers;
+    if (reader.next) {
+        reader.next->pprev = &reader.next;
+    }
+    reader.pprev = &readers;
+    readers = &reader;
+    mutex_unlock(&readers_mutex);
+    reader.registered = 1;
+}
+
+void
+rcu_read_lock(void)
+{
+    if (reader.nesting++) {
+        return;
+    }
+    if (!reader.registered) {
+        rcu_reader_register();
+    }
+    __atomic_store_n(&reader.epoch, __atomic_load_n(&epoch, __ATOMIC_ACQUIRE), __ATOMIC_RELAXED);
+    /* NOTE: orders the store above before the loads of the protected pointers (pairs with rcu_synchronize()) */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+void
+rcu_read_unlock(void)
+{
+    if (--reader.nesting) {
+        return;
+    }
+    __atomic_store_n(&reader.epoch, 0, __ATOMIC_RELEASE);
+}
+
+void
+rcu_synchronize(void)
+{
+    struct rcu_reader *r;
+    unsigned long target, e;
+
+    mutex_lock(&readers_mutex);
+    target = __atomic_add_fetch(&epoch, 1, __ATOMIC_SEQ_CST);
+    for (r = readers; r; r = r->next) {
+        while ((e = __atomic_load_n(&r->epoch, __ATOMIC_ACQUIRE)) != 0 && e < target) {
+            sched_yield();
+        }
+    }
+    mutex_unlock(&readers_mutex);
+}
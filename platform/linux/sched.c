@@ -1,6 +1,9 @@
+#define _GNU_SOURCE /* for CPU_SET, pthread_attr_setaffinity_np */
 #include <pthread.h>
 #include <time.h>
 #include <errno.h>
+#include <signal.h>
+#include <sched.h>
 
 #include "platform.h"
 
@@ -57,3 +60,36 @@ sched_interrupt(struct sched_ctx *ctx)
     ctx->interrupted = 1;
     return pthread_cond_broadcast(&ctx->cond);
 }
+
+int
+thread_create(thread_t *thread, void *(*start)(void *arg), void *arg, int cpu)
+{
+    pthread_attr_t attr;
+    cpu_set_t cpuset;
+    sigset_t all, old;
+    int err;
+
+    pthread_attr_init(&attr);
+    if (cpu >= 0) {
+        CPU_ZERO(&cpuset);
+        CPU_SET(cpu, &cpuset);
+        err = pthread_attr_setaffinity_np(&attr, sizeof(cpuset), &cpuset);
+        if (err) {
+            pthread_attr_destroy(&attr);
+            return -1;
+        }
+    }
+    /* the new thread must not take signals that are meant for the intr thread (inherits the mask) */
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    err = pthread_create(thread, &attr, start, arg);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    pthread_attr_destroy(&attr);
+    return err ? -1 : 0;
+}
+
+int
+thread_join(thread_t thread)
+{
+    return pthread_join(thread, NULL) ? -1 : 0;
+}
@@ -2,6 +2,8 @@
 #include <stdint.h>
 #include <string.h>
 
+#include "platform.h"
+
 #include "util.h"
 #include "net.h"
 #include "ip.h"
@@ -10,7 +12,15 @@
 
 #include "sock.h"
 
-static struct sock socks[128];
+struct sock_stack {
+    struct sock socks[128];
+};
+
+static struct sock_stack *
+sock_stack(void)
+{
+    return net_stack_priv(NET_STACK_PRIV_SOCK);
+}
 
 int
 sockaddr_pton(const char *p, struct sockaddr *n, size_t size)
@@ -49,9 +59,10 @@ sockaddr_ntop(const struct sockaddr *n, char *p, size_t size)
 static struct sock *
 sock_alloc(void)
 {
+    struct sock_stack *sock = sock_stack();
     struct sock *entry;
 
-    for (entry = socks; entry < tailof(socks); entry++) {
+    for (entry = sock->socks; entry < tailof(sock->socks); entry++) {
         if (!entry->used) {
             entry->used = 1;
             return entry;
@@ -70,16 +81,19 @@ sock_free(struct sock *s)
 static struct sock *
 sock_get(int id)
 {
-    if (id < 0 || id >= (int)countof(socks)) {
+    struct sock_stack *sock = sock_stack();
+
+    if (id < 0 || id >= (int)countof(sock->socks)) {
         /* out of range */
         return NULL;
     }
-    return &socks[id];
+    return &sock->socks[id];
 }
 
 int
 sock_open(int domain, int type, int protocol)
 {
+    struct sock_stack *sock = sock_stack();
     struct sock *s;
 
     if (domain != AF_INET) {
@@ -108,7 +122,7 @@ sock_open(int domain, int type, int protocol)
     if (s->desc == -1) {
         return -1;
     }
-    return indexof(socks, s);
+    return indexof(sock->socks, s);
 }
 
 int
@@ -234,6 +248,7 @@ sock_listen(int id, int backlog)
 int
 sock_accept(int id, struct sockaddr *addr, int *addrlen)
 {
+    struct sock_stack *sock = sock_stack();
     struct sock *s, *new_s;
     struct ip_endpoint ep;
     int ret;
@@ -258,7 +273,7 @@ sock_accept(int id, struct sockaddr *addr, int *addrlen)
         new_s->family = s->family;
         new_s->type = s->type;
         new_s->desc = ret;
-        return indexof(socks, new_s);
+        return indexof(sock->socks, new_s);
     }
     return -1;
 }
@@ -322,3 +337,46 @@ sock_send(int id, const void *buf, size_t n)
     }
     return -1;
 }
+
+int
+sock_setsockopt(int id, int level, int optname, const void *optval, int optlen)
+{
+    struct sock *s;
+    int val;
+
+    s = sock_get(id);
+    if (!s) {
+        return -1;
+    }
+    if (s->type != SOCK_STREAM || level != SOL_SOCKET || optlen != sizeof(int)) {
+        return -1;
+    }
+    val = *(const int *)optval;
+    if (val <= 0) {
+        return -1;
+    }
+    switch (s->family) {
+    case AF_INET:
+        switch (optname) {
+        case SO_RCVBUF:
+            return tcp_set_bufsize(s->desc, val, 0);
+        case SO_SNDBUF:
+            return tcp_set_bufsize(s->desc, 0, val);
+        }
+    }
+    return -1;
+}
+
+int
+sock_init(void)
+{
+    struct sock_stack *sock;
+
+    sock = memory_alloc(sizeof(*sock));
+    if (!sock) {
+        errorf("memory_alloc() failure");
+        return -1;
+    }
+    net_stack_set_priv(NET_STACK_PRIV_SOCK, sock);
+    return 0;
+}
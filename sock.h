@@ -24,6 +24,11 @@
 
 #define INADDR_ANY ((ip_addr_t)0)
 
+#define SOL_SOCKET 1
+
+#define SO_SNDBUF  7
+#define SO_RCVBUF  8
+
 #define SOCKADDR_STR_LEN IP_ENDPOINT_STR_LEN
 
 struct sock {
@@ -71,5 +76,10 @@ extern ssize_t
 sock_recv(int id, void *buf, size_t n);
 extern ssize_t
 sock_send(int id, const void *buf, size_t n);
+extern int
+sock_setsockopt(int id, int level, int optname, const void *optval, int optlen);
+
+extern int
+sock_init(void);
 
 #endif
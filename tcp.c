@@ -1,4 +1,5 @@
 #include <stdio.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
@@ -8,8 +9,11 @@
 #include "platform.h"
 
 #include "util.h"
+#include "pktbuf.h"
+#include "timer.h"
 #include "net.h"
 #include "ip.h"
+#include "icmp.h"
 #include "tcp.h"
 
 #define TCP_FLG_FIN 0x01
@@ -22,11 +26,20 @@
 #define TCP_FLG_IS(x, y) ((x & 0x3f) == (y))
 #define TCP_FLG_ISSET(x, y) ((x & 0x3f) & (y) ? 1 : 0)
 
+/* NOTE: the sequence space wraps around, compare by the signed distance (RFC 793 3.3) */
+#define TCP_SEQ_LT(a, b)  ((int32_t)((a) - (b)) < 0)
+#define TCP_SEQ_LEQ(a, b) ((int32_t)((a) - (b)) <= 0)
+#define TCP_SEQ_GT(a, b)  ((int32_t)((a) - (b)) > 0)
+#define TCP_SEQ_GEQ(a, b) ((int32_t)((a) - (b)) >= 0)
+
 #define TCP_PCB_SIZE 16
 
 #define TCP_PCB_MODE_RFC793 1
 #define TCP_PCB_MODE_SOCKET 2
 
+#define TCP_FIN_QUEUED 1 /* sent after the data in the send buffer */
+#define TCP_FIN_SENT   2
+
 #define TCP_PCB_STATE_FREE         0
 #define TCP_PCB_STATE_CLOSED       1
 #define TCP_PCB_STATE_LISTEN       2
@@ -40,13 +53,39 @@
 #define TCP_PCB_STATE_CLOSE_WAIT  10
 #define TCP_PCB_STATE_LAST_ACK    11
 
-#define TCP_DEFAULT_RTO 200000 /* micro seconds */
+#define TCP_DEFAULT_MSS 536 /* RFC 1122 4.2.2.6 */
+#define TCP_DEFAULT_BUFSIZE 65535 /* send and receive buffers, see tcp_set_bufsize() */
+#define TCP_DEFAULT_RTO 200000 /* micro seconds, until the first RTT sample */
+#define TCP_DEFAULT_RTO_MIN 200000 /* micro seconds, see tcp_set_rto_bounds() */
+#define TCP_DEFAULT_RTO_MAX 60000000 /* RFC 6298 2.5 */
+#define TCP_CLOCK_GRANULARITY 1000 /* micro seconds, the G of RFC 6298 2 (the timer wheel) */
 #define TCP_RETRANSMIT_DEADLINE 12 /* seconds */
 #define TCP_TIMEWAIT_SEC 30 /* substitute for 2MSL */
 
+#define TCP_OPT_EOL    0
+#define TCP_OPT_NOP    1
+#define TCP_OPT_WSCALE 3 /* RFC 7323 2 */
+
+#define TCP_WSCALE_MAX 14 /* RFC 7323 2.3 */
+
+#define TCP_OOO_RANGES_MAX 16 /* out-of-order ranges held per connection (see tcp_ooo_insert()) */
+
 #define TCP_SOURCE_PORT_MIN 49152
 #define TCP_SOURCE_PORT_MAX 65535
 
+/*
+ * NOTE: A pcb belongs to a shard and is protected by the lock of the shard. A connection belongs to
+ *       the shard of its flow, i.e. the net worker its segments are steered to (see ip_hash()), so the
+ *       workers do not contend with each other. The pcbs without a flow (not yet connected, listening,
+ *       and rfc793 passive opens which become the connection) belong to an extra shard.
+ *       Locks are taken in ascending order of the shard index, the operations that need the whole
+ *       table (bind, port selection) take all of them.
+ */
+#define TCP_SHARD_NUM    (NET_WORKER_NUM + 1)
+#define TCP_SHARD_LISTEN NET_WORKER_NUM
+#define TCP_SHARD_NONE   (-1) /* free pcb */
+#define TCP_SHARD_ANY    (-2) /* for tcp_pcb_select(), all locks must be held */
+
 struct pseudo_hdr {
     uint32_t src;
     uint32_t dst;
@@ -71,8 +110,9 @@ struct tcp_segment_info {
     uint32_t seq;
     uint32_t ack;
     uint16_t len;
-    uint16_t wnd;
+    uint16_t wnd; /* as in the header, not scaled yet */
     uint16_t up;
+    int wscale; /* the window scale option (SYN only), -1 if absent */
 };
 
 struct tcp_pcb {
@@ -83,42 +123,88 @@ struct tcp_pcb {
     struct {
         uint32_t nxt;
         uint32_t una;
-        uint16_t wnd;
+        uint32_t wnd; /* scaled, in bytes */
         uint16_t up;
         uint32_t wl1;
         uint32_t wl2;
+        uint8_t wscale; /* shift applied to the windows from the peer */
+        uint32_t max; /* the highest sequence number sent, only new data is timed */
     } snd;
     uint32_t iss;
     struct {
         uint32_t nxt;
-        uint16_t wnd;
+        uint32_t wnd; /* in bytes, advertised shifted right by wscale */
         uint16_t up;
+        uint8_t wscale; /* shift the peer applies to our windows */
     } rcv;
+    int wscale_on; /* the window scale option goes in our SYN, i.e. active open or offered by the peer */
     uint32_t irs;
     uint16_t mtu;
     uint16_t mss;
-    uint8_t buf[65535]; /* receive buffer */
+    uint8_t *buf; /* receive buffer (ring), the free space is RCV.WND */
+    uint32_t bufsize;
+    uint32_t head; /* position of the data not read yet in the buf */
+    struct {
+        uint32_t start;
+        uint32_t end;
+    } ooo[TCP_OOO_RANGES_MAX]; /* out-of-order data in the buf, sorted and not adjacent to each other */
+    int ooo_num;
+    uint8_t *sbuf; /* send buffer (ring), the data from SND.UNA, sent or not */
+    uint32_t sbufsize;
+    uint32_t shead; /* position of SND.UNA in the sbuf */
+    size_t slen; /* bytes in the sbuf */
+    uint32_t cwnd; /* congestion window (RFC 5681), in bytes, 0 until the first data is sent */
+    uint32_t ssthresh;
+    int fin; /* TCP_FIN_QUEUED or TCP_FIN_SENT, after the user closed */
+    unsigned int rto; /* micro seconds, backed off on every retransmission */
+    unsigned int rto_min; /* micro seconds, see tcp_set_rto_bounds() */
+    unsigned int rto_max;
+    struct {
+        int timing; /* a segment is being timed */
+        int backoff; /* the RTO has been backed off, kept until SND.UNA advances (the first sample if none yet) */
+        uint32_t seq; /* the end of the timed segment */
+        uint64_t start; /* micro seconds */
+        unsigned int srtt; /* micro seconds, valid once sampled */
+        unsigned int rttvar;
+        unsigned int last;
+        unsigned int min;
+        unsigned long samples;
+        unsigned long retransmits;
+    } rtt;
+    uint64_t rtx_since; /* milliseconds, the first retransmission of SND.UNA (0: none) */
     struct sched_ctx ctx;
-    struct queue_head queue; /* retransmit queue */
-    struct timeval tw_timer;
-    struct tcp_pcb *parent;
+    struct timer_entry rto_timer; /* retransmit, and probe the zero window */
+    struct timer_entry tw_timer; /* TIME-WAIT */
+    struct tcp_pcb *parent; /* NOTE: written under the listen shard mutex once the pcb is allocated */
     struct queue_head backlog;
+    struct queue_entry link; /* for the parent's backlog */
+    int orphan; /* the listener has gone, aborted on its own worker */
+    int shard; /* NOTE: must be the last member, see tcp_pcb_release() */
 };
 
-struct tcp_queue_entry {
-    struct timeval first;
-    struct timeval last;
-    unsigned int rto; /* micro seconds */
-    uint32_t seq;
-    uint8_t flg;
-    size_t len;
+struct tcp_stack {
+    mutex_t mutexes[TCP_SHARD_NUM];
+    struct tcp_pcb pcbs[TCP_PCB_SIZE];
 };
 
-static mutex_t mutex = MUTEX_INITIALIZER;
-static struct tcp_pcb pcbs[TCP_PCB_SIZE];
+static struct tcp_stack *
+tcp_stack(void)
+{
+    return net_stack_priv(NET_STACK_PRIV_TCP);
+}
 
 static ssize_t
 tcp_output_segment(uint32_t seq, uint32_t ack, uint8_t flg, uint16_t wnd, uint8_t *data, size_t len, struct ip_endpoint *local, struct ip_endpoint *foreign);
+static ssize_t
+tcp_output_data(struct tcp_pcb *pcb, size_t off, size_t len, uint8_t flg);
+static ssize_t
+tcp_output(struct tcp_pcb *pcb, uint8_t flg);
+static void
+tcp_output_pending(struct tcp_pcb *pcb);
+static void
+tcp_retransmit_timer(void *arg);
+static void
+tcp_timewait_timer(void *arg);
 
 static char *
 tcp_flg_ntoa(uint8_t flg)
@@ -136,52 +222,158 @@ tcp_flg_ntoa(uint8_t flg)
 }
 
 static void
-tcp_dump(const uint8_t *data, size_t len)
+tcp_dump(FILE *fp, const void *data, size_t len)
 {
     struct tcp_hdr *hdr;
 
-    flockfile(stderr);
+    flockfile(fp);
     hdr = (struct tcp_hdr *)data;
-    fprintf(stderr, "        src: %u\n", ntoh16(hdr->src));
-    fprintf(stderr, "        dst: %u\n", ntoh16(hdr->dst));
-    fprintf(stderr, "        seq: %u\n", ntoh32(hdr->seq));
-    fprintf(stderr, "        ack: %u\n", ntoh32(hdr->ack));
-    fprintf(stderr, "        off: 0x%02x (%d)\n", hdr->off, (hdr->off >> 4) << 2);
-    fprintf(stderr, "        flg: 0x%02x (%s)\n", hdr->flg, tcp_flg_ntoa(hdr->flg));
-    fprintf(stderr, "        wnd: %u\n", ntoh16(hdr->wnd));
-    fprintf(stderr, "        sum: 0x%04x\n", ntoh16(hdr->sum));
-    fprintf(stderr, "         up: %u\n", ntoh16(hdr->up));
+    fprintf(fp, "        src: %u\n", ntoh16(hdr->src));
+    fprintf(fp, "        dst: %u\n", ntoh16(hdr->dst));
+    fprintf(fp, "        seq: %u\n", ntoh32(hdr->seq));
+    fprintf(fp, "        ack: %u\n", ntoh32(hdr->ack));
+    fprintf(fp, "        off: 0x%02x (%d)\n", hdr->off, (hdr->off >> 4) << 2);
+    fprintf(fp, "        flg: 0x%02x (%s)\n", hdr->flg, tcp_flg_ntoa(hdr->flg));
+    fprintf(fp, "        wnd: %u\n", ntoh16(hdr->wnd));
+    fprintf(fp, "        sum: 0x%04x\n", ntoh16(hdr->sum));
+    fprintf(fp, "         up: %u\n", ntoh16(hdr->up));
 #ifdef HEXDUMP
-    hexdump(stderr, data, len);
+    hexdump(fp, data, len);
 #endif
-    funlockfile(stderr);
+    funlockfile(fp);
 }
 
 /*
  * TCP Protocol Control Block (PCB)
  *
- * NOTE: TCP PCB functions must be called after mutex locked
+ * NOTE: TCP PCB functions must be called after the mutex of the shard locked
  */
 
+static int
+tcp_pcb_shard(struct tcp_pcb *pcb)
+{
+    return __atomic_load_n(&pcb->shard, __ATOMIC_ACQUIRE);
+}
+
+static int
+tcp_flow_shard(struct ip_endpoint *local, struct ip_endpoint *foreign)
+{
+    /* NOTE: the same tuple as the steering of the incoming segments (src: foreign, dst: local) */
+    return net_worker_select(ip_flow_hash(foreign->addr, local->addr, foreign->port, local->port));
+}
+
+static void
+tcp_lock_all(void)
+{
+    struct tcp_stack *tcp = tcp_stack();
+    mutex_t *mutex;
+
+    for (mutex = tcp->mutexes; mutex < tailof(tcp->mutexes); mutex++) {
+        mutex_lock(mutex);
+    }
+}
+
+static void
+tcp_unlock_all(mutex_t *keep)
+{
+    struct tcp_stack *tcp = tcp_stack();
+    mutex_t *mutex;
+
+    for (mutex = tcp->mutexes; mutex < tailof(tcp->mutexes); mutex++) {
+        if (mutex != keep) {
+            mutex_unlock(mutex);
+        }
+    }
+}
+
+/* NOTE: returns the mutex of the shard the pcb belongs to (locked), NULL if the pcb is free */
+static mutex_t *
+tcp_pcb_lock(struct tcp_pcb *pcb)
+{
+    struct tcp_stack *tcp = tcp_stack();
+    mutex_t *mutex;
+    int shard;
+
+    while ((shard = tcp_pcb_shard(pcb)) != TCP_SHARD_NONE) {
+        mutex = &tcp->mutexes[shard];
+        mutex_lock(mutex);
+        if (tcp_pcb_shard(pcb) == shard) {
+            return mutex;
+        }
+        /* moved (or released) while waiting for the lock */
+        mutex_unlock(mutex);
+    }
+    return NULL;
+}
+
+static void
+tcp_pcb_bind_timers(struct tcp_pcb *pcb, int shard)
+{
+    timer_entry_init(&pcb->rto_timer, net_worker_wheel(shard), tcp_retransmit_timer, pcb);
+    timer_entry_init(&pcb->tw_timer, net_worker_wheel(shard), tcp_timewait_timer, pcb);
+}
+
 static struct tcp_pcb *
-tcp_pcb_alloc(void)
+tcp_pcb_alloc(int shard)
 {
+    struct tcp_stack *tcp = tcp_stack();
     struct tcp_pcb *pcb;
+    int expected;
 
-    for (pcb = pcbs; pcb < tailof(pcbs); pcb++) {
-        if (pcb->state == TCP_PCB_STATE_FREE) {
+    for (pcb = tcp->pcbs; pcb < tailof(tcp->pcbs); pcb++) {
+        expected = TCP_SHARD_NONE;
+        if (__atomic_compare_exchange_n(&pcb->shard, &expected, shard, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
             pcb->state = TCP_PCB_STATE_CLOSED;
+            pcb->bufsize = TCP_DEFAULT_BUFSIZE;
+            pcb->sbufsize = TCP_DEFAULT_BUFSIZE;
+            pcb->rto = TCP_DEFAULT_RTO;
+            pcb->rto_min = TCP_DEFAULT_RTO_MIN;
+            pcb->rto_max = TCP_DEFAULT_RTO_MAX;
+            pcb->ssthresh = UINT32_MAX; /* RFC 5681 3.1, arbitrarily high */
             sched_ctx_init(&pcb->ctx);
+            tcp_pcb_bind_timers(pcb, shard);
             return pcb;
         }
     }
     return NULL;
 }
 
+/* NOTE: must be called after all tcp->mutexes locked, and before any timer of the pcb is armed */
+static void
+tcp_pcb_move(struct tcp_pcb *pcb, int shard)
+{
+    tcp_pcb_bind_timers(pcb, shard);
+    __atomic_store_n(&pcb->shard, shard, __ATOMIC_RELEASE);
+}
+
+/*
+ * NOTE: allocates the buffers (sized by the user, see tcp_set_bufsize()) before the SYN is sent, the receive
+ *       window and the shift which fits it into the 16-bit window field (RFC 7323 2.3) follow from the size
+ */
+static int
+tcp_pcb_alloc_buffers(struct tcp_pcb *pcb)
+{
+    pcb->buf = memory_alloc_nozero(pcb->bufsize);
+    pcb->sbuf = memory_alloc_nozero(pcb->sbufsize);
+    if (!pcb->buf || !pcb->sbuf) {
+        errorf("memory_alloc() failure");
+        memory_free(pcb->buf);
+        memory_free(pcb->sbuf);
+        pcb->buf = pcb->sbuf = NULL;
+        return -1;
+    }
+    pcb->rcv.wnd = pcb->bufsize;
+    pcb->rcv.wscale = 0;
+    while (((uint32_t)UINT16_MAX << pcb->rcv.wscale) < pcb->bufsize && pcb->rcv.wscale < TCP_WSCALE_MAX) {
+        pcb->rcv.wscale++;
+    }
+    return 0;
+}
+
 static void
 tcp_pcb_release(struct tcp_pcb *pcb)
 {
-    struct queue_entry *entry;
+    struct tcp_stack *tcp = tcp_stack();
     struct tcp_pcb *est;
     char ep1[IP_ENDPOINT_STR_LEN];
     char ep2[IP_ENDPOINT_STR_LEN];
@@ -190,23 +382,41 @@ tcp_pcb_release(struct tcp_pcb *pcb)
         sched_wakeup(&pcb->ctx);
         return;
     }
-    while ((entry = queue_pop(&pcb->queue)) != NULL) {
-        memory_free(entry);
+    timer_cancel(&pcb->rto_timer);
+    timer_cancel(&pcb->tw_timer);
+    if (__atomic_load_n(&pcb->parent, __ATOMIC_ACQUIRE)) {
+        /* NOTE: not accepted yet, may still be linked on the backlog of the listener (greater shard index) */
+        mutex_lock(&tcp->mutexes[TCP_SHARD_LISTEN]);
+        if (pcb->parent) {
+            queue_remove(&pcb->parent->backlog, &pcb->link);
+        }
+        mutex_unlock(&tcp->mutexes[TCP_SHARD_LISTEN]);
     }
-    while ((est = queue_pop(&pcb->backlog)) != NULL) {
-        tcp_pcb_release(est);
+    while ((est = queue_data(queue_pop(&pcb->backlog), struct tcp_pcb, link)) != NULL) {
+        /* NOTE: belongs to the shard of its flow (not locked here), aborted on its own worker */
+        __atomic_store_n(&est->parent, NULL, __ATOMIC_RELEASE);
+        __atomic_store_n(&est->orphan, 1, __ATOMIC_RELEASE);
+        timer_arm(&est->tw_timer, 0);
     }
     debugf("released, local=%s, foreign=%s",
         ip_endpoint_ntop(&pcb->local, ep1, sizeof(ep1)), ip_endpoint_ntop(&pcb->foreign, ep2, sizeof(ep2)));
-    memset(pcb, 0, sizeof(*pcb));
+    memory_free(pcb->buf);
+    memory_free(pcb->sbuf);
+    /* NOTE: the shard is cleared last, the slot can be allocated by another shard right after */
+    memset(pcb, 0, offsetof(struct tcp_pcb, shard));
+    __atomic_store_n(&pcb->shard, TCP_SHARD_NONE, __ATOMIC_RELEASE);
 }
 
 static struct tcp_pcb *
-tcp_pcb_select(struct ip_endpoint *local, struct ip_endpoint *foreign)
+tcp_pcb_select(int shard, struct ip_endpoint *local, struct ip_endpoint *foreign)
 {
+    struct tcp_stack *tcp = tcp_stack();
     struct tcp_pcb *pcb, *listen_pcb = NULL;
 
-    for (pcb = pcbs; pcb < tailof(pcbs); pcb++) {
+    for (pcb = tcp->pcbs; pcb < tailof(tcp->pcbs); pcb++) {
+        if (shard != TCP_SHARD_ANY && tcp_pcb_shard(pcb) != shard) {
+            continue;
+        }
         if ((pcb->local.addr == IP_ADDR_ANY || pcb->local.addr == local->addr) && pcb->local.port == local->port) {
             if (!foreign) {
                 return pcb;
@@ -225,17 +435,42 @@ tcp_pcb_select(struct ip_endpoint *local, struct ip_endpoint *foreign)
     return listen_pcb;
 }
 
+/* NOTE: the caller must hold the tcp->mutexes (all, or the one of the shard) */
 static struct tcp_pcb *
-tcp_pcb_get(int id)
+tcp_pcb_lookup(int id)
 {
+    struct tcp_stack *tcp = tcp_stack();
     struct tcp_pcb *pcb;
 
-    if (id < 0 || id >= (int)countof(pcbs)) {
+    if (id < 0 || id >= (int)countof(tcp->pcbs)) {
         /* out of range */
         return NULL;
     }
-    pcb = &pcbs[id];
+    pcb = &tcp->pcbs[id];
+    if (tcp_pcb_shard(pcb) == TCP_SHARD_NONE || pcb->state == TCP_PCB_STATE_FREE) {
+        return NULL;
+    }
+    return pcb;
+}
+
+/* NOTE: returns the pcb with the mutex of its shard locked */
+static struct tcp_pcb *
+tcp_pcb_get(int id, mutex_t **mutex)
+{
+    struct tcp_stack *tcp = tcp_stack();
+    struct tcp_pcb *pcb;
+
+    if (id < 0 || id >= (int)countof(tcp->pcbs)) {
+        /* out of range */
+        return NULL;
+    }
+    pcb = &tcp->pcbs[id];
+    *mutex = tcp_pcb_lock(pcb);
+    if (!*mutex) {
+        return NULL;
+    }
     if (pcb->state == TCP_PCB_STATE_FREE) {
+        mutex_unlock(*mutex);
         return NULL;
     }
     return pcb;
@@ -244,151 +479,708 @@ tcp_pcb_get(int id)
 static int
 tcp_pcb_id(struct tcp_pcb *pcb)
 {
-    return indexof(pcbs, pcb);
+    struct tcp_stack *tcp = tcp_stack();
+    return indexof(tcp->pcbs, pcb);
+}
+
+/*
+ * TCP Ring
+ *
+ * NOTE: the send and receive buffers are rings, a region in them is copied in at most two parts
+ */
+
+static size_t
+tcp_ring_pos(size_t size, size_t pos, size_t off)
+{
+    pos += off;
+    if (pos >= size) {
+        pos -= size;
+    }
+    return pos;
+}
+
+static void
+tcp_ring_write(uint8_t *ring, size_t size, size_t pos, const uint8_t *data, size_t len)
+{
+    size_t n;
+
+    n = MIN(len, size - pos);
+    memcpy(ring + pos, data, n);
+    memcpy(ring, data + n, len - n);
+}
+
+static void
+tcp_ring_read(const uint8_t *ring, size_t size, size_t pos, uint8_t *buf, size_t len)
+{
+    size_t n;
+
+    n = MIN(len, size - pos);
+    memcpy(buf, ring + pos, n);
+    memcpy(buf + n, ring, len - n);
+}
+
+/* NOTE: the MSS in effect, the default until the path MTU is taken (see tcp_send()) */
+static size_t
+tcp_mss(struct tcp_pcb *pcb)
+{
+    return pcb->mss ? pcb->mss : TCP_DEFAULT_MSS;
+}
+
+/*
+ * TCP Send Buffer
+ *
+ * NOTE: The send buffer is a ring holding the data from SND.UNA, both in flight and not sent yet. The
+ *       user only appends to it (see tcp_send()), the segments are cut out of it when the window allows
+ *       (see tcp_output_pending()) and retransmitted from it, the data leaves it when acknowledged.
+ * NOTE: TCP Send Buffer functions must be called after mutex locked
+ */
+
+/* NOTE: the sequence number of the first byte in the send buffer (SND.UNA, or the one after the SYN) */
+static uint32_t
+tcp_sbuf_seq(struct tcp_pcb *pcb)
+{
+    return pcb->snd.una == pcb->iss ? pcb->snd.una + 1 : pcb->snd.una;
+}
+
+static size_t
+tcp_sbuf_append(struct tcp_pcb *pcb, const uint8_t *data, size_t len)
+{
+    len = MIN(len, pcb->sbufsize - pcb->slen);
+    tcp_ring_write(pcb->sbuf, pcb->sbufsize, tcp_ring_pos(pcb->sbufsize, pcb->shead, pcb->slen), data, len);
+    pcb->slen += len;
+    return len;
+}
+
+static void
+tcp_sbuf_consume(struct tcp_pcb *pcb, size_t len)
+{
+    pcb->shead = tcp_ring_pos(pcb->sbufsize, pcb->shead, len);
+    pcb->slen -= len;
+}
+
+/*
+ * TCP Congestion Control
+ *
+ * NOTE: RFC 5681 slow start and congestion avoidance, the data in flight is bounded by the congestion
+ *       window as well as the send window, so a large buffer (see tcp_set_bufsize()) is not sent out in
+ *       one burst the path (or the input queue of the local stack) has no room for. The window starts
+ *       at IW, grows by up to an MSS per ACK in slow start and by about an MSS per RTT above ssthresh,
+ *       and goes back to one MSS on a retransmission timeout. No fast retransmit (RFC 5681 3.2).
+ * NOTE: TCP Congestion Control functions must be called after mutex locked
+ */
+
+/* NOTE: the initial window, RFC 5681 3.1 */
+static uint32_t
+tcp_cwnd_initial(struct tcp_pcb *pcb)
+{
+    size_t mss;
+
+    mss = tcp_mss(pcb);
+    if (mss > 2190) {
+        return 2 * mss;
+    }
+    if (mss > 1095) {
+        return 3 * mss;
+    }
+    return 4 * mss;
+}
+
+/* NOTE: SND.UNA has advanced by acked bytes */
+static void
+tcp_cwnd_ack(struct tcp_pcb *pcb, uint32_t acked)
+{
+    size_t mss;
+    uint32_t inc;
+
+    if (!pcb->cwnd) {
+        return;
+    }
+    mss = tcp_mss(pcb);
+    if (pcb->cwnd < pcb->ssthresh) {
+        inc = MIN(acked, mss); /* slow start, RFC 5681 (2) */
+    } else {
+        inc = MAX(mss * mss / pcb->cwnd, 1); /* congestion avoidance, RFC 5681 (3) */
+    }
+    /* NOTE: nothing more than the send buffer can be in flight */
+    pcb->cwnd = MIN(pcb->cwnd + inc, MAX(pcb->sbufsize, tcp_cwnd_initial(pcb)));
+}
+
+/* NOTE: the retransmission timer has fired, flight is what was in flight at the first timeout of SND.UNA */
+static void
+tcp_cwnd_timeout(struct tcp_pcb *pcb, uint32_t flight, int first)
+{
+    size_t mss;
+
+    if (!pcb->cwnd) {
+        /* NOTE: the SYN, no data sent yet */
+        return;
+    }
+    mss = tcp_mss(pcb);
+    if (first) {
+        /* NOTE: RFC 5681 (4), not lowered again while the retransmission is lost too */
+        pcb->ssthresh = MAX(flight / 2, 2 * mss);
+    }
+    pcb->cwnd = mss; /* the loss window */
 }
 
 /*
  * TCP Retransmit
  *
+ * NOTE: A single timer per connection (RFC 6298 5), armed while anything is in flight and restarted
+ *       when an ACK advances SND.UNA. On expiry SND.NXT goes back to SND.UNA and everything in flight is
+ *       sent again out of the send buffer (go-back-N), so several losses in a window are recovered in one
+ *       timeout rather than one segment per timeout; the timer is backed off. An ACK for data sent before
+ *       the timeout brings SND.NXT forward again. While the window is zero and nothing is in flight, the
+ *       same timer sends one byte beyond the window to probe it.
+ * NOTE: The RTO follows the RTT of the connection (RFC 6298 2). One segment of new data at a time is
+ *       timed, from its transmission to the ACK covering it. Karn's rule: the measurement is dropped on a
+ *       timeout and not started again until an ACK for new data ends the backoff, so a sample never
+ *       comes from a retransmitted segment. The backoff only lasts over consecutive timeouts of the same
+ *       SND.UNA, an ACK advancing it brings the RTO back to the estimate, or every later loss would double
+ *       it again. Before the first sample there is no estimate, the backed-off RTO is kept until one is
+ *       taken (RFC 6298 5.5), or a path slower than the initial RTO would never be sampled.
  * NOTE: TCP Retransmit functions must be called after mutex locked
  */
 
-static int
-tcp_retransmit_queue_add(struct tcp_pcb *pcb, uint32_t seq, uint8_t flg, uint8_t *data, size_t len)
+static void
+tcp_rtt_start(struct tcp_pcb *pcb, uint32_t seq)
 {
-    struct tcp_queue_entry *entry;
+    if (pcb->rtt.timing || pcb->rtx_since) {
+        return;
+    }
+    pcb->rtt.timing = 1;
+    pcb->rtt.seq = seq;
+    pcb->rtt.start = timer_now_usec();
+}
 
-    entry = memory_alloc(sizeof(*entry) + len);
-    if (!entry) {
-        errorf("memory_alloc() failure");
-        return -1;
+static void
+tcp_rtt_sample(struct tcp_pcb *pcb, uint32_t ack)
+{
+    unsigned int r, delta;
+
+    if (!pcb->rtt.timing || TCP_SEQ_LT(ack, pcb->rtt.seq)) {
+        return;
     }
-    entry->rto = TCP_DEFAULT_RTO;
-    entry->seq = seq;
-    entry->flg = flg;
-    entry->len = len;
-    memcpy(entry + 1, data, entry->len);
-    gettimeofday(&entry->first, NULL);
-    entry->last = entry->first;
-    if (!queue_push(&pcb->queue, entry)) {
-        errorf("queue_push() failure");
-        memory_free(entry);
-        return -1;
+    pcb->rtt.timing = 0;
+    r = MIN(timer_now_usec() - pcb->rtt.start, TCP_RTO_MAX);
+    if (!pcb->rtt.samples) {
+        pcb->rtt.srtt = r;
+        pcb->rtt.rttvar = r / 2;
+        pcb->rtt.min = r;
+    } else {
+        delta = pcb->rtt.srtt > r ? pcb->rtt.srtt - r : r - pcb->rtt.srtt;
+        pcb->rtt.rttvar = (3 * pcb->rtt.rttvar + delta) / 4;
+        pcb->rtt.srtt = (7 * pcb->rtt.srtt + r) / 8;
+        pcb->rtt.min = MIN(pcb->rtt.min, r);
+    }
+    pcb->rtt.last = r;
+    pcb->rtt.samples++;
+    pcb->rtt.backoff = 0;
+    debugf("rtt=%u, srtt=%u, rttvar=%u (micro seconds)", r, pcb->rtt.srtt, pcb->rtt.rttvar);
+}
+
+/* NOTE: the RTO without backoff, RTO = SRTT + max(G, 4 * RTTVAR) within the bounds */
+static unsigned int
+tcp_rto_base(struct tcp_pcb *pcb)
+{
+    unsigned int rto;
+
+    rto = TCP_DEFAULT_RTO;
+    if (pcb->rtt.samples) {
+        rto = pcb->rtt.srtt + MAX(TCP_CLOCK_GRANULARITY, 4 * pcb->rtt.rttvar);
     }
-    return 0;
+    return MIN(MAX(rto, pcb->rto_min), pcb->rto_max);
 }
 
+/* NOTE: SND.UNA advances to the ack, the acknowledged data leaves the send buffer */
 static void
-tcp_retransmit_queue_cleanup(struct tcp_pcb *pcb)
+tcp_retransmit_ack(struct tcp_pcb *pcb, uint32_t ack)
 {
-    struct tcp_queue_entry *entry;
+    uint32_t seq;
 
-    while ((entry = queue_peek(&pcb->queue))) {
-        if (entry->seq >= pcb->snd.una) {
-            break;
-        }
-        entry = queue_pop(&pcb->queue);
-        debugf("remove, seq=%u, flags=%s, len=%u", entry->seq, tcp_flg_ntoa(entry->flg), entry->len);
-        memory_free(entry);
+    seq = tcp_sbuf_seq(pcb);
+    if (TCP_SEQ_GT(ack, seq)) {
+        tcp_sbuf_consume(pcb, MIN(ack - seq, pcb->slen));
+    }
+    tcp_cwnd_ack(pcb, ack - pcb->snd.una);
+    pcb->snd.una = ack;
+    tcp_rtt_sample(pcb, ack);
+    if (pcb->rtt.samples) {
+        /* NOTE: SND.UNA has moved past the segment timed out, the estimate holds again */
+        pcb->rtt.backoff = 0;
+    }
+    if (!pcb->rtt.backoff) {
+        pcb->rto = tcp_rto_base(pcb);
+    }
+    pcb->rtx_since = 0;
+    if (pcb->snd.una == pcb->snd.nxt) {
+        timer_cancel(&pcb->rto_timer);
+    } else {
+        timer_arm(&pcb->rto_timer, pcb->rto / 1000);
+    }
+    /* NOTE: for the sender waiting for room in the send buffer */
+    sched_wakeup(&pcb->ctx);
+}
+
+/* NOTE: SND.NXT goes back to SND.UNA, the data in flight (and the FIN) is sent again by tcp_output_pending() */
+static void
+tcp_retransmit_rewind(struct tcp_pcb *pcb)
+{
+    pcb->snd.nxt = tcp_sbuf_seq(pcb);
+    pcb->rtt.timing = 0;
+    if (pcb->fin == TCP_FIN_SENT) {
+        pcb->fin = TCP_FIN_QUEUED;
     }
-    return;
 }
 
+/* NOTE: the ACK is beyond SND.NXT gone back, the data up to it has arrived from an earlier transmission */
 static void
-tcp_retransmit_queue_emit(void *arg, void *data)
+tcp_retransmit_forward(struct tcp_pcb *pcb, uint32_t ack)
+{
+    if (TCP_SEQ_LEQ(ack, pcb->snd.nxt) || TCP_SEQ_GT(ack, pcb->snd.max)) {
+        return;
+    }
+    pcb->snd.nxt = ack;
+    if (pcb->fin == TCP_FIN_QUEUED && ack - tcp_sbuf_seq(pcb) > pcb->slen) {
+        pcb->fin = TCP_FIN_SENT;
+    }
+}
+
+/* NOTE: zero window probe, one byte beyond the window, retransmitted (backed off) until the window opens */
+static void
+tcp_retransmit_probe(struct tcp_pcb *pcb)
+{
+    debugf("zero window probe");
+    tcp_output_data(pcb, 0, 1, TCP_FLG_ACK);
+    pcb->snd.nxt++;
+    timer_arm(&pcb->rto_timer, pcb->rto / 1000);
+}
+
+static void
+tcp_retransmit(struct tcp_pcb *pcb)
+{
+    switch (pcb->state) {
+    case TCP_PCB_STATE_SYN_SENT:
+        tcp_output(pcb, TCP_FLG_SYN);
+        return;
+    case TCP_PCB_STATE_SYN_RECEIVED:
+        tcp_output(pcb, TCP_FLG_SYN | TCP_FLG_ACK);
+        return;
+    }
+    tcp_retransmit_rewind(pcb);
+    tcp_output_pending(pcb);
+    if (pcb->snd.una == pcb->snd.nxt && pcb->slen && !pcb->snd.wnd) {
+        /* NOTE: the window has closed meanwhile, nothing can be sent but the probe */
+        tcp_retransmit_probe(pcb);
+    }
+}
+
+static void
+tcp_retransmit_timer(void *arg)
 {
     struct tcp_pcb *pcb;
-    struct tcp_queue_entry *entry;
-    struct timeval now, diff, timeout;
+    uint64_t now;
+    int first;
+    mutex_t *mutex;
 
     pcb = (struct tcp_pcb *)arg;
-    entry = (struct tcp_queue_entry *)data;
-    gettimeofday(&now, NULL);
-    timersub(&now, &entry->first, &diff);
-    if (diff.tv_sec >= TCP_RETRANSMIT_DEADLINE) {
+    mutex = tcp_pcb_lock(pcb);
+    if (!mutex) {
+        return;
+    }
+    if (pcb->state == TCP_PCB_STATE_FREE || pcb->state == TCP_PCB_STATE_CLOSED) {
+        mutex_unlock(mutex);
+        return;
+    }
+    if (pcb->snd.una == pcb->snd.nxt) {
+        if (pcb->slen && !pcb->snd.wnd) {
+            tcp_retransmit_probe(pcb);
+        }
+        mutex_unlock(mutex);
+        return;
+    }
+    now = timer_now();
+    first = !pcb->rtx_since;
+    if (first) {
+        pcb->rtx_since = now;
+    } else if (now - pcb->rtx_since >= TCP_RETRANSMIT_DEADLINE * 1000) {
         pcb->state = TCP_PCB_STATE_CLOSED;
         sched_wakeup(&pcb->ctx);
+        mutex_unlock(mutex);
         return;
     }
-    timeout = entry->last;
-    timeval_add_usec(&timeout, entry->rto);
-    if (timercmp(&now, &timeout, >)) {
-        tcp_output_segment(entry->seq, pcb->rcv.nxt, entry->flg, pcb->rcv.wnd, (uint8_t *)(entry+1), entry->len, &pcb->local, &pcb->foreign);
-        entry->last = now;
-        entry->rto *= 2;
+    tcp_cwnd_timeout(pcb, pcb->snd.nxt - pcb->snd.una, first);
+    /* NOTE: Karn's rule, the ACK may be for either transmission */
+    pcb->rtt.timing = 0;
+    pcb->rtt.backoff = 1;
+    pcb->rtt.retransmits++;
+    tcp_retransmit(pcb);
+    pcb->rto = MIN(pcb->rto * 2, pcb->rto_max);
+    timer_arm(&pcb->rto_timer, pcb->rto / 1000);
+    mutex_unlock(mutex);
+}
+
+static void
+tcp_timewait_timer(void *arg)
+{
+    struct tcp_pcb *pcb;
+    char ep1[IP_ENDPOINT_STR_LEN];
+    char ep2[IP_ENDPOINT_STR_LEN];
+    mutex_t *mutex;
+
+    pcb = (struct tcp_pcb *)arg;
+    mutex = tcp_pcb_lock(pcb);
+    if (!mutex) {
+        return;
     }
+    if (pcb->state == TCP_PCB_STATE_TIME_WAIT) {
+        debugf("timewait has elapsed, local=%s, foreign=%s",
+            ip_endpoint_ntop(&pcb->local, ep1, sizeof(ep1)), ip_endpoint_ntop(&pcb->foreign, ep2, sizeof(ep2)));
+        tcp_pcb_release(pcb);
+    } else if (__atomic_load_n(&pcb->orphan, __ATOMIC_ACQUIRE)) {
+        debugf("listener has gone, local=%s, foreign=%s",
+            ip_endpoint_ntop(&pcb->local, ep1, sizeof(ep1)), ip_endpoint_ntop(&pcb->foreign, ep2, sizeof(ep2)));
+        pcb->state = TCP_PCB_STATE_CLOSED;
+        tcp_pcb_release(pcb);
+    }
+    mutex_unlock(mutex);
 }
 
 static void
 tcp_set_timewait_timer(struct tcp_pcb *pcb)
 {
-    gettimeofday(&pcb->tw_timer, NULL);
-    pcb->tw_timer.tv_sec += TCP_TIMEWAIT_SEC;
+    timer_arm(&pcb->tw_timer, TCP_TIMEWAIT_SEC * 1000);
     debugf("start time_wait timer: %d seconds", TCP_TIMEWAIT_SEC);
 }
 
+/*
+ * TCP Receive Buffer
+ *
+ * NOTE: The receive buffer is a ring, the data not read yet starts at the head and its length is the
+ *       size of the buf minus RCV.WND, so a read copies out at most two regions and nothing is moved.
+ * NOTE: TCP Receive Buffer functions must be called after mutex locked
+ */
+
+/* NOTE: writes at the offset from the tail (the end of the data not read yet), off + len must fit RCV.WND */
+static void
+tcp_rbuf_write(struct tcp_pcb *pcb, size_t off, const uint8_t *data, size_t len)
+{
+    size_t pos;
+
+    pos = tcp_ring_pos(pcb->bufsize, pcb->head, (pcb->bufsize - pcb->rcv.wnd) + off);
+    tcp_ring_write(pcb->buf, pcb->bufsize, pos, data, len);
+}
+
+/* NOTE: len must not exceed the data not read yet */
+static void
+tcp_rbuf_read(struct tcp_pcb *pcb, uint8_t *buf, size_t len)
+{
+    tcp_ring_read(pcb->buf, pcb->bufsize, pcb->head, buf, len);
+    pcb->head = tcp_ring_pos(pcb->bufsize, pcb->head, len);
+    pcb->rcv.wnd += len;
+}
+
+/*
+ * TCP Out-of-order Reassembly
+ *
+ * NOTE: A segment beyond RCV.NXT is copied into the receive buffer at the position its sequence number
+ *       will take, so the data held out of order needs no memory other than the buffer (bounded by the
+ *       window), and nothing is copied again when the gap fills. Only the ranges are kept, as an array
+ *       sorted by the sequence number (offsets from RCV.NXT, wrap-safe), merged when overlapping or
+ *       adjacent. When the array is full the segment is dropped, the peer retransmits it.
+ * NOTE: TCP Reassembly functions must be called after mutex locked
+ */
+
+static int
+tcp_ooo_insert(struct tcp_pcb *pcb, uint32_t start, uint32_t end)
+{
+    uint32_t s, e;
+    int i, j;
+
+    s = start - pcb->rcv.nxt;
+    e = end - pcb->rcv.nxt;
+    for (i = 0; i < pcb->ooo_num; i++) {
+        if (pcb->ooo[i].end - pcb->rcv.nxt >= s) {
+            break;
+        }
+    }
+    for (j = i; j < pcb->ooo_num; j++) {
+        if (pcb->ooo[j].start - pcb->rcv.nxt > e) {
+            break;
+        }
+        s = MIN(s, pcb->ooo[j].start - pcb->rcv.nxt);
+        e = MAX(e, pcb->ooo[j].end - pcb->rcv.nxt);
+    }
+    if (i == j) {
+        /* not merged */
+        if (pcb->ooo_num == TCP_OOO_RANGES_MAX) {
+            return -1;
+        }
+        memmove(&pcb->ooo[i+1], &pcb->ooo[i], sizeof(pcb->ooo[0]) * (pcb->ooo_num - i));
+        pcb->ooo_num++;
+    } else {
+        memmove(&pcb->ooo[i+1], &pcb->ooo[j], sizeof(pcb->ooo[0]) * (pcb->ooo_num - j));
+        pcb->ooo_num -= j - i - 1;
+    }
+    pcb->ooo[i].start = pcb->rcv.nxt + s;
+    pcb->ooo[i].end = pcb->rcv.nxt + e;
+    return 0;
+}
+
+/* NOTE: advances RCV.NXT over the ranges the in-order data has reached */
+static void
+tcp_ooo_pull(struct tcp_pcb *pcb)
+{
+    int i;
+
+    for (i = 0; i < pcb->ooo_num; i++) {
+        if (TCP_SEQ_GT(pcb->ooo[i].start, pcb->rcv.nxt)) {
+            break;
+        }
+        if (TCP_SEQ_GT(pcb->ooo[i].end, pcb->rcv.nxt)) {
+            pcb->rcv.nxt = pcb->ooo[i].end;
+        }
+    }
+    memmove(&pcb->ooo[0], &pcb->ooo[i], sizeof(pcb->ooo[0]) * (pcb->ooo_num - i));
+    pcb->ooo_num -= i;
+}
+
+/*
+ * NOTE: stores the segment text into the receive buffer (trimmed to the window), returns the number of
+ *       bytes that became available to the user, 0 if the text is held out of order (or a duplicate)
+ */
+static size_t
+tcp_segment_text(struct tcp_pcb *pcb, uint32_t seq, uint8_t *data, size_t len)
+{
+    uint32_t nxt, off;
+
+    off = seq - pcb->rcv.nxt;
+    if ((int32_t)off < 0) {
+        /* already received in part */
+        if (len <= -off) {
+            return 0;
+        }
+        data += -off;
+        len -= -off;
+        off = 0;
+    }
+    if (off >= pcb->rcv.wnd) {
+        return 0;
+    }
+    len = MIN(len, pcb->rcv.wnd - off);
+    tcp_rbuf_write(pcb, off, data, len);
+    if (off) {
+        if (tcp_ooo_insert(pcb, pcb->rcv.nxt + off, pcb->rcv.nxt + off + len) == -1) {
+            debugf("too many out-of-order ranges, dropped, seq=%u, len=%zu", pcb->rcv.nxt + off, len);
+        }
+        return 0;
+    }
+    nxt = pcb->rcv.nxt;
+    pcb->rcv.nxt += len;
+    tcp_ooo_pull(pcb);
+    len = pcb->rcv.nxt - nxt;
+    pcb->rcv.wnd -= len;
+    return len;
+}
+
+/*
+ * NOTE: puts the header in front of the options (optlen bytes, padded to 4) and the payload already in the
+ *       pkt and transmits it, the pkt is freed
+ */
 static ssize_t
-tcp_output_segment(uint32_t seq, uint32_t ack, uint8_t flg, uint16_t wnd, uint8_t *data, size_t len, struct ip_endpoint *local, struct ip_endpoint *foreign)
+tcp_output_segment_pkt(struct pktbuf *pkt, size_t optlen, uint32_t seq, uint32_t ack, uint8_t flg, uint16_t wnd, struct ip_endpoint *local, struct ip_endpoint *foreign)
 {
-    uint8_t buf[IP_PAYLOAD_SIZE_MAX] = {};
     struct tcp_hdr *hdr;
     struct pseudo_hdr pseudo;
     uint16_t psum;
     uint16_t total;
+    size_t len;
     char ep1[IP_ENDPOINT_STR_LEN];
     char ep2[IP_ENDPOINT_STR_LEN];
+    ssize_t ret;
 
-    hdr = (struct tcp_hdr *)buf;
+    len = pktbuf_len(pkt) - optlen;
+    hdr = (struct tcp_hdr *)pktbuf_push(pkt, sizeof(*hdr));
     hdr->src = local->port;
     hdr->dst = foreign->port;
     hdr->seq = hton32(seq);
     hdr->ack = hton32(ack);
-    hdr->off = (sizeof(*hdr) >> 2) << 4;
+    hdr->off = ((sizeof(*hdr) + optlen) >> 2) << 4;
     hdr->flg = flg;
     hdr->wnd = hton16(wnd);
     hdr->sum = 0;
     hdr->up = 0;
-    memcpy(hdr + 1, data, len);
     pseudo.src = local->addr;
     pseudo.dst = foreign->addr;
     pseudo.zero = 0;
     pseudo.protocol = IP_PROTOCOL_TCP;
-    total = sizeof(*hdr) + len;
+    total = sizeof(*hdr) + optlen + len;
     pseudo.len = hton16(total);
     psum = ~cksum16((uint16_t *)&pseudo, sizeof(pseudo), 0);
     hdr->sum = cksum16((uint16_t *)hdr, total, psum);
     debugf("%s => %s, len=%zu (payload=%zu)",
         ip_endpoint_ntop(local, ep1, sizeof(ep1)), ip_endpoint_ntop(foreign, ep2, sizeof(ep2)), total, len);
-    tcp_dump((uint8_t *)hdr, total);
-    if (ip_output(IP_PROTOCOL_TCP, (uint8_t *)hdr, total, local->addr, foreign->addr) == -1) {
+    debugdump_with(tcp_dump, (uint8_t *)hdr, total);
+    ret = ip_output_df(IP_PROTOCOL_TCP, pkt, local->addr, foreign->addr); /* NOTE: path MTU discovery */
+    pktbuf_free(pkt);
+    if (ret == -1) {
         return -1;
     }
     return len;
 }
 
 static ssize_t
-tcp_output(struct tcp_pcb *pcb, uint8_t flg, uint8_t *data, size_t len)
+tcp_output_segment(uint32_t seq, uint32_t ack, uint8_t flg, uint16_t wnd, uint8_t *data, size_t len, struct ip_endpoint *local, struct ip_endpoint *foreign)
 {
-    uint32_t seq;
+    struct pktbuf *pkt;
+
+    pkt = pktbuf_alloc(PKTBUF_HEADROOM + sizeof(struct tcp_hdr), len);
+    if (!pkt) {
+        errorf("pktbuf_alloc() failure");
+        return -1;
+    }
+    memcpy(pktbuf_put(pkt, len), data, len);
+    return tcp_output_segment_pkt(pkt, 0, seq, ack, flg, wnd, local, foreign);
+}
+
+/* NOTE: the window field, never scaled in a SYN (RFC 7323 2.2) */
+static uint16_t
+tcp_rcv_wnd(struct tcp_pcb *pcb, uint8_t flg)
+{
+    if (TCP_FLG_ISSET(flg, TCP_FLG_SYN)) {
+        return MIN(pcb->rcv.wnd, UINT16_MAX);
+    }
+    return MIN(pcb->rcv.wnd >> pcb->rcv.wscale, UINT16_MAX);
+}
 
-    seq = pcb->snd.nxt;
+/* NOTE: sends len bytes at the offset in the send buffer, copied straight into the pkt */
+static ssize_t
+tcp_output_data(struct tcp_pcb *pcb, size_t off, size_t len, uint8_t flg)
+{
+    struct pktbuf *pkt;
+
+    pkt = pktbuf_alloc(PKTBUF_HEADROOM + sizeof(struct tcp_hdr), len);
+    if (!pkt) {
+        errorf("pktbuf_alloc() failure");
+        return -1;
+    }
+    tcp_ring_read(pcb->sbuf, pcb->sbufsize, tcp_ring_pos(pcb->sbufsize, pcb->shead, off), pktbuf_put(pkt, len), len);
+    return tcp_output_segment_pkt(pkt, 0, tcp_sbuf_seq(pcb) + off, pcb->rcv.nxt, flg, tcp_rcv_wnd(pcb, flg), &pcb->local, &pcb->foreign);
+}
+
+/* NOTE: SYN with the window scale option (NOP, kind, length, shift) */
+static ssize_t
+tcp_output_syn(struct tcp_pcb *pcb, uint8_t flg)
+{
+    struct pktbuf *pkt;
+    uint8_t *opt;
+
+    pkt = pktbuf_alloc(PKTBUF_HEADROOM + sizeof(struct tcp_hdr) + 4, 0);
+    if (!pkt) {
+        errorf("pktbuf_alloc() failure");
+        return -1;
+    }
+    opt = pktbuf_push(pkt, 4);
+    opt[0] = TCP_OPT_NOP;
+    opt[1] = TCP_OPT_WSCALE;
+    opt[2] = 3;
+    opt[3] = pcb->rcv.wscale;
+    return tcp_output_segment_pkt(pkt, 4, pcb->iss, pcb->rcv.nxt, flg, tcp_rcv_wnd(pcb, flg), &pcb->local, &pcb->foreign);
+}
+
+/* NOTE: control segments without text (SYN, ACK, RST), the data and FIN are sent by tcp_output_pending() */
+static ssize_t
+tcp_output(struct tcp_pcb *pcb, uint8_t flg)
+{
     if (TCP_FLG_ISSET(flg, TCP_FLG_SYN)) {
-        seq = pcb->iss;
+        if (!timer_pending(&pcb->rto_timer)) {
+            timer_arm(&pcb->rto_timer, pcb->rto / 1000);
+        }
+        pcb->snd.max = pcb->iss + 1;
+        tcp_rtt_start(pcb, pcb->iss + 1);
+        if (pcb->wscale_on) {
+            return tcp_output_syn(pcb, flg);
+        }
+        return tcp_output_segment(pcb->iss, pcb->rcv.nxt, flg, tcp_rcv_wnd(pcb, flg), NULL, 0, &pcb->local, &pcb->foreign);
     }
-    if (TCP_FLG_ISSET(flg, TCP_FLG_SYN | TCP_FLG_FIN) || len) {
-        tcp_retransmit_queue_add(pcb, seq, flg, data, len);
+    return tcp_output_segment(pcb->snd.nxt, pcb->rcv.nxt, flg, tcp_rcv_wnd(pcb, flg), NULL, 0, &pcb->local, &pcb->foreign);
+}
+
+/*
+ * NOTE: sends the data in the send buffer not sent yet, as much as the send and congestion windows allow,
+ *       cut into segments of the MSS, and the FIN after it; called whenever the user appends, an ACK or a window
+ *       update arrives, so the sender never waits for a timer while the window is open
+ */
+static void
+tcp_output_pending(struct tcp_pcb *pcb)
+{
+    size_t mss, off, len, avail;
+    uint32_t wnd, seq;
+    uint8_t flg;
+
+    switch (pcb->state) {
+    case TCP_PCB_STATE_ESTABLISHED:
+    case TCP_PCB_STATE_FIN_WAIT1:
+    case TCP_PCB_STATE_CLOSE_WAIT:
+    case TCP_PCB_STATE_CLOSING:
+    case TCP_PCB_STATE_LAST_ACK:
+        break;
+    default:
+        return;
+    }
+    mss = tcp_mss(pcb);
+    if (!pcb->cwnd) {
+        pcb->cwnd = tcp_cwnd_initial(pcb);
+    }
+    wnd = MIN(pcb->snd.wnd, pcb->cwnd);
+    while (pcb->fin != TCP_FIN_SENT) {
+        off = pcb->snd.nxt - tcp_sbuf_seq(pcb);
+        avail = wnd > off ? wnd - off : 0;
+        len = MIN(MIN(pcb->slen - off, mss), avail);
+        flg = TCP_FLG_ACK;
+        if (len && off + len == pcb->slen) {
+            flg |= TCP_FLG_PSH;
+        }
+        if (pcb->fin == TCP_FIN_QUEUED && off + len == pcb->slen) {
+            flg |= TCP_FLG_FIN;
+        }
+        if (!len && !TCP_FLG_ISSET(flg, TCP_FLG_FIN)) {
+            break;
+        }
+        /* NOTE: a segment failed to go out is as good as lost, the retransmit timer recovers it */
+        tcp_output_data(pcb, off, len, flg);
+        seq = pcb->snd.nxt;
+        pcb->snd.nxt += len;
+        if (TCP_FLG_ISSET(flg, TCP_FLG_FIN)) {
+            pcb->snd.nxt++;
+            pcb->fin = TCP_FIN_SENT;
+        }
+        if (TCP_SEQ_GT(pcb->snd.nxt, pcb->snd.max)) {
+            if (TCP_SEQ_GEQ(seq, pcb->snd.max)) {
+                /* NOTE: not sent before (see tcp_input_error()) */
+                tcp_rtt_start(pcb, pcb->snd.nxt);
+            }
+            pcb->snd.max = pcb->snd.nxt;
+        }
+        if (!timer_pending(&pcb->rto_timer) || seq == pcb->snd.una) {
+            /* NOTE: nothing was in flight, a pending timer is the probe of the zero window (restarted) */
+            timer_arm(&pcb->rto_timer, pcb->rto / 1000);
+        }
+    }
+    if (pcb->snd.una == pcb->snd.nxt && pcb->slen && !pcb->snd.wnd && !timer_pending(&pcb->rto_timer)) {
+        /* NOTE: the zero window, probed by tcp_retransmit_timer() */
+        timer_arm(&pcb->rto_timer, pcb->rto / 1000);
     }
-    return tcp_output_segment(seq, pcb->rcv.nxt, flg, pcb->rcv.wnd, data, len, &pcb->local, &pcb->foreign);
 }
 
 /* rfc793 - section 3.9 [Event Processing > SEGMENT ARRIVES] */
 static void
-tcp_segment_arrives(struct tcp_segment_info *seg, uint8_t flags, uint8_t *data, size_t len, struct ip_endpoint *local, struct ip_endpoint *foreign)
+tcp_segment_arrives(struct tcp_pcb *pcb, struct tcp_segment_info *seg, uint8_t flags, uint8_t *data, size_t len, struct ip_endpoint *local, struct ip_endpoint *foreign)
 {
-    struct tcp_pcb *pcb, *new_pcb;
+    struct tcp_stack *tcp = tcp_stack();
+    struct tcp_pcb *new_pcb;
     int acceptable = 0;
 
-    pcb = tcp_pcb_select(local, foreign);
     if (!pcb || pcb->state == TCP_PCB_STATE_CLOSED) {
         if (TCP_FLG_ISSET(flags, TCP_FLG_RST)) {
             return;
@@ -422,22 +1214,41 @@ tcp_segment_arrives(struct tcp_segment_info *seg, uint8_t flags, uint8_t *data,
             /* ignore: security/compartment check */
             /* ignore: precedence check */
             if (pcb->mode == TCP_PCB_MODE_SOCKET) {
-                new_pcb = tcp_pcb_alloc();
+                /* NOTE: the connection belongs to the shard of its flow, which is locked by tcp_input() */
+                new_pcb = tcp_pcb_alloc(tcp_flow_shard(local, foreign));
                 if (!new_pcb) {
                     errorf("tcp_pcb_alloc() failure");
                     return;
                 }
                 new_pcb->mode = TCP_PCB_MODE_SOCKET;
                 new_pcb->parent = pcb;
+                new_pcb->bufsize = pcb->bufsize;
+                new_pcb->sbufsize = pcb->sbufsize;
+                new_pcb->rto_min = pcb->rto_min;
+                new_pcb->rto_max = pcb->rto_max;
+                new_pcb->rto = tcp_rto_base(new_pcb);
                 pcb = new_pcb;
             }
+            if (tcp_pcb_alloc_buffers(pcb) == -1) {
+                if (pcb->mode == TCP_PCB_MODE_SOCKET) {
+                    pcb->state = TCP_PCB_STATE_CLOSED;
+                    tcp_pcb_release(pcb);
+                }
+                return;
+            }
+            /* NOTE: the windows are scaled only if both SYNs carry the option (RFC 7323 1.3) */
+            pcb->wscale_on = seg->wscale != -1;
+            if (pcb->wscale_on) {
+                pcb->snd.wscale = MIN(seg->wscale, TCP_WSCALE_MAX);
+            } else {
+                pcb->rcv.wscale = 0;
+            }
             pcb->local = *local;
             pcb->foreign = *foreign;
-            pcb->rcv.wnd = sizeof(pcb->buf);
             pcb->rcv.nxt = seg->seq + 1;
             pcb->irs = seg->seq;
             pcb->iss = random();
-            tcp_output(pcb, TCP_FLG_SYN | TCP_FLG_ACK, NULL, 0);
+            tcp_output(pcb, TCP_FLG_SYN | TCP_FLG_ACK);
             pcb->snd.nxt = pcb->iss + 1;
             pcb->snd.una = pcb->iss;
             pcb->state = TCP_PCB_STATE_SYN_RECEIVED;
@@ -455,11 +1266,11 @@ tcp_segment_arrives(struct tcp_segment_info *seg, uint8_t flags, uint8_t *data,
          * first check the ACK bit
          */
         if (TCP_FLG_ISSET(flags, TCP_FLG_ACK)) {
-            if (seg->ack <= pcb->iss || seg->ack > pcb->snd.nxt) {
+            if (TCP_SEQ_LEQ(seg->ack, pcb->iss) || TCP_SEQ_GT(seg->ack, pcb->snd.nxt)) {
                 tcp_output_segment(seg->ack, 0, TCP_FLG_RST, 0, NULL, 0, local, foreign);
                 return;
             }
-            if (pcb->snd.una <= seg->ack && seg->ack <= pcb->snd.nxt) {
+            if (TCP_SEQ_LEQ(pcb->snd.una, seg->ack) && TCP_SEQ_LEQ(seg->ack, pcb->snd.nxt)) {
                 acceptable = 1;
             }
         }
@@ -484,15 +1295,20 @@ tcp_segment_arrives(struct tcp_segment_info *seg, uint8_t flags, uint8_t *data,
         if (TCP_FLG_ISSET(flags, TCP_FLG_SYN)) {
             pcb->rcv.nxt = seg->seq + 1;
             pcb->irs = seg->seq;
+            if (seg->wscale != -1) {
+                pcb->snd.wscale = MIN(seg->wscale, TCP_WSCALE_MAX);
+            } else {
+                pcb->wscale_on = 0;
+                pcb->rcv.wscale = 0;
+            }
             if (acceptable) {
-                pcb->snd.una = seg->ack;
-                tcp_retransmit_queue_cleanup(pcb);
+                tcp_retransmit_ack(pcb, seg->ack);
             }
-            if (pcb->snd.una > pcb->iss) {
+            if (TCP_SEQ_GT(pcb->snd.una, pcb->iss)) {
                 pcb->state = TCP_PCB_STATE_ESTABLISHED;
-                tcp_output(pcb, TCP_FLG_ACK, NULL, 0);
+                tcp_output(pcb, TCP_FLG_ACK);
                 /* NOTE: not specified in the RFC793, but send window initialization required */
-                pcb->snd.wnd = seg->wnd;
+                pcb->snd.wnd = seg->wnd; /* NOTE: not scaled in a SYN */
                 pcb->snd.wl1 = seg->seq;
                 pcb->snd.wl2 = seg->ack;
                 sched_wakeup(&pcb->ctx);
@@ -500,7 +1316,7 @@ tcp_segment_arrives(struct tcp_segment_info *seg, uint8_t flags, uint8_t *data,
                 return;
             } else {
                 pcb->state = TCP_PCB_STATE_SYN_RECEIVED;
-                tcp_output(pcb, TCP_FLG_SYN | TCP_FLG_ACK, NULL, 0);
+                tcp_output(pcb, TCP_FLG_SYN | TCP_FLG_ACK);
                 /* ignore: If there are other controls or text in the segment, queue them for processing after the ESTABLISHED state has been reached */
                 return;
             }
@@ -532,7 +1348,7 @@ tcp_segment_arrives(struct tcp_segment_info *seg, uint8_t flags, uint8_t *data,
                     acceptable = 1;
                 }
             } else {
-                if (pcb->rcv.nxt <= seg->seq && seg->seq < pcb->rcv.nxt + pcb->rcv.wnd) {
+                if (TCP_SEQ_LEQ(pcb->rcv.nxt, seg->seq) && TCP_SEQ_LT(seg->seq, pcb->rcv.nxt + pcb->rcv.wnd)) {
                     acceptable = 1;
                 }
             }
@@ -540,15 +1356,15 @@ tcp_segment_arrives(struct tcp_segment_info *seg, uint8_t flags, uint8_t *data,
             if (!pcb->rcv.wnd) {
                 /* not acceptable */
             } else {
-                if ((pcb->rcv.nxt <= seg->seq && seg->seq < pcb->rcv.nxt + pcb->rcv.wnd) ||
-                    (pcb->rcv.nxt <= seg->seq + seg->len - 1 && seg->seq + seg->len - 1 < pcb->rcv.nxt + pcb->rcv.wnd)) {
+                if ((TCP_SEQ_LEQ(pcb->rcv.nxt, seg->seq) && TCP_SEQ_LT(seg->seq, pcb->rcv.nxt + pcb->rcv.wnd)) ||
+                    (TCP_SEQ_LEQ(pcb->rcv.nxt, seg->seq + seg->len - 1) && TCP_SEQ_LT(seg->seq + seg->len - 1, pcb->rcv.nxt + pcb->rcv.wnd))) {
                     acceptable = 1;
                 }
             }
         }
         if (!acceptable) {
             if (!TCP_FLG_ISSET(flags, TCP_FLG_RST)) {
-                tcp_output(pcb, TCP_FLG_ACK, NULL, 0);
+                tcp_output(pcb, TCP_FLG_ACK);
             }
             return;
         }
@@ -610,7 +1426,7 @@ tcp_segment_arrives(struct tcp_segment_info *seg, uint8_t flags, uint8_t *data,
     case TCP_PCB_STATE_LAST_ACK:
     case TCP_PCB_STATE_TIME_WAIT:
         if (TCP_FLG_ISSET(flags, TCP_FLG_SYN)) {
-            tcp_output(pcb, TCP_FLG_RST, NULL, 0);
+            tcp_output(pcb, TCP_FLG_RST);
             errorf("connection reset");
             pcb->state = TCP_PCB_STATE_CLOSED;
             tcp_pcb_release(pcb);
@@ -626,12 +1442,25 @@ tcp_segment_arrives(struct tcp_segment_info *seg, uint8_t flags, uint8_t *data,
     }
     switch (pcb->state) {
     case TCP_PCB_STATE_SYN_RECEIVED:
-        if (pcb->snd.una <= seg->ack && seg->ack <= pcb->snd.nxt) {
+        if (TCP_SEQ_LEQ(pcb->snd.una, seg->ack) && TCP_SEQ_LEQ(seg->ack, pcb->snd.nxt)) {
             pcb->state = TCP_PCB_STATE_ESTABLISHED;
+            /* NOTE: the window update below compares with WL1, which must be in the peer's sequence space (RFC 9293 3.10.7.4) */
+            pcb->snd.wnd = (uint32_t)seg->wnd << pcb->snd.wscale;
+            pcb->snd.wl1 = seg->seq;
+            pcb->snd.wl2 = seg->ack;
             sched_wakeup(&pcb->ctx);
             if (pcb->parent) {
-                queue_push(&pcb->parent->backlog, pcb);
-                sched_wakeup(&pcb->parent->ctx);
+                /* NOTE: the listener belongs to the other shard (greater index) */
+                mutex_lock(&tcp->mutexes[TCP_SHARD_LISTEN]);
+                if (pcb->parent->state == TCP_PCB_STATE_LISTEN && pcb->parent->local.port == pcb->local.port) {
+                    queue_push(&pcb->parent->backlog, &pcb->link);
+                    sched_wakeup(&pcb->parent->ctx);
+                } else {
+                    __atomic_store_n(&pcb->parent, NULL, __ATOMIC_RELEASE);
+                    __atomic_store_n(&pcb->orphan, 1, __ATOMIC_RELEASE);
+                    timer_arm(&pcb->tw_timer, 0);
+                }
+                mutex_unlock(&tcp->mutexes[TCP_SHARD_LISTEN]);
             }
         } else {
             tcp_output_segment(seg->ack, 0, TCP_FLG_RST, 0, NULL, 0, local, foreign);
@@ -643,25 +1472,32 @@ tcp_segment_arrives(struct tcp_segment_info *seg, uint8_t flags, uint8_t *data,
     case TCP_PCB_STATE_FIN_WAIT2:
     case TCP_PCB_STATE_CLOSE_WAIT:
     case TCP_PCB_STATE_CLOSING:
-        if (pcb->snd.una < seg->ack && seg->ack <= pcb->snd.nxt) {
-            pcb->snd.una = seg->ack;
-            tcp_retransmit_queue_cleanup(pcb);
-            /* ignore: Users should receive positive acknowledgments for buffers
-                        which have been SENT and fully acknowledged (i.e., SEND buffer should be returned with "ok" response) */
-            if (pcb->snd.wl1 < seg->seq || (pcb->snd.wl1 == seg->seq && pcb->snd.wl2 <= seg->ack)) {
-                pcb->snd.wnd = seg->wnd;
+        tcp_retransmit_forward(pcb, seg->ack);
+        if (TCP_SEQ_LT(pcb->snd.una, seg->ack) && TCP_SEQ_LEQ(seg->ack, pcb->snd.nxt)) {
+            /* NOTE: the acknowledged data leaves the send buffer, which wakes up the sender waiting for room */
+            tcp_retransmit_ack(pcb, seg->ack);
+        } else if (TCP_SEQ_LT(seg->ack, pcb->snd.una)) {
+            /* ignore */
+        } else if (TCP_SEQ_GT(seg->ack, pcb->snd.nxt)) {
+            tcp_output(pcb, TCP_FLG_ACK);
+            return;
+        }
+        if (TCP_SEQ_LEQ(pcb->snd.una, seg->ack) && TCP_SEQ_LEQ(seg->ack, pcb->snd.nxt)) {
+            if (TCP_SEQ_LT(pcb->snd.wl1, seg->seq) || (pcb->snd.wl1 == seg->seq && TCP_SEQ_LEQ(pcb->snd.wl2, seg->ack))) {
+                if (!seg->wnd) {
+                    /* NOTE: the answer to a window probe, the peer is alive however long the window stays closed */
+                    pcb->rtx_since = 0;
+                }
+                pcb->snd.wnd = (uint32_t)seg->wnd << pcb->snd.wscale;
                 pcb->snd.wl1 = seg->seq;
                 pcb->snd.wl2 = seg->ack;
             }
-        } else if (seg->ack < pcb->snd.una) {
-            /* ignore */
-        } else if (seg->ack > pcb->snd.nxt) {
-            tcp_output(pcb, TCP_FLG_ACK, NULL, 0);
-            return;
+            /* NOTE: the window may have opened, send what it allows now */
+            tcp_output_pending(pcb);
         }
         switch (pcb->state) {
         case TCP_PCB_STATE_FIN_WAIT1:
-            if (seg->ack == pcb->snd.nxt) {
+            if (pcb->fin == TCP_FIN_SENT && seg->ack == pcb->snd.nxt) {
                 pcb->state = TCP_PCB_STATE_FIN_WAIT2;
             }
             break;
@@ -672,7 +1508,7 @@ tcp_segment_arrives(struct tcp_segment_info *seg, uint8_t flags, uint8_t *data,
             /* do nothing */
             break;
         case TCP_PCB_STATE_CLOSING:
-            if (seg->ack == pcb->snd.nxt) {
+            if (pcb->fin == TCP_FIN_SENT && seg->ack == pcb->snd.nxt) {
                 pcb->state = TCP_PCB_STATE_TIME_WAIT;
                 /* NOTE: set 2MSL timer, although it is not explicitly stated in the RFC */
                 tcp_set_timewait_timer(pcb);
@@ -682,10 +1518,22 @@ tcp_segment_arrives(struct tcp_segment_info *seg, uint8_t flags, uint8_t *data,
         }
         break;
     case TCP_PCB_STATE_LAST_ACK:
-        if (seg->ack == pcb->snd.nxt) {
+        tcp_retransmit_forward(pcb, seg->ack);
+        if (TCP_SEQ_LT(pcb->snd.una, seg->ack) && TCP_SEQ_LEQ(seg->ack, pcb->snd.nxt)) {
+            tcp_retransmit_ack(pcb, seg->ack);
+        }
+        if (pcb->fin == TCP_FIN_SENT && seg->ack == pcb->snd.nxt) {
             pcb->state = TCP_PCB_STATE_CLOSED;
             tcp_pcb_release(pcb);
+            return;
+        }
+        if (TCP_SEQ_LT(pcb->snd.wl1, seg->seq) || (pcb->snd.wl1 == seg->seq && TCP_SEQ_LEQ(pcb->snd.wl2, seg->ack))) {
+            pcb->snd.wnd = (uint32_t)seg->wnd << pcb->snd.wscale;
+            pcb->snd.wl1 = seg->seq;
+            pcb->snd.wl2 = seg->ack;
         }
+        /* NOTE: the data left in the send buffer, and the FIN after it */
+        tcp_output_pending(pcb);
         return;
     case TCP_PCB_STATE_TIME_WAIT:
         if (TCP_FLG_ISSET(flags, TCP_FLG_FIN)) {
@@ -704,11 +1552,11 @@ tcp_segment_arrives(struct tcp_segment_info *seg, uint8_t flags, uint8_t *data,
     case TCP_PCB_STATE_FIN_WAIT1:
     case TCP_PCB_STATE_FIN_WAIT2:
         if (len) {
-            memcpy(pcb->buf + (sizeof(pcb->buf) - pcb->rcv.wnd), data, len);
-            pcb->rcv.nxt = seg->seq + seg->len;
-            pcb->rcv.wnd -= len;
-            tcp_output(pcb, TCP_FLG_ACK, NULL, 0);
-            sched_wakeup(&pcb->ctx);
+            if (tcp_segment_text(pcb, seg->seq, data, len)) {
+                sched_wakeup(&pcb->ctx);
+            }
+            /* NOTE: a duplicate ACK for the text out of order, for the fast retransmit of the peer (RFC 5681 4.2) */
+            tcp_output(pcb, TCP_FLG_ACK);
         }
         break;
     case TCP_PCB_STATE_CLOSE_WAIT:
@@ -730,8 +1578,19 @@ tcp_segment_arrives(struct tcp_segment_info *seg, uint8_t flags, uint8_t *data,
             /* drop segment */
             return;
         }
-        pcb->rcv.nxt = seg->seq + 1;
-        tcp_output(pcb, TCP_FLG_ACK, NULL, 0);
+        switch (pcb->state) {
+        case TCP_PCB_STATE_SYN_RECEIVED:
+        case TCP_PCB_STATE_ESTABLISHED:
+        case TCP_PCB_STATE_FIN_WAIT1:
+        case TCP_PCB_STATE_FIN_WAIT2:
+            if (seg->seq + seg->len - 1 != pcb->rcv.nxt) {
+                /* NOTE: not next in sequence (beyond a gap), the peer retransmits it */
+                return;
+            }
+            pcb->rcv.nxt++;
+            break;
+        }
+        tcp_output(pcb, TCP_FLG_ACK);
         switch (pcb->state) {
         case TCP_PCB_STATE_SYN_RECEIVED:
         case TCP_PCB_STATE_ESTABLISHED:
@@ -739,7 +1598,7 @@ tcp_segment_arrives(struct tcp_segment_info *seg, uint8_t flags, uint8_t *data,
             sched_wakeup(&pcb->ctx);
             break;
         case TCP_PCB_STATE_FIN_WAIT1:
-            if (seg->ack == pcb->snd.nxt) {
+            if (pcb->fin == TCP_FIN_SENT && seg->ack == pcb->snd.nxt) {
                 pcb->state = TCP_PCB_STATE_TIME_WAIT;
                 tcp_set_timewait_timer(pcb);
             } else {
@@ -768,9 +1627,37 @@ tcp_segment_arrives(struct tcp_segment_info *seg, uint8_t flags, uint8_t *data,
     return;
 }
 
+/* NOTE: only the window scale option is used, the others (MSS included) are skipped */
 static void
-tcp_input(const uint8_t *data, size_t len, ip_addr_t src, ip_addr_t dst, struct ip_iface *iface)
+tcp_parse_options(const uint8_t *opt, size_t len, struct tcp_segment_info *seg)
 {
+    size_t i = 0;
+
+    while (i < len) {
+        switch (opt[i]) {
+        case TCP_OPT_EOL:
+            return;
+        case TCP_OPT_NOP:
+            i++;
+            continue;
+        }
+        if (i + 1 >= len || opt[i+1] < 2 || i + opt[i+1] > len) {
+            debugf("malformed option, kind=%u", opt[i]);
+            return;
+        }
+        if (opt[i] == TCP_OPT_WSCALE && opt[i+1] == 3) {
+            seg->wscale = opt[i+2];
+        }
+        i += opt[i+1];
+    }
+}
+
+static void
+tcp_input(struct pktbuf *pkt, ip_addr_t src, ip_addr_t dst, struct ip_iface *iface)
+{
+    struct tcp_stack *tcp = tcp_stack();
+    const uint8_t *data = pkt->data;
+    size_t len = pktbuf_len(pkt);
     struct tcp_hdr *hdr;
     struct pseudo_hdr pseudo;
     uint16_t psum, hlen;
@@ -778,6 +1665,8 @@ tcp_input(const uint8_t *data, size_t len, ip_addr_t src, ip_addr_t dst, struct
     char addr2[IP_ADDR_STR_LEN];
     struct ip_endpoint local, foreign;
     struct tcp_segment_info seg;
+    struct tcp_pcb *pcb;
+    int shard;
 
     if (len < sizeof(*hdr)) {
         errorf("too short");
@@ -803,12 +1692,16 @@ tcp_input(const uint8_t *data, size_t len, ip_addr_t src, ip_addr_t dst, struct
         ip_addr_ntop(src, addr1, sizeof(addr1)), ntoh16(hdr->src),
         ip_addr_ntop(dst, addr2, sizeof(addr2)), ntoh16(hdr->dst),
         len, len - sizeof(*hdr));
-    tcp_dump(data, len);
+    debugdump_with(tcp_dump, data, len);
     local.addr = dst;
     local.port = hdr->dst;
     foreign.addr = src;
     foreign.port = hdr->src;
     hlen = (hdr->off >> 4) << 2;
+    if (hlen < sizeof(*hdr) || hlen > len) {
+        errorf("bad header length, hlen=%u, len=%zu", hlen, len);
+        return;
+    }
     seg.seq = ntoh32(hdr->seq);
     seg.ack = ntoh32(hdr->ack);
     seg.len = len - hlen;
@@ -820,64 +1713,127 @@ tcp_input(const uint8_t *data, size_t len, ip_addr_t src, ip_addr_t dst, struct
     }
     seg.wnd = ntoh16(hdr->wnd);
     seg.up = ntoh16(hdr->up);
-    mutex_lock(&mutex);
-    tcp_segment_arrives(&seg, hdr->flg, (uint8_t *)hdr + hlen, len - hlen, &local, &foreign);
-    mutex_unlock(&mutex);
+    seg.wscale = -1;
+    if (TCP_FLG_ISSET(hdr->flg, TCP_FLG_SYN)) {
+        tcp_parse_options((uint8_t *)(hdr + 1), hlen - sizeof(*hdr), &seg);
+    }
+    shard = tcp_flow_shard(&local, &foreign);
+    mutex_lock(&tcp->mutexes[shard]);
+    pcb = tcp_pcb_select(shard, &local, &foreign);
+    if (pcb) {
+        tcp_segment_arrives(pcb, &seg, hdr->flg, (uint8_t *)hdr + hlen, len - hlen, &local, &foreign);
+    } else {
+        /* NOTE: not a connection of the flow, look for a listener (slow path) */
+        mutex_lock(&tcp->mutexes[TCP_SHARD_LISTEN]);
+        pcb = tcp_pcb_select(TCP_SHARD_LISTEN, &local, &foreign);
+        tcp_segment_arrives(pcb, &seg, hdr->flg, (uint8_t *)hdr + hlen, len - hlen, &local, &foreign);
+        mutex_unlock(&tcp->mutexes[TCP_SHARD_LISTEN]);
+    }
+    mutex_unlock(&tcp->mutexes[shard]);
     return;
 }
 
+/*
+ * NOTE: an ICMP error about a segment we sent (the quoted header, see ip_input_error()). Only "fragmentation
+ *       needed" is acted on: the MSS is lowered at once and the queued segments too large for the new path
+ *       MTU are sent again split (RFC 1191 6.5), without waiting for the retransmission timeout. The other
+ *       errors are soft (RFC 1122 4.2.3.9), left to the retransmission.
+ */
 static void
-tcp_timer(void)
+tcp_input_error(uint8_t type, uint8_t code, uint32_t values, const uint8_t *data, size_t len, ip_addr_t src, ip_addr_t dst)
 {
+    struct tcp_stack *tcp = tcp_stack();
+    struct tcp_hdr *hdr;
+    struct ip_endpoint local, foreign;
     struct tcp_pcb *pcb;
-    struct timeval now;
-    char ep1[IP_ENDPOINT_STR_LEN];
-    char ep2[IP_ENDPOINT_STR_LEN];
+    uint32_t seq;
+    uint16_t mtu, mss;
+    int shard;
 
-    mutex_lock(&mutex);
-    gettimeofday(&now, NULL);
-    for (pcb = pcbs; pcb < tailof(pcbs); pcb++) {
-        if (pcb->state == TCP_PCB_STATE_FREE) {
-            continue;
+    if (type != ICMP_TYPE_DEST_UNREACH || code != ICMP_CODE_FRAGMENT_NEEDED) {
+        return;
+    }
+    if (len < 8) {
+        /* NOTE: the ports and the sequence number */
+        return;
+    }
+    hdr = (struct tcp_hdr *)data;
+    local.addr = src;
+    local.port = hdr->src;
+    foreign.addr = dst;
+    foreign.port = hdr->dst;
+    seq = ntoh32(hdr->seq);
+    mtu = ntoh32(values) & 0xffff;
+    if (mtu <= IP_HDR_SIZE_MIN + sizeof(struct tcp_hdr)) {
+        return;
+    }
+    mss = mtu - (IP_HDR_SIZE_MIN + sizeof(struct tcp_hdr));
+    /* NOTE: a passive connection stays in the listen shard (see tcp_open_rfc793()) */
+    for (shard = tcp_flow_shard(&local, &foreign); ; shard = TCP_SHARD_LISTEN) {
+        mutex_lock(&tcp->mutexes[shard]);
+        pcb = tcp_pcb_select(shard, &local, &foreign);
+        if (pcb && pcb->foreign.addr == foreign.addr && pcb->foreign.port == foreign.port) {
+            break;
         }
-        if (pcb->state == TCP_PCB_STATE_TIME_WAIT) {
-            if (timercmp(&now, &pcb->tw_timer, >) != 0) {
-                debugf("timewait has elapsed, local=%s, foreign=%s",
-                    ip_endpoint_ntop(&pcb->local, ep1, sizeof(ep1)), ip_endpoint_ntop(&pcb->foreign, ep2, sizeof(ep2)));
-                tcp_pcb_release(pcb);
-                continue;
-            }
+        mutex_unlock(&tcp->mutexes[shard]);
+        if (shard == TCP_SHARD_LISTEN) {
+            return;
         }
-        queue_foreach(&pcb->queue, tcp_retransmit_queue_emit, pcb);
     }
-    mutex_unlock(&mutex);
+    /* NOTE: only for a segment in flight (RFC 5927 4.1), a forged message has to guess the sequence */
+    if (TCP_SEQ_LT(seq, pcb->snd.una) || TCP_SEQ_GEQ(seq, pcb->snd.nxt) || (pcb->mss && mss >= pcb->mss)) {
+        mutex_unlock(&tcp->mutexes[shard]);
+        return;
+    }
+    debugf("mss lowered, mss=%u => %u", pcb->mss, mss);
+    pcb->mtu = mtu;
+    pcb->mss = mss;
+    /* NOTE: the data in flight is sent again out of the send buffer cut to the new MSS */
+    tcp_retransmit_rewind(pcb);
+    tcp_output_pending(pcb);
+    mutex_unlock(&tcp->mutexes[shard]);
 }
 
 static void
 event_handler(void *arg)
 {
+    struct tcp_stack *tcp = tcp_stack();
     struct tcp_pcb *pcb;
 
-    mutex_lock(&mutex);
-    for (pcb = pcbs; pcb < tailof(pcbs); pcb++) {
-        if (pcb->state != TCP_PCB_STATE_FREE) {
+    tcp_lock_all();
+    for (pcb = tcp->pcbs; pcb < tailof(tcp->pcbs); pcb++) {
+        if (tcp_pcb_shard(pcb) != TCP_SHARD_NONE && pcb->state != TCP_PCB_STATE_FREE) {
             sched_interrupt(&pcb->ctx);
         }
     }
-    mutex_unlock(&mutex);
+    tcp_unlock_all(NULL);
 }
 
 int
 tcp_init(void)
 {
-    struct timeval interval = {0,100000};
+    struct tcp_stack *tcp;
+    struct tcp_pcb *pcb;
+    mutex_t *mutex;
 
+    tcp = memory_alloc(sizeof(*tcp));
+    if (!tcp) {
+        errorf("memory_alloc() failure");
+        return -1;
+    }
+    for (mutex = tcp->mutexes; mutex < tailof(tcp->mutexes); mutex++) {
+        mutex_init(mutex);
+    }
+    for (pcb = tcp->pcbs; pcb < tailof(tcp->pcbs); pcb++) {
+        pcb->shard = TCP_SHARD_NONE;
+    }
+    net_stack_set_priv(NET_STACK_PRIV_TCP, tcp);
     if (ip_protocol_register("TCP", IP_PROTOCOL_TCP, tcp_input) == -1) {
         errorf("ip_protocol_register() failure");
         return -1;
     }
-    if (net_timer_register("TCP Timer", interval, tcp_timer) == -1) {
-        errorf("net_timer_register() failure");
+    if (ip_protocol_set_error_handler(IP_PROTOCOL_TCP, tcp_input_error) == -1) {
+        errorf("ip_protocol_set_error_handler() failure");
         return -1;
     }
     net_event_subscribe(event_handler, NULL);
@@ -891,16 +1847,38 @@ tcp_init(void)
 int
 tcp_open_rfc793(struct ip_endpoint *local, struct ip_endpoint *foreign, int active)
 {
+    struct tcp_stack *tcp = tcp_stack();
     struct tcp_pcb *pcb;
     char ep1[IP_ENDPOINT_STR_LEN];
     char ep2[IP_ENDPOINT_STR_LEN];
-    int state, id;
+    struct ip_endpoint src;
+    struct ip_iface *iface;
+    mutex_t *mutex;
+    int shard, state, id;
 
-    mutex_lock(&mutex);
-    pcb = tcp_pcb_alloc();
+    if (!active) {
+        /* NOTE: stays in the listen shard after the connection established */
+        shard = TCP_SHARD_LISTEN;
+    } else {
+        src = *local;
+        if (src.addr == IP_ADDR_ANY) {
+            /* NOTE: the flow shard is selected with the actual source address */
+            iface = ip_route_get_iface(foreign->addr);
+            if (!iface) {
+                errorf("ip_route_get_iface() failure");
+                return -1;
+            }
+            src.addr = iface->unicast;
+        }
+        local = &src;
+        shard = tcp_flow_shard(local, foreign);
+    }
+    mutex = &tcp->mutexes[shard];
+    mutex_lock(mutex);
+    pcb = tcp_pcb_alloc(shard);
     if (!pcb) {
         errorf("tcp_pcb_alloc() failure");
-        mutex_unlock(&mutex);
+        mutex_unlock(mutex);
         return -1;
     }
     pcb->mode = TCP_PCB_MODE_RFC793;
@@ -916,13 +1894,19 @@ tcp_open_rfc793(struct ip_endpoint *local, struct ip_endpoint *foreign, int acti
             ip_endpoint_ntop(local, ep1, sizeof(ep1)), ip_endpoint_ntop(foreign, ep2, sizeof(ep2)));
         pcb->local = *local;
         pcb->foreign = *foreign;
-        pcb->rcv.wnd = sizeof(pcb->buf);
+        if (tcp_pcb_alloc_buffers(pcb) == -1) {
+            pcb->state = TCP_PCB_STATE_CLOSED;
+            tcp_pcb_release(pcb);
+            mutex_unlock(mutex);
+            return -1;
+        }
+        pcb->wscale_on = 1;
         pcb->iss = random();
-        if (tcp_output(pcb, TCP_FLG_SYN, NULL, 0) == -1) {
+        if (tcp_output(pcb, TCP_FLG_SYN) == -1) {
             errorf("tcp_output() failure");
             pcb->state = TCP_PCB_STATE_CLOSED;
             tcp_pcb_release(pcb);
-            mutex_unlock(&mutex);
+            mutex_unlock(mutex);
             return -1;
         }
         pcb->snd.una = pcb->iss;
@@ -933,11 +1917,11 @@ AGAIN:
     state = pcb->state;
     /* waiting for state changed */
     while (pcb->state == state) {
-        if (sched_sleep(&pcb->ctx, &mutex, NULL) == -1) {
+        if (sched_sleep(&pcb->ctx, mutex, NULL) == -1) {
             debugf("interrupted");
             pcb->state = TCP_PCB_STATE_CLOSED;
             tcp_pcb_release(pcb);
-            mutex_unlock(&mutex);
+            mutex_unlock(mutex);
             errno = EINTR;
             return -1;
         }
@@ -949,13 +1933,13 @@ AGAIN:
         errorf("open error: %d", pcb->state);
         pcb->state = TCP_PCB_STATE_CLOSED;
         tcp_pcb_release(pcb);
-        mutex_unlock(&mutex);
+        mutex_unlock(mutex);
         return -1;
     }
     id = tcp_pcb_id(pcb);
     debugf("connection established: local=%s, foreign=%s",
         ip_endpoint_ntop(&pcb->local, ep1, sizeof(ep1)), ip_endpoint_ntop(&pcb->foreign, ep2, sizeof(ep2)));
-    mutex_unlock(&mutex);
+    mutex_unlock(mutex);
     return id;
 }
 
@@ -963,22 +1947,21 @@ int
 tcp_state(int id)
 {
     struct tcp_pcb *pcb;
+    mutex_t *mutex;
     int state;
 
-    mutex_lock(&mutex);
-    pcb = tcp_pcb_get(id);
+    pcb = tcp_pcb_get(id, &mutex);
     if (!pcb) {
         errorf("pcb not found");
-        mutex_unlock(&mutex);
         return -1;
     }
     if (pcb->mode != TCP_PCB_MODE_RFC793) {
         errorf("not opened in rfc793 mode");
-        mutex_unlock(&mutex);
+        mutex_unlock(mutex);
         return -1;
     }
     state = pcb->state;
-    mutex_unlock(&mutex);
+    mutex_unlock(mutex);
     return state;
 }
 
@@ -989,42 +1972,53 @@ tcp_state(int id)
 int
 tcp_open(void)
 {
+    struct tcp_stack *tcp = tcp_stack();
     struct tcp_pcb *pcb;
+    mutex_t *mutex;
     int id;
 
-    mutex_lock(&mutex);
-    pcb = tcp_pcb_alloc();
+    /* NOTE: belongs to the listen shard until connected (see tcp_connect()) */
+    mutex = &tcp->mutexes[TCP_SHARD_LISTEN];
+    mutex_lock(mutex);
+    pcb = tcp_pcb_alloc(TCP_SHARD_LISTEN);
     if (!pcb) {
         errorf("tcp_pcb_alloc() failure");
-        mutex_unlock(&mutex);
+        mutex_unlock(mutex);
         return -1;
     }
     pcb->mode = TCP_PCB_MODE_SOCKET;
     id = tcp_pcb_id(pcb);
-    mutex_unlock(&mutex);
+    mutex_unlock(mutex);
     return id;
 }
 
 int
 tcp_connect(int id, struct ip_endpoint *foreign)
 {
+    struct tcp_stack *tcp = tcp_stack();
     struct tcp_pcb *pcb;
     struct ip_endpoint local;
     struct ip_iface *iface;
     char addr[IP_ADDR_STR_LEN];
+    mutex_t *mutex;
     int p;
     int state;
 
-    mutex_lock(&mutex);
-    pcb = tcp_pcb_get(id);
+    tcp_lock_all();
+    pcb = tcp_pcb_lookup(id);
     if (!pcb) {
         errorf("pcb not found");
-        mutex_unlock(&mutex);
+        tcp_unlock_all(NULL);
         return -1;
     }
     if (pcb->mode != TCP_PCB_MODE_SOCKET) {
         errorf("not opened in socket mode");
-        mutex_unlock(&mutex);
+        tcp_unlock_all(NULL);
+        return -1;
+    }
+    if (pcb->state != TCP_PCB_STATE_CLOSED) {
+        errorf("not in CLOSED state");
+        tcp_unlock_all(NULL);
         return -1;
     }
     local.addr = pcb->local.addr;
@@ -1033,7 +2027,7 @@ tcp_connect(int id, struct ip_endpoint *foreign)
         iface = ip_route_get_iface(foreign->addr);
         if (!iface) {
             errorf("ip_route_get_iface() failure");
-            mutex_unlock(&mutex);
+            tcp_unlock_all(NULL);
             return -1;
         }
         debugf("select source address: %s", ip_addr_ntop(iface->unicast, addr, sizeof(addr)));
@@ -1042,7 +2036,7 @@ tcp_connect(int id, struct ip_endpoint *foreign)
     if (!local.port) {
         for (p = TCP_SOURCE_PORT_MIN; p <= TCP_SOURCE_PORT_MAX; p++) {
             local.port = p;
-            if (!tcp_pcb_select(&local, foreign)) {
+            if (!tcp_pcb_select(TCP_SHARD_ANY, &local, foreign)) {
                 debugf("dinamic assign srouce port: %d", ntoh16(local.port));
                 pcb->local.port = local.port;
                 break;
@@ -1050,7 +2044,7 @@ tcp_connect(int id, struct ip_endpoint *foreign)
         }
         if (!local.port) {
             debugf("failed to dinamic assign srouce port");
-            mutex_unlock(&mutex);
+            tcp_unlock_all(NULL);
             return -1;
         }
     }
@@ -1058,13 +2052,24 @@ tcp_connect(int id, struct ip_endpoint *foreign)
     pcb->local.port = local.port;
     pcb->foreign.addr = foreign->addr;
     pcb->foreign.port = foreign->port;
-    pcb->rcv.wnd = sizeof(pcb->buf);
+    /* NOTE: move to the shard of the flow, only its lock is kept */
+    p = tcp_flow_shard(&pcb->local, &pcb->foreign);
+    tcp_pcb_move(pcb, p);
+    mutex = &tcp->mutexes[p];
+    tcp_unlock_all(mutex);
+    if (tcp_pcb_alloc_buffers(pcb) == -1) {
+        pcb->state = TCP_PCB_STATE_CLOSED;
+        tcp_pcb_release(pcb);
+        mutex_unlock(mutex);
+        return -1;
+    }
+    pcb->wscale_on = 1;
     pcb->iss = random();
-    if (tcp_output(pcb, TCP_FLG_SYN, NULL, 0) == -1) {
+    if (tcp_output(pcb, TCP_FLG_SYN) == -1) {
         errorf("tcp_output() failure");
         pcb->state = TCP_PCB_STATE_CLOSED;
         tcp_pcb_release(pcb);
-        mutex_unlock(&mutex);
+        mutex_unlock(mutex);
         return -1;
     }
     pcb->snd.una = pcb->iss;
@@ -1074,11 +2079,11 @@ AGAIN:
     state = pcb->state;
     // waiting for state changed
     while (pcb->state == state) {
-        if (sched_sleep(&pcb->ctx, &mutex, NULL) == -1) {
+        if (sched_sleep(&pcb->ctx, mutex, NULL) == -1) {
             debugf("interrupted");
             pcb->state = TCP_PCB_STATE_CLOSED;
             tcp_pcb_release(pcb);
-            mutex_unlock(&mutex);
+            mutex_unlock(mutex);
             errno = EINTR;
             return -1;
         }
@@ -1090,11 +2095,11 @@ AGAIN:
         errorf("open error: %d", pcb->state);
         pcb->state = TCP_PCB_STATE_CLOSED;
         tcp_pcb_release(pcb);
-        mutex_unlock(&mutex);
+        mutex_unlock(mutex);
         return -1;
     }
     id = tcp_pcb_id(pcb);
-    mutex_unlock(&mutex);
+    mutex_unlock(mutex);
     return id;
 }
 
@@ -1104,27 +2109,117 @@ tcp_bind(int id, struct ip_endpoint *local)
     struct tcp_pcb *pcb, *exist;
     char ep[IP_ENDPOINT_STR_LEN];
 
-    mutex_lock(&mutex);
-    pcb = tcp_pcb_get(id);
+    tcp_lock_all();
+    pcb = tcp_pcb_lookup(id);
     if (!pcb) {
         errorf("pcb not found");
-        mutex_unlock(&mutex);
+        tcp_unlock_all(NULL);
         return -1;
     }
     if (pcb->mode != TCP_PCB_MODE_SOCKET) {
         errorf("not opened in socket mode");
-        mutex_unlock(&mutex);
+        tcp_unlock_all(NULL);
         return -1;
     }
-    exist = tcp_pcb_select(local, NULL);
+    exist = tcp_pcb_select(TCP_SHARD_ANY, local, NULL);
     if (exist) {
         errorf("already bound, exist=%s", ip_endpoint_ntop(&exist->local, ep, sizeof(ep)));
-        mutex_unlock(&mutex);
+        tcp_unlock_all(NULL);
         return -1;
     }
     pcb->local = *local;
     debugf("success: local=%s", ip_endpoint_ntop(&pcb->local, ep, sizeof(ep)));
-    mutex_unlock(&mutex);
+    tcp_unlock_all(NULL);
+    return 0;
+}
+
+/*
+ * NOTE: sizes the receive and send buffers (0: unchanged), allowed before the SYN is sent; a connection
+ *       accepted from a listener takes the sizes of the listener. A receive buffer over 64KB is advertised
+ *       with the window scale option (RFC 7323), in effect only if the peer sends it too. However large the
+ *       send buffer, the data in flight grows with the congestion window (see tcp_cwnd_ack()).
+ */
+int
+tcp_set_bufsize(int id, size_t rcvbuf, size_t sndbuf)
+{
+    struct tcp_pcb *pcb;
+    mutex_t *mutex;
+
+    if ((rcvbuf && (rcvbuf < TCP_BUFSIZE_MIN || rcvbuf > TCP_BUFSIZE_MAX)) ||
+        (sndbuf && (sndbuf < TCP_BUFSIZE_MIN || sndbuf > TCP_BUFSIZE_MAX))) {
+        errorf("invalid size, rcvbuf=%zu, sndbuf=%zu", rcvbuf, sndbuf);
+        return -1;
+    }
+    pcb = tcp_pcb_get(id, &mutex);
+    if (!pcb) {
+        errorf("pcb not found");
+        return -1;
+    }
+    if (pcb->state != TCP_PCB_STATE_CLOSED && pcb->state != TCP_PCB_STATE_LISTEN) {
+        errorf("not in CLOSED or LISTEN state");
+        mutex_unlock(mutex);
+        return -1;
+    }
+    if (rcvbuf) {
+        pcb->bufsize = rcvbuf;
+    }
+    if (sndbuf) {
+        pcb->sbufsize = sndbuf;
+    }
+    mutex_unlock(mutex);
+    return 0;
+}
+
+/*
+ * NOTE: bounds the RTO of the connection (micro seconds), RFC 6298 2.4 recommends 1 second as the lower
+ *       bound, lower ones suit the LAN and loopback paths; a connection accepted from a listener takes the
+ *       bounds of the listener
+ */
+int
+tcp_set_rto_bounds(int id, unsigned int min, unsigned int max)
+{
+    struct tcp_pcb *pcb;
+    mutex_t *mutex;
+
+    if (min < TCP_RTO_MIN || max > TCP_RTO_MAX || min > max) {
+        errorf("invalid bounds, min=%u, max=%u", min, max);
+        return -1;
+    }
+    pcb = tcp_pcb_get(id, &mutex);
+    if (!pcb) {
+        errorf("pcb not found");
+        return -1;
+    }
+    pcb->rto_min = min;
+    pcb->rto_max = max;
+    if (!pcb->rtt.backoff) {
+        pcb->rto = tcp_rto_base(pcb);
+    } else {
+        pcb->rto = MIN(MAX(pcb->rto, min), max);
+    }
+    mutex_unlock(mutex);
+    return 0;
+}
+
+int
+tcp_rtt_stat(int id, struct tcp_rtt_stat *stat)
+{
+    struct tcp_pcb *pcb;
+    mutex_t *mutex;
+
+    pcb = tcp_pcb_get(id, &mutex);
+    if (!pcb) {
+        errorf("pcb not found");
+        return -1;
+    }
+    stat->srtt = pcb->rtt.srtt;
+    stat->rttvar = pcb->rtt.rttvar;
+    stat->rto = pcb->rto;
+    stat->last = pcb->rtt.last;
+    stat->min = pcb->rtt.min;
+    stat->samples = pcb->rtt.samples;
+    stat->retransmits = pcb->rtt.retransmits;
+    mutex_unlock(mutex);
     return 0;
 }
 
@@ -1132,22 +2227,26 @@ int
 tcp_listen(int id, int backlog)
 {
     struct tcp_pcb *pcb;
+    mutex_t *mutex;
 
-    mutex_lock(&mutex);
-    pcb = tcp_pcb_get(id);
+    pcb = tcp_pcb_get(id, &mutex);
     if (!pcb) {
         errorf("pcb not found");
-        mutex_unlock(&mutex);
         return -1;
     }
     if (pcb->mode != TCP_PCB_MODE_SOCKET) {
         errorf("not opened in socket mode");
-        mutex_unlock(&mutex);
+        mutex_unlock(mutex);
+        return -1;
+    }
+    if (pcb->state != TCP_PCB_STATE_CLOSED) {
+        errorf("not in CLOSED state");
+        mutex_unlock(mutex);
         return -1;
     }
     pcb->state = TCP_PCB_STATE_LISTEN;
     (void)backlog; // TODO: set backlog
-    mutex_unlock(&mutex);
+    mutex_unlock(mutex);
     return 0;
 }
 
@@ -1155,44 +2254,44 @@ int
 tcp_accept(int id, struct ip_endpoint *foreign)
 {
     struct tcp_pcb *pcb, *new_pcb;
+    mutex_t *mutex;
     int new_id;
 
-    mutex_lock(&mutex);
-    pcb = tcp_pcb_get(id);
+    pcb = tcp_pcb_get(id, &mutex);
     if (!pcb) {
         errorf("pcb not found");
-        mutex_unlock(&mutex);
         return -1;
     }
     if (pcb->mode != TCP_PCB_MODE_SOCKET) {
         errorf("not opened in socket mode");
-        mutex_unlock(&mutex);
+        mutex_unlock(mutex);
         return -1;
     }
     if (pcb->state != TCP_PCB_STATE_LISTEN) {
         errorf("not in LISTEN state");
-        mutex_unlock(&mutex);
+        mutex_unlock(mutex);
         return -1;
     }
-    while (!(new_pcb = queue_pop(&pcb->backlog))) {
-        if (sched_sleep(&pcb->ctx, &mutex, NULL) == -1) {
+    while (!(new_pcb = queue_data(queue_pop(&pcb->backlog), struct tcp_pcb, link))) {
+        if (sched_sleep(&pcb->ctx, mutex, NULL) == -1) {
             debugf("interrupted");
-            mutex_unlock(&mutex);
+            mutex_unlock(mutex);
             errno = EINTR;
             return -1;
         }
         if (pcb->state == TCP_PCB_STATE_CLOSED) {
             debugf("closed");
             tcp_pcb_release(pcb);
-            mutex_unlock(&mutex);
+            mutex_unlock(mutex);
             return -1;
         }
     }
+    __atomic_store_n(&new_pcb->parent, NULL, __ATOMIC_RELEASE);
     if (foreign) {
         *foreign = new_pcb->foreign;
     }
     new_id = tcp_pcb_id(new_pcb);
-    mutex_unlock(&mutex);
+    mutex_unlock(mutex);
     return new_id;
 }
 
@@ -1205,49 +2304,54 @@ tcp_send(int id, uint8_t *data, size_t len)
 {
     struct tcp_pcb *pcb;
     ssize_t sent = 0;
-    struct ip_iface *iface;
-    size_t mss, cap, slen;
+    uint16_t mtu;
+    size_t n;
+    mutex_t *mutex;
 
-    mutex_lock(&mutex);
-    pcb = tcp_pcb_get(id);
+    pcb = tcp_pcb_get(id, &mutex);
     if (!pcb) {
         errorf("pcb not found");
-        mutex_unlock(&mutex);
         return -1;
     }
 RETRY:
     switch (pcb->state) {
     case TCP_PCB_STATE_CLOSED:
         errorf("connection does not exist");
-        mutex_unlock(&mutex);
+        mutex_unlock(mutex);
         return -1;
     case TCP_PCB_STATE_LISTEN:
         // ignore: change the connection from passive to active
         errorf("this connection is passive");
-        mutex_unlock(&mutex);
+        mutex_unlock(mutex);
         return -1;
     case TCP_PCB_STATE_SYN_SENT:
     case TCP_PCB_STATE_SYN_RECEIVED:
         // ignore: Queue the data for transmission after entering ESTABLISHED state
         errorf("insufficient resources");
-        mutex_unlock(&mutex);
+        mutex_unlock(mutex);
         return -1;
     case TCP_PCB_STATE_ESTABLISHED:
     case TCP_PCB_STATE_CLOSE_WAIT:
-        iface = ip_route_get_iface(pcb->local.addr);
-        if (!iface) {
-            errorf("iface not found");
-            mutex_unlock(&mutex);
-            return -1;
+        if (!pcb->mss) {
+            /* NOTE: taken once, from then on only lowered by tcp_input_error() */
+            mtu = ip_pmtu_get(pcb->foreign.addr);
+            if (!mtu) {
+                errorf("no route to host");
+                mutex_unlock(mutex);
+                return -1;
+            }
+            pcb->mtu = mtu;
+            pcb->mss = mtu - (IP_HDR_SIZE_MIN + sizeof(struct tcp_hdr));
         }
-        mss = NET_IFACE(iface)->dev->mtu - (IP_HDR_SIZE_MIN + sizeof(struct tcp_hdr));
         while (sent < (ssize_t)len) {
-            cap = pcb->snd.wnd - (pcb->snd.nxt - pcb->snd.una);
-            if (!cap) {
-                if (sched_sleep(&pcb->ctx, &mutex, NULL) == -1) {
+            /* NOTE: only appended to the send buffer, tcp_output_pending() sends what the window allows */
+            n = tcp_sbuf_append(pcb, data + sent, len - sent);
+            if (!n) {
+                /* NOTE: the send buffer is full, wait for the ACKs to make room */
+                if (sched_sleep(&pcb->ctx, mutex, NULL) == -1) {
                     debugf("interrupted");
                     if (!sent) {
-                        mutex_unlock(&mutex);
+                        mutex_unlock(mutex);
                         errno = EINTR;
                         return -1;
                     }
@@ -1255,16 +2359,8 @@ RETRY:
                 }
                 goto RETRY;
             }
-            slen = MIN(MIN(mss, len - sent), cap);
-            if (tcp_output(pcb, TCP_FLG_ACK | TCP_FLG_PSH, data + sent, slen) == -1) {
-                errorf("tcp_output() failure");
-                pcb->state = TCP_PCB_STATE_CLOSED;
-                tcp_pcb_release(pcb);
-                mutex_unlock(&mutex);
-                return -1;
-            }
-            pcb->snd.nxt += slen;
-            sent += slen;
+            sent += n;
+            tcp_output_pending(pcb);
         }
         break;
     case TCP_PCB_STATE_FIN_WAIT1:
@@ -1273,14 +2369,14 @@ RETRY:
     case TCP_PCB_STATE_LAST_ACK:
     case TCP_PCB_STATE_TIME_WAIT:
         errorf("connection closing");
-        mutex_unlock(&mutex);
+        mutex_unlock(mutex);
         return -1;
     default:
         errorf("unknown state '%u'", pcb->state);
-        mutex_unlock(&mutex);
+        mutex_unlock(mutex);
         return -1;
     }
-    mutex_unlock(&mutex);
+    mutex_unlock(mutex);
     return sent;
 }
 
@@ -1288,36 +2384,35 @@ ssize_t
 tcp_receive(int id, uint8_t *buf, size_t size)
 {
     struct tcp_pcb *pcb;
-    size_t remain, len;
+    size_t remain, len, update;
+    mutex_t *mutex;
 
-    mutex_lock(&mutex);
-    pcb = tcp_pcb_get(id);
+    pcb = tcp_pcb_get(id, &mutex);
     if (!pcb) {
         errorf("pcb not found");
-        mutex_unlock(&mutex);
         return -1;
     }
 RETRY:
     switch (pcb->state) {
     case TCP_PCB_STATE_CLOSED:
         errorf("connection does not exist");
-        mutex_unlock(&mutex);
+        mutex_unlock(mutex);
         return -1;
     case TCP_PCB_STATE_LISTEN:
     case TCP_PCB_STATE_SYN_SENT:
     case TCP_PCB_STATE_SYN_RECEIVED:
         /* ignore: Queue for processing after entering ESTABLISHED state */
         errorf("insufficient resources");
-        mutex_unlock(&mutex);
+        mutex_unlock(mutex);
         return -1;
     case TCP_PCB_STATE_ESTABLISHED:
     case TCP_PCB_STATE_FIN_WAIT1:
     case TCP_PCB_STATE_FIN_WAIT2:
-        remain = sizeof(pcb->buf) - pcb->rcv.wnd;
+        remain = pcb->bufsize - pcb->rcv.wnd;
         if (!remain) {
-            if (sched_sleep(&pcb->ctx, &mutex, NULL) == -1) {
+            if (sched_sleep(&pcb->ctx, mutex, NULL) == -1) {
                 debugf("interrupted");
-                mutex_unlock(&mutex);
+                mutex_unlock(mutex);
                 errno = EINTR;
                 return -1;
             }
@@ -1325,7 +2420,7 @@ RETRY:
         }
         break;
     case TCP_PCB_STATE_CLOSE_WAIT:
-        remain = sizeof(pcb->buf) - pcb->rcv.wnd;
+        remain = pcb->bufsize - pcb->rcv.wnd;
         if (remain) {
             break;
         }
@@ -1334,18 +2429,21 @@ RETRY:
     case TCP_PCB_STATE_LAST_ACK:
     case TCP_PCB_STATE_TIME_WAIT:
         debugf("connection closing");
-        mutex_unlock(&mutex);
+        mutex_unlock(mutex);
         return 0;
     default:
         errorf("unknown state '%u'", pcb->state);
-        mutex_unlock(&mutex);
+        mutex_unlock(mutex);
         return -1;
     }
     len = MIN(size, remain);
-    memcpy(buf, pcb->buf, len);
-    memmove(pcb->buf, pcb->buf + len, remain - len);
-    pcb->rcv.wnd += len;
-    mutex_unlock(&mutex);
+    tcp_rbuf_read(pcb, buf, len);
+    /* NOTE: a window update once the window has opened enough (receiver side SWS avoidance, RFC 1122 4.2.3.3) */
+    update = MIN(pcb->bufsize / 2, tcp_mss(pcb));
+    if (pcb->state != TCP_PCB_STATE_CLOSE_WAIT && pcb->rcv.wnd - len < update && pcb->rcv.wnd >= update) {
+        tcp_output(pcb, TCP_FLG_ACK);
+    }
+    mutex_unlock(mutex);
     return len;
 }
 
@@ -1353,18 +2451,17 @@ int
 tcp_close(int id)
 {
     struct tcp_pcb *pcb;
+    mutex_t *mutex;
 
-    mutex_lock(&mutex);
-    pcb = tcp_pcb_get(id);
+    pcb = tcp_pcb_get(id, &mutex);
     if (!pcb) {
         errorf("pcb not found");
-        mutex_unlock(&mutex);
         return -1;
     }
     switch (pcb->state) {
     case TCP_PCB_STATE_CLOSED:
         errorf("connection does not exist");
-        mutex_unlock(&mutex);
+        mutex_unlock(mutex);
         return -1;
     case TCP_PCB_STATE_LISTEN:
         pcb->state = TCP_PCB_STATE_CLOSED;
@@ -1373,34 +2470,31 @@ tcp_close(int id)
         pcb->state = TCP_PCB_STATE_CLOSED;
         break;
     case TCP_PCB_STATE_SYN_RECEIVED:
-        tcp_output(pcb, TCP_FLG_ACK | TCP_FLG_FIN, NULL, 0);
-        pcb->snd.nxt++;
-        pcb->state = TCP_PCB_STATE_FIN_WAIT1;
-        break;
     case TCP_PCB_STATE_ESTABLISHED:
-        tcp_output(pcb, TCP_FLG_ACK | TCP_FLG_FIN,  NULL, 0);
-        pcb->snd.nxt++;
+        /* NOTE: the FIN follows the data left in the send buffer */
+        pcb->fin = TCP_FIN_QUEUED;
         pcb->state = TCP_PCB_STATE_FIN_WAIT1;
+        tcp_output_pending(pcb);
         break;
     case TCP_PCB_STATE_FIN_WAIT1:
     case TCP_PCB_STATE_FIN_WAIT2:
         errorf("connection closing");
-        mutex_unlock(&mutex);
+        mutex_unlock(mutex);
         return -1;
     case TCP_PCB_STATE_CLOSE_WAIT:
-        tcp_output(pcb, TCP_FLG_ACK | TCP_FLG_FIN, NULL, 0);
-        pcb->snd.nxt++;
+        pcb->fin = TCP_FIN_QUEUED;
         pcb->state = TCP_PCB_STATE_LAST_ACK; /* RFC793 says "enter CLOSING state", but it seems to be LAST-ACK state */
+        tcp_output_pending(pcb);
         break;
     case TCP_PCB_STATE_CLOSING:
     case TCP_PCB_STATE_LAST_ACK:
     case TCP_PCB_STATE_TIME_WAIT:
         errorf("connection closing");
-        mutex_unlock(&mutex);
+        mutex_unlock(mutex);
         return -1;
     default:
         errorf("unknown state '%u'", pcb->state);
-        mutex_unlock(&mutex);
+        mutex_unlock(mutex);
         return -1;
     }
     if (pcb->state == TCP_PCB_STATE_CLOSED) {
@@ -1408,6 +2502,6 @@ tcp_close(int id)
     } else {
         sched_wakeup(&pcb->ctx);
     }
-    mutex_unlock(&mutex);
+    mutex_unlock(mutex);
     return 0;
 }
@@ -18,6 +18,22 @@
 #define TCP_STATE_CLOSE_WAIT  10
 #define TCP_STATE_LAST_ACK    11
 
+#define TCP_BUFSIZE_MIN 4096
+#define TCP_BUFSIZE_MAX (8 * 1024 * 1024)
+
+#define TCP_RTO_MIN 1000 /* micro seconds, the bounds for tcp_set_rto_bounds() */
+#define TCP_RTO_MAX 120000000
+
+struct tcp_rtt_stat {
+    unsigned int srtt; /* micro seconds */
+    unsigned int rttvar;
+    unsigned int rto; /* current, backed off while retransmitting */
+    unsigned int last; /* the latest sample */
+    unsigned int min; /* the lowest sample */
+    unsigned long samples;
+    unsigned long retransmits; /* by timeout */
+};
+
 extern int
 tcp_init(void);
 
@@ -42,5 +58,11 @@ extern int
 tcp_listen(int id, int backlog);
 extern int
 tcp_accept(int id, struct ip_endpoint *foreign);
+extern int
+tcp_set_bufsize(int id, size_t rcvbuf, size_t sndbuf);
+extern int
+tcp_set_rto_bounds(int id, unsigned int min, unsigned int max);
+extern int
+tcp_rtt_stat(int id, struct tcp_rtt_stat *stat);
 
 #endif
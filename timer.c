@@ -0,0 +1,219 @@
+#include <stdint.h>
+#include <time.h>
+
+#include "platform.h"
+
+#include "util.h"
+#include "timer.h"
+
+/*
+ * NOTE: Four levels of 64 slots with 1ms resolution (covers 2^24 ms, about 4.6 hours).
+ *       Level 0 holds the timers due within 64 ticks, one slot per tick. Each higher level
+ *       holds 64 times longer ranges and is cascaded down one level when level 0 wraps around.
+ *       Longer timeouts are clamped to the maximum range.
+ */
+#define TIMER_WHEEL_BITS 6
+#define TIMER_WHEEL_SIZE (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_MASK (TIMER_WHEEL_SIZE - 1)
+#define TIMER_WHEEL_LEVELS 4
+#define TIMER_WHEEL_RANGE(level) ((uint64_t)1 << (TIMER_WHEEL_BITS * ((level) + 1)))
+#define TIMER_WHEEL_INDEX(tick, level) (((tick) >> (TIMER_WHEEL_BITS * (level))) & TIMER_WHEEL_MASK)
+
+struct timer_wheel {
+    mutex_t mutex;
+    struct timer_entry *slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SIZE];
+    struct timer_entry *expired; /* due, waiting for their handler to run */
+    uint64_t current; /* the next tick to process */
+};
+
+uint64_t
+timer_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* NOTE: for measurements finer than the wheel (e.g. the RTT of a LAN) */
+uint64_t
+timer_now_usec(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void
+timer_link(struct timer_entry **head, struct timer_entry *timer)
+{
+    timer->next = *head;
+    if (timer->next) {
+        timer->next->pprev = &timer->next;
+    }
+    *head = timer;
+    timer->pprev = head;
+}
+
+static void
+timer_unlink(struct timer_entry *timer)
+{
+    *timer->pprev = timer->next;
+    if (timer->next) {
+        timer->next->pprev = timer->pprev;
+    }
+    timer->next = NULL;
+    timer->pprev = NULL;
+}
+
+/* NOTE: must be called after wheel->mutex locked */
+static void
+timer_insert(struct timer_wheel *wheel, struct timer_entry *timer)
+{
+    uint64_t delta;
+    int level;
+
+    if (timer->expire < wheel->current) {
+        /* already due, run on the next tick */
+        timer->expire = wheel->current;
+    }
+    delta = timer->expire - wheel->current;
+    if (delta >= TIMER_WHEEL_RANGE(TIMER_WHEEL_LEVELS - 1)) {
+        delta = TIMER_WHEEL_RANGE(TIMER_WHEEL_LEVELS - 1) - 1;
+        timer->expire = wheel->current + delta;
+    }
+    for (level = 0; delta >= TIMER_WHEEL_RANGE(level); level++);
+    timer_link(&wheel->slots[level][TIMER_WHEEL_INDEX(timer->expire, level)], timer);
+}
+
+void
+timer_entry_init(struct timer_entry *timer, struct timer_wheel *wheel, void (*handler)(void *arg), void *arg)
+{
+    timer->next = NULL;
+    timer->pprev = NULL;
+    timer->expire = 0;
+    timer->wheel = wheel;
+    timer->handler = handler;
+    timer->arg = arg;
+}
+
+void
+timer_arm(struct timer_entry *timer, uint64_t msec)
+{
+    struct timer_wheel *wheel = timer->wheel;
+
+    mutex_lock(&wheel->mutex);
+    if (timer->pprev) {
+        timer_unlink(timer);
+    }
+    timer->expire = timer_now() + msec;
+    timer_insert(wheel, timer);
+    mutex_unlock(&wheel->mutex);
+}
+
+void
+timer_cancel(struct timer_entry *timer)
+{
+    struct timer_wheel *wheel = timer->wheel;
+
+    mutex_lock(&wheel->mutex);
+    if (timer->pprev) {
+        timer_unlink(timer);
+    }
+    mutex_unlock(&wheel->mutex);
+}
+
+int
+timer_pending(struct timer_entry *timer)
+{
+    struct timer_wheel *wheel = timer->wheel;
+    int ret;
+
+    mutex_lock(&wheel->mutex);
+    ret = timer->pprev != NULL;
+    mutex_unlock(&wheel->mutex);
+    return ret;
+}
+
+/* NOTE: must be called after wheel->mutex locked */
+static void
+timer_cascade(struct timer_wheel *wheel, int level)
+{
+    struct timer_entry *timer;
+    struct timer_entry **slot;
+
+    slot = &wheel->slots[level][TIMER_WHEEL_INDEX(wheel->current, level)];
+    while ((timer = *slot) != NULL) {
+        timer_unlink(timer);
+        timer_insert(wheel, timer);
+    }
+}
+
+/* NOTE: must be called after wheel->mutex locked */
+static void
+timer_tick(struct timer_wheel *wheel)
+{
+    struct timer_entry *timer;
+    struct timer_entry **slot;
+    int level;
+
+    for (level = 1; level < TIMER_WHEEL_LEVELS; level++) {
+        if (TIMER_WHEEL_INDEX(wheel->current, level - 1) != 0) {
+            break;
+        }
+        timer_cascade(wheel, level);
+    }
+    slot = &wheel->slots[0][TIMER_WHEEL_INDEX(wheel->current, 0)];
+    while ((timer = *slot) != NULL) {
+        timer_unlink(timer);
+        timer_link(&wheel->expired, timer);
+    }
+    wheel->current++;
+}
+
+/* NOTE: called on every tick of the thread that owns the wheel */
+int
+timer_expire(struct timer_wheel *wheel)
+{
+    uint64_t now;
+    struct timer_entry *timer;
+    void (*handler)(void *arg);
+    void *arg;
+
+    now = timer_now();
+    mutex_lock(&wheel->mutex);
+    while (wheel->current <= now) {
+        timer_tick(wheel);
+    }
+    while ((timer = wheel->expired) != NULL) {
+        timer_unlink(timer);
+        handler = timer->handler;
+        arg = timer->arg;
+        mutex_unlock(&wheel->mutex);
+        handler(arg);
+        mutex_lock(&wheel->mutex);
+    }
+    mutex_unlock(&wheel->mutex);
+    return 0;
+}
+
+struct timer_wheel *
+timer_wheel_alloc(void)
+{
+    struct timer_wheel *wheel;
+
+    wheel = memory_alloc(sizeof(*wheel));
+    if (!wheel) {
+        return NULL;
+    }
+    mutex_init(&wheel->mutex);
+    wheel->current = timer_now();
+    return wheel;
+}
+
+void
+timer_wheel_free(struct timer_wheel *wheel)
+{
+    memory_free(wheel);
+}
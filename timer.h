@@ -0,0 +1,49 @@
+#ifndef TIMER_H
+#define TIMER_H
+
+#include <stdint.h>
+
+/*
+ * Timer (hierarchical timing wheel)
+ *
+ * NOTE: An entry is embedded in the object it times and armed/cancelled in O(1).
+ *       Handlers run on the intr thread without any timer lock held, so they may re-arm themselves.
+ *       A handler can still race with a concurrent re-arm/cancel from another thread,
+ *       so it must re-validate the state of its object under the object's own lock.
+ *       Each wheel is expired by one thread, the intr thread or a net worker of a stack
+ *       (see net_worker_wheel()), an entry is bound to its wheel on init.
+ */
+
+struct timer_wheel; /* opaque, see timer.c */
+
+struct timer_entry {
+    struct timer_entry *next;
+    struct timer_entry **pprev; /* NULL when not pending */
+    uint64_t expire; /* milliseconds (monotonic) */
+    struct timer_wheel *wheel;
+    void (*handler)(void *arg);
+    void *arg;
+};
+
+extern uint64_t
+timer_now(void);
+extern uint64_t
+timer_now_usec(void);
+
+extern void
+timer_entry_init(struct timer_entry *timer, struct timer_wheel *wheel, void (*handler)(void *arg), void *arg);
+extern void
+timer_arm(struct timer_entry *timer, uint64_t msec);
+extern void
+timer_cancel(struct timer_entry *timer);
+extern int
+timer_pending(struct timer_entry *timer);
+
+extern struct timer_wheel *
+timer_wheel_alloc(void);
+extern void
+timer_wheel_free(struct timer_wheel *wheel);
+extern int
+timer_expire(struct timer_wheel *wheel);
+
+#endif
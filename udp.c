@@ -8,6 +8,7 @@
 #include "platform.h"
 
 #include "util.h"
+#include "pktbuf.h"
 #include "net.h"
 #include "ip.h"
 #include "udp.h"
@@ -22,6 +23,16 @@
 #define UDP_SOURCE_PORT_MIN 49152
 #define UDP_SOURCE_PORT_MAX 65535
 
+/*
+ * NOTE: A pcb belongs to the shard of its local port (the net worker the datagrams to the port are
+ *       steered to, see ip_hash()) and is protected by the lock of the shard. The pcbs not bound yet
+ *       belong to the shard of port 0. Binding (explicitly or on the first sendto) moves the pcb with
+ *       all locks held, they are taken in ascending order of the shard index.
+ */
+#define UDP_SHARD_NUM  NET_WORKER_NUM
+#define UDP_SHARD_NONE (-1) /* free pcb */
+#define UDP_SHARD_ANY  (-2) /* for udp_pcb_select(), all locks must be held */
+
 struct pseudo_hdr {
     uint32_t src;
     uint32_t dst;
@@ -42,47 +53,113 @@ struct udp_pcb {
     struct ip_endpoint local;
     struct queue_head queue; /* receive queue */
     struct sched_ctx ctx;
+    int shard;
 };
 
-/* NOTE: the data follows immediately after the structure */
 struct udp_queue_entry {
+    struct queue_entry link;
     struct ip_endpoint foreign;
-    uint16_t len;
+    struct pktbuf *pkt; /* NOTE: holds a reference to the received packet (payload only) */
+};
+
+struct udp_stack {
+    mutex_t mutexes[UDP_SHARD_NUM];
+    struct udp_pcb pcbs[UDP_PCB_SIZE];
 };
 
-static mutex_t mutex = MUTEX_INITIALIZER;
-static struct udp_pcb pcbs[UDP_PCB_SIZE];
+static struct udp_stack *
+udp_stack(void)
+{
+    return net_stack_priv(NET_STACK_PRIV_UDP);
+}
 
 static void
-udp_dump(const uint8_t *data, size_t len)
+udp_dump(FILE *fp, const void *data, size_t len)
 {
     struct udp_hdr *hdr;
 
-    flockfile(stderr);
+    flockfile(fp);
     hdr = (struct udp_hdr *)data;
-    fprintf(stderr, "        src: %u\n", ntoh16(hdr->src));
-    fprintf(stderr, "        dst: %u\n", ntoh16(hdr->dst));
-    fprintf(stderr, "        len: %u\n", ntoh16(hdr->len));
-    fprintf(stderr, "        sum: 0x%04x\n", ntoh16(hdr->sum));
+    fprintf(fp, "        src: %u\n", ntoh16(hdr->src));
+    fprintf(fp, "        dst: %u\n", ntoh16(hdr->dst));
+    fprintf(fp, "        len: %u\n", ntoh16(hdr->len));
+    fprintf(fp, "        sum: 0x%04x\n", ntoh16(hdr->sum));
 #ifdef HEXDUMP
-    hexdump(stderr, data, len);
+    hexdump(fp, data, len);
 #endif
-    funlockfile(stderr);
+    funlockfile(fp);
 }
 
 /*
  * UDP Protocol Control Block (PCB)
  *
- * NOTE: UDP PCB functions must be called after mutex locked
+ * NOTE: UDP PCB functions must be called after the mutex of the shard locked
  */
 
+static int
+udp_pcb_shard(struct udp_pcb *pcb)
+{
+    return __atomic_load_n(&pcb->shard, __ATOMIC_ACQUIRE);
+}
+
+static int
+udp_port_shard(uint16_t port)
+{
+    return net_worker_select(ip_flow_hash(IP_ADDR_ANY, IP_ADDR_ANY, 0, port));
+}
+
+static void
+udp_lock_all(void)
+{
+    struct udp_stack *udp = udp_stack();
+    mutex_t *mutex;
+
+    for (mutex = udp->mutexes; mutex < tailof(udp->mutexes); mutex++) {
+        mutex_lock(mutex);
+    }
+}
+
+static void
+udp_unlock_all(void)
+{
+    struct udp_stack *udp = udp_stack();
+    mutex_t *mutex;
+
+    for (mutex = udp->mutexes; mutex < tailof(udp->mutexes); mutex++) {
+        mutex_unlock(mutex);
+    }
+}
+
+/* NOTE: returns the mutex of the shard the pcb belongs to (locked), NULL if the pcb is free */
+static mutex_t *
+udp_pcb_lock(struct udp_pcb *pcb)
+{
+    struct udp_stack *udp = udp_stack();
+    mutex_t *mutex;
+    int shard;
+
+    while ((shard = udp_pcb_shard(pcb)) != UDP_SHARD_NONE) {
+        mutex = &udp->mutexes[shard];
+        mutex_lock(mutex);
+        if (udp_pcb_shard(pcb) == shard) {
+            return mutex;
+        }
+        /* moved (or released) while waiting for the lock */
+        mutex_unlock(mutex);
+    }
+    return NULL;
+}
+
 static struct udp_pcb *
-udp_pcb_alloc(void)
+udp_pcb_alloc(int shard)
 {
+    struct udp_stack *udp = udp_stack();
     struct udp_pcb *pcb;
+    int expected;
 
-    for (pcb = pcbs; pcb < tailof(pcbs); pcb++) {
-        if (pcb->state == UDP_PCB_STATE_FREE) {
+    for (pcb = udp->pcbs; pcb < tailof(udp->pcbs); pcb++) {
+        expected = UDP_SHARD_NONE;
+        if (__atomic_compare_exchange_n(&pcb->shard, &expected, shard, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
             pcb->state = UDP_PCB_STATE_OPEN;
             sched_ctx_init(&pcb->ctx);
             return pcb;
@@ -94,7 +171,7 @@ udp_pcb_alloc(void)
 static void
 udp_pcb_release(struct udp_pcb *pcb)
 {
-    struct queue_entry *entry;
+    struct udp_queue_entry *entry;
 
     pcb->state = UDP_PCB_STATE_CLOSING;
     if (sched_ctx_destroy(&pcb->ctx) == -1) {
@@ -104,17 +181,24 @@ udp_pcb_release(struct udp_pcb *pcb)
     pcb->state = UDP_PCB_STATE_FREE;
     pcb->local.addr = IP_ADDR_ANY;
     pcb->local.port = 0;
-    while ((entry = queue_pop(&pcb->queue)) != NULL) {
+    while ((entry = queue_data(queue_pop(&pcb->queue), struct udp_queue_entry, link)) != NULL) {
+        pktbuf_free(entry->pkt);
         memory_free(entry);
     }
+    /* NOTE: the slot can be allocated by another shard right after */
+    __atomic_store_n(&pcb->shard, UDP_SHARD_NONE, __ATOMIC_RELEASE);
 }
 
 static struct udp_pcb *
-udp_pcb_select(ip_addr_t addr, uint16_t port)
+udp_pcb_select(int shard, ip_addr_t addr, uint16_t port)
 {
+    struct udp_stack *udp = udp_stack();
     struct udp_pcb *pcb;
 
-    for (pcb = pcbs; pcb < tailof(pcbs); pcb++) {
+    for (pcb = udp->pcbs; pcb < tailof(udp->pcbs); pcb++) {
+        if (shard != UDP_SHARD_ANY && udp_pcb_shard(pcb) != shard) {
+            continue;
+        }
         if (pcb->state == UDP_PCB_STATE_OPEN) {
             if ((pcb->local.addr == IP_ADDR_ANY || pcb->local.addr == addr) && pcb->local.port == port) {
                 return pcb;
@@ -124,31 +208,68 @@ udp_pcb_select(ip_addr_t addr, uint16_t port)
     return NULL;
 }
 
+/* NOTE: the caller must hold all udp->mutexes */
+static struct udp_pcb *
+udp_pcb_lookup(int id)
+{
+    struct udp_stack *udp = udp_stack();
+    struct udp_pcb *pcb;
+
+    if (id < 0 || id >= (int)countof(udp->pcbs)) {
+        /* out of range */
+        return NULL;
+    }
+    pcb = &udp->pcbs[id];
+    if (udp_pcb_shard(pcb) == UDP_SHARD_NONE || pcb->state != UDP_PCB_STATE_OPEN) {
+        return NULL;
+    }
+    return pcb;
+}
+
+/* NOTE: returns the pcb with the mutex of its shard locked */
 static struct udp_pcb *
-udp_pcb_get(int id)
+udp_pcb_get(int id, mutex_t **mutex)
 {
+    struct udp_stack *udp = udp_stack();
     struct udp_pcb *pcb;
 
-    if (id < 0 || id >= (int)countof(pcbs)) {
+    if (id < 0 || id >= (int)countof(udp->pcbs)) {
         /* out of range */
         return NULL;
     }
-    pcb = &pcbs[id];
+    pcb = &udp->pcbs[id];
+    *mutex = udp_pcb_lock(pcb);
+    if (!*mutex) {
+        return NULL;
+    }
     if (pcb->state != UDP_PCB_STATE_OPEN) {
+        mutex_unlock(*mutex);
         return NULL;
     }
     return pcb;
 }
 
+/* NOTE: must be called after all udp->mutexes locked */
+static void
+udp_pcb_bind(struct udp_pcb *pcb, struct ip_endpoint *local)
+{
+    pcb->local = *local;
+    __atomic_store_n(&pcb->shard, udp_port_shard(local->port), __ATOMIC_RELEASE);
+}
+
 static int
 udp_pcb_id(struct udp_pcb *pcb)
 {
-    return indexof(pcbs, pcb);
+    struct udp_stack *udp = udp_stack();
+    return indexof(udp->pcbs, pcb);
 }
 
 static void
-udp_input(const uint8_t *data, size_t len, ip_addr_t src, ip_addr_t dst, struct ip_iface *iface)
+udp_input(struct pktbuf *pkt, ip_addr_t src, ip_addr_t dst, struct ip_iface *iface)
 {
+    struct udp_stack *udp = udp_stack();
+    const uint8_t *data = pkt->data;
+    size_t len = pktbuf_len(pkt);
     struct pseudo_hdr pseudo;
     uint16_t psum = 0;
     struct udp_hdr *hdr;
@@ -156,6 +277,8 @@ udp_input(const uint8_t *data, size_t len, ip_addr_t src, ip_addr_t dst, struct
     char addr2[IP_ADDR_STR_LEN];
     struct udp_pcb *pcb;
     struct udp_queue_entry *entry;
+    mutex_t *mutex;
+    int shard;
 
     if (len < sizeof(*hdr)) {
         errorf("too short");
@@ -180,48 +303,52 @@ udp_input(const uint8_t *data, size_t len, ip_addr_t src, ip_addr_t dst, struct
         ip_addr_ntop(src, addr1, sizeof(addr1)), ntoh16(hdr->src),
         ip_addr_ntop(dst, addr2, sizeof(addr2)), ntoh16(hdr->dst),
         len, len - sizeof(*hdr));
-    udp_dump(data, len);
-    mutex_lock(&mutex);
-    pcb = udp_pcb_select(dst, hdr->dst);
+    debugdump_with(udp_dump, data, len);
+    shard = udp_port_shard(hdr->dst);
+    mutex = &udp->mutexes[shard];
+    mutex_lock(mutex);
+    pcb = udp_pcb_select(shard, dst, hdr->dst);
     if (!pcb) {
         /* port is not in use */
-        mutex_unlock(&mutex);
+        mutex_unlock(mutex);
         return;
     }
-    entry = memory_alloc(sizeof(*entry) + (len - sizeof(*hdr)));
+    entry = memory_alloc_nozero(sizeof(*entry));
     if (!entry) {
-        mutex_unlock(&mutex);
-        errorf("memory_alloc() failure");
+        mutex_unlock(mutex);
+        errorf("memory_alloc_nozero() failure");
         return;
     }
     entry->foreign.addr = src;
     entry->foreign.port = hdr->src;
-    entry->len = len - sizeof(*hdr);
-    memcpy(entry + 1, hdr + 1, entry->len);
-    if (!queue_push(&pcb->queue, entry)) {
-        mutex_unlock(&mutex);
-        errorf("queue_push() failure");
-        return;
-    }
+    pktbuf_pull(pkt, sizeof(*hdr));
+    entry->pkt = pktbuf_get(pkt); /* NOTE: queue the packet itself instead of copying the payload */
+    queue_push(&pcb->queue, &entry->link);
     sched_wakeup(&pcb->ctx);
-    mutex_unlock(&mutex);
+    mutex_unlock(mutex);
 }
 
 ssize_t
 udp_output(struct ip_endpoint *src, struct ip_endpoint *dst, const  uint8_t *data, size_t len)
 {
-    uint8_t buf[IP_PAYLOAD_SIZE_MAX];
+    struct pktbuf *pkt;
     struct udp_hdr *hdr;
     struct pseudo_hdr pseudo;
     uint16_t total, psum = 0;
     char ep1[IP_ENDPOINT_STR_LEN];
     char ep2[IP_ENDPOINT_STR_LEN];
+    ssize_t ret;
 
     if (len > IP_PAYLOAD_SIZE_MAX - sizeof(*hdr)) {
         errorf("too long");
         return -1;
     }
-    hdr = (struct udp_hdr *)buf;
+    pkt = pktbuf_alloc(PKTBUF_HEADROOM, sizeof(*hdr) + len);
+    if (!pkt) {
+        errorf("pktbuf_alloc() failure");
+        return -1;
+    }
+    hdr = (struct udp_hdr *)pktbuf_put(pkt, sizeof(*hdr) + len);
     hdr->src = src->port;
     hdr->dst = dst->port;
     total = sizeof(*hdr) + len;
@@ -237,8 +364,10 @@ udp_output(struct ip_endpoint *src, struct ip_endpoint *dst, const  uint8_t *dat
     hdr->sum = cksum16((uint16_t *)hdr, total, psum);
     debugf("%s => %s, len=%zu (payload=%zu)",
         ip_endpoint_ntop(src, ep1, sizeof(ep1)), ip_endpoint_ntop(dst, ep2, sizeof(ep2)), total, len);
-    udp_dump((uint8_t *)hdr, total);
-    if (ip_output(IP_PROTOCOL_UDP, (uint8_t *)hdr, total, src->addr, dst->addr) == -1) {
+    debugdump_with(udp_dump, (uint8_t *)hdr, total);
+    ret = ip_output(IP_PROTOCOL_UDP, pkt, src->addr, dst->addr);
+    pktbuf_free(pkt);
+    if (ret == -1) {
         errorf("ip_output() failure");
         return -1;
     }
@@ -248,20 +377,37 @@ udp_output(struct ip_endpoint *src, struct ip_endpoint *dst, const  uint8_t *dat
 static void
 event_handler(void *arg)
 {
+    struct udp_stack *udp = udp_stack();
     struct udp_pcb *pcb;
 
-    mutex_lock(&mutex);
-    for (pcb = pcbs; pcb < tailof(pcbs); pcb++) {
-        if (pcb->state == UDP_PCB_STATE_OPEN) {
+    udp_lock_all();
+    for (pcb = udp->pcbs; pcb < tailof(udp->pcbs); pcb++) {
+        if (udp_pcb_shard(pcb) != UDP_SHARD_NONE && pcb->state == UDP_PCB_STATE_OPEN) {
             sched_interrupt(&pcb->ctx);
         }
     }
-    mutex_unlock(&mutex);
+    udp_unlock_all();
 }
 
 int
 udp_init(void)
 {
+    struct udp_stack *udp;
+    struct udp_pcb *pcb;
+    mutex_t *mutex;
+
+    udp = memory_alloc(sizeof(*udp));
+    if (!udp) {
+        errorf("memory_alloc() failure");
+        return -1;
+    }
+    for (mutex = udp->mutexes; mutex < tailof(udp->mutexes); mutex++) {
+        mutex_init(mutex);
+    }
+    for (pcb = udp->pcbs; pcb < tailof(udp->pcbs); pcb++) {
+        pcb->shard = UDP_SHARD_NONE;
+    }
+    net_stack_set_priv(NET_STACK_PRIV_UDP, udp);
     if (ip_protocol_register("UDP", IP_PROTOCOL_UDP, udp_input) == -1) {
         errorf("ip_protocol_register() failure");
         return -1;
@@ -277,18 +423,22 @@ udp_init(void)
 int
 udp_open(void)
 {
+    struct udp_stack *udp = udp_stack();
     struct udp_pcb *pcb;
-    int id;
+    mutex_t *mutex;
+    int shard, id;
 
-    mutex_lock(&mutex);
-    pcb = udp_pcb_alloc();
+    shard = udp_port_shard(0);
+    mutex = &udp->mutexes[shard];
+    mutex_lock(mutex);
+    pcb = udp_pcb_alloc(shard);
     if (!pcb) {
         errorf("udp_pcb_alloc() failure");
-        mutex_unlock(&mutex);
+        mutex_unlock(mutex);
         return -1;
     }
     id = udp_pcb_id(pcb);
-    mutex_unlock(&mutex);
+    mutex_unlock(mutex);
     return id;
 }
 
@@ -296,16 +446,15 @@ int
 udp_close(int id)
 {
     struct udp_pcb *pcb;
+    mutex_t *mutex;
 
-    mutex_lock(&mutex);
-    pcb = udp_pcb_get(id);
+    pcb = udp_pcb_get(id, &mutex);
     if (!pcb) {
         errorf("pcb not found, id=%d", id);
-        mutex_unlock(&mutex);
         return -1;
     }
     udp_pcb_release(pcb);
-    mutex_unlock(&mutex);
+    mutex_unlock(mutex);
     return 0;
 }
 
@@ -316,23 +465,23 @@ udp_bind(int id, struct ip_endpoint *local)
     char ep1[IP_ENDPOINT_STR_LEN];
     char ep2[IP_ENDPOINT_STR_LEN];
 
-    mutex_lock(&mutex);
-    pcb = udp_pcb_get(id);
+    udp_lock_all();
+    pcb = udp_pcb_lookup(id);
     if (!pcb) {
         errorf("pcb not found, id=%d", id);
-        mutex_unlock(&mutex);
+        udp_unlock_all();
         return -1;
     }
-    exist = udp_pcb_select(local->addr, local->port);
+    exist = udp_pcb_select(UDP_SHARD_ANY, local->addr, local->port);
     if (exist) {
         errorf("already in use, id=%d, want=%s, exist=%s",
             id, ip_endpoint_ntop(local, ep1, sizeof(ep1)), ip_endpoint_ntop(&exist->local, ep2, sizeof(ep2)));
-        mutex_unlock(&mutex);
+        udp_unlock_all();
         return -1;
     }
-    pcb->local = *local;
+    udp_pcb_bind(pcb, local);
     debugf("bound, id=%d, local=%s", id, ip_endpoint_ntop(&pcb->local, ep1, sizeof(ep1)));
-    mutex_unlock(&mutex);
+    udp_unlock_all();
     return 0;
 }
 
@@ -343,13 +492,13 @@ udp_sendto(int id, uint8_t *data, size_t len, struct ip_endpoint *foreign)
     struct ip_endpoint local;
     struct ip_iface *iface;
     char addr[IP_ADDR_STR_LEN];
+    struct ip_endpoint bound;
+    mutex_t *mutex;
     uint32_t p;
 
-    mutex_lock(&mutex);
-    pcb = udp_pcb_get(id);
+    pcb = udp_pcb_get(id, &mutex);
     if (!pcb) {
         errorf("pcb not found, id=%d", id);
-        mutex_unlock(&mutex);
         return -1;
     }
     local.addr = pcb->local.addr;
@@ -358,65 +507,90 @@ udp_sendto(int id, uint8_t *data, size_t len, struct ip_endpoint *foreign)
         if (!iface) {
             errorf("iface not found that can reach foreign address, addr=%s",
                 ip_addr_ntop(foreign->addr, addr, sizeof(addr)));
-            mutex_unlock(&mutex);
+            mutex_unlock(mutex);
             return -1;
         }
         local.addr = iface->unicast;
         debugf("select local address, addr=%s", ip_addr_ntop(local.addr, addr, sizeof(addr)));
     }
     if (!pcb->local.port) {
-        for (p = UDP_SOURCE_PORT_MIN; p <= UDP_SOURCE_PORT_MAX; p++) {
-            if (!udp_pcb_select(local.addr, hton16(p))) {
-                pcb->local.port = hton16(p);
-                debugf("dinamic assign local port, port=%d", p);
-                break;
-            }
+        /* NOTE: binding moves the pcb, retry with all locks held (fast path if already bound) */
+        mutex_unlock(mutex);
+        udp_lock_all();
+        pcb = udp_pcb_lookup(id);
+        if (!pcb) {
+            errorf("pcb not found, id=%d", id);
+            udp_unlock_all();
+            return -1;
         }
         if (!pcb->local.port) {
-            debugf("failed to dinamic assign local port, addr=%s", ip_addr_ntop(local.addr, addr, sizeof(addr)));
-            mutex_unlock(&mutex);
-            return -1;
+            for (p = UDP_SOURCE_PORT_MIN; p <= UDP_SOURCE_PORT_MAX; p++) {
+                if (!udp_pcb_select(UDP_SHARD_ANY, local.addr, hton16(p))) {
+                    bound.addr = pcb->local.addr;
+                    bound.port = hton16(p);
+                    udp_pcb_bind(pcb, &bound);
+                    debugf("dinamic assign local port, port=%d", p);
+                    break;
+                }
+            }
+            if (!pcb->local.port) {
+                debugf("failed to dinamic assign local port, addr=%s", ip_addr_ntop(local.addr, addr, sizeof(addr)));
+                udp_unlock_all();
+                return -1;
+            }
         }
+        local.port = pcb->local.port;
+        udp_unlock_all();
+        return udp_output(&local, foreign, data, len);
     }
     local.port = pcb->local.port;
-    mutex_unlock(&mutex);
+    mutex_unlock(mutex);
     return udp_output(&local, foreign, data, len);
 }
 
 ssize_t
 udp_recvfrom(int id, uint8_t *buf, size_t size, struct ip_endpoint *foreign)
 {
+    struct udp_stack *udp = udp_stack();
     struct udp_pcb *pcb;
     struct udp_queue_entry *entry;
     ssize_t len;
+    mutex_t *mutex;
 
-    mutex_lock(&mutex);
-    pcb = udp_pcb_get(id);
+    pcb = udp_pcb_get(id, &mutex);
     if (!pcb) {
         errorf("pcb not found, id=%d", id);
-        mutex_unlock(&mutex);
         return -1;
     }
-    while (!(entry = queue_pop(&pcb->queue))) {
-        if (sched_sleep(&pcb->ctx, &mutex, NULL) == -1) {
+    while (!(entry = queue_data(queue_pop(&pcb->queue), struct udp_queue_entry, link))) {
+        if (sched_sleep(&pcb->ctx, mutex, NULL) == -1) {
             debugf("interrupted");
-            mutex_unlock(&mutex);
+            mutex_unlock(mutex);
             errno = EINTR;
             return -1;
         }
+        if (mutex != &udp->mutexes[udp_pcb_shard(pcb)]) {
+            /* NOTE: bound (moved to another shard) while sleeping */
+            mutex_unlock(mutex);
+            mutex = udp_pcb_lock(pcb);
+            if (!mutex) {
+                return -1;
+            }
+        }
         if (pcb->state == UDP_PCB_STATE_CLOSING) {
             debugf("closed");
             udp_pcb_release(pcb);
-            mutex_unlock(&mutex);
+            mutex_unlock(mutex);
             return -1;
         }
     }
-    mutex_unlock(&mutex);
+    mutex_unlock(mutex);
     if (foreign) {
         *foreign = entry->foreign;
     }
-    len = MIN(size, entry->len); /* truncate */
-    memcpy(buf, entry + 1, len);
+    len = MIN(size, pktbuf_len(entry->pkt)); /* truncate */
+    memcpy(buf, entry->pkt->data, len);
+    pktbuf_free(entry->pkt);
     memory_free(entry);
     return len;
 }
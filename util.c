@@ -7,21 +7,526 @@
 #include <limits.h>
 #include <ctype.h>
 #include <time.h>
+#include <pthread.h>
+#include <signal.h>
 #include <sys/time.h>
 
 #include "platform.h"
 
 #include "util.h"
 
+/*
+ * Log
+ *
+ * NOTE: In LOG_MODE_ASYNC, each thread writes fixed-size records into its own
+ *       single-producer ring (no locks, no stdio) and the log thread drains all
+ *       of the rings and formats them. Records are dropped when a ring is full.
+ *       A message record holds the format and the raw arguments, only the strings
+ *       (%s) are copied inline since they often point to the caller's stack; the
+ *       format must outlive the record (the literals of the log macros do).
+ */
+
+#define LOG_RING_SIZE 1024 /* must be a power of 2 */
+#define LOG_RECORD_DATA_SIZE 224
+
+/* the type of the argument of a conversion */
+#define LOG_ARG_NONE    0 /* %% (or not supported) */
+#define LOG_ARG_INT     1
+#define LOG_ARG_LONG    2
+#define LOG_ARG_LLONG   3
+#define LOG_ARG_SIZE    4
+#define LOG_ARG_INTMAX  5
+#define LOG_ARG_PTRDIFF 6
+#define LOG_ARG_DOUBLE  7
+#define LOG_ARG_LDOUBLE 8
+#define LOG_ARG_PTR     9
+#define LOG_ARG_STR    10 /* copied inline, NUL terminated */
+
+struct log_record {
+    FILE *fp;
+    struct timespec ts;
+    int level;
+    const char *file;
+    int line;
+    const char *func;
+    const char *fmt; /* messages */
+    void (*dump)(FILE *fp, const void *data, size_t size); /* NULL for messages */
+    size_t len; /* bytes used in the data */
+    size_t size; /* the size of the dumped data, larger than len if truncated */
+    int truncated; /* the arguments did not fit in the data */
+    char data[LOG_RECORD_DATA_SIZE]; /* packed arguments or head of the dumped data */
+};
+
+struct log_spec {
+    size_t len; /* from the '%' to the conversion character */
+    int stars; /* int arguments for the width and the precision ('*') before the value */
+    int prec; /* -1 if not given in the format */
+    int type;
+};
+
+struct log_ring {
+    struct log_ring *next;
+    unsigned int head; /* updated by the log thread only */
+    unsigned int tail; /* updated by the owner thread only */
+    unsigned long dropped;
+    unsigned long reported;
+    struct log_record records[LOG_RING_SIZE];
+};
+
+static int log_mode_value = LOG_MODE_SYNC;
+static int log_terminate;
+static pthread_t log_tid;
+static struct log_ring *log_rings; /* NOTE: rings are never freed, they outlive their threads */
+static __thread struct log_ring *log_ring;
+
+static struct log_record *
+log_record_reserve(void)
+{
+    struct log_ring *ring;
+    unsigned int head;
+
+    ring = log_ring;
+    if (!ring) {
+        ring = memory_alloc(sizeof(*ring));
+        if (!ring) {
+            return NULL;
+        }
+        ring->next = __atomic_load_n(&log_rings, __ATOMIC_ACQUIRE);
+        while (!__atomic_compare_exchange_n(&log_rings, &ring->next, ring, 1, __ATOMIC_RELEASE, __ATOMIC_ACQUIRE));
+        log_ring = ring;
+    }
+    head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    if (ring->tail - head == LOG_RING_SIZE) {
+        __atomic_add_fetch(&ring->dropped, 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+    return &ring->records[ring->tail & (LOG_RING_SIZE - 1)];
+}
+
+static void
+log_record_commit(void)
+{
+    __atomic_store_n(&log_ring->tail, log_ring->tail + 1, __ATOMIC_RELEASE);
+}
+
+/* NOTE: parses the conversion starting at the '%' */
+static void
+log_spec_parse(const char *p, struct log_spec *spec)
+{
+    const char *start = p;
+    int l = 0, mod = 0;
+
+    spec->stars = 0;
+    spec->prec = -1;
+    for (p++; *p && strchr("-+ #0", *p); p++);
+    if (*p == '*') {
+        spec->stars++;
+        p++;
+    }
+    for (; isdigit((unsigned char)*p); p++);
+    if (*p == '.') {
+        p++;
+        if (*p == '*') {
+            spec->stars++;
+            p++;
+        } else {
+            for (spec->prec = 0; isdigit((unsigned char)*p); p++) {
+                spec->prec = spec->prec * 10 + (*p - '0');
+            }
+        }
+    }
+    for (; *p && strchr("hlLzjt", *p); p++) {
+        if (*p == 'l') {
+            l++;
+        } else if (*p != 'h') {
+            mod = *p;
+        }
+    }
+    switch (*p) {
+    case 'd': case 'i': case 'u': case 'o': case 'x': case 'X': case 'c':
+        if (l >= 2) {
+            spec->type = LOG_ARG_LLONG;
+        } else if (l == 1) {
+            spec->type = *p == 'c' ? LOG_ARG_INT : LOG_ARG_LONG; /* NOTE: %lc takes a wint_t */
+        } else if (mod == 'z') {
+            spec->type = LOG_ARG_SIZE;
+        } else if (mod == 'j') {
+            spec->type = LOG_ARG_INTMAX;
+        } else if (mod == 't') {
+            spec->type = LOG_ARG_PTRDIFF;
+        } else {
+            spec->type = LOG_ARG_INT;
+        }
+        break;
+    case 'f': case 'F': case 'e': case 'E': case 'g': case 'G': case 'a': case 'A':
+        spec->type = mod == 'L' ? LOG_ARG_LDOUBLE : LOG_ARG_DOUBLE;
+        break;
+    case 's':
+        spec->type = LOG_ARG_STR;
+        break;
+    case 'p':
+    case 'n':
+        spec->type = LOG_ARG_PTR;
+        break;
+    default:
+        spec->type = LOG_ARG_NONE;
+        break;
+    }
+    if (*p) {
+        p++;
+    }
+    spec->len = p - start;
+}
+
+static int
+log_record_put(struct log_record *record, const void *arg, size_t size)
+{
+    if (record->len + size > sizeof(record->data)) {
+        record->truncated = 1;
+        return -1;
+    }
+    memcpy(record->data + record->len, arg, size);
+    record->len += size;
+    return 0;
+}
+
+/* NOTE: the hot path, the arguments are copied as they are (no formatting, no stdio) */
+static void
+log_record_pack(struct log_record *record, const char *fmt, va_list ap)
+{
+    const char *p, *str;
+    struct log_spec spec;
+    union {
+        int i;
+        long l;
+        long long ll;
+        size_t z;
+        intmax_t j;
+        ptrdiff_t t;
+        double d;
+        long double ld;
+        void *ptr;
+    } v;
+    int i, star = -1;
+    size_t n, room;
+
+    record->len = 0;
+    record->truncated = 0;
+    for (p = strchr(fmt, '%'); p; p = strchr(p, '%')) {
+        log_spec_parse(p, &spec);
+        p += spec.len;
+        for (i = 0; i < spec.stars; i++) {
+            star = va_arg(ap, int);
+            if (log_record_put(record, &star, sizeof(star)) == -1) {
+                return;
+            }
+        }
+        switch (spec.type) {
+        case LOG_ARG_INT:
+            v.i = va_arg(ap, int);
+            n = sizeof(v.i);
+            break;
+        case LOG_ARG_LONG:
+            v.l = va_arg(ap, long);
+            n = sizeof(v.l);
+            break;
+        case LOG_ARG_LLONG:
+            v.ll = va_arg(ap, long long);
+            n = sizeof(v.ll);
+            break;
+        case LOG_ARG_SIZE:
+            v.z = va_arg(ap, size_t);
+            n = sizeof(v.z);
+            break;
+        case LOG_ARG_INTMAX:
+            v.j = va_arg(ap, intmax_t);
+            n = sizeof(v.j);
+            break;
+        case LOG_ARG_PTRDIFF:
+            v.t = va_arg(ap, ptrdiff_t);
+            n = sizeof(v.t);
+            break;
+        case LOG_ARG_DOUBLE:
+            v.d = va_arg(ap, double);
+            n = sizeof(v.d);
+            break;
+        case LOG_ARG_LDOUBLE:
+            v.ld = va_arg(ap, long double);
+            n = sizeof(v.ld);
+            break;
+        case LOG_ARG_PTR:
+            v.ptr = va_arg(ap, void *);
+            n = sizeof(v.ptr);
+            break;
+        case LOG_ARG_STR:
+            str = va_arg(ap, const char *);
+            if (!str) {
+                str = "(null)";
+            }
+            room = sizeof(record->data) - record->len;
+            if (!room) {
+                record->truncated = 1;
+                return;
+            }
+            /* NOTE: a precision bounds the read, the string may not be terminated */
+            if (spec.prec == -1 && spec.stars == 2) {
+                spec.prec = star;
+            }
+            n = strnlen(str, spec.prec >= 0 ? MIN((size_t)spec.prec, room - 1) : room - 1);
+            memcpy(record->data + record->len, str, n);
+            record->data[record->len + n] = '\0';
+            record->len += n + 1;
+            if (n == room - 1 && str[n] && (spec.prec < 0 || n < (size_t)spec.prec)) {
+                record->truncated = 1;
+                return;
+            }
+            continue;
+        default:
+            continue;
+        }
+        if (log_record_put(record, &v, n) == -1) {
+            return;
+        }
+    }
+}
+
+#define LOG_RECORD_GET(x) \
+    do { \
+        if (off + sizeof(x) > record->len) { \
+            goto TRUNCATED; \
+        } \
+        memcpy(&(x), record->data + off, sizeof(x)); \
+        off += sizeof(x); \
+    } while (0)
+
+#define LOG_RECORD_PRINT(v) \
+    (spec.stars == 0 ? fprintf(record->fp, conv, v) : \
+     spec.stars == 1 ? fprintf(record->fp, conv, stars[0], v) : fprintf(record->fp, conv, stars[0], stars[1], v))
+
+/* NOTE: the log thread, formats the message out of the format and the packed arguments */
+static void
+log_record_format(struct log_record *record)
+{
+    const char *p, *next;
+    struct log_spec spec;
+    char conv[32];
+    int i, stars[2];
+    size_t off = 0;
+    int vi;
+    long vl;
+    long long vll;
+    size_t vz;
+    intmax_t vj;
+    ptrdiff_t vt;
+    double vd;
+    long double vld;
+    void *vptr;
+
+    for (p = record->fmt; (next = strchr(p, '%')) != NULL; p = next + spec.len) {
+        fwrite(p, 1, next - p, record->fp);
+        log_spec_parse(next, &spec);
+        for (i = 0; i < spec.stars; i++) {
+            LOG_RECORD_GET(stars[i]);
+        }
+        if (spec.len >= sizeof(conv)) {
+            fwrite(next, 1, spec.len, record->fp);
+            continue;
+        }
+        memcpy(conv, next, spec.len);
+        conv[spec.len] = '\0';
+        switch (spec.type) {
+        case LOG_ARG_INT:
+            LOG_RECORD_GET(vi);
+            LOG_RECORD_PRINT(vi);
+            break;
+        case LOG_ARG_LONG:
+            LOG_RECORD_GET(vl);
+            LOG_RECORD_PRINT(vl);
+            break;
+        case LOG_ARG_LLONG:
+            LOG_RECORD_GET(vll);
+            LOG_RECORD_PRINT(vll);
+            break;
+        case LOG_ARG_SIZE:
+            LOG_RECORD_GET(vz);
+            LOG_RECORD_PRINT(vz);
+            break;
+        case LOG_ARG_INTMAX:
+            LOG_RECORD_GET(vj);
+            LOG_RECORD_PRINT(vj);
+            break;
+        case LOG_ARG_PTRDIFF:
+            LOG_RECORD_GET(vt);
+            LOG_RECORD_PRINT(vt);
+            break;
+        case LOG_ARG_DOUBLE:
+            LOG_RECORD_GET(vd);
+            LOG_RECORD_PRINT(vd);
+            break;
+        case LOG_ARG_LDOUBLE:
+            LOG_RECORD_GET(vld);
+            LOG_RECORD_PRINT(vld);
+            break;
+        case LOG_ARG_PTR:
+            LOG_RECORD_GET(vptr);
+            if (conv[spec.len - 1] != 'n') {
+                LOG_RECORD_PRINT(vptr);
+            }
+            break;
+        case LOG_ARG_STR:
+            if (off >= record->len) {
+                goto TRUNCATED;
+            }
+            LOG_RECORD_PRINT(record->data + off);
+            off += strlen(record->data + off) + 1;
+            break;
+        default:
+            if (strcmp(conv, "%%") == 0) {
+                fputc('%', record->fp);
+            } else {
+                fwrite(conv, 1, spec.len, record->fp);
+            }
+            break;
+        }
+    }
+    fputs(p, record->fp);
+    if (!record->truncated) {
+        return;
+    }
+TRUNCATED:
+    fputs("...(truncated)", record->fp);
+}
+
+static void
+log_record_write(struct log_record *record)
+{
+    struct tm tm;
+    char timestamp[32];
+
+    if (record->dump) {
+        if (record->len < record->size) {
+            fprintf(record->fp, "        (dump truncated, %zu of %zu bytes)\n", record->len, record->size);
+        }
+        record->dump(record->fp, record->data, record->len);
+        return;
+    }
+    strftime(timestamp, sizeof(timestamp), "%T", localtime_r(&record->ts.tv_sec, &tm));
+    fprintf(record->fp, "%s.%03d [%c] %s: ", timestamp, (int)(record->ts.tv_nsec / 1000000), record->level, record->func);
+    log_record_format(record);
+    fprintf(record->fp, " (%s:%d)\n", record->file, record->line);
+}
+
+static int
+log_drain(void)
+{
+    struct log_ring *ring;
+    unsigned int head, tail;
+    unsigned long dropped;
+    int n = 0;
+
+    flockfile(stderr);
+    for (ring = __atomic_load_n(&log_rings, __ATOMIC_ACQUIRE); ring; ring = ring->next) {
+        head = ring->head;
+        tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++, n++) {
+            log_record_write(&ring->records[head & (LOG_RING_SIZE - 1)]);
+        }
+        __atomic_store_n(&ring->head, head, __ATOMIC_RELEASE);
+        dropped = __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+        if (dropped != ring->reported) {
+            fprintf(stderr, "[W] log: %lu records dropped (ring full)\n", dropped - ring->reported);
+            ring->reported = dropped;
+        }
+    }
+    funlockfile(stderr);
+    return n;
+}
+
+static void *
+log_thread(void *arg)
+{
+    struct timespec interval = {0, 1000000}; /* 1ms */
+    int terminate;
+
+    while (1) {
+        terminate = __atomic_load_n(&log_terminate, __ATOMIC_ACQUIRE);
+        if (log_drain() == 0) {
+            if (terminate) {
+                break;
+            }
+            nanosleep(&interval, NULL);
+        }
+    }
+    return NULL;
+}
+
+int
+log_mode(void)
+{
+    return __atomic_load_n(&log_mode_value, __ATOMIC_RELAXED);
+}
+
+int
+log_mode_set(int mode)
+{
+    sigset_t all, old;
+    int err;
+
+    if (mode == log_mode()) {
+        return 0;
+    }
+    switch (mode) {
+    case LOG_MODE_ASYNC:
+        __atomic_store_n(&log_terminate, 0, __ATOMIC_RELEASE);
+        /* the log thread must not take signals that are meant for the other threads (inherits the mask) */
+        sigfillset(&all);
+        pthread_sigmask(SIG_BLOCK, &all, &old);
+        err = pthread_create(&log_tid, NULL, log_thread, NULL);
+        pthread_sigmask(SIG_SETMASK, &old, NULL);
+        if (err) {
+            return -1;
+        }
+        __atomic_store_n(&log_mode_value, LOG_MODE_ASYNC, __ATOMIC_RELEASE);
+        return 0;
+    case LOG_MODE_SYNC:
+        __atomic_store_n(&log_mode_value, LOG_MODE_SYNC, __ATOMIC_RELEASE);
+        __atomic_store_n(&log_terminate, 1, __ATOMIC_RELEASE);
+        pthread_join(log_tid, NULL);
+        log_drain(); /* records committed after the log thread exited */
+        return 0;
+    }
+    return -1;
+}
+
 int
 lprintf(FILE *fp, int level, const char *file, int line, const char *func, const char *fmt, ...)
 {
+    struct log_record *record;
     struct timeval tv;
     struct tm tm;
     char timestamp[32];
     int n = 0;
     va_list ap;
 
+    if (log_mode() == LOG_MODE_ASYNC) {
+        record = log_record_reserve();
+        if (!record) {
+            return -1;
+        }
+        record->fp = fp;
+        clock_gettime(CLOCK_REALTIME, &record->ts);
+        record->level = level;
+        record->file = file;
+        record->line = line;
+        record->func = func;
+        record->fmt = fmt;
+        record->dump = NULL;
+        va_start(ap, fmt);
+        log_record_pack(record, fmt, ap);
+        va_end(ap);
+        log_record_commit();
+        return 0;
+    }
     flockfile(fp);
     gettimeofday(&tv, NULL);
     strftime(timestamp, sizeof(timestamp), "%T", localtime_r(&tv.tv_sec, &tm));
@@ -34,6 +539,28 @@ lprintf(FILE *fp, int level, const char *file, int line, const char *func, const
     return n;
 }
 
+int
+ldump(FILE *fp, void (*func)(FILE *fp, const void *data, size_t size), const void *data, size_t size)
+{
+    struct log_record *record;
+
+    if (log_mode() == LOG_MODE_ASYNC) {
+        record = log_record_reserve();
+        if (!record) {
+            return -1;
+        }
+        record->fp = fp;
+        record->dump = func;
+        record->size = size;
+        record->len = MIN(size, sizeof(record->data)); /* NOTE: only the head of the data is dumped */
+        memcpy(record->data, data, record->len);
+        log_record_commit();
+        return 0;
+    }
+    func(fp, data, size);
+    return 0;
+}
+
 void
 hexdump(FILE *fp, const void *data, size_t size)
 {
@@ -70,84 +597,105 @@ hexdump(FILE *fp, const void *data, size_t size)
     funlockfile(fp);
 }
 
-struct queue_entry {
-    struct queue_entry *next;
+struct mpsc_ring_slot {
+    unsigned long seq; /* NOTE: equal to the position when free, position + 1 when filled */
     void *data;
 };
 
+int
+mpsc_ring_init(struct mpsc_ring *ring, size_t depth)
+{
+    size_t size = 1;
+    unsigned long i;
+
+    while (size < depth) {
+        size <<= 1;
+    }
+    ring->slots = memory_alloc(sizeof(*ring->slots) * size);
+    if (!ring->slots) {
+        return -1;
+    }
+    for (i = 0; i < size; i++) {
+        ring->slots[i].seq = i;
+    }
+    ring->mask = size - 1;
+    ring->head = 0;
+    ring->tail = 0;
+    ring->drops = 0;
+    return 0;
+}
+
 void
-queue_init(struct queue_head *queue)
+mpsc_ring_destroy(struct mpsc_ring *ring)
 {
-    queue->head = NULL;
-    queue->tail = NULL;
-    queue->num = 0;
+    memory_free(ring->slots);
+    ring->slots = NULL;
 }
 
-void *
-queue_push(struct queue_head *queue, void *data)
+int
+mpsc_ring_push(struct mpsc_ring *ring, void *data)
 {
-    struct queue_entry *entry;
+    struct mpsc_ring_slot *slot;
+    unsigned long pos, seq;
+    long diff;
 
-    if (!queue) {
-        return NULL;
-    }
-    entry = memory_alloc(sizeof(*entry));
-    if (!entry) {
-        return NULL;
-    }
-    entry->next = NULL;
-    entry->data = data;
-    if (queue->tail) {
-        queue->tail->next = entry;
-    }
-    queue->tail = entry;
-    if (!queue->head) {
-        queue->head = entry;
+    pos = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+    while (1) {
+        slot = &ring->slots[pos & ring->mask];
+        seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        diff = (long)(seq - pos);
+        if (diff == 0) {
+            /* the slot is free, claim the position */
+            if (__atomic_compare_exchange_n(&ring->tail, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                break;
+            }
+        } else if (diff < 0) {
+            /* the consumer has not released the slot yet: full */
+            __atomic_add_fetch(&ring->drops, 1, __ATOMIC_RELAXED);
+            return -1;
+        } else {
+            /* another producer took the position */
+            pos = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+        }
     }
-    queue->num++;
-    return data;
+    slot->data = data;
+    __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+    return 0;
 }
 
 void *
-queue_pop(struct queue_head *queue)
+mpsc_ring_pop(struct mpsc_ring *ring)
 {
-    struct queue_entry *entry;
+    struct mpsc_ring_slot *slot;
+    unsigned long pos;
     void *data;
 
-    if (!queue || !queue->head) {
+    pos = ring->head;
+    slot = &ring->slots[pos & ring->mask];
+    if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != pos + 1) {
+        /* empty (or the producer has not finished writing yet) */
         return NULL;
     }
-    entry = queue->head;
-    queue->head = entry->next;
-    if (!queue->head) {
-        queue->tail = NULL;
-    }
-    queue->num--;
-    data = entry->data;
-    memory_free(entry);
+    data = slot->data;
+    __atomic_store_n(&slot->seq, pos + ring->mask + 1, __ATOMIC_RELEASE);
+    __atomic_store_n(&ring->head, pos + 1, __ATOMIC_RELAXED);
     return data;
 }
 
-void *
-queue_peek(struct queue_head *queue)
+size_t
+mpsc_ring_count(const struct mpsc_ring *ring)
 {
-    if (!queue || !queue->head) {
-        return NULL;
-    }
-    return queue->head->data;
+    unsigned long head, tail;
+
+    head = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+    tail = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+    return tail - head; /* NOTE: approximate, includes slots still being written */
 }
 
-void
-queue_foreach(struct queue_head *queue, void (*func)(void *arg, void *data), void *arg)
+unsigned long
+mpsc_ring_drops(const struct mpsc_ring *ring)
 {
-    struct queue_entry *entry;
-
-    if (!queue || !func) {
-        return;
-    }
-    for (entry = queue->head; entry; entry = entry->next) {
-        func(arg, entry->data);
-    }
+    return __atomic_load_n(&ring->drops, __ATOMIC_RELAXED);
 }
 
 #ifndef __BIG_ENDIAN
@@ -232,3 +780,26 @@ cksum16(uint16_t *addr, uint16_t count, uint32_t init)
     }
     return ~(uint16_t)sum;
 }
+
+uint32_t
+toeplitz_hash(const uint8_t *key, size_t keylen, const uint8_t *data, size_t len)
+{
+    uint32_t hash = 0, window;
+    size_t i;
+    int bit;
+
+    /* NOTE: for each set bit of the data, XOR the 32-bit window of the key that starts at the bit */
+    window = (uint32_t)key[0] << 24 | (uint32_t)key[1] << 16 | (uint32_t)key[2] << 8 | key[3];
+    for (i = 0; i < len; i++) {
+        for (bit = 7; bit >= 0; bit--) {
+            if (data[i] & (1 << bit)) {
+                hash ^= window;
+            }
+            window <<= 1;
+            if (i + 4 < keylen && key[i + 4] & (1 << bit)) {
+                window |= 1;
+            }
+        }
+    }
+    return hash;
+}
@@ -1,6 +1,7 @@
 #ifndef UTIL_H
 #define UTIL_H
 
+#include <stddef.h>
 #include <stdio.h>
 #include <stdint.h>
 #include <unistd.h>
@@ -16,6 +17,8 @@
 #define tailof(x) (x + countof(x))
 #define indexof(x, y) (((uintptr_t)y - (uintptr_t)x) / sizeof(*y))
 
+#define container_of(ptr, type, member) ((type *)((uintptr_t)(ptr) - offsetof(type, member)))
+
 #define timeval_add_usec(x, y)         \
     do {                               \
         (x)->tv_sec += y / 1000000;    \
@@ -36,13 +39,49 @@
         }                                 \
     } while(0);
 
+#define LOG_LEVEL_NONE  0
+#define LOG_LEVEL_ERROR 1
+#define LOG_LEVEL_WARN  2
+#define LOG_LEVEL_INFO  3
+#define LOG_LEVEL_DEBUG 4
+
+/* NOTE: selected at build time (e.g. `make LOG_LEVEL=1`), the disabled levels compile to nothing */
+#ifndef LOG_LEVEL
+#define LOG_LEVEL LOG_LEVEL_DEBUG
+#endif
+
+#define LOG_MODE_SYNC  0 /* format and write in the caller's context */
+#define LOG_MODE_ASYNC 1 /* enqueue binary records to the per-thread ring, the log thread formats them */
+
+/* NOTE: arguments are type-checked but never evaluated */
+#define lprintf_nop(...) do { if (0) lprintf(stderr, 0, __FILE__, __LINE__, __func__, __VA_ARGS__); } while (0)
+#define ldump_nop(...) do { if (0) ldump(__VA_ARGS__); } while (0)
+
+#if LOG_LEVEL >= LOG_LEVEL_ERROR
 #define errorf(...) lprintf(stderr, 'E', __FILE__, __LINE__, __func__, __VA_ARGS__)
+#else
+#define errorf(...) lprintf_nop(__VA_ARGS__)
+#endif
+#if LOG_LEVEL >= LOG_LEVEL_WARN
 #define warnf(...) lprintf(stderr, 'W', __FILE__, __LINE__, __func__, __VA_ARGS__)
+#else
+#define warnf(...) lprintf_nop(__VA_ARGS__)
+#endif
+#if LOG_LEVEL >= LOG_LEVEL_INFO
 #define infof(...) lprintf(stderr, 'I', __FILE__, __LINE__, __func__, __VA_ARGS__)
+#else
+#define infof(...) lprintf_nop(__VA_ARGS__)
+#endif
+#if LOG_LEVEL >= LOG_LEVEL_DEBUG
 #define debugf(...) lprintf(stderr, 'D', __FILE__, __LINE__, __func__, __VA_ARGS__)
+#define debugdump_with(func, data, len) ldump(stderr, func, data, len)
+#else
+#define debugf(...) lprintf_nop(__VA_ARGS__)
+#define debugdump_with(func, data, len) ldump_nop(stderr, func, data, len)
+#endif
 
-#ifdef HEXDUMP
-#define debugdump(...) hexdump(stderr, __VA_ARGS__)
+#if defined(HEXDUMP) && LOG_LEVEL >= LOG_LEVEL_DEBUG
+#define debugdump(...) ldump(stderr, hexdump, __VA_ARGS__)
 #else
 #define debugdump(...)
 #endif
@@ -51,8 +90,23 @@ extern int
 lprintf(FILE *fp, int level, const char *file, int line, const char *func, const char *fmt, ...);
 extern void
 hexdump(FILE *fp, const void *data, size_t size);
+extern int
+ldump(FILE *fp, void (*func)(FILE *fp, const void *data, size_t size), const void *data, size_t size);
+extern int
+log_mode_set(int mode);
+extern int
+log_mode(void);
+
+/*
+ * Queue (intrusive)
+ *
+ * NOTE: The link (struct queue_entry) is embedded in the queued object, so push/pop never allocate.
+ *       An object can be linked into only one queue at a time through the same member.
+ */
 
-struct queue_entry;
+struct queue_entry {
+    struct queue_entry *next;
+};
 
 struct queue_head {
     struct queue_entry *head;
@@ -60,16 +114,114 @@ struct queue_head {
     unsigned int num;
 };
 
+#define QUEUE_HEAD_INITIALIZER {NULL, NULL, 0}
+
+/* NOTE: evaluates to NULL for a NULL entry, so it can wrap queue_pop()/queue_peek() directly */
+#define queue_data(entry, type, member) ((type *)queue_entry_data((entry), offsetof(type, member)))
+
+static inline void *
+queue_entry_data(struct queue_entry *entry, size_t offset)
+{
+    return entry ? (void *)((uintptr_t)entry - offset) : NULL;
+}
+
+static inline void
+queue_init(struct queue_head *queue)
+{
+    queue->head = NULL;
+    queue->tail = NULL;
+    queue->num = 0;
+}
+
+static inline void
+queue_push(struct queue_head *queue, struct queue_entry *entry)
+{
+    entry->next = NULL;
+    if (queue->tail) {
+        queue->tail->next = entry;
+    } else {
+        queue->head = entry;
+    }
+    queue->tail = entry;
+    queue->num++;
+}
+
+static inline struct queue_entry *
+queue_pop(struct queue_head *queue)
+{
+    struct queue_entry *entry;
+
+    entry = queue->head;
+    if (!entry) {
+        return NULL;
+    }
+    queue->head = entry->next;
+    if (!queue->head) {
+        queue->tail = NULL;
+    }
+    queue->num--;
+    entry->next = NULL;
+    return entry;
+}
+
+/* NOTE: walks the queue from the head (singly linked), for short queues only; returns -1 if not linked */
+static inline int
+queue_remove(struct queue_head *queue, struct queue_entry *entry)
+{
+    struct queue_entry **p, *prev = NULL;
+
+    for (p = &queue->head; *p; prev = *p, p = &(*p)->next) {
+        if (*p == entry) {
+            *p = entry->next;
+            if (queue->tail == entry) {
+                queue->tail = prev;
+            }
+            queue->num--;
+            entry->next = NULL;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+static inline struct queue_entry *
+queue_peek(const struct queue_head *queue)
+{
+    return queue->head;
+}
+
+#define queue_foreach(entry, queue) \
+    for ((entry) = (queue)->head; (entry); (entry) = (entry)->next)
+
+/*
+ * Ring (bounded, lock-free, multi-producer/single-consumer)
+ *
+ * NOTE: Any number of threads may push concurrently, only one thread may pop.
+ *       The depth is rounded up to a power of two, a push to a full ring fails and is counted as a drop.
+ */
+
+struct mpsc_ring_slot;
+
+struct mpsc_ring {
+    unsigned long tail __attribute__((aligned(64))); /* updated by the producers */
+    unsigned long drops;
+    unsigned long head __attribute__((aligned(64))); /* updated by the consumer only */
+    unsigned long mask;
+    struct mpsc_ring_slot *slots;
+};
+
+extern int
+mpsc_ring_init(struct mpsc_ring *ring, size_t depth);
 extern void
-queue_init(struct queue_head *queue);
-extern void *
-queue_push(struct queue_head *queue, void *data);
-extern void *
-queue_pop(struct queue_head *queue);
+mpsc_ring_destroy(struct mpsc_ring *ring);
+extern int
+mpsc_ring_push(struct mpsc_ring *ring, void *data);
 extern void *
-queue_peek(struct queue_head *queue);
-extern void
-queue_foreach(struct queue_head *queue, void (*func)(void *arg, void *data), void *arg);
+mpsc_ring_pop(struct mpsc_ring *ring);
+extern size_t
+mpsc_ring_count(const struct mpsc_ring *ring);
+extern unsigned long
+mpsc_ring_drops(const struct mpsc_ring *ring);
 
 extern uint16_t
 hton16(uint16_t h);
@@ -83,4 +235,8 @@ ntoh32(uint32_t n);
 extern uint16_t
 cksum16(uint16_t *addr, uint16_t count, uint32_t init);
 
+/* NOTE: the key must be at least 4 bytes longer than the data (40 bytes covers the IPv6 4-tuple) */
+extern uint32_t
+toeplitz_hash(const uint8_t *key, size_t keylen, const uint8_t *data, size_t len);
+
 #endif